@@ -221,6 +221,7 @@ add_new_key(struct add_options *opt, int argc, char **argv)
     krb5_error_code ret = 0;
     int i;
     int num;
+    int locked;
     krb5_key_data key_data[3];
     krb5_key_data *kdp = NULL;
 
@@ -251,6 +252,9 @@ add_new_key(struct add_options *opt, int argc, char **argv)
 	kdp = key_data;
     }
 
+    /* nothing has to be prompted for */
+    locked = (num == 1 && opt->use_defaults_flag && lock_database());
+
     for(i = 0; i < argc; i++) {
 	ret = add_one_principal (argv[i],
 				 opt->random_key_flag,
@@ -269,6 +273,7 @@ add_new_key(struct add_options *opt, int argc, char **argv)
 	    break;
 	}
     }
+    ret = unlock_database(locked, ret);
     if (kdp) {
 	int16_t dummy = 3;
 	kadm5_free_key_data (kadm_handle, &dummy, key_data);
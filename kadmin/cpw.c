@@ -144,6 +144,7 @@ cpw_entry(struct passwd_options *opt, int argc, char **argv)
     int i;
     struct cpw_entry_data data;
     int num;
+    int locked;
     krb5_key_data key_data[3];
 
     data.keepold = opt->keepold_flag;
@@ -179,9 +180,14 @@ cpw_entry(struct passwd_options *opt, int argc, char **argv)
 	data.key_data = key_data;
     }
 
+    /* nothing has to be prompted for */
+    locked = (num == 1 && lock_database());
+
     for(i = 0; i < argc; i++)
 	ret = foreach_principal(argv[i], do_cpw_entry, "cpw", &data);
 
+    ret = unlock_database(locked, ret);
+
     if (data.key_data) {
 	int16_t dummy;
 	kadm5_free_key_data (kadm_handle, &dummy, key_data);
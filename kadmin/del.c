@@ -45,11 +45,16 @@ del_entry(void *opt, int argc, char **argv)
 {
     int i;
     krb5_error_code ret = 0;
+    int locked;
+
+    locked = lock_database();
 
     for(i = 0; i < argc; i++) {
 	ret = foreach_principal(argv[i], do_del_entry, "del", NULL);
 	if (ret)
 	    break;
     }
+
+    ret = unlock_database(locked, ret);
     return ret != 0;
 }
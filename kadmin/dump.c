@@ -37,6 +37,236 @@
 
 extern int local_flag;
 
+/*
+ * A binary dump is KADMIN_BINARY_DUMP_MAGIC followed by one record per
+ * entry: the length (four bytes, big endian) and bytes of the encoded
+ * principal key, which is empty for some backends, and the length and
+ * bytes of the DER encoded hdb_entry as stored in the database.  The
+ * entries are neither decoded nor decrypted, and with --parallel each
+ * thread walks its own shard of the database with its own handle.
+ * Meanwhile the dumping handle holds the write lock, so that the
+ * threads all see the same database; backends that can't promise that
+ * (no HDB_CAP_F_PARALLEL_WALK) are dumped by one thread.  The records
+ * of the threads come out in no particular order.
+ */
+
+#define BINARY_BUFSIZE (1024 * 1024)
+
+struct binary_out {
+    FILE *f;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    HEIMDAL_MUTEX mutex;
+#endif
+};
+
+struct binary_writer {
+    struct binary_out *out;
+    unsigned char *buf;
+    size_t len, alloc;
+    unsigned long count;
+};
+
+static krb5_error_code
+binary_flush(struct binary_writer *w)
+{
+    krb5_error_code ret = 0;
+
+    if (w->len == 0)
+	return 0;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    HEIMDAL_MUTEX_lock(&w->out->mutex);
+#endif
+    if (fwrite(w->buf, w->len, 1, w->out->f) != 1)
+	ret = errno ? errno : EIO;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    HEIMDAL_MUTEX_unlock(&w->out->mutex);
+#endif
+    w->len = 0;
+    return ret;
+}
+
+static void
+binary_put(struct binary_writer *w, const krb5_data *d)
+{
+    unsigned char *p = w->buf + w->len;
+
+    p[0] = (d->length >> 24) & 0xff;
+    p[1] = (d->length >> 16) & 0xff;
+    p[2] = (d->length >> 8) & 0xff;
+    p[3] = d->length & 0xff;
+    if (d->length)
+	memcpy(p + 4, d->data, d->length);
+    w->len += 4 + d->length;
+}
+
+static krb5_error_code
+binary_record(krb5_context ctx, HDB *db, krb5_data *key, krb5_data *value,
+	      void *arg)
+{
+    struct binary_writer *w = arg;
+    size_t need = 8 + key->length + value->length;
+    krb5_error_code ret;
+
+    if (key->length > UINT32_MAX || value->length > UINT32_MAX)
+	return ERANGE;
+    if (w->len + need > w->alloc) {
+	ret = binary_flush(w);
+	if (ret)
+	    return ret;
+	if (need > w->alloc) {
+	    unsigned char *tmp = realloc(w->buf, need);
+
+	    if (tmp == NULL)
+		return ENOMEM;
+	    w->buf = tmp;
+	    w->alloc = need;
+	}
+    }
+    binary_put(w, key);
+    binary_put(w, value);
+    w->count++;
+    return 0;
+}
+
+static krb5_error_code
+binary_shard(krb5_context ctx, HDB *db, unsigned shard, unsigned nshards,
+	     struct binary_out *out, unsigned long *count)
+{
+    struct binary_writer w;
+    krb5_error_code ret;
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.alloc = BINARY_BUFSIZE;
+    w.buf = malloc(w.alloc);
+    if (w.buf == NULL)
+	return ENOMEM;
+    ret = hdb_foreach_shard(ctx, db, shard, nshards, binary_record, &w);
+    if (ret == 0)
+	ret = binary_flush(&w);
+    free(w.buf);
+    *count += w.count;
+    return ret;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+struct dump_thread {
+    pthread_t thread;
+    krb5_context context;
+    HDB *db;
+    unsigned shard, nshards;
+    struct binary_out *out;
+    unsigned long count;
+    krb5_error_code ret;
+};
+
+static void *
+dump_thread(void *ptr)
+{
+    struct dump_thread *t = ptr;
+
+    t->ret = binary_shard(t->context, t->db, t->shard, t->nshards,
+			  t->out, &t->count);
+    return NULL;
+}
+
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+static int
+dump_binary(HDB *db, int nthreads, FILE *f)
+{
+    struct binary_out out;
+    unsigned long count = 0;
+    krb5_error_code ret = 0;
+
+    out.f = f;
+    if (fwrite(KADMIN_BINARY_DUMP_MAGIC, KADMIN_BINARY_DUMP_MAGIC_LEN,
+	       1, f) != 1) {
+	krb5_warn(context, errno, "write");
+	return 1;
+    }
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    HEIMDAL_MUTEX_init(&out.mutex);
+    if (nthreads > 1) {
+	kadm5_server_context *contextp = kadm_handle;
+	struct dump_thread *threads;
+	int i, started;
+
+	ret = db->hdb_lock(context, db, HDB_WLOCK);
+	if (ret) {
+	    krb5_warn(context, ret, "hdb_lock");
+	    HEIMDAL_MUTEX_destroy(&out.mutex);
+	    return 1;
+	}
+	threads = calloc(nthreads, sizeof(threads[0]));
+	if (threads == NULL)
+	    krb5_errx(context, 1, "malloc: out of memory");
+	for (started = 0; started < nthreads; started++) {
+	    struct dump_thread *t = &threads[started];
+
+	    t->shard = started;
+	    t->nshards = nthreads;
+	    t->out = &out;
+	    ret = krb5_init_context(&t->context);
+	    if (ret) {
+		krb5_warn(context, ret, "krb5_init_context");
+		break;
+	    }
+	    ret = hdb_create(t->context, &t->db, contextp->config.dbname);
+	    if (ret == 0) {
+		ret = t->db->hdb_open(t->context, t->db, O_RDONLY, 0600);
+		if (ret)
+		    t->db->hdb_destroy(t->context, t->db);
+	    }
+	    if (ret) {
+		krb5_warn(t->context, ret, "hdb_open");
+		krb5_free_context(t->context);
+		break;
+	    }
+	    ret = pthread_create(&t->thread, NULL, dump_thread, t);
+	    if (ret) {
+		krb5_warn(context, ret, "pthread_create");
+		t->db->hdb_close(t->context, t->db);
+		t->db->hdb_destroy(t->context, t->db);
+		krb5_free_context(t->context);
+		break;
+	    }
+	}
+	for (i = 0; i < started; i++) {
+	    struct dump_thread *t = &threads[i];
+
+	    pthread_join(t->thread, NULL);
+	    if (t->ret) {
+		krb5_warn(t->context, t->ret, "dump of shard %d", i);
+		if (ret == 0)
+		    ret = t->ret;
+	    }
+	    count += t->count;
+	    t->db->hdb_close(t->context, t->db);
+	    t->db->hdb_destroy(t->context, t->db);
+	    krb5_free_context(t->context);
+	}
+	free(threads);
+	db->hdb_unlock(context, db);
+    } else
+#endif
+    {
+	ret = binary_shard(context, db, 0, 1, &out, &count);
+	if (ret)
+	    krb5_warn(context, ret, "dump");
+    }
+#ifdef ENABLE_PTHREAD_SUPPORT
+    HEIMDAL_MUTEX_destroy(&out.mutex);
+#endif
+    if (ret == 0 && fflush(f) != 0) {
+	ret = errno;
+	krb5_warn(context, ret, "write");
+    }
+    return ret != 0;
+}
+
 int
 dump(struct dump_options *opt, int argc, char **argv)
 {
@@ -44,6 +274,7 @@ dump(struct dump_options *opt, int argc, char **argv)
     FILE *f;
     struct hdb_print_entry_arg parg;
     HDB *db = NULL;
+    int binary, nthreads = 1, exit_code = 0;
 
     if (!local_flag) {
 	krb5_warnx(context, "dump is only available in local (-l) mode");
@@ -52,6 +283,33 @@ dump(struct dump_options *opt, int argc, char **argv)
 
     db = _kadm5_s_get_db(kadm_handle);
 
+    if (opt->format_string && strcmp(opt->format_string, "snapshot") == 0) {
+	if (argc == 0 || opt->decrypt_flag) {
+	    krb5_warnx(context, "snapshot dumps need a file and "
+		       "can't be decrypted");
+	    return 1;
+	}
+	ret = db->hdb_open(context, db, O_RDONLY, 0600);
+	if (ret) {
+	    krb5_warn(context, ret, "hdb_open");
+	    return 1;
+	}
+	ret = hdb_write_snapshot(context, db, argv[0], 0600);
+	if (ret)
+	    krb5_warn(context, ret, "hdb_write_snapshot");
+	db->hdb_close(context, db);
+	return ret != 0;
+    }
+
+    binary = opt->format_string && strcmp(opt->format_string, "binary") == 0;
+    if (binary && opt->parallel_integer > 1) {
+	if (db->hdb_capability_flags & HDB_CAP_F_PARALLEL_WALK)
+	    nthreads = opt->parallel_integer;
+	else
+	    krb5_warnx(context, "%s can't be dumped in parallel, "
+		       "dumping it with one thread", db->hdb_name);
+    }
+
     if (argc == 0)
 	f = stdout;
     else
@@ -61,19 +319,31 @@ dump(struct dump_options *opt, int argc, char **argv)
 	krb5_warn(context, errno, "open: %s", argv[0]);
 	goto out;
     }
-    ret = db->hdb_open(context, db, O_RDONLY, 0600);
+    /* the write lock that keeps parallel walkers consistent needs O_RDWR */
+    ret = db->hdb_open(context, db, nthreads > 1 ? O_RDWR : O_RDONLY, 0600);
     if (ret) {
 	krb5_warn(context, ret, "hdb_open");
 	goto out;
     }
 
+    if (binary) {
+	if (opt->decrypt_flag) {
+	    krb5_warnx(context, "binary dumps can't be decrypted");
+	    exit_code = 1;
+	} else
+	    exit_code = dump_binary(db, nthreads, f);
+	db->hdb_close(context, db);
+	goto out;
+    }
+
     if (!opt->format_string || strcmp(opt->format_string, "Heimdal") == 0) {
         parg.fmt = HDB_DUMP_HEIMDAL;
     } else if (opt->format_string && strcmp(opt->format_string, "MIT") == 0) {
         parg.fmt = HDB_DUMP_MIT;
         fprintf(f, "kdb5_util load_dump version 5\n"); /* 5||6, either way */
     } else {
-        krb5_errx(context, 1, "Supported dump formats: Heimdal and MIT");
+        krb5_errx(context, 1, "Supported dump formats: Heimdal, MIT, "
+		  "binary and snapshot");
     }
     parg.out = f;
     hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
@@ -83,5 +353,5 @@ dump(struct dump_options *opt, int argc, char **argv)
 out:
     if(f && f != stdout)
 	fclose(f);
-    return 0;
+    return exit_code;
 }
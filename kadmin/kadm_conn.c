@@ -119,25 +119,24 @@ terminate(int sig)
     SIGRETURN(0);
 }
 
-static int
-spawn_child(krb5_context contextp, int *socks,
-	    unsigned int num_socks, int this_sock)
+static krb5_socket_t
+accept_connection(krb5_context contextp, krb5_socket_t sock)
 {
     int e;
-    size_t i;
     struct sockaddr_storage __ss;
     struct sockaddr *sa = (struct sockaddr *)&__ss;
     socklen_t sa_size = sizeof(__ss);
     krb5_socket_t s;
-    pid_t pid;
     krb5_address addr;
     char buf[128];
     size_t buf_len;
 
-    s = accept(socks[this_sock], sa, &sa_size);
+    s = accept(sock, sa, &sa_size);
     if(rk_IS_BAD_SOCKET(s)) {
-	krb5_warn(contextp, rk_SOCK_ERRNO, "accept");
-	return 1;
+	/* another worker got it first */
+	if(rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EWOULDBLOCK)
+	    krb5_warn(contextp, rk_SOCK_ERRNO, "accept");
+	return s;
     }
     e = krb5_sockaddr2address(contextp, sa, &addr);
     if(e)
@@ -151,6 +150,20 @@ spawn_child(krb5_context contextp, int *socks,
 	    krb5_warnx(contextp, "connection from %s", buf);
 	krb5_free_address(contextp, &addr);
     }
+    return s;
+}
+
+static int
+spawn_child(krb5_context contextp, int *socks,
+	    unsigned int num_socks, int this_sock)
+{
+    size_t i;
+    krb5_socket_t s;
+    pid_t pid;
+
+    s = accept_connection(contextp, socks[this_sock]);
+    if(rk_IS_BAD_SOCKET(s))
+	return 1;
 
     pid = fork();
     if(pid == 0) {
@@ -167,8 +180,124 @@ spawn_child(krb5_context contextp, int *socks,
     return 1;
 }
 
+/*
+ * Bound how long a read or write on `s' may block, zero is forever.
+ */
+
+void
+set_socket_timeout(krb5_context contextp, krb5_socket_t s, int seconds)
+{
+    struct timeval tv;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    if(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv)) < 0 ||
+       setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv)) < 0)
+	krb5_warn(contextp, rk_SOCK_ERRNO, "setsockopt");
+}
+
+/*
+ * With num_workers set, that many processes are forked up front and
+ * each serves one connection after another, keeping its server
+ * handle and database open between them.  Listening sockets are
+ * shared and non-blocking, whichever worker accepts first gets the
+ * connection.  A worker that exits, as it does after any error or an
+ * MIT protocol connection, is replaced by the parent.
+ *
+ * A connection gets auth_timeout to authenticate and idle_timeout
+ * between requests after that, so a client that stalls cannot keep
+ * a worker from serving others.
+ */
+
 static void
-wait_for_connection(krb5_context contextp,
+worker_loop(krb5_context contextp, krb5_keytab keytab,
+	    krb5_socket_t *socks, unsigned int num_socks,
+	    fd_set *orig_read_set, int max_fd)
+{
+    unsigned int i;
+    fd_set read_set;
+    krb5_socket_t s;
+    int e;
+
+    while (term_flag == 0) {
+	read_set = *orig_read_set;
+	e = select(max_fd + 1, &read_set, NULL, NULL, NULL);
+	if(rk_IS_SOCKET_ERROR(e)) {
+	    if(rk_SOCK_ERRNO != EINTR)
+		krb5_warn(contextp, rk_SOCK_ERRNO, "select");
+	    continue;
+	}
+	for(i = 0; i < num_socks && term_flag == 0; i++) {
+	    if(!FD_ISSET(socks[i], &read_set))
+		continue;
+	    s = accept_connection(contextp, socks[i]);
+	    if(rk_IS_BAD_SOCKET(s))
+		continue;
+	    socket_set_nonblocking(s, 0);
+	    set_socket_timeout(contextp, s, auth_timeout);
+	    kadmind_loop(contextp, keytab, s);
+	    rk_closesocket(s);
+	}
+    }
+    exit(0);
+}
+
+static void
+start_workers(krb5_context contextp, krb5_keytab keytab,
+	      krb5_socket_t *socks, unsigned int num_socks,
+	      fd_set *orig_read_set, int max_fd)
+{
+    unsigned int i;
+    int status, running = 0;
+    time_t started = 0;
+    pid_t pid;
+
+    for(i = 0; i < num_socks; i++)
+	socket_set_nonblocking(socks[i], 1);
+
+    krb5_warnx(contextp, "kadmind started with %d workers", num_workers);
+
+    while (term_flag == 0) {
+	while (running < num_workers && term_flag == 0) {
+	    pid = fork();
+	    if(pid < 0) {
+		krb5_warn(contextp, errno, "fork");
+		break;
+	    }
+	    if(pid == 0)
+		worker_loop(contextp, keytab, socks, num_socks,
+			    orig_read_set, max_fd);
+	    started = time(NULL);
+	    running++;
+	}
+	pid = waitpid(-1, &status, 0);
+	if(pid == -1) {
+	    if(errno != EINTR && errno != ECHILD) {
+		krb5_warn(contextp, errno, "waitpid");
+		sleep(1);
+	    }
+	    continue;
+	}
+	running--;
+	if(WIFSIGNALED(status))
+	    krb5_warnx(contextp, "worker %ld killed by signal %d",
+		       (long)pid, WTERMSIG(status));
+	/* don't spin if the workers die right away */
+	if(time(NULL) - started < 1)
+	    sleep(1);
+    }
+
+    while (running > 0 && (pid = waitpid(-1, &status, 0)) != 0) {
+	if(pid > 0)
+	    running--;
+	else if(errno != EINTR)
+	    break;
+    }
+    exit(0);
+}
+
+static void
+wait_for_connection(krb5_context contextp, krb5_keytab keytab,
 		    krb5_socket_t *socks, unsigned int num_socks)
 {
     unsigned int i;
@@ -194,6 +323,11 @@ wait_for_connection(krb5_context contextp,
 
     signal(SIGTERM, terminate);
     signal(SIGINT, terminate);
+
+    if (num_workers > 0)
+	start_workers(contextp, keytab, socks, num_socks,
+		      &orig_read_set, max_fd);
+
     signal(SIGCHLD, sigchld);
 
     while (term_flag == 0) {
@@ -222,7 +356,7 @@ wait_for_connection(krb5_context contextp,
 
 
 void
-start_server(krb5_context contextp, const char *port_str)
+start_server(krb5_context contextp, const char *port_str, krb5_keytab keytab)
 {
     int e;
     struct kadm_port *p;
@@ -291,5 +425,5 @@ start_server(krb5_context contextp, const char *port_str)
     if(num_socks == 0)
 	krb5_errx(contextp, 1, "no sockets to listen to - exiting");
 
-    wait_for_connection(contextp, socks, num_socks);
+    wait_for_connection(contextp, keytab, socks, num_socks);
 }
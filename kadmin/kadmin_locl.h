@@ -102,6 +102,11 @@ extern void * kadm_handle;
 #undef ALLOC
 #define ALLOC(X) ((X) = malloc(sizeof(*(X))))
 
+/* dump.c, load.c: first bytes of a binary dump */
+
+#define KADMIN_BINARY_DUMP_MAGIC	"\0HDBdump"
+#define KADMIN_BINARY_DUMP_MAGIC_LEN	8
+
 /* util.c */
 
 void attributes2str(krb5_flags, char *, size_t);
@@ -131,6 +136,8 @@ int set_entry(krb5_context, kadm5_principal_ent_t, int *,
 int
 foreach_principal(const char *, int (*)(krb5_principal, void*),
 		  const char *, void *);
+int lock_database(void);
+krb5_error_code unlock_database(int, krb5_error_code);
 
 int parse_des_key (const char *, krb5_key_data *, const char **);
 
@@ -142,9 +149,12 @@ random_password(char *, size_t);
 /* kadm_conn.c */
 
 extern sig_atomic_t term_flag, doing_useful_work;
+extern int num_workers;
+extern int auth_timeout, idle_timeout;
 
 void parse_ports(krb5_context, const char*);
-void start_server(krb5_context, const char*);
+void start_server(krb5_context, const char*, krb5_keytab);
+void set_socket_timeout(krb5_context, krb5_socket_t, int);
 
 /* server.c */
 
@@ -44,6 +44,8 @@ static int version_flag;
 static int debug_flag;
 static char *port_str;
 char *realm;
+int num_workers = -1;
+int auth_timeout, idle_timeout;
 
 static struct getargs args[] = {
     {
@@ -70,6 +72,8 @@ static struct getargs args[] = {
     },
     {	"ports",	'p',	arg_string, &port_str,
 	"ports to listen to", "port" },
+    {	"num-workers",	0,	arg_integer, &num_workers,
+	"number of worker processes", "number" },
     {	"help",		'h',	arg_flag,   &help_flag, NULL, NULL },
     {	"version",	'v',	arg_flag,   &version_flag, NULL, NULL }
 };
@@ -150,6 +154,17 @@ main(int argc, char **argv)
     if(ret)
 	krb5_err(context, 1, ret, "krb5_kt_resolve");
 
+    if (num_workers == -1)
+	num_workers = krb5_config_get_int_default(context, NULL, 0,
+						  "kadmin", "num-workers",
+						  NULL);
+    auth_timeout = krb5_config_get_time_default(context, NULL, 30,
+						"kadmin", "auth-timeout",
+						NULL);
+    idle_timeout = krb5_config_get_time_default(context, NULL, 300,
+						"kadmin", "idle-timeout",
+						NULL);
+
     kadm5_setup_passwd_quality_check (context, check_library, check_function);
 
     for (i = 0; i < policy_libraries.num_strings; i++) {
@@ -173,7 +188,7 @@ main(int argc, char **argv)
 	mini_inetd(debug_port, &sfd);
     } else {
 #ifdef _WIN32
-	start_server(context, port_str);
+	start_server(context, port_str, keytab);
 #else
 	struct sockaddr_storage __ss;
 	struct sockaddr *sa = (struct sockaddr *)&__ss;
@@ -186,7 +201,7 @@ main(int argc, char **argv)
 
 	if(roken_getsockname(STDIN_FILENO, sa, &sa_size) < 0 &&
 	   rk_SOCK_ERRNO == ENOTSOCK) {
-	    start_server(context, port_str);
+	    start_server(context, port_str, keytab);
 	}
 #endif /* _WIN32 */
 	sfd = STDIN_FILENO;
@@ -34,6 +34,9 @@
 #include "kadmin_locl.h"
 #include "kadmin-commands.h"
 #include <kadm5/private.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 struct entry {
     char *principal;
@@ -55,6 +58,8 @@ skip_next(char *p)
 {
     while(*p && !isspace((unsigned char)*p))
 	p++;
+    if (*p == '\0')
+	return p;		/* missing trailing fields are empty */
     *p++ = 0;
     while(*p && isspace((unsigned char)*p))
 	p++;
@@ -142,6 +147,50 @@ parse_integer_alloc (unsigned int **u, const char *s)
     return ret;
 }
 
+static int
+hex_digit(int c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decode the `len' hex digits in `p' into `data', two at a time.
+ * This used to be a sscanf() per byte, which was a good part of the
+ * time spent loading a large dump.
+ */
+
+static int
+parse_hex(krb5_data *data, const char *p, size_t len)
+{
+    krb5_error_code ret;
+    unsigned char *d;
+    int hi, lo;
+    size_t i;
+
+    ret = krb5_data_alloc(data, (len + 1) / 2);
+    if (ret)
+	krb5_err (context, 1, ret, "krb5_data_alloc");
+    d = data->data;
+    for (i = 0; i < len; i += 2) {
+	if ((hi = hex_digit(p[i])) < 0)
+	    return 1;
+	if (i + 1 == len) {
+	    d[i / 2] = hi;
+	    break;
+	}
+	if ((lo = hex_digit(p[i + 1])) < 0)
+	    return 1;
+	d[i / 2] = (hi << 4) | lo;
+    }
+    return 0;
+}
+
 /*
  * Parse dumped keys in `str' and store them in `ent'
  * return -1 if parsing failed
@@ -153,7 +202,6 @@ parse_keys(hdb_entry *ent, char *str)
     krb5_error_code ret;
     int tmp;
     char *p;
-    size_t i;
 
     p = strsep(&str, ":");
     if (sscanf(p, "%d", &tmp) != 1)
@@ -180,14 +228,8 @@ parse_keys(hdb_entry *ent, char *str)
 	    return 1;
 	key->key.keytype = tmp;
 	p = strsep(&str, ":");
-	ret = krb5_data_alloc(&key->key.keyvalue, (strlen(p) - 1) / 2 + 1);
-	if (ret)
-	    krb5_err (context, 1, ret, "krb5_data_alloc");
-	for(i = 0; i < strlen(p); i += 2) {
-	    if(sscanf(p + i, "%02x", &tmp) != 1)
-		return 1;
-	    ((u_char*)key->key.keyvalue.data)[i / 2] = tmp;
-	}
+	if (parse_hex(&key->key.keyvalue, p, strlen(p)))
+	    return 1;
 	p = strsep(&str, ":");
 	if(strcmp(p, "-") != 0){
 	    unsigned type;
@@ -211,17 +253,8 @@ parse_keys(hdb_entry *ent, char *str)
 		    ret = krb5_data_copy(&key->salt->salt, p + 1, p_len - 2);
 		    if (ret)
 			krb5_err (context, 1, ret, "krb5_data_copy");
-		} else {
-		    ret = krb5_data_alloc(&key->salt->salt,
-					  (p_len - 1) / 2 + 1);
-		    if (ret)
-			krb5_err (context, 1, ret, "krb5_data_alloc");
-		    for(i = 0; i < p_len; i += 2){
-			if (sscanf(p + i, "%02x", &tmp) != 1)
-			    return 1;
-			((u_char*)key->salt->salt.data)[i / 2] = tmp;
-		    }
-		}
+		} else if (parse_hex(&key->salt->salt, p, p_len))
+		    return 1;
 	    } else
 		krb5_data_zero (&key->salt->salt);
 	}
@@ -235,7 +268,7 @@ parse_keys(hdb_entry *ent, char *str)
  */
 
 static int
-parse_event(Event *ev, char *s)
+parse_event(krb5_context ctx, Event *ev, char *s)
 {
     krb5_error_code ret;
     char *p;
@@ -247,20 +280,20 @@ parse_event(Event *ev, char *s)
     if(parse_time_string(&ev->time, p) != 1)
 	return -1;
     p = strsep(&s, ":");
-    ret = krb5_parse_name(context, p, &ev->principal);
+    ret = krb5_parse_name(ctx, p, &ev->principal);
     if (ret)
 	return -1;
     return 1;
 }
 
 static int
-parse_event_alloc (Event **ev, char *s)
+parse_event_alloc (krb5_context ctx, Event **ev, char *s)
 {
     Event tmp;
     int ret;
 
     *ev = NULL;
-    ret = parse_event (&tmp, s);
+    ret = parse_event (ctx, &tmp, s);
     if (ret == 1) {
 	*ev = malloc (sizeof (**ev));
 	if (*ev == NULL)
@@ -355,188 +388,678 @@ parse_extensions(char *str, HDB_extensions **e)
 
 
 /*
- * Parse the dump file in `filename' and create the database (merging
- * iff merge)
+ * Parse one line of a dump in `s' into `ent'.  Returns 0 on success,
+ * otherwise `*msg' tells what was wrong with the line.
  */
 
 static int
-doit(const char *filename, int mergep)
+parse_line(krb5_context ctx, char *s, hdb_entry_ex *ent, char **msg)
 {
     krb5_error_code ret;
-    FILE *f;
-    char s[8192]; /* XXX should fix this properly */
-    char *p;
-    int line;
-    int flags = O_RDWR;
     struct entry e;
-    hdb_entry_ex ent;
-    HDB *db = _kadm5_s_get_db(kadm_handle);
+    const char *what = NULL, *field = NULL;
+    char *p;
 
-    f = fopen(filename, "r");
-    if(f == NULL){
-	krb5_warn(context, errno, "fopen(%s)", filename);
-	return 1;
+    *msg = NULL;
+
+    p = s;
+    while (isspace((unsigned char)*p))
+	p++;
+
+    e.principal = p;
+    for(; *p; p++){
+	if(*p == '\\')
+	    p++;
+	else if(isspace((unsigned char)*p))
+	    break;
     }
-    ret = kadm5_log_truncate (kadm_handle);
-    if (ret) {
-	fclose (f);
-	krb5_warn(context, ret, "kadm5_log_truncate");
+    p = skip_next(p);
+
+    e.key = p;
+    p = skip_next(p);
+
+    e.created = p;
+    p = skip_next(p);
+
+    e.modified = p;
+    p = skip_next(p);
+
+    e.valid_start = p;
+    p = skip_next(p);
+
+    e.valid_end = p;
+    p = skip_next(p);
+
+    e.pw_end = p;
+    p = skip_next(p);
+
+    e.max_life = p;
+    p = skip_next(p);
+
+    e.max_renew = p;
+    p = skip_next(p);
+
+    e.flags = p;
+    p = skip_next(p);
+
+    e.generation = p;
+    p = skip_next(p);
+
+    e.extensions = p;
+    skip_next(p);
+
+    memset(ent, 0, sizeof(*ent));
+    ret = krb5_parse_name(ctx, e.principal, &ent->entry.principal);
+    if(ret) {
+	const char *m = krb5_get_error_message(ctx, ret);
+	if (asprintf(msg, "%s (%s)", m, e.principal) < 0)
+	    krb5_errx (context, 1, "malloc: out of memory");
+	krb5_free_error_message(ctx, m);
 	return 1;
     }
 
-    if(!mergep)
-	flags |= O_CREAT | O_TRUNC;
-    ret = db->hdb_open(context, db, flags, 0600);
-    if(ret){
-	krb5_warn(context, ret, "hdb_open");
-	fclose(f);
+    if (parse_keys(&ent->entry, e.key)) {
+	what = "error parsing keys";
+	field = e.key;
+    } else if (parse_event(ctx, &ent->entry.created_by, e.created) == -1) {
+	what = "error parsing created event";
+	field = e.created;
+    } else if (parse_event_alloc (ctx, &ent->entry.modified_by, e.modified) == -1) {
+	what = "error parsing event";
+	field = e.modified;
+    } else if (parse_time_string_alloc (&ent->entry.valid_start, e.valid_start) == -1) {
+	what = "error parsing time";
+	field = e.valid_start;
+    } else if (parse_time_string_alloc (&ent->entry.valid_end, e.valid_end) == -1) {
+	what = "error parsing time";
+	field = e.valid_end;
+    } else if (parse_time_string_alloc (&ent->entry.pw_end, e.pw_end) == -1) {
+	what = "error parsing time";
+	field = e.pw_end;
+    } else if (parse_integer_alloc (&ent->entry.max_life, e.max_life) == -1) {
+	what = "error parsing lifetime";
+	field = e.max_life;
+    } else if (parse_integer_alloc (&ent->entry.max_renew, e.max_renew) == -1) {
+	what = "error parsing lifetime";
+	field = e.max_renew;
+    } else if (parse_hdbflags2int (&ent->entry.flags, e.flags) != 1) {
+	what = "error parsing flags";
+	field = e.flags;
+    } else if (parse_generation(e.generation, &ent->entry.generation) == -1) {
+	what = "error parsing generation";
+	field = e.generation;
+    } else if (parse_extensions(e.extensions, &ent->entry.extensions) == -1) {
+	what = "error parsing extension";
+	field = e.extensions;
+    }
+    if (what) {
+	if (asprintf(msg, "%s (%s)", what, field) < 0)
+	    krb5_errx (context, 1, "malloc: out of memory");
+	hdb_free_entry (ctx, ent);
 	return 1;
     }
-    line = 0;
-    ret = 0;
-    while(fgets(s, sizeof(s), f) != NULL) {
-	line++;
+    return 0;
+}
 
-	p = s;
-	while (isspace((unsigned char)*p))
-	    p++;
+/*
+ * The dump is mapped and cut at line (or binary record) boundaries
+ * into chunks of about LOAD_CHUNK_SIZE bytes.  Parser threads pick the
+ * chunks in order and decode them into entries; the writer (the
+ * calling thread) stores the chunks in dump order, so errors are
+ * reported with the right line numbers and a principal that is dumped
+ * twice still ends up with the last version.
+ */
 
-	e.principal = p;
-	for(p = s; *p; p++){
-	    if(*p == '\\')
-		p++;
-	    else if(isspace((unsigned char)*p)) {
-		*p = 0;
-		break;
-	    }
-	}
-	p = skip_next(p);
+#define LOAD_CHUNK_SIZE (1024 * 1024)
 
-	e.key = p;
-	p = skip_next(p);
+struct load_error {
+    struct load_error *next;
+    unsigned long line;		/* relative to the start of the chunk */
+    char *msg;
+};
 
-	e.created = p;
-	p = skip_next(p);
+struct load_chunk {
+    const char *data;
+    size_t len;
+    int binary;			/* records of a binary dump */
+    int parsed;
+    unsigned long lines;
+    size_t num, alloc;
+    hdb_entry_ex *entries;
+    struct load_error *errors, **errors_tail;
+};
 
-	e.modified = p;
-	p = skip_next(p);
+static hdb_entry_ex *
+chunk_slot(struct load_chunk *c)
+{
+    if (c->num == c->alloc) {
+	hdb_entry_ex *tmp;
+
+	c->alloc = c->alloc ? c->alloc * 2 : 1024;
+	tmp = realloc(c->entries, c->alloc * sizeof(c->entries[0]));
+	if (tmp == NULL)
+	    krb5_errx (context, 1, "realloc: out of memory");
+	c->entries = tmp;
+    }
+    return &c->entries[c->num];
+}
+
+static void
+chunk_error(struct load_chunk *c, char *msg)
+{
+    struct load_error *err;
+
+    err = malloc(sizeof(*err));
+    if (err == NULL)
+	krb5_errx (context, 1, "malloc: out of memory");
+    err->next = NULL;
+    err->line = c->lines;
+    err->msg = msg;
+    *c->errors_tail = err;
+    c->errors_tail = &err->next;
+}
+
+/*
+ * Get the next length prefixed field of a binary dump (see dump.c),
+ * NULL if the dump is truncated.
+ */
+
+static const char *
+binary_field(const char *p, const char *end, krb5_data *d)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    size_t len;
+
+    if (end - p < 4)
+	return NULL;
+    len = ((size_t)u[0] << 24) | ((size_t)u[1] << 16) | (u[2] << 8) | u[3];
+    if ((size_t)(end - p) - 4 < len)
+	return NULL;
+    d->data = (void *)(p + 4);
+    d->length = len;
+    return p + 4 + len;
+}
+
+static int
+parse_record(krb5_context ctx, krb5_data *key, krb5_data *value,
+	     hdb_entry_ex *ent, char **msg)
+{
+    krb5_error_code ret;
+
+    *msg = NULL;
+    memset(ent, 0, sizeof(*ent));
+    ret = hdb_value2entry(ctx, value, &ent->entry);
+    if (ret) {
+	const char *m = krb5_get_error_message(ctx, ret);
+	if (asprintf(msg, "error decoding entry (%s)", m) < 0)
+	    krb5_errx (context, 1, "malloc: out of memory");
+	krb5_free_error_message(ctx, m);
+	return 1;
+    }
+    if (ent->entry.principal == NULL) {
+	ent->entry.principal = malloc(sizeof(*ent->entry.principal));
+	if (ent->entry.principal == NULL)
+	    krb5_errx (context, 1, "malloc: out of memory");
+	if (key->length == 0 ||
+	    hdb_key2principal(ctx, key, ent->entry.principal) != 0) {
+	    free(ent->entry.principal);
+	    ent->entry.principal = NULL;
+	    hdb_free_entry(ctx, ent);
+	    *msg = strdup("entry without a principal");
+	    if (*msg == NULL)
+		krb5_errx (context, 1, "malloc: out of memory");
+	    return 1;
+	}
+    }
+    if (ent->entry.generation)
+	ent->entry.generation->gen--; /* XXX gets bumped in _hdb_store */
+    return 0;
+}
 
-	e.valid_start = p;
-	p = skip_next(p);
+static void
+parse_chunk(krb5_context ctx, struct load_chunk *c)
+{
+    const char *p = c->data, *end = c->data + c->len, *nl;
+    char *buf = NULL, *msg;
+    size_t len, bufsize = 0;
+    krb5_data key, value;
+
+    c->errors_tail = &c->errors;
+    while (c->binary && p < end) {
+	/* the records were checked when the dump was cut into chunks */
+	p = binary_field(p, end, &key);
+	p = binary_field(p, end, &value);
+	c->lines++;
+	if (parse_record(ctx, &key, &value, chunk_slot(c), &msg) == 0)
+	    c->num++;
+	else
+	    chunk_error(c, msg);
+    }
+    while (!c->binary && p < end) {
+	nl = memchr(p, '\n', end - p);
+	len = (nl ? nl : end) - p;
+	c->lines++;
+
+	if (len + 1 > bufsize) {
+	    bufsize = len + 1 < 8192 ? 8192 : len + 1;
+	    free(buf);
+	    buf = malloc(bufsize);
+	    if (buf == NULL)
+		krb5_errx (context, 1, "malloc: out of memory");
+	}
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	p = nl ? nl + 1 : end;
+
+	if (parse_line(ctx, buf, chunk_slot(c), &msg) == 0)
+	    c->num++;
+	else
+	    chunk_error(c, msg);
+    }
+    free(buf);
+}
 
-	e.valid_end = p;
-	p = skip_next(p);
+static void
+free_chunk(krb5_context ctx, struct load_chunk *c)
+{
+    struct load_error *err;
+    size_t i;
 
-	e.pw_end = p;
-	p = skip_next(p);
+    for (i = 0; i < c->num; i++)
+	hdb_free_entry(ctx, &c->entries[i]);
+    free(c->entries);
+    c->entries = NULL;
+    c->num = c->alloc = 0;
+    while ((err = c->errors) != NULL) {
+	c->errors = err->next;
+	free(err->msg);
+	free(err);
+    }
+}
 
-	e.max_life = p;
-	p = skip_next(p);
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+struct load_pool {
+    HEIMDAL_MUTEX mutex;
+    pthread_cond_t cond;	/* a chunk was parsed or stored */
+    struct load_chunk *chunks;
+    size_t nchunks;
+    size_t next;		/* next chunk to parse */
+    size_t stored;		/* chunks the writer is done with */
+    size_t window;		/* how far the parsers may run ahead */
+    int shutdown;
+};
 
-	e.max_renew = p;
-	p = skip_next(p);
+struct load_thread {
+    pthread_t thread;
+    krb5_context context;
+    struct load_pool *pool;
+};
 
-	e.flags = p;
-	p = skip_next(p);
+static void *
+load_thread(void *ptr)
+{
+    struct load_thread *t = ptr;
+    struct load_pool *pool = t->pool;
+    struct load_chunk *c;
+
+    HEIMDAL_MUTEX_lock(&pool->mutex);
+    while (1) {
+	while (!pool->shutdown && pool->next < pool->nchunks &&
+	       pool->next >= pool->stored + pool->window)
+	    pthread_cond_wait(&pool->cond, &pool->mutex);
+	if (pool->shutdown || pool->next >= pool->nchunks)
+	    break;
+	c = &pool->chunks[pool->next++];
+	HEIMDAL_MUTEX_unlock(&pool->mutex);
 
-	e.generation = p;
-	p = skip_next(p);
+	parse_chunk(t->context, c);
 
-	e.extensions = p;
-	skip_next(p);
+	HEIMDAL_MUTEX_lock(&pool->mutex);
+	c->parsed = 1;
+	pthread_cond_broadcast(&pool->cond);
+    }
+    HEIMDAL_MUTEX_unlock(&pool->mutex);
+    return NULL;
+}
 
-	memset(&ent, 0, sizeof(ent));
-	ret = krb5_parse_name(context, e.principal, &ent.entry.principal);
-	if(ret) {
-	    const char *msg = krb5_get_error_message(context, ret);
-	    fprintf(stderr, "%s:%d:%s (%s)\n",
-		    filename, line, msg, e.principal);
-	    krb5_free_error_message(context, msg);
-	    continue;
-	}
+#endif /* ENABLE_PTHREAD_SUPPORT */
 
-	if (parse_keys(&ent.entry, e.key)) {
-	    fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
-		     filename, line, e.key);
-	    hdb_free_entry (context, &ent);
-	    continue;
-	}
+/*
+ * Read all of `fd' into memory, for dumps that can not be mapped
+ * (pipes).
+ */
 
-	if (parse_event(&ent.entry.created_by, e.created) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
-		     filename, line, e.created);
-	    hdb_free_entry (context, &ent);
-	    continue;
+static int
+read_dump(int fd, char **data, size_t *len)
+{
+    size_t size = 0, alloc = 0;
+    char *buf = NULL, *tmp;
+    ssize_t n;
+
+    while (1) {
+	if (size == alloc) {
+	    alloc = alloc ? alloc * 2 : LOAD_CHUNK_SIZE;
+	    tmp = realloc(buf, alloc);
+	    if (tmp == NULL) {
+		free(buf);
+		return ENOMEM;
+	    }
+	    buf = tmp;
 	}
-	if (parse_event_alloc (&ent.entry.modified_by, e.modified) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing event (%s)\n",
-		     filename, line, e.modified);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	n = read(fd, buf + size, alloc - size);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    free(buf);
+	    return errno;
 	}
-	if (parse_time_string_alloc (&ent.entry.valid_start, e.valid_start) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, line, e.valid_start);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	if (n == 0)
+	    break;
+	size += n;
+    }
+    *data = buf;
+    *len = size;
+    return 0;
+}
+
+static double
+elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+	(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*
+ * Parse the dump file in `filename' and create the database (merging
+ * iff merge).  The entries are parsed by `nthreads' threads (-1 picks a
+ * number from the CPUs online, 0 parses in the writer) and stored in
+ * one backend transaction, or `batch_size' entries per transaction if
+ * it is not 0.
+ */
+
+static int
+doit(const char *filename, int mergep, int nthreads, int batch_size,
+     int progress)
+{
+    krb5_error_code ret;
+    int fd;
+    struct stat sb;
+    char *data = NULL;
+    size_t len = 0;
+    int mapped = 0, binary;
+    struct load_chunk *chunks = NULL, *c;
+    size_t nchunks = 0, i, j;
+    const char *p, *q, *end;
+    unsigned long line, count;
+    struct load_error *err;
+    struct timeval start, last;
+    int flags = O_RDWR;
+    int locked;
+    HDB *db = _kadm5_s_get_db(kadm_handle);
+#ifdef ENABLE_PTHREAD_SUPPORT
+    struct load_pool pool;
+    struct load_thread *threads = NULL;
+    int started = 0;
+#endif
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0){
+	krb5_warn(context, errno, "open(%s)", filename);
+	return 1;
+    }
+    if (fstat(fd, &sb) < 0) {
+	krb5_warn(context, errno, "fstat(%s)", filename);
+	close(fd);
+	return 1;
+    }
+#ifdef HAVE_MMAP
+    if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	(uintmax_t)sb.st_size <= SIZE_MAX) {
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED) {
+	    len = sb.st_size;
+	    mapped = 1;
+	} else
+	    data = NULL;
+    }
+#endif
+    if (!mapped) {
+	ret = read_dump(fd, &data, &len);
+	if (ret) {
+	    krb5_warn(context, ret, "read(%s)", filename);
+	    close(fd);
+	    return 1;
 	}
-	if (parse_time_string_alloc (&ent.entry.valid_end,   e.valid_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, line, e.valid_end);
-	    hdb_free_entry (context, &ent);
-	    continue;
+    }
+    close(fd);
+
+    /*
+     * cut the dump into chunks that end on a newline, or a record of
+     * a binary dump
+     */
+    end = data + len;
+    binary = len >= KADMIN_BINARY_DUMP_MAGIC_LEN &&
+	memcmp(data, KADMIN_BINARY_DUMP_MAGIC,
+	       KADMIN_BINARY_DUMP_MAGIC_LEN) == 0;
+    for (p = data + (binary ? KADMIN_BINARY_DUMP_MAGIC_LEN : 0); p < end; p = q) {
+	if (binary) {
+	    krb5_data key, value;
+
+	    for (q = p; q < end && (size_t)(q - p) < LOAD_CHUNK_SIZE; ) {
+		if ((q = binary_field(q, end, &key)) == NULL ||
+		    (q = binary_field(q, end, &value)) == NULL) {
+		    krb5_warnx(context, "%s: truncated binary dump", filename);
+		    ret = HEIM_ERR_EOF;
+		    goto out;
+		}
+	    }
+	} else if ((size_t)(end - p) <= LOAD_CHUNK_SIZE)
+	    q = end;
+	else {
+	    q = memchr(p + LOAD_CHUNK_SIZE, '\n',
+		       end - p - LOAD_CHUNK_SIZE);
+	    q = q ? q + 1 : end;
 	}
-	if (parse_time_string_alloc (&ent.entry.pw_end,      e.pw_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, line, e.pw_end);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	if ((nchunks % 64) == 0) {
+	    c = realloc(chunks, (nchunks + 64) * sizeof(chunks[0]));
+	    if (c == NULL)
+		krb5_errx (context, 1, "realloc: out of memory");
+	    chunks = c;
 	}
+	c = &chunks[nchunks++];
+	memset(c, 0, sizeof(*c));
+	c->data = p;
+	c->len = q - p;
+	c->binary = binary;
+    }
 
-	if (parse_integer_alloc (&ent.entry.max_life,  e.max_life) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, line, e.max_life);
-	    hdb_free_entry (context, &ent);
-	    continue;
+    ret = kadm5_log_truncate (kadm_handle);
+    if (ret) {
+	krb5_warn(context, ret, "kadm5_log_truncate");
+	goto out;
+    }
 
+    if(!mergep)
+	flags |= O_CREAT | O_TRUNC;
+    ret = db->hdb_open(context, db, flags, 0600);
+    if(ret){
+	krb5_warn(context, ret, "hdb_open");
+	goto out;
+    }
+
+    if (nthreads < 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* leave one CPU to the writer */
+	nthreads = ncpu > 1 ? (ncpu > 9 ? 8 : ncpu - 1) : 0;
+#else
+	nthreads = 0;
+#endif
+    }
+    if ((size_t)nthreads > nchunks)
+	nthreads = nchunks;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (nthreads > 0) {
+	HEIMDAL_MUTEX_init(&pool.mutex);
+	pthread_cond_init(&pool.cond, NULL);
+	pool.chunks = chunks;
+	pool.nchunks = nchunks;
+	pool.next = pool.stored = 0;
+	pool.window = 4 * nthreads;
+	pool.shutdown = 0;
+
+	threads = calloc(nthreads, sizeof(threads[0]));
+	if (threads == NULL)
+	    krb5_errx (context, 1, "malloc: out of memory");
+	for (started = 0; started < nthreads; started++) {
+	    struct load_thread *t = &threads[started];
+
+	    t->pool = &pool;
+	    ret = krb5_init_context(&t->context);
+	    if (ret) {
+		krb5_warn(context, ret, "krb5_init_context");
+		break;
+	    }
+	    ret = pthread_create(&t->thread, NULL, load_thread, t);
+	    if (ret) {
+		krb5_warn(context, ret, "pthread_create");
+		krb5_free_context(t->context);
+		break;
+	    }
 	}
-	if (parse_integer_alloc (&ent.entry.max_renew, e.max_renew) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, line, e.max_renew);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	/* the writer parses whatever the threads did not get to */
+	ret = 0;
+    }
+#else
+    nthreads = 0;
+#endif
+
+    /* backends that can (sqlite) store each batch in one transaction */
+    locked = db->hdb_lock(context, db, HDB_WLOCK) == 0;
+    gettimeofday(&start, NULL);
+    last = start;
+    line = 0;
+    count = 0;
+    for (i = 0; i < nchunks && ret == 0; i++) {
+	c = &chunks[i];
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+	if (started > 0) {
+	    HEIMDAL_MUTEX_lock(&pool.mutex);
+	    if (pool.next <= i) {
+		/* the threads are all busy, parse it here */
+		pool.next = i + 1;
+		HEIMDAL_MUTEX_unlock(&pool.mutex);
+		parse_chunk(context, c);
+	    } else {
+		while (!c->parsed)
+		    pthread_cond_wait(&pool.cond, &pool.mutex);
+		HEIMDAL_MUTEX_unlock(&pool.mutex);
+	    }
+	} else
+#endif
+	    parse_chunk(context, c);
+
+	for (err = c->errors; err != NULL; err = err->next)
+	    fprintf(stderr, "%s:%lu:%s\n", filename, line + err->line,
+		    err->msg);
+	line += c->lines;
+
+	for (j = 0; j < c->num; j++) {
+	    ret = db->hdb_store(context, db, HDB_F_REPLACE, &c->entries[j]);
+	    if (ret) {
+		krb5_warn(context, ret, "db_store");
+		break;
+	    }
+	    count++;
+	    if (locked && batch_size > 0 && (count % batch_size) == 0) {
+		ret = db->hdb_unlock(context, db);
+		if (ret) {
+		    krb5_warn(context, ret, "hdb_unlock");
+		    locked = 0;
+		    break;
+		}
+		locked = db->hdb_lock(context, db, HDB_WLOCK) == 0;
+	    }
 	}
-
-	if (parse_hdbflags2int (&ent.entry.flags, e.flags) != 1) {
-	    fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
-		     filename, line, e.flags);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	free_chunk(context, c);
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+	if (started > 0) {
+	    HEIMDAL_MUTEX_lock(&pool.mutex);
+	    pool.stored = i + 1;
+	    pthread_cond_broadcast(&pool.cond);
+	    HEIMDAL_MUTEX_unlock(&pool.mutex);
 	}
+#endif
 
-	if(parse_generation(e.generation, &ent.entry.generation) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
-		     filename, line, e.generation);
-	    hdb_free_entry (context, &ent);
-	    continue;
-	}
+	if (progress && elapsed(&last) >= 1.0) {
+	    double t = elapsed(&start);
 
-	if(parse_extensions(e.extensions, &ent.entry.extensions) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
-		     filename, line, e.extensions);
-	    hdb_free_entry (context, &ent);
-	    continue;
+	    fprintf(stderr, "%s: %3d%% %lu entries (%.0f entries/s)\n",
+		    filename, (int)(100.0 * (c->data + c->len - data) / len),
+		    count, t > 0 ? count / t : 0.0);
+	    gettimeofday(&last, NULL);
 	}
+    }
+    if (locked) {
+	krb5_error_code ret2;
 
-	ret = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
-	hdb_free_entry (context, &ent);
+	/* a failed load leaves nothing of the current batch behind */
 	if (ret) {
-	    krb5_warn(context, ret, "db_store");
-	    break;
+	    ret2 = hdb_rollback(context, db);
+	    if (ret2)
+		krb5_warn(context, ret2, "hdb_rollback");
+	} else {
+	    ret2 = db->hdb_unlock(context, db);
+	    if (ret2) {
+		krb5_warn(context, ret2, "hdb_unlock");
+		ret = ret2;
+	    }
 	}
     }
     db->hdb_close(context, db);
-    fclose(f);
+
+    if (progress) {
+	double t = elapsed(&start);
+
+	fprintf(stderr, "%s: %lu entries in %.1fs (%.0f entries/s)\n",
+		filename, count, t, t > 0 ? count / t : 0.0);
+    }
+
+ out:
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (threads) {
+	int k;
+
+	HEIMDAL_MUTEX_lock(&pool.mutex);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.cond);
+	HEIMDAL_MUTEX_unlock(&pool.mutex);
+	for (k = 0; k < started; k++) {
+	    pthread_join(threads[k].thread, NULL);
+	    krb5_free_context(threads[k].context);
+	}
+	free(threads);
+	pthread_cond_destroy(&pool.cond);
+	HEIMDAL_MUTEX_destroy(&pool.mutex);
+    }
+#endif
+    for (i = 0; i < nchunks; i++)
+	free_chunk(context, &chunks[i]);
+    free(chunks);
+#ifdef HAVE_MMAP
+    if (mapped)
+	munmap(data, len);
+    else
+#endif
+	free(data);
     return ret != 0;
 }
 
@@ -544,24 +1067,31 @@ doit(const char *filename, int mergep)
 extern int local_flag;
 
 static int
-loadit(int mergep, const char *name, int argc, char **argv)
+loadit(int mergep, const char *name, int nthreads, int batch_size,
+       int progress, int argc, char **argv)
 {
     if(!local_flag) {
 	krb5_warnx(context, "%s is only available in local (-l) mode", name);
 	return 0;
     }
+    if (batch_size < 0) {
+	krb5_warnx(context, "%s: invalid batch size %d", name, batch_size);
+	return 1;
+    }
 
-    return doit(argv[0], mergep);
+    return doit(argv[0], mergep, nthreads, batch_size, progress);
 }
 
 int
-load(void *opt, int argc, char **argv)
+load(struct load_options *opt, int argc, char **argv)
 {
-    return loadit(0, "load", argc, argv);
+    return loadit(0, "load", opt->threads_integer, opt->batch_size_integer,
+		  opt->progress_flag, argc, argv);
 }
 
 int
-merge(void *opt, int argc, char **argv)
+merge(struct merge_options *opt, int argc, char **argv)
 {
-    return loadit(1, "merge", argc, argv);
+    return loadit(1, "merge", opt->threads_integer, opt->batch_size_integer,
+		  opt->progress_flag, argc, argv);
 }
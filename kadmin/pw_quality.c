@@ -58,3 +58,23 @@ password_quality(void *opt, int argc, char **argv)
 
     return 0;
 }
+
+int
+create_password_dictionary(struct create_password_dictionary_options *opt,
+			   int argc, char **argv)
+{
+    krb5_error_code ret;
+
+    if (opt->bits_per_word_integer <= 0) {
+	krb5_warnx(context, "invalid bits per word %d",
+		   opt->bits_per_word_integer);
+	return 1;
+    }
+    ret = kadm5_create_passwd_dictionary(context, argv[0], argv[1],
+					 opt->bits_per_word_integer);
+    if (ret) {
+	krb5_warn(context, ret, "kadm5_create_passwd_dictionary");
+	return 1;
+    }
+    return 0;
+}
@@ -519,7 +519,11 @@ v5_loop (krb5_context contextp,
 	    exit(0);
 	ret = krb5_read_priv_message(contextp, ac, &fd, &in);
 	if(ret == HEIM_ERR_EOF)
-	    exit(0);
+	    return;
+	if((ret == EAGAIN || ret == EWOULDBLOCK) && num_workers > 0) {
+	    krb5_warnx(contextp, "connection idle for too long, closing it");
+	    return;
+	}
 	if(ret)
 	    krb5_err(contextp, 1, ret, "krb5_read_priv_message");
 	doing_useful_work = 1;
@@ -542,6 +546,13 @@ match_appl_version(const void *data, const char *appl_version)
     return 1;
 }
 
+/*
+ * The server handle of the last connection, kept for the next one
+ * when kadmind serves many connections from a process.  Clients that
+ * send realm parameters of their own get a handle of their own.
+ */
+static void *cached_handle;
+
 static void
 handle_v5(krb5_context contextp,
 	  krb5_keytab keytab,
@@ -584,6 +595,7 @@ handle_v5(krb5_context contextp,
 	if(ret)
 	    krb5_err(contextp, 1, ret, "krb5_read_priv_message");
 	_kadm5_unmarshal_params(contextp, &params, &realm_params);
+	krb5_data_free(&params);
     }
 
     initial = ticket->ticket.flags.initial;
@@ -591,16 +603,34 @@ handle_v5(krb5_context contextp,
     if (ret)
 	krb5_err (contextp, 1, ret, "krb5_unparse_name");
     krb5_free_ticket (contextp, ticket);
-    ret = kadm5_s_init_with_password_ctx(contextp,
-					 client,
-					 NULL,
-					 KADM5_ADMIN_SERVICE,
-					 &realm_params,
-					 0, 0,
-					 &kadm_handlep);
-    if(ret)
-	krb5_err (contextp, 1, ret, "kadm5_init_with_password_ctx");
+    if (realm_params.mask == 0 && cached_handle != NULL) {
+	kadm_handlep = cached_handle;
+	cached_handle = NULL;
+	ret = kadm5_s_set_caller(kadm_handlep, client);
+	if(ret)
+	    krb5_err (contextp, 1, ret, "kadm5_s_set_caller");
+    } else {
+	ret = kadm5_s_init_with_password_ctx(contextp,
+					     client,
+					     NULL,
+					     KADM5_ADMIN_SERVICE,
+					     &realm_params,
+					     0, 0,
+					     &kadm_handlep);
+	if(ret)
+	    krb5_err (contextp, 1, ret, "kadm5_init_with_password_ctx");
+    }
+    free(client);
+    if (num_workers > 0)
+	set_socket_timeout(contextp, fd, idle_timeout);
     v5_loop (contextp, ac, initial, kadm_handlep, fd);
+
+    if (realm_params.mask == 0 && cached_handle == NULL && num_workers > 0)
+	cached_handle = kadm_handlep;
+    else
+	kadm5_destroy(kadm_handlep);
+    krb5_auth_con_free(contextp, ac);
+    free(realm_params.realm);
 }
 
 krb5_error_code
@@ -614,7 +644,11 @@ kadmind_loop(krb5_context contextp,
 
     n = krb5_net_read(contextp, &sock, buf, 4);
     if(n == 0)
-	exit(0);
+	return 0;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && num_workers > 0) {
+	krb5_warnx(contextp, "connection timed out before authenticating");
+	return 0;
+    }
     if(n < 0)
 	krb5_err(contextp, 1, errno, "read");
     _krb5_get_int(buf, &len, 4);
@@ -635,6 +669,9 @@ kadmind_loop(krb5_context contextp,
     } else
 	len = 4;
 
+    /* the MIT protocol authenticates inside its RPC stream */
+    if (num_workers > 0)
+	set_socket_timeout(contextp, sock, idle_timeout);
     handle_mit(contextp, buf, len, sock);
 
     return 0;
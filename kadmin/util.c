@@ -636,6 +636,38 @@ foreach_principal(const char *exp_str,
     return ret;
 }
 
+/*
+ * Hold the database lock across a command that changes several
+ * principals, so that their log records are committed together.
+ * Returns whether the lock was taken, it fails harmlessly against a
+ * remote kadmind.  Not to be used when the command prompts.
+ */
+int
+lock_database(void)
+{
+    return kadm5_lock(kadm_handle) == 0;
+}
+
+/*
+ * Release the lock if lock_database() took it and return `ret', or the
+ * error of the unlock if there was none.
+ */
+krb5_error_code
+unlock_database(int locked, krb5_error_code ret)
+{
+    krb5_error_code ret2;
+
+    if (!locked)
+	return ret;
+    ret2 = kadm5_unlock(kadm_handle);
+    if (ret2) {
+	krb5_warn(context, ret2, "kadm5_unlock");
+	if (ret == 0)
+	    ret = ret2;
+    }
+    return ret;
+}
+
 /*
  * prompt with `prompt' and default value `def', and store the reply
  * in `buf, len'
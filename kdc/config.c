@@ -45,6 +45,7 @@ struct dbinfo {
 };
 
 static char *config_file;	/* location of kdc config file */
+static char **config_files;	/* and the full list, for kdc_init_context() */
 
 static int require_preauth = -1; /* 1 == require preauth for all principals */
 static char *max_request_str;	/* `max_request' as a string */
@@ -69,6 +70,12 @@ krb5_addresses explicit_addresses;
 size_t max_request_udp;
 size_t max_request_tcp;
 
+/* Number of KDC worker processes to fork, 0 or 1 means none */
+int num_workers = -1;
+
+/* Number of request processing threads, 0 means none */
+int num_threads = -1;
+
 
 static struct getarg_strings addresses_str;	/* addresses to listen on */
 
@@ -111,6 +118,10 @@ static struct getargs args[] = {
 	"addresses to listen on", "list of addresses" },
     {	"disable-des",	0,	arg_flag, &disable_des,
 	"disable DES", NULL },
+    {	"num-workers",	0,	arg_integer, &num_workers,
+	"number of worker processes", "number" },
+    {	"num-threads",	0,	arg_integer, &num_threads,
+	"number of request processing threads", "number" },
     {	"builtin-hdb",	0,	arg_flag,   &builtin_hdb_flag,
 	"list builtin hdb backends", NULL},
     {   "runas-user",	0,	arg_string, &runas_string,
@@ -180,7 +191,6 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     }
 
     {
-	char **files;
 	int aret;
 
 	if (config_file == NULL) {
@@ -189,12 +199,11 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 		errx(1, "out of memory");
 	}
 
-	ret = krb5_prepend_config_files_default(config_file, &files);
+	ret = krb5_prepend_config_files_default(config_file, &config_files);
 	if (ret)
 	    krb5_err(context, 1, ret, "getting configuration files");
 
-	ret = krb5_set_config_files(context, files);
-	krb5_free_config_files(files);
+	ret = krb5_set_config_files(context, config_files);
 	if(ret)
 	    krb5_err(context, 1, ret, "reading configuration files");
     }
@@ -273,6 +282,13 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 							   "detach", NULL);
 #endif /* SUPPORT_DETACH */
 
+    if(num_workers == -1)
+	num_workers = krb5_config_get_int_default(context, NULL, 0,
+						  "kdc", "num-workers", NULL);
+    if(num_threads == -1)
+	num_threads = krb5_config_get_int_default(context, NULL, 0,
+						  "kdc", "num-threads", NULL);
+
     if(max_request_tcp == 0)
 	max_request_tcp = 64 * 1024;
     if(max_request_udp == 0)
@@ -301,3 +317,26 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 
     return config;
 }
+
+/*
+ * Create another context that reads the same configuration files as
+ * the one set up by configure(), for the request threads.
+ */
+
+krb5_error_code
+kdc_init_context(krb5_context *context)
+{
+    krb5_error_code ret;
+
+    ret = krb5_init_context(context);
+    if (ret)
+	return ret;
+    ret = krb5_set_config_files(*context, config_files);
+    if (ret == 0)
+	ret = krb5_kt_register(*context, &hdb_kt_ops);
+    if (ret) {
+	krb5_free_context(*context);
+	*context = NULL;
+    }
+    return ret;
+}
@@ -186,6 +186,13 @@ parse_ports(krb5_context context,
     free (str_copy);
 }
 
+/*
+ * Set when several worker processes share the same non-blocking
+ * listening sockets.
+ */
+
+static int shared_listeners;
+
 /*
  * every socket we listen on
  */
@@ -202,6 +209,8 @@ struct descr {
     struct sockaddr *sa;
     socklen_t sock_len;
     char addr_string[128];
+    int next_free;
+    krb5_boolean pending;	/* request handed to a thread */
 };
 
 static void
@@ -232,7 +241,8 @@ reinit_descrs (struct descr *d, int n)
 static void
 init_socket(krb5_context context,
 	    krb5_kdc_configuration *config,
-	    struct descr *d, krb5_address *a, int family, int type, int port)
+	    struct descr *d, krb5_address *a, int family, int type, int port,
+	    int reuse_port)
 {
     krb5_error_code ret;
     struct sockaddr_storage __ss;
@@ -263,6 +273,13 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+    if (reuse_port) {
+	int one = 1;
+	if (setsockopt(d->s, SOL_SOCKET, SO_REUSEPORT, (void *)&one, sizeof(one)) < 0)
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
 #endif
     d->type = type;
     d->port = port;
@@ -291,13 +308,14 @@ init_socket(krb5_context context,
 
 /*
  * Allocate descriptors for all the sockets that we should listen on
- * and return the number of them.
+ * and return the number of them.  With `reuse_port' the sockets are
+ * bound with SO_REUSEPORT so that several sets can share the ports.
  */
 
 static int
 init_sockets(krb5_context context,
 	     krb5_kdc_configuration *config,
-	     struct descr **desc)
+	     struct descr **desc, int reuse_port)
 {
     krb5_error_code ret;
     size_t i, j;
@@ -321,7 +339,8 @@ init_sockets(krb5_context context,
     for (i = 0; i < num_ports; i++){
 	for (j = 0; j < addresses.len; ++j) {
 	    init_socket(context, config, &d[num], &addresses.val[j],
-			ports[i].family, ports[i].type, ports[i].port);
+			ports[i].family, ports[i].type, ports[i].port,
+			reuse_port);
 	    if(d[num].s != rk_INVALID_SOCKET){
 		char a_str[80];
 		size_t len;
@@ -338,7 +357,8 @@ init_sockets(krb5_context context,
 	    }
 	}
     }
-    krb5_free_addresses (context, &addresses);
+    if (addresses.val != explicit_addresses.val)
+	krb5_free_addresses (context, &addresses);
     d = realloc(d, num * sizeof(*d));
     if (d == NULL && num != 0)
 	krb5_errx(context, 1, "realloc(%lu) failed",
@@ -378,7 +398,103 @@ addr_to_string(krb5_context context,
 }
 
 /*
- *
+ * UDP datagrams are read up to KDC_UDP_BATCH at a time into one
+ * preallocated buffer, and while a batch is open the replies are
+ * queued and then sent together.
+ */
+
+#ifdef HAVE_RECVMMSG
+#define KDC_UDP_BATCH 32
+#else
+#define KDC_UDP_BATCH 1
+#endif
+
+struct udp_reply {
+    krb5_socket_t s;
+    struct sockaddr_storage __ss;
+    socklen_t sock_len;
+    char addr_string[128];
+    krb5_data data;
+};
+
+static unsigned char *udp_buf;
+static int udp_batching;
+static size_t udp_nreplies;
+static struct udp_reply udp_replies[KDC_UDP_BATCH];
+
+static void
+flush_udp_replies(krb5_context context,
+		  krb5_kdc_configuration *config)
+{
+    size_t i = 0;
+
+    while (i < udp_nreplies) {
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[KDC_UDP_BATCH];
+	struct iovec iov[KDC_UDP_BATCH];
+	size_t j, n;
+	int sent;
+
+	/* one sendmmsg() per run of replies going out the same socket */
+	memset(msgs, 0, sizeof(msgs));
+	for (n = 0, j = i; j < udp_nreplies; j++, n++) {
+	    struct udp_reply *r = &udp_replies[j];
+
+	    if (r->s != udp_replies[i].s)
+		break;
+	    iov[n].iov_base = r->data.data;
+	    iov[n].iov_len = r->data.length;
+	    msgs[n].msg_hdr.msg_name = &r->__ss;
+	    msgs[n].msg_hdr.msg_namelen = r->sock_len;
+	    msgs[n].msg_hdr.msg_iov = &iov[n];
+	    msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+	sent = sendmmsg(udp_replies[i].s, msgs, n, 0);
+	if (sent <= 0) {
+	    kdc_log(context, config, 0, "sendmmsg(%s): %s",
+		    udp_replies[i].addr_string, strerror(rk_SOCK_ERRNO));
+	    sent = 1;	/* skip the one that failed */
+	}
+	i += sent;
+#else
+	struct udp_reply *r = &udp_replies[i++];
+
+	if (rk_IS_SOCKET_ERROR(sendto(r->s, r->data.data, r->data.length, 0,
+				      (struct sockaddr *)&r->__ss,
+				      r->sock_len)))
+	    kdc_log(context, config, 0, "sendto(%s): %s", r->addr_string,
+		    strerror(rk_SOCK_ERRNO));
+#endif
+    }
+    for (i = 0; i < udp_nreplies; i++)
+	krb5_data_free(&udp_replies[i].data);
+    udp_nreplies = 0;
+}
+
+static void
+queue_udp_reply(krb5_context context,
+		krb5_kdc_configuration *config,
+		struct descr *d,
+		krb5_data *reply)
+{
+    struct udp_reply *r;
+
+    if (udp_nreplies == KDC_UDP_BATCH)
+	flush_udp_replies(context, config);
+    r = &udp_replies[udp_nreplies];
+    /* the queue takes over the reply, the caller frees an empty one */
+    r->data = *reply;
+    krb5_data_zero(reply);
+    r->s = d->s;
+    memcpy(&r->__ss, d->sa, d->sock_len);
+    r->sock_len = d->sock_len;
+    strlcpy(r->addr_string, d->addr_string, sizeof(r->addr_string));
+    udp_nreplies++;
+}
+
+/*
+ * Send `reply' to the peer in `d'. A datagram reply sent while a
+ * batch is open is moved to the queue and `reply' is left empty.
  */
 
 static void
@@ -391,6 +507,10 @@ send_reply(krb5_context context,
     kdc_log(context, config, 5,
 	    "sending %lu bytes to %s", (unsigned long)reply->length,
 	    d->addr_string);
+    if (udp_batching && d->type == SOCK_DGRAM) {
+	queue_udp_reply(context, config, d, reply);
+	return;
+    }
     if(prependlength){
 	unsigned char l[4];
 	l[0] = (reply->length >> 24) & 0xff;
@@ -411,15 +531,266 @@ send_reply(krb5_context context,
     }
 }
 
+#ifdef ENABLE_PTHREAD_SUPPORT
+
 /*
- * Handle the request in `buf, len' to socket `d'
+ * With num-threads set the requests are handed to a pool of threads,
+ * each with its own context and database handles, so that a slow
+ * backend or a PKINIT request does not hold up everybody else.  The
+ * threads put the processed requests on the done list and wake up the
+ * network loop through a pipe, and the loop sends the replies.
  */
 
+struct kdc_job {
+    struct kdc_job *next;
+    int idx;			/* descr of the TCP connection, or -1 */
+    krb5_socket_t s;
+    int type;
+    krb5_boolean prependlength;
+    krb5_data request;
+    krb5_data reply;
+    krb5_error_code ret;
+    struct timeval now;		/* when the request came in */
+    struct sockaddr_storage __ss;
+    socklen_t sock_len;
+    char addr_string[128];
+};
+
+struct request_pool;
+
+struct request_thread {
+    pthread_t thread;
+    krb5_context context;
+    krb5_kdc_configuration *config;
+    struct request_pool *pool;
+};
+
+struct request_pool {
+    HEIMDAL_MUTEX mutex;
+    pthread_cond_t cond;
+    struct kdc_job *queue, **queue_tail;
+    struct kdc_job *done, **done_tail;
+    int shutdown;
+    int wakeup[2];
+    int nthreads;
+    struct request_thread *threads;
+};
+
+static struct request_pool *request_pool;
+
+static void
+free_job(struct kdc_job *job)
+{
+    krb5_data_free(&job->request);
+    krb5_data_free(&job->reply);
+    free(job);
+}
+
+static void *
+request_thread(void *ptr)
+{
+    struct request_thread *t = ptr;
+    struct request_pool *pool = t->pool;
+    struct kdc_job *job;
+    int wakeup;
+
+    while (1) {
+	HEIMDAL_MUTEX_lock(&pool->mutex);
+	while (pool->queue == NULL && !pool->shutdown)
+	    pthread_cond_wait(&pool->cond, &pool->mutex);
+	job = pool->queue;
+	if (job == NULL) {
+	    HEIMDAL_MUTEX_unlock(&pool->mutex);
+	    break;
+	}
+	pool->queue = job->next;
+	if (pool->queue == NULL)
+	    pool->queue_tail = &pool->queue;
+	HEIMDAL_MUTEX_unlock(&pool->mutex);
+
+	krb5_kdc_update_time(&job->now);
+	job->ret = krb5_kdc_process_request(t->context, t->config,
+					    job->request.data,
+					    job->request.length,
+					    &job->reply, &job->prependlength,
+					    job->addr_string,
+					    (struct sockaddr *)&job->__ss,
+					    job->type == SOCK_DGRAM);
+	if (request_log)
+	    krb5_kdc_save_request(t->context, request_log,
+				  job->request.data, job->request.length,
+				  &job->reply, (struct sockaddr *)&job->__ss);
+
+	HEIMDAL_MUTEX_lock(&pool->mutex);
+	job->next = NULL;
+	wakeup = (pool->done == NULL);
+	*pool->done_tail = job;
+	pool->done_tail = &job->next;
+	HEIMDAL_MUTEX_unlock(&pool->mutex);
+
+	/* if the pipe is full the loop is going to wake up anyway */
+	if (wakeup)
+	    while (write(pool->wakeup[1], "", 1) < 0 && errno == EINTR)
+		;
+    }
+    return NULL;
+}
+
 static void
+destroy_request_thread(struct request_thread *t)
+{
+    if (t->config) {
+	krb5_kdc_free_dbinfo(t->context, t->config);
+	free(t->config);
+    }
+    if (t->context)
+	krb5_free_context(t->context);
+}
+
+static void
+start_request_pool(krb5_context context,
+		   krb5_kdc_configuration *config)
+{
+    struct request_pool *pool;
+    krb5_error_code ret;
+    int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+	krb5_errx(context, 1, "out of memory");
+    HEIMDAL_MUTEX_init(&pool->mutex);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->queue_tail = &pool->queue;
+    pool->done_tail = &pool->done;
+    if (pipe(pool->wakeup) < 0)
+	krb5_err(context, 1, errno, "pipe");
+    for (i = 0; i < 2; i++) {
+	rk_cloexec(pool->wakeup[i]);
+	socket_set_nonblocking(pool->wakeup[i], 1);
+    }
+
+    pool->threads = calloc(num_threads, sizeof(pool->threads[0]));
+    if (pool->threads == NULL)
+	krb5_errx(context, 1, "out of memory");
+    for (i = 0; i < num_threads; i++) {
+	struct request_thread *t = &pool->threads[i];
+
+	t->pool = pool;
+	ret = kdc_init_context(&t->context);
+	if (ret)
+	    krb5_err(context, 1, ret, "kdc_init_context");
+
+	/* share everything but the database handles */
+	t->config = malloc(sizeof(*t->config));
+	if (t->config == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	*t->config = *config;
+	t->config->db = NULL;
+	t->config->num_db = 0;
+	t->config->db_state = NULL;
+	t->config->entry_cache = NULL;
+	t->config->logf = NULL;	/* krb5_kdc_set_dbinfo() is chatty */
+	ret = krb5_kdc_set_dbinfo(t->context, t->config);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
+	t->config->logf = config->logf;
+
+	ret = pthread_create(&t->thread, NULL, request_thread, t);
+	if (ret)
+	    krb5_err(context, 1, ret, "pthread_create");
+	pool->nthreads++;
+    }
+    request_pool = pool;
+    kdc_log(context, config, 0, "started %d request threads", num_threads);
+}
+
+static void
+stop_request_pool(void)
+{
+    struct request_pool *pool = request_pool;
+    struct kdc_job *job;
+    int i;
+
+    if (pool == NULL)
+	return;
+    request_pool = NULL;
+
+    HEIMDAL_MUTEX_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    HEIMDAL_MUTEX_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->nthreads; i++) {
+	pthread_join(pool->threads[i].thread, NULL);
+	destroy_request_thread(&pool->threads[i]);
+    }
+    while ((job = pool->done) != NULL) {
+	pool->done = job->next;
+	free_job(job);
+    }
+    close(pool->wakeup[0]);
+    close(pool->wakeup[1]);
+    pthread_cond_destroy(&pool->cond);
+    HEIMDAL_MUTEX_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Put the request in `buf, len' from `d' on the queue.  For TCP the
+ * connection is marked pending until the reply has been sent.
+ */
+
+static krb5_error_code
+queue_request(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      void *buf, size_t len, krb5_boolean prependlength,
+	      struct descr *d, int idx)
+{
+    krb5_error_code ret;
+    struct kdc_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+	return ENOMEM;
+    ret = krb5_data_copy(&job->request, buf, len);
+    if (ret) {
+	free(job);
+	return ret;
+    }
+    gettimeofday(&job->now, NULL);
+    job->idx = idx;
+    job->s = d->s;
+    job->type = d->type;
+    job->prependlength = prependlength;
+    memcpy(&job->__ss, d->sa, d->sock_len);
+    job->sock_len = d->sock_len;
+    strlcpy(job->addr_string, d->addr_string, sizeof(job->addr_string));
+    if (idx != -1)
+	d->pending = TRUE;
+
+    HEIMDAL_MUTEX_lock(&request_pool->mutex);
+    *request_pool->queue_tail = job;
+    request_pool->queue_tail = &job->next;
+    pthread_cond_signal(&request_pool->cond);
+    HEIMDAL_MUTEX_unlock(&request_pool->mutex);
+
+    return 0;
+}
+
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+/*
+ * Handle the request in `buf, len' to socket `d', which is `d[idx]'
+ * for TCP.  Returns 1 if the request was queued and the reply is sent
+ * later on.
+ */
+
+static int
 do_request(krb5_context context,
 	   krb5_kdc_configuration *config,
 	   void *buf, size_t len, krb5_boolean prependlength,
-	   struct descr *d)
+	   struct descr *d, int idx)
 {
     krb5_error_code ret;
     krb5_data reply;
@@ -427,6 +798,15 @@ do_request(krb5_context context,
 
     krb5_kdc_update_time(NULL);
 
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (request_pool) {
+	ret = queue_request(context, config, buf, len, prependlength, d, idx);
+	if (ret == 0)
+	    return 1;
+	krb5_warn(context, ret, "queueing request from %s", d->addr_string);
+    }
+#endif
+
     krb5_data_zero(&reply);
     ret = krb5_kdc_process_request(context, config,
 				   buf, len, &reply, &prependlength,
@@ -442,6 +822,40 @@ do_request(krb5_context context,
 	kdc_log(context, config, 0,
 		"Failed processing %lu byte request from %s",
 		(unsigned long)len, d->addr_string);
+    return 0;
+}
+
+/*
+ * Handle the datagram in `buf, n' that came in on the UDP socket in
+ * `d'
+ */
+
+static void
+handle_datagram(krb5_context context,
+		krb5_kdc_configuration *config,
+		struct descr *d, unsigned char *buf, size_t n)
+{
+    addr_to_string (context, d->sa, d->sock_len,
+		    d->addr_string, sizeof(d->addr_string));
+    if (n == max_request_udp) {
+	krb5_data data;
+	krb5_warn(context, errno,
+		  "recvfrom: truncated packet from %s, asking for TCP",
+		  d->addr_string);
+	krb5_mk_error(context,
+		      KRB5KRB_ERR_RESPONSE_TOO_BIG,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      &data);
+	send_reply(context, config, FALSE, d, &data);
+	krb5_data_free(&data);
+    } else {
+	do_request(context, config, buf, n, FALSE, d, -1);
+    }
 }
 
 /*
@@ -453,43 +867,57 @@ handle_udp(krb5_context context,
 	   krb5_kdc_configuration *config,
 	   struct descr *d)
 {
-    unsigned char *buf;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[KDC_UDP_BATCH];
+    struct iovec iov[KDC_UDP_BATCH];
+    struct sockaddr_storage ss[KDC_UDP_BATCH];
+    int i;
+#endif
     ssize_t n;
 
-    buf = malloc(max_request_udp);
-    if(buf == NULL){
-	kdc_log(context, config, 0, "Failed to allocate %lu bytes", (unsigned long)max_request_udp);
-	return;
+    if (udp_buf == NULL) {
+	udp_buf = malloc(KDC_UDP_BATCH * max_request_udp);
+	if (udp_buf == NULL) {
+	    kdc_log(context, config, 0, "Failed to allocate %lu bytes",
+		    (unsigned long)(KDC_UDP_BATCH * max_request_udp));
+	    return;
+	}
     }
 
+#ifdef HAVE_RECVMMSG
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < KDC_UDP_BATCH; i++) {
+	iov[i].iov_base = udp_buf + i * max_request_udp;
+	iov[i].iov_len = max_request_udp;
+	msgs[i].msg_hdr.msg_name = &ss[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(ss[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(d->s, msgs, KDC_UDP_BATCH, MSG_DONTWAIT, NULL);
+#else
     d->sock_len = sizeof(d->__ss);
-    n = recvfrom(d->s, buf, max_request_udp, 0, d->sa, &d->sock_len);
-    if(rk_IS_SOCKET_ERROR(n))
-	krb5_warn(context, rk_SOCK_ERRNO, "recvfrom");
-    else {
-	addr_to_string (context, d->sa, d->sock_len,
-			d->addr_string, sizeof(d->addr_string));
-	if ((size_t)n == max_request_udp) {
-	    krb5_data data;
-	    krb5_warn(context, errno,
-		      "recvfrom: truncated packet from %s, asking for TCP",
-		      d->addr_string);
-	    krb5_mk_error(context,
-			  KRB5KRB_ERR_RESPONSE_TOO_BIG,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  &data);
-	    send_reply(context, config, FALSE, d, &data);
-	    krb5_data_free(&data);
-	} else {
-	    do_request(context, config, buf, n, FALSE, d);
-	}
+    n = recvfrom(d->s, udp_buf, max_request_udp, 0, d->sa, &d->sock_len);
+#endif
+    if(rk_IS_SOCKET_ERROR(n)) {
+	/* another worker got there first */
+	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EWOULDBLOCK)
+	    krb5_warn(context, rk_SOCK_ERRNO, "recvfrom");
+	return;
+    }
+
+    udp_batching = 1;
+#ifdef HAVE_RECVMMSG
+    for (i = 0; i < n; i++) {
+	d->sock_len = msgs[i].msg_hdr.msg_namelen;
+	memcpy(d->sa, &ss[i], d->sock_len);
+	handle_datagram(context, config, d, iov[i].iov_base, msgs[i].msg_len);
     }
-    free (buf);
+#else
+    handle_datagram(context, config, d, udp_buf, n);
+#endif
+    udp_batching = 0;
+    flush_udp_replies(context, config);
 }
 
 static void
@@ -542,17 +970,14 @@ add_new_tcp (krb5_context context,
     d[child].sock_len = sizeof(d[child].__ss);
     s = accept(d[parent].s, d[child].sa, &d[child].sock_len);
     if(rk_IS_BAD_SOCKET(s)) {
-	krb5_warn(context, rk_SOCK_ERRNO, "accept");
+	if (!shared_listeners ||
+	    (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EWOULDBLOCK))
+	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
 	return;
     }
-
-#ifdef FD_SETSIZE
-    if (s >= FD_SETSIZE) {
-	krb5_warnx(context, "socket FD too large");
-	rk_closesocket (s);
-	return;
-    }
-#endif
+    /* some systems let the new socket inherit O_NONBLOCK */
+    if (shared_listeners)
+	socket_set_nonblocking(s, 0);
 
     d[child].s = s;
     d[child].timeout = time(NULL) + TCP_TIMEOUT;
@@ -745,17 +1170,12 @@ handle_http_tcp (krb5_context context,
 static void
 handle_tcp(krb5_context context,
 	   krb5_kdc_configuration *config,
-	   struct descr *d, int idx, int min_free)
+	   struct descr *d, int idx)
 {
     unsigned char buf[1024];
     int n;
     int ret = 0;
 
-    if (d[idx].timeout == 0) {
-	add_new_tcp (context, config, d, idx, min_free);
-	return;
-    }
-
     n = recvfrom(d[idx].s, buf, sizeof(buf), 0, NULL, NULL);
     if(rk_IS_SOCKET_ERROR(n)){
 	krb5_warn(context, rk_SOCK_ERRNO, "recvfrom failed from %s to %s/%d",
@@ -818,116 +1238,775 @@ handle_tcp(krb5_context context,
     if (ret < 0)
 	return;
     else if (ret == 1) {
-	do_request(context, config,
-		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
-	clear_descr(d + idx);
+	if (do_request(context, config,
+		       d[idx].buf, d[idx].len, TRUE, &d[idx], idx) == 0)
+	    clear_descr(d + idx);
+    }
+}
+
+/*
+ * Readiness notification for the main loop.  Descriptors are
+ * registered once, by their index in the descr array, and a wait only
+ * reports back the indices that have become readable, so the cost of a
+ * wakeup does not depend on the number of idle connections.
+ */
+
+#define KDC_MAX_EVENTS 256
+
+struct kdc_events;
+
+struct kdc_events_ops {
+    const char *name;
+    int (*init)(struct kdc_events *);
+    void (*destroy)(struct kdc_events *);
+    int (*add)(struct kdc_events *, krb5_socket_t, int);
+    void (*del)(struct kdc_events *, krb5_socket_t, int);
+    int (*wait)(struct kdc_events *, int, int *, int);
+};
+
+struct kdc_events {
+    const struct kdc_events_ops *ops;
+    void *data;
+};
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+
+struct epoll_events {
+    int fd;
+    struct epoll_event ev[KDC_MAX_EVENTS];
+};
+
+static int
+epoll_events_init(struct kdc_events *e)
+{
+    struct epoll_events *p;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+	return ENOMEM;
+    p->fd = epoll_create(KDC_MAX_EVENTS);
+    if (p->fd < 0) {
+	int save_errno = errno;
+	free(p);
+	return save_errno;
     }
+    rk_cloexec(p->fd);
+    e->data = p;
+    return 0;
 }
 
-krb5_boolean
-realloc_descrs(struct descr **d, unsigned int *ndescr)
+static void
+epoll_events_destroy(struct kdc_events *e)
+{
+    struct epoll_events *p = e->data;
+
+    close(p->fd);
+    free(p);
+}
+
+static int
+epoll_events_add(struct kdc_events *e, krb5_socket_t s, int idx)
+{
+    struct epoll_events *p = e->data;
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = idx;
+    if (epoll_ctl(p->fd, EPOLL_CTL_ADD, s, &ev) < 0)
+	return errno;
+    return 0;
+}
+
+static void
+epoll_events_del(struct kdc_events *e, krb5_socket_t s, int idx)
+{
+    struct epoll_events *p = e->data;
+    struct epoll_event ev;
+
+    /* closing the socket already removed it, this is for the odd case */
+    memset(&ev, 0, sizeof(ev));
+    (void)epoll_ctl(p->fd, EPOLL_CTL_DEL, s, &ev);
+}
+
+static int
+epoll_events_wait(struct kdc_events *e, int timeout, int *ready, int nready)
+{
+    struct epoll_events *p = e->data;
+    int i, n;
+
+    if (nready > KDC_MAX_EVENTS)
+	nready = KDC_MAX_EVENTS;
+    n = epoll_wait(p->fd, p->ev, nready, timeout);
+    for (i = 0; i < n; i++)
+	ready[i] = p->ev[i].data.u32;
+    return n;
+}
+
+static const struct kdc_events_ops epoll_events_ops = {
+    "epoll",
+    epoll_events_init,
+    epoll_events_destroy,
+    epoll_events_add,
+    epoll_events_del,
+    epoll_events_wait
+};
+
+#endif /* HAVE_SYS_EPOLL_H && HAVE_EPOLL_CREATE */
+
+/*
+ * The poll() and select() backends keep a table of sockets indexed
+ * like the descr array, with holes marked rk_INVALID_SOCKET.  They are
+ * O(n) per wakeup, but poll() at least is not limited by FD_SETSIZE.
+ */
+
+struct sock_table {
+    krb5_socket_t *s;
+    size_t size;		/* allocated entries */
+    size_t len;			/* highest used index + 1 */
+    size_t next;		/* where to start reporting next time */
+#ifdef HAVE_POLL
+    struct pollfd *pfd;
+#endif
+};
+
+static int
+sock_table_init(struct kdc_events *e)
+{
+    e->data = calloc(1, sizeof(struct sock_table));
+    if (e->data == NULL)
+	return ENOMEM;
+    return 0;
+}
+
+static void
+sock_table_destroy(struct kdc_events *e)
+{
+    struct sock_table *t = e->data;
+
+    free(t->s);
+#ifdef HAVE_POLL
+    free(t->pfd);
+#endif
+    free(t);
+}
+
+static int
+sock_table_add(struct kdc_events *e, krb5_socket_t s, int idx)
+{
+    struct sock_table *t = e->data;
+    size_t i;
+
+    if ((size_t)idx >= t->size) {
+	size_t size = max(t->size * 2, (size_t)idx + 16);
+	krb5_socket_t *tmp;
+
+	tmp = realloc(t->s, size * sizeof(t->s[0]));
+	if (tmp == NULL)
+	    return ENOMEM;
+	t->s = tmp;
+#ifdef HAVE_POLL
+	{
+	    struct pollfd *ptmp;
+
+	    ptmp = realloc(t->pfd, size * sizeof(t->pfd[0]));
+	    if (ptmp == NULL)
+		return ENOMEM;
+	    t->pfd = ptmp;
+	}
+#endif
+	for (i = t->size; i < size; i++)
+	    t->s[i] = rk_INVALID_SOCKET;
+	t->size = size;
+    }
+    t->s[idx] = s;
+    if ((size_t)idx >= t->len)
+	t->len = idx + 1;
+    return 0;
+}
+
+static void
+sock_table_del(struct kdc_events *e, krb5_socket_t s, int idx)
+{
+    struct sock_table *t = e->data;
+
+    if ((size_t)idx >= t->len)
+	return;
+    t->s[idx] = rk_INVALID_SOCKET;
+    while (t->len > 0 && rk_IS_BAD_SOCKET(t->s[t->len - 1]))
+	t->len--;
+}
+
+#ifdef HAVE_POLL
+
+static int
+poll_events_wait(struct kdc_events *e, int timeout, int *ready, int nready)
+{
+    struct sock_table *t = e->data;
+    size_t i, j;
+    int n, num = 0;
+
+    for (i = 0; i < t->len; i++) {
+	t->pfd[i].fd = t->s[i];	/* negative fds are ignored by poll() */
+	t->pfd[i].events = POLLIN;
+	t->pfd[i].revents = 0;
+    }
+    n = poll(t->pfd, t->len, timeout);
+    if (n <= 0)
+	return n;
+    if (t->next >= t->len)
+	t->next = 0;
+    for (j = 0; j < t->len && num < nready; j++) {
+	i = (t->next + j) % t->len;
+	if (t->pfd[i].revents & (POLLIN|POLLERR|POLLHUP))
+	    ready[num++] = i;
+    }
+    t->next = (t->next + j) % t->len;
+    return num;
+}
+
+static const struct kdc_events_ops poll_events_ops = {
+    "poll",
+    sock_table_init,
+    sock_table_destroy,
+    sock_table_add,
+    sock_table_del,
+    poll_events_wait
+};
+
+#endif /* HAVE_POLL */
+
+static int
+select_events_add(struct kdc_events *e, krb5_socket_t s, int idx)
+{
+#if !defined(NO_LIMIT_FD_SETSIZE) && defined(FD_SETSIZE)
+    if (s >= FD_SETSIZE)
+	return EMFILE;
+#endif
+    return sock_table_add(e, s, idx);
+}
+
+static int
+select_events_wait(struct kdc_events *e, int timeout, int *ready, int nready)
+{
+    struct sock_table *t = e->data;
+    struct timeval tmout;
+    krb5_socket_t max_fd = 0;
+    fd_set fds;
+    size_t i, j;
+    int n, num = 0;
+
+    FD_ZERO(&fds);
+    for (i = 0; i < t->len; i++) {
+	if (rk_IS_BAD_SOCKET(t->s[i]))
+	    continue;
+	if (max_fd < t->s[i])
+	    max_fd = t->s[i];
+	FD_SET(t->s[i], &fds);
+    }
+    tmout.tv_sec = timeout / 1000;
+    tmout.tv_usec = (timeout % 1000) * 1000;
+    n = select(max_fd + 1, &fds, 0, 0, &tmout);
+    if (n <= 0)
+	return n;
+    if (t->next >= t->len)
+	t->next = 0;
+    for (j = 0; j < t->len && num < nready; j++) {
+	i = (t->next + j) % t->len;
+	if (!rk_IS_BAD_SOCKET(t->s[i]) && FD_ISSET(t->s[i], &fds))
+	    ready[num++] = i;
+    }
+    t->next = (t->next + j) % t->len;
+    return num;
+}
+
+static const struct kdc_events_ops select_events_ops = {
+    "select",
+    sock_table_init,
+    sock_table_destroy,
+    select_events_add,
+    sock_table_del,
+    select_events_wait
+};
+
+static const struct kdc_events_ops *kdc_events_backends[] = {
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+    &epoll_events_ops,
+#endif
+#ifdef HAVE_POLL
+    &poll_events_ops,
+#endif
+    &select_events_ops,
+    NULL
+};
+
+/*
+ * Pick the first backend that works, or the one named by
+ * [kdc]event-backend.
+ */
+
+static void
+init_events(krb5_context context, struct kdc_events *e)
+{
+    const char *name;
+    size_t i;
+    int ret = 0;
+
+    name = krb5_config_get_string(context, NULL, "kdc", "event-backend", NULL);
+    for (i = 0; kdc_events_backends[i] != NULL; i++) {
+	if (name && strcasecmp(name, kdc_events_backends[i]->name) != 0)
+	    continue;
+	e->ops = kdc_events_backends[i];
+	ret = e->ops->init(e);
+	if (ret == 0)
+	    return;
+	krb5_warn(context, ret, "%s event backend", e->ops->name);
+    }
+    if (name)
+	krb5_errx(context, 1, "event backend %s not available", name);
+    krb5_errx(context, 1, "no usable event backend");
+}
+
+/*
+ * Grow the descr array, new entries are put on the free list.
+ */
+
+static krb5_boolean
+realloc_descrs(struct descr **d, unsigned int *ndescr, int *free_list)
 {
     struct descr *tmp;
+    unsigned int grow;
     size_t i;
 
-    tmp = realloc(*d, (*ndescr + 4) * sizeof(**d));
+    grow = max(*ndescr, 4);
+    tmp = realloc(*d, (*ndescr + grow) * sizeof(**d));
     if(tmp == NULL)
         return FALSE;
 
     *d = tmp;
     reinit_descrs (*d, *ndescr);
-    memset(*d + *ndescr, 0, 4 * sizeof(**d));
-    for(i = *ndescr; i < *ndescr + 4; i++)
-        init_descr (*d + i);
+    for(i = *ndescr + grow; i > *ndescr; i--) {
+        init_descr (*d + i - 1);
+        (*d)[i - 1].next_free = *free_list;
+        *free_list = i - 1;
+    }
 
-    *ndescr += 4;
+    *ndescr += grow;
 
     return TRUE;
 }
 
-int
-next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
+static int
+next_free_descr(krb5_context context, struct descr **d, unsigned int *ndescr,
+		int *free_list)
 {
-    size_t i;
-    int min_free;
+    int idx;
 
-    for(i = 0; i < *ndescr; i++) {
-        int s = (*d + i)->s;
-        if(rk_IS_BAD_SOCKET(s))
-            return i;
+    if (*free_list == -1 && !realloc_descrs(d, ndescr, free_list)) {
+        krb5_warnx(context, "No memory");
+        return -1;
     }
+    idx = *free_list;
+    *free_list = (*d)[idx].next_free;
+    return idx;
+}
 
-    min_free = *ndescr;
-    if(!realloc_descrs(d, ndescr)) {
-        min_free = -1;
-        krb5_warnx(context, "No memory");
+static void
+release_descr(struct kdc_events *e, struct descr *d, int idx,
+	      krb5_socket_t s, int *free_list)
+{
+    e->ops->del(e, s, idx);
+    d[idx].next_free = *free_list;
+    *free_list = idx;
+}
+
+/*
+ * Drop the TCP connections that have been hanging around for too
+ * long, returning when the next one will expire (or 0 if none).
+ */
+
+static time_t
+expire_tcp(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   struct kdc_events *e,
+	   struct descr *d, unsigned int ndescr, int *free_list,
+	   time_t now)
+{
+    time_t next = 0;
+    size_t i;
+
+    for(i = 0; i < ndescr; i++) {
+	krb5_socket_t s = d[i].s;
+
+	if(rk_IS_BAD_SOCKET(s) || d[i].type != SOCK_STREAM ||
+	   d[i].timeout == 0 || d[i].pending)
+	    continue;
+	if(d[i].timeout < now) {
+	    kdc_log(context, config, 1,
+		    "TCP-connection from %s expired after %lu bytes",
+		    d[i].addr_string, (unsigned long)d[i].len);
+	    clear_descr(&d[i]);
+	    release_descr(e, d, i, s, free_list);
+	} else if (next == 0 || d[i].timeout < next)
+	    next = d[i].timeout;
     }
+    return next;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
 
-    return min_free;
+/*
+ * Send the replies of the requests the threads are done with.  TCP
+ * connections are closed once their reply has gone out.
+ */
+
+static void
+finish_requests(krb5_context context,
+		krb5_kdc_configuration *config,
+		struct descr *d, unsigned int ndescr, int *free_list)
+{
+    struct kdc_job *job, *next;
+    char buf[64];
+
+    while (read(request_pool->wakeup[0], buf, sizeof(buf)) > 0)
+	;
+
+    HEIMDAL_MUTEX_lock(&request_pool->mutex);
+    job = request_pool->done;
+    request_pool->done = NULL;
+    request_pool->done_tail = &request_pool->done;
+    HEIMDAL_MUTEX_unlock(&request_pool->mutex);
+
+    udp_batching = 1;
+    for (; job != NULL; job = next) {
+	next = job->next;
+
+	if (job->idx == -1) {
+	    struct descr u;
+
+	    memset(&u, 0, sizeof(u));
+	    u.s = job->s;
+	    u.type = job->type;
+	    u.sa = (struct sockaddr *)&job->__ss;
+	    u.sock_len = job->sock_len;
+	    strlcpy(u.addr_string, job->addr_string, sizeof(u.addr_string));
+	    if (job->reply.length)
+		send_reply(context, config, job->prependlength, &u, &job->reply);
+	} else if ((unsigned int)job->idx < ndescr &&
+		   d[job->idx].pending && d[job->idx].s == job->s) {
+	    struct descr *c = &d[job->idx];
+
+	    if (job->reply.length)
+		send_reply(context, config, job->prependlength, c, &job->reply);
+	    c->pending = FALSE;
+	    clear_descr(c);
+	    /* already removed from the event set in serve() */
+	    c->next_free = *free_list;
+	    *free_list = job->idx;
+	}
+	if (job->ret)
+	    kdc_log(context, config, 0,
+		    "Failed processing %lu byte request from %s",
+		    (unsigned long)job->request.length, job->addr_string);
+	free_job(job);
+    }
+    udp_batching = 0;
+    flush_udp_replies(context, config);
 }
 
-void
-loop(krb5_context context,
-     krb5_kdc_configuration *config)
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+/*
+ * Serve requests on the `ndescr' listening sockets in `d' until told
+ * to exit.
+ */
+
+static void
+serve(krb5_context context,
+      krb5_kdc_configuration *config,
+      struct descr *d, unsigned int ndescr)
 {
-    struct descr *d;
-    unsigned int ndescr;
+    struct kdc_events events;
+    int free_list = -1;
+    int ready[KDC_MAX_EVENTS];
+    time_t next_expire = 0;
+    krb5_error_code ret;
+    size_t i;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    int wakeup_idx = -1;
+#endif
 
-    ndescr = init_sockets(context, config, &d);
-    if(ndescr <= 0)
-	krb5_errx(context, 1, "No sockets!");
-    kdc_log(context, config, 0, "KDC started");
+    init_events(context, &events);
+    for (i = 0; i < ndescr; i++) {
+	ret = events.ops->add(&events, d[i].s, i);
+	if (ret)
+	    krb5_err(context, 1, ret, "adding listening socket to %s",
+		     events.ops->name);
+    }
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (num_threads > 0) {
+	start_request_pool(context, config);
+	wakeup_idx = next_free_descr(context, &d, &ndescr, &free_list);
+	if (wakeup_idx == -1)
+	    krb5_errx(context, 1, "out of memory");
+	d[wakeup_idx].s = request_pool->wakeup[0];
+	ret = events.ops->add(&events, d[wakeup_idx].s, wakeup_idx);
+	if (ret)
+	    krb5_err(context, 1, ret, "adding wakeup pipe to %s",
+		     events.ops->name);
+    }
+#endif
+    kdc_log(context, config, 5, "using %s event backend", events.ops->name);
     while(exit_flag == 0){
-	struct timeval tmout;
-	fd_set fds;
-	int min_free = -1;
-	int max_fd = 0;
-	size_t i;
-
-	FD_ZERO(&fds);
-	for(i = 0; i < ndescr; i++) {
-	    if(!rk_IS_BAD_SOCKET(d[i].s)){
-		if(d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 1,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
+	time_t now = time(NULL);
+	int n;
+
+	if (next_expire && next_expire < now)
+	    next_expire = expire_tcp(context, config, &events, d, ndescr,
+				     &free_list, now);
+
+	n = events.ops->wait(&events, TCP_TIMEOUT * 1000, ready, KDC_MAX_EVENTS);
+	if (n < 0) {
+	    if (errno != EINTR)
+		krb5_warn(context, rk_SOCK_ERRNO, "%s", events.ops->name);
+	    continue;
+	}
+	for (i = 0; i < (size_t)n; i++) {
+	    int idx = ready[i];
+	    krb5_socket_t s;
+
+	    if ((unsigned int)idx >= ndescr || rk_IS_BAD_SOCKET(d[idx].s))
+		continue;
+	    s = d[idx].s;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+	    if (idx == wakeup_idx) {
+		finish_requests(context, config, d, ndescr, &free_list);
+		continue;
+	    }
+#endif
+	    if(d[idx].type == SOCK_DGRAM) {
+		handle_udp(context, config, &d[idx]);
+	    } else if(d[idx].type == SOCK_STREAM && d[idx].timeout == 0) {
+		int child = next_free_descr(context, &d, &ndescr, &free_list);
+
+		if (child == -1)
+		    continue;
+		add_new_tcp(context, config, d, idx, child);
+		if (rk_IS_BAD_SOCKET(d[child].s)) {
+		    d[child].next_free = free_list;
+		    free_list = child;
 		    continue;
 		}
-#ifndef NO_LIMIT_FD_SETSIZE
-		if(max_fd < d[i].s)
-		    max_fd = d[i].s;
-#ifdef FD_SETSIZE
-		if (max_fd >= FD_SETSIZE)
-		    krb5_errx(context, 1, "fd too large");
-#endif
-#endif
-		FD_SET(d[i].s, &fds);
+		ret = events.ops->add(&events, d[child].s, child);
+		if (ret) {
+		    krb5_warn(context, ret, "%s: %s", events.ops->name,
+			      d[child].addr_string);
+		    s = d[child].s;
+		    clear_descr(&d[child]);
+		    release_descr(&events, d, child, s, &free_list);
+		    continue;
+		}
+		if (next_expire == 0 || d[child].timeout < next_expire)
+		    next_expire = d[child].timeout;
+	    } else if(d[idx].type == SOCK_STREAM) {
+		handle_tcp(context, config, d, idx);
+		/* keep quiet until the reply is sent */
+		if (d[idx].pending)
+		    events.ops->del(&events, s, idx);
 	    }
+
+	    if (d[idx].s != s)
+		release_descr(&events, d, idx, s, &free_list);
 	}
+    }
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (wakeup_idx != -1) {
+	d[wakeup_idx].s = rk_INVALID_SOCKET;
+	stop_request_pool();
+    }
+#endif
+    events.ops->destroy(&events);
+    for (i = 0; i < ndescr; i++)
+	clear_descr(&d[i]);
+    free(d);
+    free(udp_buf);
+    udp_buf = NULL;
+}
+
+#ifdef HAVE_FORK
+
+/*
+ * State of the worker processes forked by the master.  With
+ * SO_REUSEPORT every worker slot gets its own set of listening
+ * sockets, which the master keeps open across worker restarts;
+ * otherwise all workers share one non-blocking set.
+ */
+
+struct worker {
+    pid_t pid;
+    time_t started;
+    struct descr *d;
+    unsigned int ndescr;
+};
+
+static int
+start_worker(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     struct worker *w, size_t nworkers, size_t slot)
+{
+    size_t i, j;
+    pid_t pid;
+    int ret;
+
+    pid = fork();
+    if (pid < 0) {
+	ret = errno;
+	krb5_warn(context, ret, "fork");
+	return ret;
+    }
+    if (pid > 0) {
+	w[slot].pid = pid;
+	w[slot].started = time(NULL);
+	kdc_log(context, config, 1, "started worker %ld", (long)pid);
+	return 0;
+    }
 
-	tmout.tv_sec = TCP_TIMEOUT;
-	tmout.tv_usec = 0;
-	switch(select(max_fd + 1, &fds, 0, 0, &tmout)){
-	case 0:
+    for (i = 0; i < nworkers; i++) {
+	if (i == slot || w[i].d == w[slot].d)
+	    continue;
+	for (j = 0; j < w[i].ndescr; j++)
+	    if (!rk_IS_BAD_SOCKET(w[i].d[j].s))
+		rk_closesocket(w[i].d[j].s);
+    }
+    serve(context, config, w[slot].d, w[slot].ndescr);
+    _exit(0);	/* leave the pidfile to the master */
+}
+
+static void
+start_workers(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      struct descr *d, unsigned int ndescr)
+{
+    struct worker *w;
+    size_t i, j;
+    int status;
+    pid_t pid;
+    int reuse_port = 0;
+
+    w = calloc(num_workers, sizeof(*w));
+    if (w == NULL)
+	krb5_errx(context, 1, "out of memory");
+
+#ifdef SO_REUSEPORT
+    reuse_port = 1;
+    for (i = 1; reuse_port && i < (size_t)num_workers; i++) {
+	w[i].ndescr = init_sockets(context, config, &w[i].d, 1);
+	if (w[i].ndescr != ndescr) {
+	    kdc_log(context, config, 0,
+		    "SO_REUSEPORT failed, workers will share sockets");
+	    for (j = 1; j <= i; j++) {
+		size_t k;
+		for (k = 0; k < w[j].ndescr; k++)
+		    clear_descr(&w[j].d[k]);
+		free(w[j].d);
+		w[j].d = NULL;
+	    }
+	    reuse_port = 0;
+	}
+    }
+#endif
+    for (i = 0; i < (size_t)num_workers; i++) {
+	if (i == 0 || !reuse_port) {
+	    w[i].d = d;
+	    w[i].ndescr = ndescr;
+	}
+	if (!reuse_port)
+	    for (j = 0; j < ndescr; j++)
+		socket_set_nonblocking(d[j].s, 1);
+    }
+    shared_listeners = !reuse_port;
+
+    for (i = 0; i < (size_t)num_workers; i++)
+	if (start_worker(context, config, w, num_workers, i))
+	    krb5_errx(context, 1, "failed to start worker %lu",
+		      (unsigned long)i);
+    kdc_log(context, config, 0, "KDC started with %d workers", num_workers);
+
+    while (exit_flag == 0) {
+	pid = waitpid(-1, &status, 0);
+	if (pid == -1) {
+	    if (errno == EINTR) {
+		/* pass SIGHUP on to the workers */
+		if (reopen_flag) {
+		    reopen_flag = 0;
+		    for (i = 0; i < (size_t)num_workers; i++)
+			if (w[i].pid > 0)
+			    kill(w[i].pid, SIGHUP);
+		}
+		continue;
+	    }
+	    krb5_warn(context, errno, "waitpid");
 	    break;
-	case -1:
-	    if (errno != EINTR)
-		krb5_warn(context, rk_SOCK_ERRNO, "select");
+	}
+	for (i = 0; i < (size_t)num_workers; i++)
+	    if (w[i].pid == pid)
+		break;
+	if (i == (size_t)num_workers)
+	    continue;
+	w[i].pid = 0;
+	if (WIFEXITED(status))
+	    kdc_log(context, config, 0, "worker %ld exited with status %d",
+		    (long)pid, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+	    kdc_log(context, config, 0, "worker %ld killed by signal %d",
+		    (long)pid, WTERMSIG(status));
+	if (exit_flag)
 	    break;
-	default:
-	    for(i = 0; i < ndescr; i++)
-		if(!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-            min_free = next_min_free(context, &d, &ndescr);
-
-            if(d[i].type == SOCK_DGRAM)
-                handle_udp(context, config, &d[i]);
-            else if(d[i].type == SOCK_STREAM)
-                handle_tcp(context, config, d, i, min_free);
-		}
+	/* don't spin if the workers die right away */
+	if (time(NULL) - w[i].started < 1)
+	    sleep(1);
+	if (exit_flag == 0)
+	    start_worker(context, config, w, num_workers, i);
+    }
+
+    for (i = 0; i < (size_t)num_workers; i++)
+	if (w[i].pid > 0)
+	    kill(w[i].pid, SIGTERM);
+    for (i = 0; i < (size_t)num_workers; i++) {
+	while (w[i].pid > 0 && waitpid(w[i].pid, &status, 0) == -1 &&
+	       errno == EINTR)
+	    ;
+	if (i == 0 || w[i].d != d) {
+	    for (j = 0; j < w[i].ndescr; j++)
+		clear_descr(&w[i].d[j]);
+	    free(w[i].d);
 	}
     }
+    free(w);
+}
+
+#endif /* HAVE_FORK */
+
+void
+loop(krb5_context context,
+     krb5_kdc_configuration *config)
+{
+    struct descr *d;
+    unsigned int ndescr;
+
+    ndescr = init_sockets(context, config, &d, num_workers > 1);
+    if(ndescr <= 0)
+	krb5_errx(context, 1, "No sockets!");
+#ifdef HAVE_FORK
+    if (num_workers > 1)
+	start_workers(context, config, d, ndescr);
+    else
+#endif
+    {
+	kdc_log(context, config, 0, "KDC started");
+	serve(context, config, d, ndescr);
+    }
     if (0);
 #ifdef SIGXCPU
     else if(exit_flag == SIGXCPU)
@@ -937,5 +2016,4 @@ loop(krb5_context context,
 	kdc_log(context, config, 0, "Terminated");
     else
 	kdc_log(context, config, 0, "Unexpected exit reason: %d", exit_flag);
-    free (d);
 }
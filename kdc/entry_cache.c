@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kdc_locl.h"
+
+/*
+ * Cache of entries fetched by _kdc_db_fetch(), decoded and with the
+ * keys already unsealed, so that the hot principals (the krbtgt and
+ * popular services) don't have to be read from the database for
+ * every request.
+ *
+ * Every krb5_kdc_configuration has its own cache, and the request
+ * threads have their own configuration, so there is no locking.  An
+ * entry is handed out with a reference that _kdc_free_ent() drops,
+ * and is evicted with the CLOCK algorithm.
+ *
+ * Only entries from databases that can be stamped (HDB_CAP_F_STAMP)
+ * are cached.  The stamps are taken at most once a second by
+ * _kdc_db_check(), so a change to the database can take up to a
+ * second to be seen.  The entries of a database are flushed when its
+ * stamp changes or it is reopened, and none are cached while the
+ * backend can't give a version.  That is only for a moment with the
+ * counters of mdb and sqlite, but db, db3 and sqlite versions without
+ * PRAGMA data_version go by the file's modification time, and are not
+ * cached until about two seconds after the last write.
+ */
+
+struct kdc_cached_entry {
+    hdb_entry_ex ent;		/* what the caller sees */
+    void (*free_entry)(krb5_context, hdb_entry_ex *);
+    struct kdc_cached_entry *next;	/* hash chain */
+    unsigned int refcount;	/* the cache holds one while in it */
+    int referenced;
+    char *name;
+    unsigned flags;
+    krb5uint32 kvno;
+    int db;
+};
+
+struct kdc_db_stamp {
+    int valid;
+    unsigned int serial;	/* of the database's kdc_db_state */
+};
+
+struct kdc_entry_cache {
+    size_t size;
+    size_t nbuckets;
+    size_t hand;
+    struct kdc_cached_entry **slots;
+    struct kdc_cached_entry **buckets;
+    struct kdc_db_stamp *stamps;
+};
+
+/* marks the entries owned by the cache, it is never called */
+static void
+cached_free_entry(krb5_context context, hdb_entry_ex *ent)
+{
+}
+
+static unsigned
+hash_name(const char *name, unsigned flags, krb5uint32 kvno)
+{
+    const unsigned char *p;
+    unsigned h = flags ^ (kvno << 7);
+
+    for (p = (const unsigned char *)name; *p; p++)
+	h = h * 31 + *p;
+    return h;
+}
+
+static void
+put_entry(krb5_context context, struct kdc_cached_entry *ce)
+{
+    if (--ce->refcount > 0)
+	return;
+    ce->ent.free_entry = ce->free_entry;
+    hdb_free_entry(context, &ce->ent);
+    free(ce->name);
+    free(ce);
+}
+
+static void
+remove_entry(krb5_context context, struct kdc_entry_cache *c, size_t slot)
+{
+    struct kdc_cached_entry *ce = c->slots[slot], **p;
+
+    p = &c->buckets[hash_name(ce->name, ce->flags, ce->kvno) % c->nbuckets];
+    while (*p != ce)
+	p = &(*p)->next;
+    *p = ce->next;
+    c->slots[slot] = NULL;
+    put_entry(context, ce);
+}
+
+static struct kdc_entry_cache *
+get_cache(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *c;
+
+    if (config->entry_cache || config->entry_cache_size == 0 ||
+	config->num_db == 0)
+	return config->entry_cache;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return NULL;
+    c->size = config->entry_cache_size;
+    c->nbuckets = c->size * 2 + 1;
+    c->slots = calloc(c->size, sizeof(c->slots[0]));
+    c->buckets = calloc(c->nbuckets, sizeof(c->buckets[0]));
+    c->stamps = calloc(config->num_db, sizeof(c->stamps[0]));
+    if (c->slots == NULL || c->buckets == NULL || c->stamps == NULL) {
+	free(c->slots);
+	free(c->buckets);
+	free(c->stamps);
+	free(c);
+	return NULL;
+    }
+    config->entry_cache = c;
+    return c;
+}
+
+/*
+ * Flush what we have from the databases that changed since we last
+ * looked, and tell if anything can be cached at all right now.
+ */
+
+static int
+check_stamps(krb5_context context, krb5_kdc_configuration *config,
+	     struct kdc_entry_cache *c)
+{
+    struct kdc_db_state *state;
+    size_t i;
+    int db, usable = 0;
+
+    for (db = 0; db < config->num_db; db++) {
+	struct kdc_db_stamp *s = &c->stamps[db];
+	int valid = 0;
+
+	state = _kdc_db_check(context, config, db);
+	if (state && state->stamped && state->stamp.version != 0)
+	    valid = 1;
+	if (valid && s->valid && s->serial == state->serial) {
+	    usable = 1;
+	    continue;
+	}
+	/* entries are only added while the stamp is valid */
+	for (i = 0; s->valid && i < c->size; i++)
+	    if (c->slots[i] && c->slots[i]->db == db)
+		remove_entry(context, c, i);
+	s->valid = valid;
+	if (valid) {
+	    s->serial = state->serial;
+	    usable = 1;
+	}
+    }
+    return usable;
+}
+
+/*
+ * Look up `principal' in the cache; returns 0 and a referenced entry
+ * on a hit, HDB_ERR_NOENTRY otherwise.
+ */
+
+krb5_error_code
+_kdc_cache_lookup(krb5_context context,
+		  krb5_kdc_configuration *config,
+		  krb5_const_principal principal,
+		  unsigned flags,
+		  krb5uint32 kvno,
+		  HDB **db,
+		  hdb_entry_ex **h)
+{
+    struct kdc_entry_cache *c;
+    struct kdc_cached_entry *ce;
+    char *name;
+
+    c = get_cache(context, config);
+    if (c == NULL || !check_stamps(context, config, c))
+	return HDB_ERR_NOENTRY;
+    if (krb5_unparse_name(context, principal, &name))
+	return HDB_ERR_NOENTRY;
+
+    ce = c->buckets[hash_name(name, flags, kvno) % c->nbuckets];
+    for (; ce != NULL; ce = ce->next)
+	if (ce->flags == flags && ce->kvno == kvno &&
+	    strcmp(ce->name, name) == 0)
+	    break;
+    free(name);
+    if (ce == NULL)
+	return HDB_ERR_NOENTRY;
+
+    ce->referenced = 1;
+    ce->refcount++;
+    if (db)
+	*db = config->db[ce->db];
+    *h = &ce->ent;
+    return 0;
+}
+
+/*
+ * Put the entry `*h' that was just fetched from database `db' in the
+ * cache, `*h' is then owned by the cache and the caller holds a
+ * reference to it.
+ */
+
+void
+_kdc_cache_add(krb5_context context,
+	       krb5_kdc_configuration *config,
+	       krb5_const_principal principal,
+	       unsigned flags,
+	       krb5uint32 kvno,
+	       int db,
+	       hdb_entry_ex **h)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    struct kdc_cached_entry *ce, **b;
+
+    if (c == NULL || !c->stamps[db].valid)
+	return;
+
+    ce = calloc(1, sizeof(*ce));
+    if (ce == NULL)
+	return;
+    if (krb5_unparse_name(context, principal, &ce->name)) {
+	free(ce);
+	return;
+    }
+    ce->flags = flags;
+    ce->kvno = kvno;
+    ce->db = db;
+    ce->refcount = 2;
+    ce->ent = **h;
+    ce->free_entry = ce->ent.free_entry;
+    ce->ent.free_entry = cached_free_entry;
+
+    /* find a slot, evicting with the CLOCK algorithm */
+    while (c->slots[c->hand] && c->slots[c->hand]->referenced) {
+	c->slots[c->hand]->referenced = 0;
+	c->hand = (c->hand + 1) % c->size;
+    }
+    if (c->slots[c->hand])
+	remove_entry(context, c, c->hand);
+    c->slots[c->hand] = ce;
+    c->hand = (c->hand + 1) % c->size;
+
+    b = &c->buckets[hash_name(ce->name, flags, kvno) % c->nbuckets];
+    ce->next = *b;
+    *b = ce;
+
+    free(*h);
+    *h = &ce->ent;
+}
+
+/*
+ * Drop a reference to `ent' if it came from the cache, returns TRUE
+ * if it did.
+ */
+
+krb5_boolean
+_kdc_cache_release(krb5_context context, hdb_entry_ex *ent)
+{
+    if (ent->free_entry != cached_free_entry)
+	return FALSE;
+    put_entry(context, (struct kdc_cached_entry *)ent);
+    return TRUE;
+}
+
+void
+_kdc_cache_free(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    size_t i;
+
+    if (c == NULL)
+	return;
+    for (i = 0; i < c->size; i++)
+	if (c->slots[i])
+	    remove_entry(context, c, i);
+    free(c->slots);
+    free(c->buckets);
+    free(c->stamps);
+    free(c);
+    config->entry_cache = NULL;
+}
@@ -92,6 +92,11 @@ typedef struct krb5_kdc_configuration {
     const char *kx509_template;
     const char *kx509_ca;
 
+    struct kdc_db_state *db_state; /* one per db, see _kdc_db_fetch() */
+
+    size_t entry_cache_size;
+    struct kdc_entry_cache *entry_cache;
+
 } krb5_kdc_configuration;
 
 struct krb5_kdc_service {
@@ -91,8 +91,11 @@ struct kdc_request_desc {
 
 
 extern sig_atomic_t exit_flag;
+extern sig_atomic_t reopen_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
+extern int num_workers;
+extern int num_threads;
 extern const char *request_log;
 extern const char *port_str;
 extern krb5_addresses explicit_addresses;
@@ -111,7 +114,17 @@ extern const struct units _kdc_digestunits[];
 #define KDC_LOG_FILE		"kdc.log"
 
 extern struct timeval _kdc_now;
-#define kdc_time (_kdc_now.tv_sec)
+#define kdc_time (_kdc_request_time()->tv_sec)
+
+struct kdc_db_state {
+    int open;
+    int generation;
+    uint64_t dev, ino;		/* of the file that was opened */
+    time_t checked;		/* when the stamp was last taken */
+    int stamped;		/* the backend could stamp the database */
+    unsigned int serial;	/* bumped when the stamp changes */
+    struct hdb_stamp stamp;
+};
 
 extern char *runas_string;
 extern char *chroot_string;
@@ -122,6 +135,9 @@ loop(krb5_context context, krb5_kdc_configuration *config);
 krb5_kdc_configuration *
 configure(krb5_context context, int argc, char **argv, int *optidx);
 
+krb5_error_code
+kdc_init_context(krb5_context *context);
+
 #ifdef __APPLE__
 void bonjour_announce(krb5_context, krb5_kdc_configuration *);
 #endif
@@ -316,6 +316,13 @@ _kdc_log_timestamp(krb5_context context,
 
 #ifdef PKINIT
 
+/*
+ * The PKINIT identity, OCSP state and hx509 objects are shared by all
+ * request threads, so only one of them does PKINIT at a time.
+ */
+
+static HEIMDAL_MUTEX pkinit_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
 static krb5_error_code
 pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
 {
@@ -323,6 +330,8 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
     char *client_cert = NULL;
     krb5_error_code ret;
 
+    HEIMDAL_MUTEX_lock(&pkinit_mutex);
+
     ret = _kdc_pk_rd_padata(r->context, r->config, &r->req, pa, r->client, &pkp);
     if (ret || pkp == NULL) {
 	ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
@@ -362,6 +371,8 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
     if (pkp)
 	_kdc_pk_free_client_param(r->context, pkp);
 
+    HEIMDAL_MUTEX_unlock(&pkinit_mutex);
+
     return ret;
 }
 
@@ -43,6 +43,7 @@
 #endif
 
 sig_atomic_t exit_flag = 0;
+sig_atomic_t reopen_flag = 0;
 
 #ifdef SUPPORT_DETACH
 int detach_from_console = -1;
@@ -54,6 +55,13 @@ sigterm(int sig)
     exit_flag = sig;
 }
 
+static RETSIGTYPE
+sighup(int sig)
+{
+    krb5_kdc_reopen_db();
+    reopen_flag = 1;
+}
+
 /*
  * Allow dropping root bit, since heimdal reopens the database all the
  * time the database needs to be owned by the user you are switched
@@ -142,6 +150,9 @@ main(int argc, char **argv)
 	sigaction(SIGXCPU, &sa, NULL);
 #endif
 
+	sa.sa_handler = sighup;
+	sigaction(SIGHUP, &sa, NULL);
+
 	sa.sa_handler = SIG_IGN;
 #ifdef SIGPIPE
 	sigaction(SIGPIPE, &sa, NULL);
@@ -153,6 +164,9 @@ main(int argc, char **argv)
 #ifdef SIGXCPU
     signal(SIGXCPU, sigterm);
 #endif
+#ifdef SIGHUP
+    signal(SIGHUP, sighup);
+#endif
 #ifdef SIGPIPE
     signal(SIGPIPE, SIG_IGN);
 #endif
@@ -35,6 +35,131 @@
 
 struct timeval _kdc_now;
 
+/*
+ * Databases that can be read while somebody else writes to them
+ * (HDB_CAP_F_KEEP_OPEN) are opened on first use and then kept open.
+ * They are reopened when the file behind them has been replaced, or
+ * after krb5_kdc_reopen_db().  The others are still opened and closed
+ * around every fetch, since they hold a lock while open.
+ *
+ * Backends that can stamp their database (HDB_CAP_F_STAMP) are
+ * stamped at most once a second by _kdc_db_check(), which is what
+ * both the reopen check and the entry cache go by.
+ */
+
+static volatile sig_atomic_t db_generation;
+
+/**
+ * Make the KDC reopen its databases before the next lookup.  Safe to
+ * call from a signal handler.
+ */
+
+void
+krb5_kdc_reopen_db(void)
+{
+    db_generation++;
+}
+
+static struct kdc_db_state *
+db_state(krb5_kdc_configuration *config, int i)
+{
+    if (config->db_state == NULL) {
+	config->db_state = calloc(config->num_db, sizeof(config->db_state[0]));
+	if (config->db_state == NULL)
+	    return NULL;
+    }
+    return &config->db_state[i];
+}
+
+static void
+update_stamp(krb5_context context, HDB *db, struct kdc_db_state *s)
+{
+    struct hdb_stamp stamp;
+    int stamped = 0;
+
+    s->checked = kdc_time;
+    if (db->hdb_capability_flags & HDB_CAP_F_STAMP)
+	stamped = (db->hdb_get_stamp(context, db, &stamp) == 0);
+    if (stamped == s->stamped &&
+	(!stamped || (stamp.dev == s->stamp.dev && stamp.ino == s->stamp.ino &&
+		      stamp.version == s->stamp.version)))
+	return;
+    s->stamped = stamped;
+    if (stamped)
+	s->stamp = stamp;
+    s->serial++;
+}
+
+/*
+ * Return the state of database `i', with a stamp that is at most a
+ * second old, or NULL if out of memory.
+ */
+
+struct kdc_db_state *
+_kdc_db_check(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_state *s = db_state(config, i);
+
+    if (s != NULL && s->checked != kdc_time)
+	update_stamp(context, config->db[i], s);
+    return s;
+}
+
+static krb5_error_code
+open_db(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    HDB *db = config->db[i];
+    struct kdc_db_state *s;
+    krb5_error_code ret;
+
+    if ((db->hdb_capability_flags & HDB_CAP_F_KEEP_OPEN) == 0)
+	return db->hdb_open(context, db, O_RDONLY, 0);
+
+    s = _kdc_db_check(context, config, i);
+    if (s == NULL)
+	return krb5_enomem(context);
+
+    if (s->open && s->generation == db_generation) {
+	if (!s->stamped || (s->stamp.dev == s->dev && s->stamp.ino == s->ino))
+	    return 0;
+	kdc_log(context, config, 3, "database %s was replaced, reopening",
+		db->hdb_name);
+    }
+    if (s->open) {
+	db->hdb_close(context, db);
+	s->open = 0;
+    }
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret)
+	return ret;
+    s->open = 1;
+    s->generation = db_generation;
+    /* a new handle may count versions from scratch */
+    update_stamp(context, db, s);
+    s->serial++;
+    s->dev = s->stamped ? s->stamp.dev : 0;
+    s->ino = s->stamped ? s->stamp.ino : 0;
+    return 0;
+}
+
+static void
+close_db(krb5_context context, krb5_kdc_configuration *config, int i,
+	 krb5_error_code fetch_ret)
+{
+    HDB *db = config->db[i];
+
+    if ((db->hdb_capability_flags & HDB_CAP_F_KEEP_OPEN) == 0) {
+	db->hdb_close(context, db);
+    } else if (fetch_ret && fetch_ret != HDB_ERR_NOENTRY &&
+	       fetch_ret != HDB_ERR_NOT_FOUND_HERE &&
+	       fetch_ret != HDB_ERR_KVNO_NOT_FOUND) {
+	/* start over with a fresh handle next time */
+	db->hdb_close(context, db);
+	config->db_state[i].open = 0;
+    }
+}
+
 krb5_error_code
 _kdc_db_fetch(krb5_context context,
 	      krb5_kdc_configuration *config,
@@ -58,6 +183,9 @@ _kdc_db_fetch(krb5_context context,
 	    flags |= HDB_F_KVNO_SPECIFIED;
     }
 
+    if (_kdc_cache_lookup(context, config, principal, flags, kvno, db, h) == 0)
+	return 0;
+
     ent = calloc(1, sizeof (*ent));
     if (ent == NULL)
         return krb5_enomem(context);
@@ -78,7 +206,7 @@ _kdc_db_fetch(krb5_context context,
     }
 
     for (i = 0; i < config->num_db; i++) {
-	ret = config->db[i]->hdb_open(context, config->db[i], O_RDONLY, 0);
+	ret = open_db(context, config, i);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
@@ -96,11 +224,12 @@ _kdc_db_fetch(krb5_context context,
 					    flags | HDB_F_DECRYPT,
 					    kvno,
 					    ent);
-	config->db[i]->hdb_close(context, config->db[i]);
+	close_db(context, config, i, ret);
 
 	if (ret == 0) {
 	    if (db)
 		*db = config->db[i];
+	    _kdc_cache_add(context, config, principal, flags, kvno, i, &ent);
 	    *h = ent;
             ent = NULL;
             goto out;
@@ -119,6 +248,8 @@ out:
 void
 _kdc_free_ent(krb5_context context, hdb_entry_ex *ent)
 {
+    if (_kdc_cache_release(context, ent))
+	return;
     hdb_free_entry (context, ent);
     free (ent);
 }
@@ -35,16 +35,62 @@
 #include "kdc_locl.h"
 
 /*
- *
+ * Every thread keeps the time of the request it is processing in its
+ * own copy, so that the request threads of the kdc do not see the time
+ * of the next request the network loop reads.
+ */
+
+static HEIMDAL_thread_key now_key;
+static int now_created;
+
+static void
+init_now_tls(void *ptr)
+{
+    int ret;
+    HEIMDAL_key_create(&now_key, free, ret);
+    if (ret == 0)
+	now_created = 1;
+}
+
+/*
+ * The time of the request of the calling thread, falls back to the
+ * shared _kdc_now when a copy can't be made.
  */
 
+struct timeval *
+_kdc_request_time(void)
+{
+    static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+    struct timeval *now;
+    int ret;
+
+    heim_base_once_f(&once, NULL, init_now_tls);
+    if (!now_created)
+	return &_kdc_now;
+
+    now = HEIMDAL_getspecific(now_key);
+    if (now == NULL) {
+	now = calloc(1, sizeof(*now));
+	if (now == NULL)
+	    return &_kdc_now;
+	HEIMDAL_setspecific(now_key, now, ret);
+	if (ret) {
+	    free(now);
+	    return &_kdc_now;
+	}
+    }
+    return now;
+}
+
 void
 krb5_kdc_update_time(struct timeval *tv)
 {
+    struct timeval *now = _kdc_request_time();
+
     if (tv == NULL)
-	gettimeofday(&_kdc_now, NULL);
+	gettimeofday(now, NULL);
     else
-	_kdc_now = *tv;
+	*now = *tv;
 }
 
 static krb5_error_code
@@ -213,11 +259,13 @@ krb5_kdc_process_request(krb5_context context,
 		*prependlength = 0;
 
 	    heim_auto_release_drain(pool);
+	    heim_release(pool);
 	    return ret;
 	}
     }
 
     heim_auto_release_drain(pool);
+    heim_release(pool);
 
     return -1;
 }
@@ -282,7 +330,7 @@ krb5_kdc_save_request(krb5_context context,
 
     d.data = rk_UNCONST(buf);
     d.length = len;
-    t = _kdc_now.tv_sec;
+    t = kdc_time;
 
     fd = open(fn, O_WRONLY|O_CREAT|O_APPEND, 0600);
     if (fd < 0) {
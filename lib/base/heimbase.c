@@ -501,8 +501,9 @@ autorel_dealloc(void *ptr)
     if (tls->current != ptr)
 	heim_abort("autorelease not releaseing top pool");
 
-    if (tls->current != tls->head)
-	tls->current = ar->parent;
+    tls->current = ar->parent;
+    if (tls->head == ar)
+	tls->head = NULL;
     HEIMDAL_MUTEX_unlock(&tls->tls_mutex);
 }
 
@@ -38,17 +38,209 @@
 #include <krb5-types.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 
+#include <roken.h>
+
 #include "rijndael-alg-fst.h"
 #include "aes.h"
 
+/*
+ * On x86 the AES instructions are used when the CPU has them. The
+ * choice is made once per process and can be overridden by setting
+ * HCRYPTO_NO_AESNI in the environment, which the tests use to check
+ * the table driven code on machines that do have AES-NI.
+ *
+ * Both implementations share the rijndael key schedule; for AES-NI
+ * the round keys are stored in byte order instead of as big endian
+ * words. The decryption schedule of rijndael-alg-fst is already the
+ * "equivalent inverse cipher" schedule that AESDEC expects.
+ */
+
+#if !defined(NO_AESNI) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_AESNI 1
+#endif
+
+#ifdef HAVE_AESNI
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_FUNC __attribute__((target("aes,sse2")))
+
+static int aesni_available = -1;
+
+static int
+aesni_probe(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!issuid() && getenv("HCRYPTO_NO_AESNI") != NULL)
+	return 0;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+	return 0;
+    return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+static inline int
+use_aesni(void)
+{
+    if (aesni_available < 0)
+	aesni_available = aesni_probe();
+    return aesni_available;
+}
+
+static void
+aesni_convert_key(AES_KEY *key)
+{
+    int i;
+
+    for (i = 0; i < (key->rounds + 1) * 4; i++) {
+	uint32_t w = key->key[i];
+	unsigned char *p = (unsigned char *)&key->key[i];
+
+	p[0] = (w >> 24) & 0xff;
+	p[1] = (w >> 16) & 0xff;
+	p[2] = (w >>  8) & 0xff;
+	p[3] = (w      ) & 0xff;
+    }
+}
+
+static AESNI_FUNC void
+aesni_load_key(const AES_KEY *key, __m128i *rk)
+{
+    const __m128i *k = (const __m128i *)key->key;
+    int i;
+
+    for (i = 0; i <= key->rounds; i++)
+	rk[i] = _mm_loadu_si128(&k[i]);
+}
+
+static AESNI_FUNC __m128i
+aesni_encrypt_block(__m128i b, const __m128i *rk, int rounds)
+{
+    int i;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for (i = 1; i < rounds; i++)
+	b = _mm_aesenc_si128(b, rk[i]);
+    return _mm_aesenclast_si128(b, rk[rounds]);
+}
+
+static AESNI_FUNC __m128i
+aesni_decrypt_block(__m128i b, const __m128i *rk, int rounds)
+{
+    int i;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for (i = 1; i < rounds; i++)
+	b = _mm_aesdec_si128(b, rk[i]);
+    return _mm_aesdeclast_si128(b, rk[rounds]);
+}
+
+static AESNI_FUNC void
+aesni_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i b;
+
+    aesni_load_key(key, rk);
+    b = aesni_encrypt_block(_mm_loadu_si128((const __m128i *)in),
+			    rk, key->rounds);
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+static AESNI_FUNC void
+aesni_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i b;
+
+    aesni_load_key(key, rk);
+    b = aesni_decrypt_block(_mm_loadu_si128((const __m128i *)in),
+			    rk, key->rounds);
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+/*
+ * CBC over whole blocks. Encryption is inherently serial; decryption
+ * runs four blocks at a time to keep the AES unit busy.
+ */
+
+static AESNI_FUNC void
+aesni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+		  unsigned long size, const AES_KEY *key,
+		  unsigned char *iv, int forward_encrypt)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i ivec = _mm_loadu_si128((const __m128i *)iv);
+    const __m128i *ip = (const __m128i *)in;
+    __m128i *op = (__m128i *)out;
+    unsigned long n = size / AES_BLOCK_SIZE;
+    int rounds = key->rounds;
+    int i;
+
+    aesni_load_key(key, rk);
+
+    if (forward_encrypt) {
+	for (; n > 0; n--) {
+	    ivec = _mm_xor_si128(_mm_loadu_si128(ip++), ivec);
+	    ivec = aesni_encrypt_block(ivec, rk, rounds);
+	    _mm_storeu_si128(op++, ivec);
+	}
+    } else {
+	for (; n >= 4; n -= 4) {
+	    __m128i c0 = _mm_loadu_si128(ip++);
+	    __m128i c1 = _mm_loadu_si128(ip++);
+	    __m128i c2 = _mm_loadu_si128(ip++);
+	    __m128i c3 = _mm_loadu_si128(ip++);
+	    __m128i b0 = _mm_xor_si128(c0, rk[0]);
+	    __m128i b1 = _mm_xor_si128(c1, rk[0]);
+	    __m128i b2 = _mm_xor_si128(c2, rk[0]);
+	    __m128i b3 = _mm_xor_si128(c3, rk[0]);
+
+	    for (i = 1; i < rounds; i++) {
+		b0 = _mm_aesdec_si128(b0, rk[i]);
+		b1 = _mm_aesdec_si128(b1, rk[i]);
+		b2 = _mm_aesdec_si128(b2, rk[i]);
+		b3 = _mm_aesdec_si128(b3, rk[i]);
+	    }
+	    b0 = _mm_aesdeclast_si128(b0, rk[rounds]);
+	    b1 = _mm_aesdeclast_si128(b1, rk[rounds]);
+	    b2 = _mm_aesdeclast_si128(b2, rk[rounds]);
+	    b3 = _mm_aesdeclast_si128(b3, rk[rounds]);
+
+	    _mm_storeu_si128(op++, _mm_xor_si128(b0, ivec));
+	    _mm_storeu_si128(op++, _mm_xor_si128(b1, c0));
+	    _mm_storeu_si128(op++, _mm_xor_si128(b2, c1));
+	    _mm_storeu_si128(op++, _mm_xor_si128(b3, c2));
+	    ivec = c3;
+	}
+	for (; n > 0; n--) {
+	    __m128i c = _mm_loadu_si128(ip++);
+	    __m128i b = aesni_decrypt_block(c, rk, rounds);
+
+	    _mm_storeu_si128(op++, _mm_xor_si128(b, ivec));
+	    ivec = c;
+	}
+    }
+    _mm_storeu_si128((__m128i *)iv, ivec);
+}
+
+#endif /* HAVE_AESNI */
+
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_AESNI
+    if (use_aesni())
+	aesni_convert_key(key);
+#endif
     return 0;
 }
 
@@ -58,18 +250,34 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_AESNI
+    if (use_aesni())
+	aesni_convert_key(key);
+#endif
     return 0;
 }
 
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (use_aesni()) {
+	aesni_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (use_aesni()) {
+	aesni_decrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -81,6 +289,17 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HAVE_AESNI
+    if (use_aesni() && size >= AES_BLOCK_SIZE) {
+	unsigned long len = size & ~(unsigned long)(AES_BLOCK_SIZE - 1);
+
+	aesni_cbc_encrypt(in, out, len, key, iv, forward_encrypt);
+	in += len;
+	out += len;
+	size -= len;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
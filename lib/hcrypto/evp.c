@@ -186,6 +186,37 @@ EVP_MD_CTX_cleanup(EVP_MD_CTX *ctx) HC_DEPRECATED
     return 1;
 }
 
+/**
+ * Copy the state of one message digest context to another, so that
+ * a digest of a common prefix can be computed once and continued
+ * many times.  The memory of the destination context is reused if it
+ * was last used with the same message digest.
+ *
+ * @param out the context to copy to.
+ * @param in the context to copy from.
+ *
+ * @return 1 on success.
+ *
+ * @ingroup hcrypto_evp
+ */
+
+int
+EVP_MD_CTX_copy_ex(EVP_MD_CTX *out, const EVP_MD_CTX *in)
+{
+    if (in->md == NULL || in->ptr == NULL)
+	return 0;
+    if (out->md != in->md || out->engine != in->engine) {
+	EVP_MD_CTX_cleanup(out);
+	out->ptr = malloc(in->md->ctx_size);
+	if (out->ptr == NULL)
+	    return 0;
+	out->md = in->md;
+	out->engine = in->engine;
+    }
+    memcpy(out->ptr, in->ptr, in->md->ctx_size);
+    return 1;
+}
+
 /**
  * Get the EVP_MD use for a specified context.
  *
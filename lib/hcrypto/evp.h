@@ -64,6 +64,7 @@
 #define EVP_DigestUpdate hc_EVP_DigestUpdate
 #define EVP_MD_CTX_block_size hc_EVP_MD_CTX_block_size
 #define EVP_MD_CTX_cleanup hc_EVP_MD_CTX_cleanup
+#define EVP_MD_CTX_copy_ex hc_EVP_MD_CTX_copy_ex
 #define EVP_MD_CTX_create hc_EVP_MD_CTX_create
 #define EVP_MD_CTX_init hc_EVP_MD_CTX_init
 #define EVP_MD_CTX_destroy hc_EVP_MD_CTX_destroy
@@ -261,6 +262,7 @@ EVP_MD_CTX *
 void	HC_DEPRECATED EVP_MD_CTX_init(EVP_MD_CTX *);
 void	EVP_MD_CTX_destroy(EVP_MD_CTX *);
 int	HC_DEPRECATED EVP_MD_CTX_cleanup(EVP_MD_CTX *);
+int	EVP_MD_CTX_copy_ex(EVP_MD_CTX *, const EVP_MD_CTX *);
 
 int	EVP_DigestInit_ex(EVP_MD_CTX *, const EVP_MD *, ENGINE *);
 int	EVP_DigestUpdate(EVP_MD_CTX *,const void *, size_t);
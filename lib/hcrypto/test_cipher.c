@@ -69,6 +69,79 @@ struct tests aes_tests[] = {
       16,
       "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00",
       "\xdc\x95\xc0\x78\xa2\x40\x89\x89\xad\x48\xa2\x14\x92\x84\x20\x87"
+    },
+    /* NIST SP 800-38A F.2.5 */
+    { "aes-256 sp800-38a",
+      "\x60\x3d\xeb\x10\x15\xca\x71\xbe\x2b\x73\xae\xf0\x85\x7d\x77\x81"
+      "\x1f\x35\x2c\x07\x3b\x61\x08\xd7\x2d\x98\x10\xa3\x09\x14\xdf\xf4",
+      32,
+      "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f",
+      64,
+      "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+      "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+      "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+      "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10",
+      "\xf5\x8c\x4c\x04\xd6\xe5\xf1\xba\x77\x9e\xab\xfb\x5f\x7b\xfb\xd6"
+      "\x9c\xfc\x4e\x96\x7e\xdb\x80\x8d\x67\x9f\x77\x7b\xc6\x70\x2c\x7d"
+      "\x39\xf2\x33\x69\xa9\xd9\xba\xcf\xa5\x30\xe2\x63\x04\x23\x14\x61"
+      "\xb2\xeb\x05\xe2\xc3\x9b\xe9\xfc\xda\x6c\x19\x07\x8c\x6a\x9d\x1b"
+    }
+};
+
+struct tests aes128_tests[] = {
+    /* NIST SP 800-38A F.2.1 */
+    { "aes-128 sp800-38a",
+      "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c",
+      16,
+      "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f",
+      64,
+      "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+      "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+      "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+      "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10",
+      "\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d"
+      "\x50\x86\xcb\x9b\x50\x72\x19\xee\x95\xdb\x11\x3a\x91\x76\x78\xb2"
+      "\x73\xbe\xd6\xb8\xe3\xc1\x74\x3b\x71\x16\xe6\x9e\x22\x22\x95\x16"
+      "\x3f\xf1\xca\xa1\x68\x1f\xac\x09\x12\x0e\xca\x30\x75\x86\xe1\xa7"
+    },
+    { "aes-128 7 blocks",
+      "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c",
+      16,
+      "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f",
+      112,
+      "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+      "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+      "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+      "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10"
+      "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+      "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+      "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef",
+      "\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d"
+      "\x50\x86\xcb\x9b\x50\x72\x19\xee\x95\xdb\x11\x3a\x91\x76\x78\xb2"
+      "\x73\xbe\xd6\xb8\xe3\xc1\x74\x3b\x71\x16\xe6\x9e\x22\x22\x95\x16"
+      "\x3f\xf1\xca\xa1\x68\x1f\xac\x09\x12\x0e\xca\x30\x75\x86\xe1\xa7"
+      "\x1f\x55\x12\xb4\xe7\x73\xa5\x91\xe3\x38\x01\x09\xa5\x5e\x8b\x75"
+      "\xd0\xce\x36\x6b\xff\x52\x44\xe8\xdd\x3b\xad\xa4\x59\x09\x05\x34"
+      "\xbe\x69\xf5\x10\x6b\x17\x10\x3b\x3c\xd1\x67\x26\xe8\x62\x50\x8c"
+    }
+};
+
+struct tests aes192_tests[] = {
+    /* NIST SP 800-38A F.2.3 */
+    { "aes-192 sp800-38a",
+      "\x8e\x73\xb0\xf7\xda\x0e\x64\x52\xc8\x10\xf3\x2b\x80\x90\x79\xe5"
+      "\x62\xf8\xea\xd2\x52\x2c\x6b\x7b",
+      24,
+      "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f",
+      64,
+      "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+      "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+      "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+      "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10",
+      "\x4f\x02\x1d\xb2\x43\xbc\x63\x3d\x71\x78\x18\x3a\x9f\xa0\x71\xe8"
+      "\xb4\xd9\xad\xa9\xad\x7d\xed\xf4\xe5\xe7\x38\x76\x3f\x69\x14\x5a"
+      "\x57\x1b\x24\x20\x12\xfb\x7a\xe0\x7f\xa9\xba\xac\x3d\xf1\x02\xe0"
+      "\x08\xb0\xe2\x79\x88\x59\x88\x81\xd9\x20\xa9\xe6\x4f\x56\x15\xcd"
     }
 };
 
@@ -286,10 +359,49 @@ test_cipher(int i, const EVP_CIPHER *c, struct tests *t)
     return 0;
 }
 
+static void
+time_cipher(const EVP_CIPHER *c, const char *name)
+{
+    unsigned char key[32], iv[EVP_MAX_IV_LENGTH];
+    const size_t len = 8192;
+    const int loops = 2048;
+    EVP_CIPHER_CTX ctx;
+    struct timeval tv1, tv2;
+    void *d;
+    int i, encp;
+
+    memset(key, 0x17, sizeof(key));
+    memset(iv, 0x42, sizeof(iv));
+    d = ecalloc(1, len);
+
+    for (encp = 1; encp >= 0; encp--) {
+	EVP_CIPHER_CTX_init(&ctx);
+	if (EVP_CipherInit_ex(&ctx, c, NULL, key, iv, encp) != 1)
+	    errx(1, "%s: EVP_CipherInit_ex", name);
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < loops; i++)
+	    EVP_Cipher(&ctx, d, d, len);
+	gettimeofday(&tv2, NULL);
+	timevalsub(&tv2, &tv1);
+
+	printf("%s %s: %lu MB in %lu.%06lu s\n", name,
+	       encp ? "encrypt" : "decrypt",
+	       (unsigned long)(len * loops / (1024 * 1024)),
+	       (unsigned long)tv2.tv_sec, (unsigned long)tv2.tv_usec);
+
+	EVP_CIPHER_CTX_cleanup(&ctx);
+    }
+    free(d);
+}
+
+static int time_aes_flag;
 static int version_flag;
 static int help_flag;
 
 static struct getargs args[] = {
+    { "time-aes",	0,	arg_flag,	&time_aes_flag,
+      "time AES CBC encryption and decryption", NULL },
     { "version",	0,	arg_flag,	&version_flag,
       "print version", NULL },
     { "help",		0,	arg_flag,	&help_flag,
@@ -329,6 +441,10 @@ main(int argc, char **argv)
     argv += idx;
 
     /* hcrypto */
+    for (i = 0; i < sizeof(aes128_tests)/sizeof(aes128_tests[0]); i++)
+	ret += test_cipher(i, EVP_hcrypto_aes_128_cbc(), &aes128_tests[i]);
+    for (i = 0; i < sizeof(aes192_tests)/sizeof(aes192_tests[0]); i++)
+	ret += test_cipher(i, EVP_hcrypto_aes_192_cbc(), &aes192_tests[i]);
     for (i = 0; i < sizeof(aes_tests)/sizeof(aes_tests[0]); i++)
 	ret += test_cipher(i, EVP_hcrypto_aes_256_cbc(), &aes_tests[i]);
     for (i = 0; i < sizeof(aes_cfb_tests)/sizeof(aes_cfb_tests[0]); i++)
@@ -344,6 +460,11 @@ main(int argc, char **argv)
     for (i = 0; i < sizeof(rc4_tests)/sizeof(rc4_tests[0]); i++)
 	ret += test_cipher(i, EVP_hcrypto_rc4(), &rc4_tests[i]);
 
+    if (time_aes_flag) {
+	time_cipher(EVP_hcrypto_aes_128_cbc(), "aes-128-cbc");
+	time_cipher(EVP_hcrypto_aes_256_cbc(), "aes-256-cbc");
+    }
+
     /* Common Crypto */
 #ifdef __APPLE__
     for (i = 0; i < sizeof(aes_tests)/sizeof(aes_tests[0]); i++)
@@ -98,9 +98,18 @@ hdb_value2entry_alias(krb5_context context, krb5_data *value,
     return decode_hdb_entry_alias(value->data, value->length, ent, NULL);
 }
 
-krb5_error_code
-_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
-		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+/*
+ * Look up `principal' with `get', following an alias if HDB_F_CANON
+ * is set.  When `borrowed' is set the values returned by `get' point
+ * into the backend's storage and are only valid until the next call,
+ * so they are decoded but not freed.
+ */
+
+static krb5_error_code
+fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	   unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry,
+	   krb5_error_code (*get)(krb5_context, HDB *, krb5_data, krb5_data *),
+	   int borrowed)
 {
     krb5_principal enterprise_principal = NULL;
     krb5_data key, value;
@@ -124,37 +133,42 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
     hdb_principal2key(context, principal, &key);
     if (enterprise_principal)
 	krb5_free_principal(context, enterprise_principal);
-    ret = db->hdb__get(context, db, key, &value);
+    ret = (*get)(context, db, key, &value);
     krb5_data_free(&key);
     if(ret)
 	return ret;
     ret = hdb_value2entry(context, &value, &entry->entry);
     if (ret == ASN1_BAD_ID && (flags & HDB_F_CANON) == 0) {
-	krb5_data_free(&value);
+	if (!borrowed)
+	    krb5_data_free(&value);
 	return HDB_ERR_NOENTRY;
     } else if (ret == ASN1_BAD_ID) {
 	hdb_entry_alias alias;
 
 	ret = hdb_value2entry_alias(context, &value, &alias);
 	if (ret) {
-	    krb5_data_free(&value);
+	    if (!borrowed)
+		krb5_data_free(&value);
 	    return ret;
 	}
 	hdb_principal2key(context, alias.principal, &key);
-	krb5_data_free(&value);
+	if (!borrowed)
+	    krb5_data_free(&value);
 	free_hdb_entry_alias(&alias);
 
-	ret = db->hdb__get(context, db, key, &value);
+	ret = (*get)(context, db, key, &value);
 	krb5_data_free(&key);
 	if (ret)
 	    return ret;
 	ret = hdb_value2entry(context, &value, &entry->entry);
 	if (ret) {
-	    krb5_data_free(&value);
+	    if (!borrowed)
+		krb5_data_free(&value);
 	    return ret;
 	}
     }
-    krb5_data_free(&value);
+    if (!borrowed)
+	krb5_data_free(&value);
     if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_ALL_KVNOS)) {
 	/* Decrypt the current keys */
 	ret = hdb_unseal_keys(context, db, &entry->entry);
@@ -194,6 +208,29 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
     return 0;
 }
 
+krb5_error_code
+_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return fetch_kvno(context, db, principal, flags, kvno, entry,
+		      db->hdb__get, 0);
+}
+
+/*
+ * Like _hdb_fetch_kvno() but with a `get' that lends out its values
+ * instead of copying them, see fetch_kvno().
+ */
+
+krb5_error_code
+_hdb_fetch_kvno_borrowed(krb5_context context, HDB *db,
+			 krb5_const_principal principal,
+			 unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry,
+			 krb5_error_code (*get)(krb5_context, HDB *,
+						krb5_data, krb5_data *))
+{
+    return fetch_kvno(context, db, principal, flags, kvno, entry, get, 1);
+}
+
 static krb5_error_code
 hdb_remove_aliases(krb5_context context, HDB *db, krb5_data *key)
 {
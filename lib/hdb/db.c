@@ -170,6 +170,19 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+static krb5_error_code
+DB_get_stamp(krb5_context context, HDB *db, struct hdb_stamp *stamp)
+{
+    krb5_error_code ret;
+    char *fn;
+
+    if (asprintf(&fn, "%s.db", db->hdb_name) == -1)
+	return krb5_enomem(context);
+    ret = _hdb_file_stamp(context, fn, stamp);
+    free(fn);
+    return ret;
+}
+
 static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
@@ -337,7 +350,8 @@ hdb_db_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_STAMP;
     (*db)->hdb_open = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
@@ -345,6 +359,7 @@ hdb_db_create(krb5_context context, HDB **db,
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
     (*db)->hdb_nextkey= DB_nextkey;
+    (*db)->hdb_get_stamp = DB_get_stamp;
     (*db)->hdb_lock = DB_lock;
     (*db)->hdb_unlock = DB_unlock;
     (*db)->hdb_rename = DB_rename;
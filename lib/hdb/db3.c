@@ -51,6 +51,10 @@
 #include <db.h>
 #endif
 
+#ifndef DB_CURSOR_BULK
+# define DB_CURSOR_BULK 0	/* Missing with DB < 4.8 */
+#endif
+
 typedef struct {
     HDB hdb;            /* generic members */
     int lock_fd;        /* DB3-specific */
@@ -162,6 +166,97 @@ DB_nextkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
     return DB_seq(context, db, flags, entry, DB_NEXT);
 }
 
+/*
+ * Walk the keys with a cursor of our own and hand out the entries
+ * that hash into the shard.
+ */
+
+static krb5_error_code
+DB_foreach_shard(krb5_context context, HDB *db, unsigned shard,
+		 unsigned nshards, hdb_foreach_raw_func_t func, void *arg)
+{
+    DB *d = (DB*)db->hdb_db;
+    DBC *dbc;
+    DBT key, value;
+    krb5_data key_data, data;
+    krb5_error_code ret = 0;
+    int code;
+
+    code = (*d->cursor)(d, NULL, &dbc, DB_CURSOR_BULK);
+    if (code) {
+	krb5_set_error_message(context, code, "d->cursor: %s", strerror(code));
+	return code;
+    }
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&value, 0, sizeof(DBT));
+    for (code = (*dbc->c_get)(dbc, &key, &value, DB_FIRST);
+	 code == 0;
+	 code = (*dbc->c_get)(dbc, &key, &value, DB_NEXT)) {
+	key_data.data = key.data;
+	key_data.length = key.size;
+	data.data = value.data;
+	data.length = value.size;
+	if (!_hdb_value_is_entry(&data) ||
+	    _hdb_key2shard(&key_data, nshards) != shard)
+	    continue;
+	ret = (*func)(context, db, &key_data, &data, arg);
+	if (ret)
+	    break;
+    }
+    (*dbc->c_close)(dbc);
+    if (ret)
+	return ret;
+    if (code != DB_NOTFOUND)
+	return code;
+    return 0;
+}
+
+/*
+ * The keys are encoded principals, which are not ordered by name, so
+ * all of them are looked at, but no entry is decoded.
+ */
+
+static krb5_error_code
+DB_foreach_name(krb5_context context, HDB *db, const char *prefix,
+		hdb_foreach_name_func_t func, void *arg)
+{
+    DB *d = (DB*)db->hdb_db;
+    DBC *dbc;
+    DBT key, value;
+    krb5_data key_data, data;
+    size_t prefix_len = strlen(prefix);
+    krb5_error_code ret = 0;
+    int code;
+
+    code = (*d->cursor)(d, NULL, &dbc, DB_CURSOR_BULK);
+    if (code) {
+	krb5_set_error_message(context, code, "d->cursor: %s", strerror(code));
+	return code;
+    }
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&value, 0, sizeof(DBT));
+    for (code = (*dbc->c_get)(dbc, &key, &value, DB_FIRST);
+	 code == 0;
+	 code = (*dbc->c_get)(dbc, &key, &value, DB_NEXT)) {
+	key_data.data = key.data;
+	key_data.length = key.size;
+	data.data = value.data;
+	data.length = value.size;
+	ret = _hdb_foreach_name_key(context, db, &key_data, &data,
+				    prefix, prefix_len, func, arg);
+	if (ret)
+	    break;
+    }
+    (*dbc->c_close)(dbc);
+    if (ret)
+	return ret;
+    if (code != DB_NOTFOUND)
+	return code;
+    return 0;
+}
+
 static krb5_error_code
 DB_rename(krb5_context context, HDB *db, const char *new_name)
 {
@@ -189,6 +284,19 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+static krb5_error_code
+DB_get_stamp(krb5_context context, HDB *db, struct hdb_stamp *stamp)
+{
+    krb5_error_code ret;
+    char *fn;
+
+    if (asprintf(&fn, "%s.db", db->hdb_name) == -1)
+	return krb5_enomem(context);
+    ret = _hdb_file_stamp(context, fn, stamp);
+    free(fn);
+    return ret;
+}
+
 static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
@@ -347,9 +455,6 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 	return ret;
     }
 
-#ifndef DB_CURSOR_BULK
-# define DB_CURSOR_BULK 0	/* Missing with DB < 4.8 */
-#endif
     ret = (*d->cursor)(d, NULL, &dbc, DB_CURSOR_BULK);
 
     if (ret) {
@@ -396,7 +501,8 @@ hdb_db_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_FOREACH_SHARD | HDB_CAP_F_FOREACH_NAME | HDB_CAP_F_STAMP;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
@@ -404,6 +510,9 @@ hdb_db_create(krb5_context context, HDB **db,
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
     (*db)->hdb_nextkey= DB_nextkey;
+    (*db)->hdb_foreach_shard = DB_foreach_shard;
+    (*db)->hdb_foreach_name = DB_foreach_name;
+    (*db)->hdb_get_stamp = DB_get_stamp;
     (*db)->hdb_lock = DB_lock;
     (*db)->hdb_unlock = DB_unlock;
     (*db)->hdb_rename = DB_rename;
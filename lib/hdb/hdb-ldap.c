@@ -39,9 +39,15 @@
 #include <lber.h>
 #include <ldap.h>
 #include <sys/un.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #include <hex.h>
+#include <heim_threads.h>
 
 static krb5_error_code LDAP__connect(krb5_context context, HDB *);
+static void LDAP__drop(krb5_context context, HDB *);
+static void LDAP__release(krb5_context context, HDB *);
 static krb5_error_code LDAP_close(krb5_context context, HDB *);
 
 static krb5_error_code
@@ -52,9 +58,33 @@ static const char *default_structural_object = "account";
 static char *structural_object;
 static const char *default_ldap_url = "ldapi:///";
 static krb5_boolean samba_forwardable;
+static krb5_boolean pipeline_searches;
+static struct timeval search_timeout;
+
+/*
+ * Bound connections that are not in use are kept in a pool shared by
+ * all handles talking to the same server as the same identity, so
+ * that several threads can have searches outstanding at once without
+ * each handle binding a connection of its own.
+ */
+
+struct ldap_pool {
+    struct ldap_pool *next;
+    char *url;
+    char *bind_dn;
+    krb5_boolean start_tls;
+    unsigned int refs;
+    size_t size;
+    size_t nidle;
+    LDAP **idle;
+};
+
+static HEIMDAL_MUTEX pool_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct ldap_pool *pools;
 
 struct hdbldapdb {
     LDAP *h_lp;
+    struct ldap_pool *h_pool;
     int   h_msgid;
     char *h_base;
     char *h_url;
@@ -73,6 +103,7 @@ struct hdbldapdb {
 #define HDB2BINDDN(db) (((struct hdbldapdb *)(db)->hdb_db)->h_bind_dn)
 #define HDB2BINDPW(db) (((struct hdbldapdb *)(db)->hdb_db)->h_bind_password)
 #define HDB2CREATE(db) (((struct hdbldapdb *)(db)->hdb_db)->h_createbase)
+#define HDB2POOL(db) (((struct hdbldapdb *)(db)->hdb_db)->h_pool)
 
 /*
  *
@@ -140,7 +171,7 @@ check_ldap(krb5_context context, HDB *db, int ret)
     case LDAP_SUCCESS:
 	return 0;
     case LDAP_SERVER_DOWN:
-	LDAP_close(context, db);
+	LDAP__drop(context, db);
 	return 1;
     default:
 	return 1;
@@ -834,6 +865,114 @@ escape_value(krb5_context context, const unsigned char *unquoted, char **quoted)
 }
 
 
+/*
+ * Send a search for each of the `n' filters before waiting for any
+ * of the answers, and return the first result that has entries in
+ * it, or else the last one.  Once a search has found something the
+ * later ones are abandoned, so they can neither slow down nor fail
+ * the lookup.  The search is retried once on a new connection if the
+ * server went away, since a pooled connection may have been closed
+ * by the server while idle; a connection that timed out is dropped.
+ */
+
+static krb5_error_code
+LDAP__search(krb5_context context, HDB *db, char **filters, size_t n,
+	     LDAPMessage **msg)
+{
+    LDAPMessage *res[2];
+    int msgid[2];
+    krb5_error_code ret;
+    size_t i, failed = 0;
+    int rc = LDAP_SUCCESS, tries, r;
+
+    heim_assert(n > 0 && n <= sizeof(res)/sizeof(res[0]),
+		"too many LDAP searches");
+
+    *msg = NULL;
+
+    for (tries = 0; tries < 2; tries++) {
+	ret = LDAP__connect(context, db);
+	if (ret)
+	    return ret;
+
+	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
+	if (ret)
+	    return ret;
+
+	for (i = 0; i < n; i++) {
+	    res[i] = NULL;
+	    msgid[i] = -1;
+	}
+
+	for (i = 0, rc = LDAP_SUCCESS; rc == LDAP_SUCCESS && i < n; i++) {
+	    rc = ldap_search_ext(HDB2LDAP(db), HDB2BASE(db),
+				 LDAP_SCOPE_SUBTREE, filters[i],
+				 krb5kdcentry_attrs, 0,
+				 NULL, NULL, NULL, 0, &msgid[i]);
+	    failed = i;
+	}
+
+	for (i = 0; rc == LDAP_SUCCESS && i < n; i++) {
+	    failed = i;
+	    r = ldap_result(HDB2LDAP(db), msgid[i], LDAP_MSG_ALL,
+			    search_timeout.tv_sec ? &search_timeout : NULL,
+			    &res[i]);
+	    if (r == 0) {
+		rc = LDAP_TIMEOUT;
+	    } else if (r < 0) {
+		if (ldap_get_option(HDB2LDAP(db), LDAP_OPT_RESULT_CODE,
+				    &rc) != LDAP_OPT_SUCCESS ||
+		    rc == LDAP_SUCCESS)
+		    rc = LDAP_OTHER;
+	    } else if (ldap_parse_result(HDB2LDAP(db), res[i], &rc,
+					 NULL, NULL, NULL, NULL,
+					 0) != LDAP_SUCCESS)
+		rc = LDAP_OTHER;
+	    if (rc == LDAP_SUCCESS &&
+		ldap_count_entries(HDB2LDAP(db), res[i]) > 0)
+		break;
+	}
+
+	if (rc == LDAP_SUCCESS)
+	    break;
+
+	for (i = 0; i < n; i++) {
+	    if (res[i])
+		ldap_msgfree(res[i]);
+	    else if (msgid[i] >= 0 && HDB2LDAP(db))
+		ldap_abandon_ext(HDB2LDAP(db), msgid[i], NULL, NULL);
+	}
+	if (rc == LDAP_TIMEOUT) {
+	    LDAP__drop(context, db);
+	    break;
+	}
+	/* check_ldap() drops the connection if the server went away */
+	if (check_ldap(context, db, rc) && rc != LDAP_SERVER_DOWN)
+	    break;
+    }
+
+    if (rc != LDAP_SUCCESS) {
+	ret = HDB_ERR_NOENTRY;
+	krb5_set_error_message(context, ret, "ldap_search_ext: "
+			       "filter: %s - error: %s",
+			       filters[failed], ldap_err2string(rc));
+	return ret;
+    }
+
+    for (i = 0; i < n; i++) {
+	if (res[i] == NULL) {
+	    if (msgid[i] >= 0)
+		ldap_abandon_ext(HDB2LDAP(db), msgid[i], NULL, NULL);
+	} else if (*msg == NULL &&
+	    (i == n - 1 || ldap_count_entries(HDB2LDAP(db), res[i]) > 0))
+	    *msg = res[i];
+	else
+	    ldap_msgfree(res[i]);
+    }
+
+    return 0;
+}
+
 static krb5_error_code
 LDAP__lookup_princ(krb5_context context,
 		   HDB *db,
@@ -843,11 +982,7 @@ LDAP__lookup_princ(krb5_context context,
 {
     krb5_error_code ret;
     int rc;
-    char *quote, *filter = NULL;
-
-    ret = LDAP__connect(context, db);
-    if (ret)
-	return ret;
+    char *quote, *filters[2] = { NULL, NULL };
 
     /*
      * Quote searches that contain filter language, this quote
@@ -858,7 +993,7 @@ LDAP__lookup_princ(krb5_context context,
     if (ret)
 	goto out;
 
-    rc = asprintf(&filter,
+    rc = asprintf(&filters[0],
 		  "(&(objectClass=krb5Principal)(krb5PrincipalName=%s))",
 		  quote);
     free(quote);
@@ -869,34 +1004,12 @@ LDAP__lookup_princ(krb5_context context,
 	goto out;
     }
 
-    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-    if (ret)
-	goto out;
-
-    rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db),
-			   LDAP_SCOPE_SUBTREE, filter,
-			   krb5kdcentry_attrs, 0,
-			   NULL, NULL, NULL,
-			   0, msg);
-    if (check_ldap(context, db, rc)) {
-	ret = HDB_ERR_NOENTRY;
-	krb5_set_error_message(context, ret, "ldap_search_ext_s: "
-			      "filter: %s - error: %s",
-			      filter, ldap_err2string(rc));
-	goto out;
-    }
-
-    if (userid && ldap_count_entries(HDB2LDAP(db), *msg) == 0) {
-	free(filter);
-	filter = NULL;
-	ldap_msgfree(*msg);
-	*msg = NULL;
-
+    if (userid) {
 	ret = escape_value(context, userid, &quote);
 	if (ret)
 	    goto out;
 
-	rc = asprintf(&filter,
+	rc = asprintf(&filters[1],
 	    "(&(|(objectClass=sambaSamAccount)(objectClass=%s))(uid=%s))",
 		      structural_object, quote);
 	free(quote);
@@ -905,29 +1018,26 @@ LDAP__lookup_princ(krb5_context context,
 	    krb5_set_error_message(context, ret, "asprintf: out of memory");
 	    goto out;
 	}
-
-	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-	if (ret)
-	    goto out;
-
-	rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db), LDAP_SCOPE_SUBTREE,
-			       filter, krb5kdcentry_attrs, 0,
-			       NULL, NULL, NULL,
-			       0, msg);
-	if (check_ldap(context, db, rc)) {
-	    ret = HDB_ERR_NOENTRY;
-	    krb5_set_error_message(context, ret,
-				   "ldap_search_ext_s: filter: %s error: %s",
-				   filter, ldap_err2string(rc));
-	    goto out;
-	}
     }
 
-    ret = 0;
+    /*
+     * The uid search is only used when the principal search finds
+     * nothing; unless told not to, send both at once to save a round
+     * trip.
+     */
+    if (userid && !pipeline_searches) {
+	ret = LDAP__search(context, db, filters, 1, msg);
+	if (ret || ldap_count_entries(HDB2LDAP(db), *msg) > 0)
+	    goto out;
+	ldap_msgfree(*msg);
+	*msg = NULL;
+	ret = LDAP__search(context, db, &filters[1], 1, msg);
+    } else
+	ret = LDAP__search(context, db, filters, userid ? 2 : 1, msg);
 
   out:
-    if (filter)
-	free(filter);
+    free(filters[0]);
+    free(filters[1]);
 
     return ret;
 }
@@ -1415,13 +1525,180 @@ out:
     return ret;
 }
 
+/*
+ * Find or set up the pool for the server and identity of `h'.
+ */
+
 static krb5_error_code
-LDAP_close(krb5_context context, HDB * db)
+LDAP__pool_ref(krb5_context context, struct hdbldapdb *h)
+{
+    struct ldap_pool *p;
+    krb5_error_code ret = 0;
+
+    HEIMDAL_MUTEX_lock(&pool_mutex);
+    for (p = pools; p != NULL; p = p->next) {
+	if (strcmp(p->url, h->h_url) == 0 &&
+	    p->start_tls == h->h_start_tls &&
+	    (p->bind_dn == NULL ? h->h_bind_dn == NULL :
+	     h->h_bind_dn != NULL && strcmp(p->bind_dn, h->h_bind_dn) == 0))
+	    break;
+    }
+    if (p == NULL) {
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+	    goto enomem;
+	p->size = krb5_config_get_int_default(context, NULL, 4, "kdc",
+					      "hdb-ldap-pool-size", NULL);
+	p->url = strdup(h->h_url);
+	p->bind_dn = h->h_bind_dn ? strdup(h->h_bind_dn) : NULL;
+	p->idle = calloc(p->size ? p->size : 1, sizeof(p->idle[0]));
+	if (p->url == NULL || (h->h_bind_dn && p->bind_dn == NULL) ||
+	    p->idle == NULL) {
+	    free(p->url);
+	    free(p->bind_dn);
+	    free(p->idle);
+	    free(p);
+	    goto enomem;
+	}
+	p->start_tls = h->h_start_tls;
+	p->next = pools;
+	pools = p;
+    }
+    p->refs++;
+    h->h_pool = p;
+    HEIMDAL_MUTEX_unlock(&pool_mutex);
+    return 0;
+
+  enomem:
+    HEIMDAL_MUTEX_unlock(&pool_mutex);
+    ret = ENOMEM;
+    krb5_set_error_message(context, ret, "malloc: out of memory");
+    return ret;
+}
+
+static void
+LDAP__pool_unref(struct hdbldapdb *h)
+{
+    struct ldap_pool *p = h->h_pool, **pp;
+    size_t i;
+
+    if (p == NULL)
+	return;
+    h->h_pool = NULL;
+
+    HEIMDAL_MUTEX_lock(&pool_mutex);
+    if (--p->refs > 0) {
+	HEIMDAL_MUTEX_unlock(&pool_mutex);
+	return;
+    }
+    for (pp = &pools; *pp != p; pp = &(*pp)->next)
+	;
+    *pp = p->next;
+    HEIMDAL_MUTEX_unlock(&pool_mutex);
+
+    for (i = 0; i < p->nidle; i++)
+	ldap_unbind_ext(p->idle[i], NULL, NULL);
+    free(p->idle);
+    free(p->url);
+    free(p->bind_dn);
+    free(p);
+}
+
+/*
+ * An idle connection should have nothing to read; if it has, the
+ * server has closed it or sent a notice of disconnection.
+ */
+
+static int
+LDAP__idle_alive(LDAP *lp)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    int sd;
+
+    if (ldap_get_option(lp, LDAP_OPT_DESC, &sd) != LDAP_OPT_SUCCESS ||
+	sd < 0)
+	return 0;
+    if (getpeername(sd, (struct sockaddr *) &addr, &len) < 0)
+	return 0;
+#ifdef HAVE_POLL
+    {
+	struct pollfd pfd;
+
+	pfd.fd = sd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) != 0)
+	    return 0;
+    }
+#endif
+    return 1;
+}
+
+static LDAP *
+LDAP__pool_get(struct ldap_pool *p)
+{
+    LDAP *lp = NULL;
+
+    for (;;) {
+	HEIMDAL_MUTEX_lock(&pool_mutex);
+	lp = p->nidle > 0 ? p->idle[--p->nidle] : NULL;
+	HEIMDAL_MUTEX_unlock(&pool_mutex);
+	if (lp == NULL || LDAP__idle_alive(lp))
+	    return lp;
+	ldap_unbind_ext(lp, NULL, NULL);
+    }
+}
+
+/*
+ * Give the connection of `db' back to the pool, unless it is in the
+ * middle of a firstkey/nextkey iteration.
+ */
+
+static void
+LDAP__release(krb5_context context, HDB *db)
+{
+    struct ldap_pool *p = HDB2POOL(db);
+    LDAP *lp = HDB2LDAP(db);
+
+    if (lp == NULL || HDB2MSGID(db) >= 0)
+	return;
+    ((struct hdbldapdb *)db->hdb_db)->h_lp = NULL;
+
+    if (p != NULL) {
+	HEIMDAL_MUTEX_lock(&pool_mutex);
+	if (p->nidle < p->size) {
+	    p->idle[p->nidle++] = lp;
+	    lp = NULL;
+	}
+	HEIMDAL_MUTEX_unlock(&pool_mutex);
+    }
+    if (lp)
+	ldap_unbind_ext(lp, NULL, NULL);
+}
+
+/*
+ * Throw away the connection of `db', it is broken or has a search
+ * outstanding that nobody will collect.
+ */
+
+static void
+LDAP__drop(krb5_context context, HDB *db)
 {
     if (HDB2LDAP(db)) {
 	ldap_unbind_ext(HDB2LDAP(db), NULL, NULL);
 	((struct hdbldapdb *)db->hdb_db)->h_lp = NULL;
     }
+    HDBSETMSGID(db, -1);
+}
+
+static krb5_error_code
+LDAP_close(krb5_context context, HDB * db)
+{
+    if (HDB2MSGID(db) >= 0)
+	LDAP__drop(context, db);
+    else
+	LDAP__release(context, db);
 
     return 0;
 }
@@ -1474,11 +1751,11 @@ LDAP_seq(krb5_context context, HDB * db, unsigned flags, hdb_entry_ex * entry)
 		ldap_abandon_ext(HDB2LDAP(db), msgid, NULL, NULL);
 	    }
 	    HDBSETMSGID(db, -1);
+	    LDAP__release(context, db);
 	    break;
 	case LDAP_SERVER_DOWN:
 	    ldap_msgfree(e);
-	    LDAP_close(context, db);
-	    HDBSETMSGID(db, -1);
+	    LDAP__drop(context, db);
 	    ret = ENETDOWN;
 	    break;
 	default:
@@ -1487,6 +1764,7 @@ LDAP_seq(krb5_context context, HDB * db, unsigned flags, hdb_entry_ex * entry)
 	    ldap_abandon_ext(HDB2LDAP(db), msgid, NULL, NULL);
 	    ret = HDB_ERR_NOENTRY;
 	    HDBSETMSGID(db, -1);
+	    LDAP__release(context, db);
 	    break;
 	}
     } while (rc == LDAP_RES_SEARCH_REFERENCE);
@@ -1507,7 +1785,7 @@ LDAP_firstkey(krb5_context context, HDB *db, unsigned flags,
 	      hdb_entry_ex *entry)
 {
     krb5_error_code ret;
-    int msgid;
+    int msgid = -1;
 
     ret = LDAP__connect(context, db);
     if (ret)
@@ -1522,8 +1800,10 @@ LDAP_firstkey(krb5_context context, HDB *db, unsigned flags,
 			"(|(objectClass=krb5Principal)(objectClass=sambaSamAccount))",
 			krb5kdcentry_attrs, 0,
 			NULL, NULL, NULL, 0, &msgid);
-    if (msgid < 0)
+    if (msgid < 0) {
+	LDAP__release(context, db);
 	return HDB_ERR_NOENTRY;
+    }
 
     HDBSETMSGID(db, msgid);
 
@@ -1568,13 +1848,19 @@ LDAP__connect(krb5_context context, HDB * db)
 	if (ldap_get_option(HDB2LDAP(db), LDAP_OPT_DESC, &sd) == 0 &&
 	    getpeername(sd, (struct sockaddr *) &addr, &len) < 0) {
 	    /* the other end has died. reopen. */
-	    LDAP_close(context, db);
+	    LDAP__drop(context, db);
 	}
     }
 
     if (HDB2LDAP(db) != NULL) /* server is UP */
 	return 0;
 
+    if (HDB2POOL(db) != NULL) {
+	((struct hdbldapdb *)db->hdb_db)->h_lp = LDAP__pool_get(HDB2POOL(db));
+	if (HDB2LDAP(db) != NULL)
+	    return 0;
+    }
+
     rc = ldap_initialize(&((struct hdbldapdb *)db->hdb_db)->h_lp, HDB2URL(db));
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_NOENTRY, "ldap_initialize: %s",
@@ -1587,7 +1873,7 @@ LDAP__connect(krb5_context context, HDB * db)
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_BADVERSION,
 			       "ldap_set_option: %s", ldap_err2string(rc));
-	LDAP_close(context, db);
+	LDAP__drop(context, db);
 	return HDB_ERR_BADVERSION;
     }
 
@@ -1597,7 +1883,7 @@ LDAP__connect(krb5_context context, HDB * db)
 	if (rc != LDAP_SUCCESS) {
 	    krb5_set_error_message(context, HDB_ERR_BADVERSION,
 				   "ldap_start_tls_s: %s", ldap_err2string(rc));
-	    LDAP_close(context, db);
+	    LDAP__drop(context, db);
 	    return HDB_ERR_BADVERSION;
 	}
     }
@@ -1607,7 +1893,7 @@ LDAP__connect(krb5_context context, HDB * db)
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_BADVERSION,
 			      "ldap_sasl_bind_s: %s", ldap_err2string(rc));
-	LDAP_close(context, db);
+	LDAP__drop(context, db);
 	return HDB_ERR_BADVERSION;
     }
 
@@ -1617,6 +1903,7 @@ LDAP__connect(krb5_context context, HDB * db)
 static krb5_error_code
 LDAP_open(krb5_context context, HDB * db, int flags, mode_t mode)
 {
+    krb5_error_code ret;
     /* Not the right place for this. */
 #ifdef HAVE_SIGACTION
     struct sigaction sa;
@@ -1630,7 +1917,10 @@ LDAP_open(krb5_context context, HDB * db, int flags, mode_t mode)
     signal(SIGPIPE, SIG_IGN);
 #endif /* HAVE_SIGACTION */
 
-    return LDAP__connect(context, db);
+    ret = LDAP__connect(context, db);
+    if (ret == 0)
+	LDAP__release(context, db);
+    return ret;
 }
 
 static krb5_error_code
@@ -1661,6 +1951,7 @@ LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
 
   out:
     ldap_msgfree(msg);
+    LDAP__release(context, db);
 
     return ret;
 }
@@ -1750,6 +2041,7 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
 	ldap_mods_free(mods, 1);
     if (name)
 	free(name);
+    LDAP__release(context, db);
 
     return ret;
 }
@@ -1799,6 +2091,7 @@ LDAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
 	free(dn);
     if (msg != NULL)
 	ldap_msgfree(msg);
+    LDAP__release(context, db);
 
     return ret;
 }
@@ -1809,6 +2102,7 @@ LDAP_destroy(krb5_context context, HDB * db)
     krb5_error_code ret;
 
     LDAP_close(context, db);
+    LDAP__pool_unref((struct hdbldapdb *)db->hdb_db);
 
     ret = hdb_clear_master_key(context, db);
     if (HDB2BASE(db))
@@ -1834,6 +2128,7 @@ hdb_ldap_common(krb5_context context,
     struct hdbldapdb *h;
     const char *create_base = NULL;
     const char *ldap_secret_file = NULL;
+    krb5_error_code ret;
 
     if (url == NULL || url[0] == '\0') {
 	const char *p;
@@ -1867,6 +2162,13 @@ hdb_ldap_common(krb5_context context,
     samba_forwardable =
 	krb5_config_get_bool_default(context, NULL, TRUE,
 				     "kdc", "hdb-samba-forwardable", NULL);
+    pipeline_searches =
+	krb5_config_get_bool_default(context, NULL, TRUE,
+				     "kdc", "hdb-ldap-pipeline-searches", NULL);
+    search_timeout.tv_sec =
+	krb5_config_get_time_default(context, NULL, 30,
+				     "kdc", "hdb-ldap-search-timeout", NULL);
+    search_timeout.tv_usec = 0;
 
     *db = calloc(1, sizeof(**db));
     if (*db == NULL) {
@@ -1883,6 +2185,7 @@ hdb_ldap_common(krb5_context context,
 	return ENOMEM;
     }
     (*db)->hdb_db = h;
+    h->h_msgid = -1;
 
     /* XXX */
     if (asprintf(&(*db)->hdb_name, "ldap:%s", search_base) == -1) {
@@ -1905,7 +2208,6 @@ hdb_ldap_common(krb5_context context,
 					      "hdb-ldap-secret-file", NULL);
     if (ldap_secret_file != NULL) {
 	krb5_config_binding *tmp;
-	krb5_error_code ret;
 	const char *p;
 	
 	ret = krb5_config_parse_file(context, ldap_secret_file, &tmp);
@@ -1929,6 +2231,13 @@ hdb_ldap_common(krb5_context context,
 	krb5_config_get_bool_default(context, NULL, FALSE,
 				     "kdc", "hdb-ldap-start-tls", NULL);
 
+    ret = LDAP__pool_ref(context, h);
+    if (ret) {
+	LDAP_destroy(context, *db);
+	*db = NULL;
+	return ret;
+    }
+
     create_base = krb5_config_get_string(context, NULL, "kdc",
 					 "hdb-ldap-create-base", NULL);
     if (create_base == NULL)
@@ -1944,7 +2253,7 @@ hdb_ldap_common(krb5_context context,
 
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_KEEP_OPEN;
     (*db)->hdb_open = LDAP_open;
     (*db)->hdb_close = LDAP_close;
     (*db)->hdb_fetch_kvno = LDAP_fetch_kvno;
@@ -39,30 +39,114 @@
 /* OpenLDAP MDB */
 
 #include <mdb.h>
+#include <heim_threads.h>
 
 #define	KILO	1024
 
+#ifndef MDB_NOTLS
+#define MDB_NOTLS 0
+#endif
+
+/*
+ * MDB must not open the same file more than once per process: closing
+ * any of the environments drops the process' locks on the lock file
+ * for all of them.  Handles on the same file, say one per KDC thread,
+ * therefore share one environment, opened with MDB_NOTLS so that each
+ * handle keeps read transactions of its own.
+ */
+
+struct mdb_env_ref {
+    struct mdb_env_ref *next;
+    dev_t dev;
+    ino_t ino;
+    int rdonly;
+    unsigned int refs;
+    MDB_env *e;
+    MDB_dbi d;
+};
+
+static HEIMDAL_MUTEX env_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct mdb_env_ref *envs;
+
 typedef struct mdb_info {
+    struct mdb_env_ref *ref;
     MDB_env *e;
     MDB_txn *t;
     MDB_dbi d;
     MDB_cursor *c;
+    MDB_txn *rt;	/* read txn for gets, reset when not in use */
+    MDB_txn *wt;	/* write txn held by HDB_WLOCK */
+    int rollback;	/* the outermost unlock aborts wt */
+    int rdonly;
 } mdb_info;
 
+static void
+env_release(struct mdb_env_ref *ref)
+{
+    struct mdb_env_ref **p;
+
+    HEIMDAL_MUTEX_lock(&env_mutex);
+    if (--ref->refs > 0) {
+	HEIMDAL_MUTEX_unlock(&env_mutex);
+	return;
+    }
+    for (p = &envs; *p; p = &(*p)->next) {
+	if (*p == ref) {
+	    *p = ref->next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&env_mutex);
+    mdb_env_close(ref->e);
+    free(ref);
+}
+
 static krb5_error_code
 DB_close(krb5_context context, HDB *db)
 {
     mdb_info *mi = (mdb_info *)db->hdb_db;
 
-    mdb_cursor_close(mi->c);
-    mdb_txn_abort(mi->t);
-    mdb_env_close(mi->e);
+    if (mi->c)
+	mdb_cursor_close(mi->c);
+    if (mi->t)
+	mdb_txn_abort(mi->t);
+    if (mi->rt)
+	mdb_txn_abort(mi->rt);
+    if (mi->wt)
+	mdb_txn_abort(mi->wt);
+    if (mi->ref)
+	env_release(mi->ref);
     mi->c = 0;
     mi->t = 0;
+    mi->rt = 0;
+    mi->wt = 0;
     mi->e = 0;
+    mi->ref = 0;
     return 0;
 }
 
+/*
+ * Gets use one read transaction per handle that is renewed for each
+ * lookup and reset afterwards, rather than a new one every time.
+ */
+
+static int
+read_txn_begin(mdb_info *mi)
+{
+    if (mi->wt)
+	return 0;
+    if (mi->rt == NULL)
+	return mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->rt);
+    return mdb_txn_renew(mi->rt);
+}
+
+static void
+read_txn_end(mdb_info *mi)
+{
+    if (mi->wt == NULL)
+	mdb_txn_reset(mi->rt);
+}
+
 static krb5_error_code
 DB_destroy(krb5_context context, HDB *db)
 {
@@ -75,25 +159,76 @@ DB_destroy(krb5_context context, HDB *db)
     return ret;
 }
 
+/*
+ * A write lock holds one write transaction that all stores and
+ * removes go into until the outermost unlock commits it, or
+ * DB_rollback() aborts it.  Read locks only count, each get has its
+ * own snapshot.
+ */
+
 static krb5_error_code
 DB_lock(krb5_context context, HDB *db, int operation)
 {
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    int code;
+
+    if (db->lock_count == 0 && operation == HDB_WLOCK && !mi->rdonly) {
+	code = mdb_txn_begin(mi->e, NULL, 0, &mi->wt);
+	if (code) {
+	    krb5_set_error_message(context, HDB_ERR_CANT_LOCK_DB,
+				   "Can't lock %s: %s", db->hdb_name,
+				   mdb_strerror(code));
+	    return HDB_ERR_CANT_LOCK_DB;
+	}
+    }
     db->lock_count++;
     return 0;
 }
 
 static krb5_error_code
-DB_unlock(krb5_context context, HDB *db)
+unlock(krb5_context context, HDB *db, int commit)
 {
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    MDB_txn *txn = mi->wt;
+    int code = 0;
+
+    if (!commit)
+	mi->rollback = 1;
     if (db->lock_count > 1) {
 	db->lock_count--;
 	return 0;
     }
     heim_assert(db->lock_count == 1, "HDB lock/unlock sequence does not match");
     db->lock_count--;
+    commit = !mi->rollback;
+    mi->rollback = 0;
+    if (txn == NULL)
+	return 0;
+    mi->wt = NULL;
+    if (commit)
+	code = mdb_txn_commit(txn);
+    else
+	mdb_txn_abort(txn);
+    if (code) {
+	krb5_set_error_message(context, code, "Can't commit to %s: %s",
+			       db->hdb_name, mdb_strerror(code));
+	return code;
+    }
     return 0;
 }
 
+static krb5_error_code
+DB_unlock(krb5_context context, HDB *db)
+{
+    return unlock(context, db, 1);
+}
+
+static krb5_error_code
+DB_rollback(krb5_context context, HDB *db)
+{
+    return unlock(context, db, 0);
+}
+
 
 static krb5_error_code
 DB_seq(krb5_context context, HDB *db,
@@ -166,6 +301,103 @@ DB_nextkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
     return DB_seq(context, db, flags, entry, MDB_NEXT);
 }
 
+/*
+ * Walk the keys with a read transaction and cursor of our own and
+ * hand out the entries that hash into the shard.
+ */
+
+static krb5_error_code
+DB_foreach_shard(krb5_context context, HDB *db, unsigned shard,
+		 unsigned nshards, hdb_foreach_raw_func_t func, void *arg)
+{
+    mdb_info *mi = db->hdb_db;
+    MDB_txn *txn;
+    MDB_cursor *c;
+    MDB_val key, value;
+    krb5_data key_data, data;
+    krb5_error_code ret = 0;
+    int code;
+
+    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    if (code)
+	return code;
+    code = mdb_cursor_open(txn, mi->d, &c);
+    if (code) {
+	mdb_txn_abort(txn);
+	return code;
+    }
+
+    for (code = mdb_cursor_get(c, &key, &value, MDB_FIRST);
+	 code == 0;
+	 code = mdb_cursor_get(c, &key, &value, MDB_NEXT)) {
+	key_data.data = key.mv_data;
+	key_data.length = key.mv_size;
+	data.data = value.mv_data;
+	data.length = value.mv_size;
+	if (!_hdb_value_is_entry(&data) ||
+	    _hdb_key2shard(&key_data, nshards) != shard)
+	    continue;
+	ret = (*func)(context, db, &key_data, &data, arg);
+	if (ret)
+	    break;
+    }
+    mdb_cursor_close(c);
+    mdb_txn_abort(txn);
+    if (ret)
+	return ret;
+    if (code != MDB_NOTFOUND)
+	return code;
+    return 0;
+}
+
+/*
+ * The keys are encoded principals, which are not ordered by name, so
+ * all of them are looked at, but no entry is decoded.
+ */
+
+static krb5_error_code
+DB_foreach_name(krb5_context context, HDB *db, const char *prefix,
+		hdb_foreach_name_func_t func, void *arg)
+{
+    mdb_info *mi = db->hdb_db;
+    MDB_txn *txn;
+    MDB_cursor *c;
+    MDB_val key, value;
+    krb5_data key_data, data;
+    size_t prefix_len = strlen(prefix);
+    krb5_error_code ret = 0;
+    int code;
+
+    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    if (code)
+	return code;
+    code = mdb_cursor_open(txn, mi->d, &c);
+    if (code) {
+	mdb_txn_abort(txn);
+	return code;
+    }
+
+    for (code = mdb_cursor_get(c, &key, &value, MDB_FIRST);
+	 code == 0;
+	 code = mdb_cursor_get(c, &key, &value, MDB_NEXT)) {
+	key_data.data = key.mv_data;
+	key_data.length = key.mv_size;
+	data.data = value.mv_data;
+	data.length = value.mv_size;
+	ret = _hdb_foreach_name_key(context, db, &key_data, &data,
+				    prefix, prefix_len, func, arg);
+	if (ret)
+	    break;
+    }
+    mdb_cursor_close(c);
+    mdb_txn_abort(txn);
+    if (ret)
+	return ret;
+    if (code != MDB_NOTFOUND)
+	return code;
+    return 0;
+}
+
 static krb5_error_code
 DB_rename(krb5_context context, HDB *db, const char *new_name)
 {
@@ -189,27 +421,90 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+/*
+ * Every commit bumps the id of the last transaction in the environment,
+ * which is a better version than the modification time of the file.
+ */
+
 static krb5_error_code
-DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
+DB_get_stamp(krb5_context context, HDB *db, struct hdb_stamp *stamp)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    MDB_envinfo info;
+    krb5_error_code ret;
+    char *fn;
+
+    if (asprintf(&fn, "%s.mdb", db->hdb_name) == -1)
+	return krb5_enomem(context);
+    ret = _hdb_file_stamp(context, fn, stamp);
+    free(fn);
+    if (ret == 0 && mi->e && mdb_env_info(mi->e, &info) == 0)
+	stamp->version = (uint64_t)info.me_last_txnid + 1;
+    return ret;
+}
+
+/*
+ * Point `reply' at the value in the map, only valid while the read
+ * transaction is open.
+ */
+
+static krb5_error_code
+DB__borrow(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
-    MDB_txn *txn;
     MDB_val k, v;
     int code;
 
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    code = mdb_get(mi->wt ? mi->wt : mi->rt, mi->d, &k, &v);
+    if(code == MDB_NOTFOUND)
+	return HDB_ERR_NOENTRY;
     if (code)
 	return code;
+    reply->data = v.mv_data;
+    reply->length = v.mv_size;
+    return 0;
+}
+
+static krb5_error_code
+DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_data value;
+    int code;
 
-    code = mdb_get(txn, mi->d, &k, &v);
+    code = read_txn_begin(mi);
+    if (code)
+	return code;
+
+    code = DB__borrow(context, db, key, &value);
     if (code == 0)
-	krb5_data_copy(reply, v.mv_data, v.mv_size);
-    mdb_txn_abort(txn);
-    if(code == MDB_NOTFOUND)
-	return HDB_ERR_NOENTRY;
+	code = krb5_data_copy(reply, value.data, value.length);
+    read_txn_end(mi);
+    return code;
+}
+
+/*
+ * Decode the entry straight out of the map instead of copying the
+ * value first.
+ */
+
+static krb5_error_code
+DB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code code;
+
+    code = read_txn_begin(mi);
+    if (code)
+	return code;
+
+    code = _hdb_fetch_kvno_borrowed(context, db, principal, flags, kvno,
+				    entry, DB__borrow);
+    read_txn_end(mi);
     return code;
 }
 
@@ -227,15 +522,22 @@ DB__put(krb5_context context, HDB *db, int replace,
     v.mv_data = value.data;
     v.mv_size = value.length;
 
-    code = mdb_txn_begin(mi->e, NULL, 0, &txn);
-    if (code)
-	return code;
+    if (mi->rdonly)
+	return EACCES;
+    if (mi->wt)
+	code = mdb_put(mi->wt, mi->d, &k, &v,
+		       replace ? 0 : MDB_NOOVERWRITE);
+    else {
+	code = mdb_txn_begin(mi->e, NULL, 0, &txn);
+	if (code)
+	    return code;
 
-    code = mdb_put(txn, mi->d, &k, &v, replace ? 0 : MDB_NOOVERWRITE);
-    if (code)
-	mdb_txn_abort(txn);
-    else
-	code = mdb_txn_commit(txn);
+	code = mdb_put(txn, mi->d, &k, &v, replace ? 0 : MDB_NOOVERWRITE);
+	if (code)
+	    mdb_txn_abort(txn);
+	else
+	    code = mdb_txn_commit(txn);
+    }
     if(code == MDB_KEYEXIST)
 	return HDB_ERR_EXISTS;
     return code;
@@ -252,50 +554,86 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, 0, &txn);
-    if (code)
-	return code;
+    if (mi->rdonly)
+	return EACCES;
+    if (mi->wt)
+	code = mdb_del(mi->wt, mi->d, &k, NULL);
+    else {
+	code = mdb_txn_begin(mi->e, NULL, 0, &txn);
+	if (code)
+	    return code;
 
-    code = mdb_del(txn, mi->d, &k, NULL);
-    if (code)
-	mdb_txn_abort(txn);
-    else
-	code = mdb_txn_commit(txn);
+	code = mdb_del(txn, mi->d, &k, NULL);
+	if (code)
+	    mdb_txn_abort(txn);
+	else
+	    code = mdb_txn_commit(txn);
+    }
     if(code == MDB_NOTFOUND)
 	return HDB_ERR_NOENTRY;
     return code;
 }
 
+/*
+ * Find the environment of the file `fn', or open one.  A database that
+ * has been replaced gets an environment of its own; the old one goes
+ * away with the last handle that still uses it.
+ */
+
 static krb5_error_code
-DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
+env_get(krb5_context context, HDB *db, const char *fn, int rdonly,
+	mode_t mode, struct mdb_env_ref **refp)
 {
-    mdb_info *mi = (mdb_info *)db->hdb_db;
+    struct mdb_env_ref *ref = NULL;
+    struct stat sb;
     MDB_txn *txn;
-    char *fn;
     krb5_error_code ret;
-    int myflags = MDB_NOSUBDIR, tmp;
+    int tmp;
 
-    if((flags & O_ACCMODE) == O_RDONLY)
-      myflags |= MDB_RDONLY;
+    *refp = NULL;
 
-    if (asprintf(&fn, "%s.mdb", db->hdb_name) == -1) {
-	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
-	return ENOMEM;
+    HEIMDAL_MUTEX_lock(&env_mutex);
+    if (stat(fn, &sb) == 0) {
+	for (ref = envs; ref; ref = ref->next)
+	    if (ref->dev == sb.st_dev && ref->ino == sb.st_ino)
+		break;
     }
-    if (mdb_env_create(&mi->e)) {
-	free(fn);
-	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
-	return ENOMEM;
+    if (ref) {
+	if (ref->rdonly && !rdonly) {
+	    HEIMDAL_MUTEX_unlock(&env_mutex);
+	    krb5_set_error_message(context, EACCES,
+				   "%s is already open read-only in this "
+				   "process", db->hdb_name);
+	    return EACCES;
+	}
+	ref->refs++;
+	HEIMDAL_MUTEX_unlock(&env_mutex);
+	*refp = ref;
+	return 0;
+    }
+
+    ref = calloc(1, sizeof(*ref));
+    if (ref == NULL) {
+	HEIMDAL_MUTEX_unlock(&env_mutex);
+	return krb5_enomem(context);
+    }
+    /* others in this process may want to write even if we do not */
+    ref->rdonly = rdonly && access(fn, W_OK) != 0;
+
+    if (mdb_env_create(&ref->e)) {
+	HEIMDAL_MUTEX_unlock(&env_mutex);
+	free(ref);
+	return krb5_enomem(context);
     }
 
     tmp = krb5_config_get_int_default(context, NULL, 0, "kdc",
 	"hdb-mdb-maxreaders", NULL);
     if (tmp) {
-	ret = mdb_env_set_maxreaders(mi->e, tmp);
+	ret = mdb_env_set_maxreaders(ref->e, tmp);
 	if (ret) {
 	    krb5_set_error_message(context, ret, "setting maxreaders on %s: %s",
 		db->hdb_name, mdb_strerror(ret));
-	    return ret;
+	    goto fail;
 	}
     }
 
@@ -304,36 +642,67 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
     if (tmp) {
 	size_t maps = tmp;
 	maps *= KILO;
-	ret = mdb_env_set_mapsize(mi->e, maps);
+	ret = mdb_env_set_mapsize(ref->e, maps);
 	if (ret) {
 	    krb5_set_error_message(context, ret, "setting mapsize on %s: %s",
 		db->hdb_name, mdb_strerror(ret));
-	    return ret;
+	    goto fail;
 	}
     }
 
-    ret = mdb_env_open(mi->e, fn, myflags, mode);
+    ret = mdb_env_open(ref->e, fn,
+		       MDB_NOSUBDIR | MDB_NOTLS | (ref->rdonly ? MDB_RDONLY : 0),
+		       mode);
+    if (ret == 0)
+	ret = mdb_txn_begin(ref->e, NULL, MDB_RDONLY, &txn);
+    if (ret == 0) {
+	ret = mdb_open(txn, NULL, 0, &ref->d);
+	mdb_txn_abort(txn);
+    }
+    if (ret == 0 && stat(fn, &sb) != 0)
+	ret = errno;
     if (ret) {
-fail:
-	mdb_env_close(mi->e);
-	mi->e = 0;
-	free(fn);
 	krb5_set_error_message(context, ret, "opening %s: %s",
-			      db->hdb_name, mdb_strerror(ret));
-	return ret;
+			       db->hdb_name, mdb_strerror(ret));
+	goto fail;
     }
-    free(fn);
+    ref->dev = sb.st_dev;
+    ref->ino = sb.st_ino;
+    ref->refs = 1;
+    ref->next = envs;
+    envs = ref;
+    HEIMDAL_MUTEX_unlock(&env_mutex);
+    *refp = ref;
+    return 0;
 
-    ret = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
-    if (ret)
-	goto fail;
+fail:
+    HEIMDAL_MUTEX_unlock(&env_mutex);
+    mdb_env_close(ref->e);
+    free(ref);
+    return ret;
+}
 
-    ret = mdb_open(txn, NULL, 0, &mi->d);
-    mdb_txn_abort(txn);
+static krb5_error_code
+DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    char *fn;
+    krb5_error_code ret;
+
+    mi->rdonly = (flags & O_ACCMODE) == O_RDONLY;
+
+    if (asprintf(&fn, "%s.mdb", db->hdb_name) == -1) {
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+    ret = env_get(context, db, fn, mi->rdonly, mode, &mi->ref);
+    free(fn);
     if (ret)
-	goto fail;
+	return ret;
+    mi->e = mi->ref->e;
+    mi->d = mi->ref->d;
 
-    if((flags & O_ACCMODE) == O_RDONLY)
+    if (mi->rdonly)
 	ret = hdb_check_db_format(context, db);
     else
 	ret = hdb_init_db(context, db);
@@ -342,7 +711,7 @@ fail:
     if (ret) {
 	DB_close(context, db);
 	krb5_set_error_message(context, ret, "hdb_open: failed %s database %s",
-			       (flags & O_ACCMODE) == O_RDONLY ?
+			       mi->rdonly ?
 			       "checking format of" : "initialize",
 			       db->hdb_name);
     }
@@ -377,16 +746,22 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_KEEP_OPEN | HDB_CAP_F_FOREACH_SHARD | HDB_CAP_F_FOREACH_NAME |
+	HDB_CAP_F_STAMP | HDB_CAP_F_ROLLBACK;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
-    (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
+    (*db)->hdb_fetch_kvno = DB_fetch_kvno;
     (*db)->hdb_store = _hdb_store;
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
     (*db)->hdb_nextkey= DB_nextkey;
+    (*db)->hdb_foreach_shard = DB_foreach_shard;
+    (*db)->hdb_foreach_name = DB_foreach_name;
+    (*db)->hdb_get_stamp = DB_get_stamp;
     (*db)->hdb_lock = DB_lock;
     (*db)->hdb_unlock = DB_unlock;
+    (*db)->hdb_rollback = DB_rollback;
     (*db)->hdb_rename = DB_rename;
     (*db)->hdb__get = DB__get;
     (*db)->hdb__put = DB__put;
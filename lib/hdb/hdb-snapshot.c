@@ -0,0 +1,662 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hdb_locl.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/*
+ * A read-only database in a single file that is mapped into memory,
+ * meant for slave KDCs.  It holds the same keys and values as the db
+ * backends, so the fetch and alias logic in common.c is shared, and
+ * it is written in one go by hdb_write_snapshot() and moved in place
+ * with rename(), so a reader always sees a complete file.  Only the
+ * reader needs mmap(); snapshots can be written everywhere.
+ *
+ * The layout, all numbers 32 bits in network byte order:
+ *
+ *   header   magic "HDBSNAP\0", version, nslots, nkeys, table offset
+ *   records  key length, value length, key, value
+ *   table    nslots pairs of key hash and record offset
+ *
+ * The table is open addressed with linear probing and at most half
+ * full; a record offset of zero marks an empty slot.
+ */
+
+#define SNAP_MAGIC "HDBSNAP"
+#define SNAP_VERSION 1
+#define SNAP_HEADER_SIZE 24
+#define SNAP_SLOT_SIZE 8
+#define SNAP_RECORD_SIZE 8
+
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    uint32_t nslots;
+    uint32_t table;
+    uint32_t next;	/* firstkey/nextkey position */
+} snap_info;
+
+static uint32_t
+get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/* FNV-1a */
+static uint32_t
+snap_hash(const krb5_data *key)
+{
+    const unsigned char *p = key->data;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < key->length; i++) {
+	h ^= p[i];
+	h *= 16777619U;
+    }
+    return h;
+}
+
+#ifdef HAVE_MMAP
+
+/*
+ * Point `key' and `value' at the record at `off', checking that it is
+ * all inside the record area.
+ */
+
+static int
+snap_record(snap_info *si, uint32_t off, krb5_data *key, krb5_data *value)
+{
+    uint32_t klen, vlen;
+
+    if (off < SNAP_HEADER_SIZE || si->table - off < SNAP_RECORD_SIZE)
+	return HDB_ERR_UK_RERROR;
+    klen = get32(si->map + off);
+    vlen = get32(si->map + off + 4);
+    if (klen > si->table - off - SNAP_RECORD_SIZE ||
+	vlen > si->table - off - SNAP_RECORD_SIZE - klen)
+	return HDB_ERR_UK_RERROR;
+    key->data = si->map + off + SNAP_RECORD_SIZE;
+    key->length = klen;
+    value->data = si->map + off + SNAP_RECORD_SIZE + klen;
+    value->length = vlen;
+    return 0;
+}
+
+static krb5_error_code
+SNAP_close(krb5_context context, HDB *db)
+{
+    snap_info *si = (snap_info *)db->hdb_db;
+
+    if (si->map)
+	munmap(si->map, si->size);
+    si->map = NULL;
+    si->size = 0;
+    return 0;
+}
+
+static krb5_error_code
+SNAP_destroy(krb5_context context, HDB *db)
+{
+    krb5_error_code ret;
+
+    SNAP_close(context, db);
+    ret = hdb_clear_master_key (context, db);
+    free(db->hdb_db);
+    free(db->hdb_name);
+    free(db);
+    return ret;
+}
+
+static krb5_error_code
+SNAP_lock(krb5_context context, HDB *db, int operation)
+{
+    return 0;
+}
+
+static krb5_error_code
+SNAP_unlock(krb5_context context, HDB *db)
+{
+    return 0;
+}
+
+static krb5_error_code
+SNAP_open(krb5_context context, HDB *db, int flags, mode_t mode)
+{
+    snap_info *si = (snap_info *)db->hdb_db;
+    unsigned char *map;
+    struct stat sb;
+    uint32_t nslots, table;
+    int fd, ret;
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+	krb5_set_error_message(context, HDB_ERR_NO_WRITE_SUPPORT,
+			       "%s is a read-only snapshot", db->hdb_name);
+	return HDB_ERR_NO_WRITE_SUPPORT;
+    }
+
+    SNAP_close(context, db);
+
+    fd = open(db->hdb_name, O_RDONLY);
+    if (fd < 0) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "open %s: %s",
+			       db->hdb_name, strerror(ret));
+	return ret;
+    }
+    rk_cloexec(fd);
+    if (fstat(fd, &sb) < 0) {
+	ret = errno;
+	close(fd);
+	krb5_set_error_message(context, ret, "stat %s: %s",
+			       db->hdb_name, strerror(ret));
+	return ret;
+    }
+    if (sb.st_size < SNAP_HEADER_SIZE || sb.st_size > UINT32_MAX ||
+	(uint64_t)sb.st_size > SIZE_MAX) {
+	close(fd);
+	goto bad;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "mmap %s: %s",
+			       db->hdb_name, strerror(ret));
+	return ret;
+    }
+
+    nslots = get32(map + 12);
+    table = get32(map + 20);
+    if (memcmp(map, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+	get32(map + 8) != SNAP_VERSION ||
+	nslots == 0 || (nslots & (nslots - 1)) != 0 ||
+	table < SNAP_HEADER_SIZE ||
+	(uint64_t)table + (uint64_t)nslots * SNAP_SLOT_SIZE != (uint64_t)sb.st_size) {
+	munmap(map, sb.st_size);
+	goto bad;
+    }
+
+    si->map = map;
+    si->size = sb.st_size;
+    si->nslots = nslots;
+    si->table = table;
+    return 0;
+
+  bad:
+    krb5_set_error_message(context, HDB_ERR_BADVERSION,
+			   "%s is not a database snapshot", db->hdb_name);
+    return HDB_ERR_BADVERSION;
+}
+
+/*
+ * Find `key' and point `value' into the map.
+ */
+
+static krb5_error_code
+SNAP__borrow(krb5_context context, HDB *db, krb5_data key, krb5_data *value)
+{
+    snap_info *si = (snap_info *)db->hdb_db;
+    uint32_t h, i, n, off, mask;
+    krb5_data k;
+
+    if (si->map == NULL) {
+	krb5_set_error_message(context, HDB_ERR_MISUSE,
+			       "%s is not open", db->hdb_name);
+	return HDB_ERR_MISUSE;
+    }
+
+    h = snap_hash(&key);
+    mask = si->nslots - 1;
+    for (i = h & mask, n = 0; n < si->nslots; i = (i + 1) & mask, n++) {
+	const unsigned char *slot = si->map + si->table + i * SNAP_SLOT_SIZE;
+
+	off = get32(slot + 4);
+	if (off == 0)
+	    break;
+	if (get32(slot) != h)
+	    continue;
+	if (snap_record(si, off, &k, value))
+	    return HDB_ERR_UK_RERROR;
+	if (k.length == key.length && memcmp(k.data, key.data, k.length) == 0)
+	    return 0;
+    }
+    return HDB_ERR_NOENTRY;
+}
+
+static krb5_error_code
+SNAP__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
+{
+    krb5_error_code ret;
+    krb5_data value;
+
+    ret = SNAP__borrow(context, db, key, &value);
+    if (ret)
+	return ret;
+    return krb5_data_copy(reply, value.data, value.length);
+}
+
+static krb5_error_code
+SNAP__put(krb5_context context, HDB *db, int replace,
+	  krb5_data key, krb5_data value)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+static krb5_error_code
+SNAP__del(krb5_context context, HDB *db, krb5_data key)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+static krb5_error_code
+SNAP_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return _hdb_fetch_kvno_borrowed(context, db, principal, flags, kvno,
+				    entry, SNAP__borrow);
+}
+
+static krb5_error_code
+SNAP_store(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+static krb5_error_code
+SNAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+static krb5_error_code
+SNAP_nextkey(krb5_context context, HDB *db, unsigned flags,
+	     hdb_entry_ex *entry)
+{
+    snap_info *si = (snap_info *)db->hdb_db;
+    krb5_data key, value;
+    krb5_error_code ret;
+
+    if (si->map == NULL)
+	return HDB_ERR_NOENTRY;
+
+    memset(entry, 0, sizeof(*entry));
+    for (;;) {
+	if (si->next >= si->table)
+	    return HDB_ERR_NOENTRY;
+	ret = snap_record(si, si->next, &key, &value);
+	if (ret)
+	    return ret;
+	si->next += SNAP_RECORD_SIZE + key.length + value.length;
+	/* aliases don't decode as entries */
+	if (hdb_value2entry(context, &value, &entry->entry) == 0)
+	    break;
+    }
+
+    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+	ret = hdb_unseal_keys(context, db, &entry->entry);
+	if (ret) {
+	    hdb_free_entry(context, entry);
+	    return ret;
+	}
+    }
+    if (entry->entry.principal == NULL) {
+	entry->entry.principal = malloc(sizeof(*entry->entry.principal));
+	if (entry->entry.principal == NULL) {
+	    hdb_free_entry(context, entry);
+	    return krb5_enomem(context);
+	}
+	hdb_key2principal(context, &key, entry->entry.principal);
+    }
+    return 0;
+}
+
+/*
+ * Snapshots are only ever replaced as a whole, never written to.
+ */
+
+static krb5_error_code
+SNAP_get_stamp(krb5_context context, HDB *db, struct hdb_stamp *stamp)
+{
+    krb5_error_code ret;
+
+    ret = _hdb_file_stamp(context, db->hdb_name, stamp);
+    if (ret == 0)
+	stamp->version = 1;
+    return ret;
+}
+
+static krb5_error_code
+SNAP_firstkey(krb5_context context, HDB *db, unsigned flags,
+	      hdb_entry_ex *entry)
+{
+    snap_info *si = (snap_info *)db->hdb_db;
+
+    si->next = SNAP_HEADER_SIZE;
+    return SNAP_nextkey(context, db, flags, entry);
+}
+
+krb5_error_code
+hdb_snapshot_create(krb5_context context, HDB **db, const char *filename)
+{
+    *db = calloc(1, sizeof(**db));
+    if (*db == NULL)
+	return krb5_enomem(context);
+
+    (*db)->hdb_db = calloc(1, sizeof(snap_info));
+    (*db)->hdb_name = strdup(filename);
+    if ((*db)->hdb_db == NULL || (*db)->hdb_name == NULL) {
+	free((*db)->hdb_db);
+	free((*db)->hdb_name);
+	free(*db);
+	*db = NULL;
+	return krb5_enomem(context);
+    }
+
+    (*db)->hdb_master_key_set = 0;
+    (*db)->hdb_openp = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_KEEP_OPEN | HDB_CAP_F_STAMP;
+    (*db)->hdb_open = SNAP_open;
+    (*db)->hdb_close = SNAP_close;
+    (*db)->hdb_fetch_kvno = SNAP_fetch_kvno;
+    (*db)->hdb_store = SNAP_store;
+    (*db)->hdb_remove = SNAP_remove;
+    (*db)->hdb_firstkey = SNAP_firstkey;
+    (*db)->hdb_nextkey = SNAP_nextkey;
+    (*db)->hdb_get_stamp = SNAP_get_stamp;
+    (*db)->hdb_lock = SNAP_lock;
+    (*db)->hdb_unlock = SNAP_unlock;
+    (*db)->hdb_rename = NULL;
+    (*db)->hdb__get = SNAP__get;
+    (*db)->hdb__put = SNAP__put;
+    (*db)->hdb__del = SNAP__del;
+    (*db)->hdb_destroy = SNAP_destroy;
+
+    return 0;
+}
+
+#endif /* HAVE_MMAP */
+
+/*
+ * Writing a snapshot: the records are streamed out as the source
+ * database is walked, only the hash and offset of each key is kept in
+ * memory, and the table and header go in at the end.
+ */
+
+static krb5_error_code
+snap_errno(krb5_context context, const char *what, const char *fn)
+{
+    krb5_error_code ret = errno ? errno : EIO;
+
+    krb5_set_error_message(context, ret, "%s %s: %s", what, fn, strerror(ret));
+    return ret;
+}
+
+struct snap_writer {
+    const char *fn;
+    FILE *f;
+    uint32_t offset;
+    size_t nkeys;
+    size_t alloc;
+    uint32_t *hashes;
+    uint32_t *offsets;
+};
+
+static krb5_error_code
+snap_write_record(krb5_context context, struct snap_writer *w,
+		  const krb5_data *key, const krb5_data *value)
+{
+    unsigned char hdr[SNAP_RECORD_SIZE];
+    uint64_t size;
+
+    size = (uint64_t)w->offset + SNAP_RECORD_SIZE + key->length + value->length;
+    if (size > UINT32_MAX) {
+	krb5_set_error_message(context, EFBIG, "snapshot too large");
+	return EFBIG;
+    }
+
+    if (w->nkeys == w->alloc) {
+	size_t n = w->alloc ? w->alloc * 2 : 1024;
+	uint32_t *h, *o;
+
+	h = realloc(w->hashes, n * sizeof(w->hashes[0]));
+	if (h == NULL)
+	    return krb5_enomem(context);
+	w->hashes = h;
+	o = realloc(w->offsets, n * sizeof(w->offsets[0]));
+	if (o == NULL)
+	    return krb5_enomem(context);
+	w->offsets = o;
+	w->alloc = n;
+    }
+
+    put32(hdr, key->length);
+    put32(hdr + 4, value->length);
+    if (fwrite(hdr, sizeof(hdr), 1, w->f) != 1 ||
+	fwrite(key->data, key->length, 1, w->f) != 1 ||
+	(value->length && fwrite(value->data, value->length, 1, w->f) != 1))
+	return snap_errno(context, "write", w->fn);
+
+    w->hashes[w->nkeys] = snap_hash(key);
+    w->offsets[w->nkeys] = w->offset;
+    w->nkeys++;
+    w->offset = size;
+    return 0;
+}
+
+static krb5_error_code
+snap_write_entry(krb5_context context, HDB *db, hdb_entry_ex *entry,
+		 void *data)
+{
+    struct snap_writer *w = data;
+    const HDB_Ext_Aliases *aliases;
+    hdb_entry_alias alias;
+    krb5_data key, value, avalue;
+    krb5_error_code ret;
+    size_t i;
+
+    ret = hdb_principal2key(context, entry->entry.principal, &key);
+    if (ret)
+	return ret;
+    ret = hdb_entry2value(context, &entry->entry, &value);
+    if (ret) {
+	krb5_data_free(&key);
+	return ret;
+    }
+    ret = snap_write_record(context, w, &key, &value);
+    krb5_data_free(&key);
+    krb5_data_free(&value);
+    if (ret)
+	return ret;
+
+    ret = hdb_entry_get_aliases(&entry->entry, &aliases);
+    if (ret || aliases == NULL)
+	return ret;
+
+    alias.principal = entry->entry.principal;
+    ret = hdb_entry_alias2value(context, &alias, &avalue);
+    if (ret)
+	return ret;
+    for (i = 0; ret == 0 && i < aliases->aliases.len; i++) {
+	ret = hdb_principal2key(context, &aliases->aliases.val[i], &key);
+	if (ret)
+	    break;
+	ret = snap_write_record(context, w, &key, &avalue);
+	krb5_data_free(&key);
+    }
+    krb5_data_free(&avalue);
+    return ret;
+}
+
+/**
+ * Write all of `db' to a read-only snapshot in `filename' that can be
+ * used with the snapshot: backend.  The file is written next to
+ * `filename' and renamed over it when complete, so readers never see
+ * a partial snapshot.  The keys stay sealed with the master key of
+ * `db'.
+ *
+ * @param context   Kerberos 5 context
+ * @param db        an open database to copy
+ * @param filename  where to put the snapshot
+ * @param mode      permissions of a new snapshot, an existing one
+ *                  keeps its own
+ *
+ * @return 0 on success, an error code if not
+ */
+
+krb5_error_code
+hdb_write_snapshot(krb5_context context, HDB *db, const char *filename,
+		   mode_t mode)
+{
+    unsigned char hdr[SNAP_HEADER_SIZE];
+    unsigned char *table = NULL;
+    struct snap_writer w;
+    struct stat sb;
+    krb5_error_code ret;
+    uint32_t nslots, mask, i;
+    char *tmp = NULL;
+    size_t n;
+    int fd;
+
+    memset(&w, 0, sizeof(w));
+
+    if (asprintf(&tmp, "%s.XXXXXX", filename) == -1 || tmp == NULL)
+	return krb5_enomem(context);
+    w.fn = tmp;
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	ret = snap_errno(context, "mkstemp", tmp);
+	free(tmp);
+	return ret;
+    }
+    w.f = fdopen(fd, "w");
+    if (w.f == NULL) {
+	ret = snap_errno(context, "fdopen", tmp);
+	close(fd);
+	goto out;
+    }
+
+    /* the header is filled in last */
+    memset(hdr, 0, sizeof(hdr));
+    if (fwrite(hdr, sizeof(hdr), 1, w.f) != 1) {
+	ret = snap_errno(context, "write", tmp);
+	goto out;
+    }
+    w.offset = SNAP_HEADER_SIZE;
+
+    ret = hdb_foreach(context, db, HDB_F_ADMIN_DATA, snap_write_entry, &w);
+    if (ret)
+	goto out;
+
+    for (nslots = 16; nslots / 2 < w.nkeys; nslots *= 2) {
+	if (nslots > UINT32_MAX / 2 / SNAP_SLOT_SIZE) {
+	    ret = EFBIG;
+	    krb5_set_error_message(context, ret, "snapshot too large");
+	    goto out;
+	}
+    }
+    if ((uint64_t)w.offset + (uint64_t)nslots * SNAP_SLOT_SIZE > UINT32_MAX) {
+	ret = EFBIG;
+	krb5_set_error_message(context, ret, "snapshot too large");
+	goto out;
+    }
+
+    table = calloc(nslots, SNAP_SLOT_SIZE);
+    if (table == NULL) {
+	ret = krb5_enomem(context);
+	goto out;
+    }
+    mask = nslots - 1;
+    for (n = 0; n < w.nkeys; n++) {
+	for (i = w.hashes[n] & mask;
+	     get32(table + i * SNAP_SLOT_SIZE + 4) != 0;
+	     i = (i + 1) & mask)
+	    ;
+	put32(table + i * SNAP_SLOT_SIZE, w.hashes[n]);
+	put32(table + i * SNAP_SLOT_SIZE + 4, w.offsets[n]);
+    }
+
+    memcpy(hdr, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    put32(hdr + 8, SNAP_VERSION);
+    put32(hdr + 12, nslots);
+    put32(hdr + 16, w.nkeys);
+    put32(hdr + 20, w.offset);
+
+    if (fwrite(table, SNAP_SLOT_SIZE, nslots, w.f) != nslots ||
+	fseek(w.f, 0, SEEK_SET) != 0 ||
+	fwrite(hdr, sizeof(hdr), 1, w.f) != 1 ||
+	fflush(w.f) != 0 ||
+	fsync(fileno(w.f)) != 0) {
+	ret = snap_errno(context, "write", tmp);
+	goto out;
+    }
+    ret = fclose(w.f);
+    w.f = NULL;
+    if (ret) {
+	ret = snap_errno(context, "close", tmp);
+	goto out;
+    }
+
+    /* mkstemp() makes the file 0600 whatever the caller asked for */
+    if (stat(filename, &sb) == 0)
+	mode = sb.st_mode & 07777;
+    if (chmod(tmp, mode) < 0)
+	ret = snap_errno(context, "chmod", tmp);
+    else if (rk_rename(tmp, filename) < 0)
+	ret = snap_errno(context, "rename", tmp);
+
+  out:
+    if (w.f)
+	fclose(w.f);
+    if (ret)
+	unlink(tmp);
+    free(tmp);
+    free(table);
+    free(w.hashes);
+    free(w.offsets);
+    return ret;
+}
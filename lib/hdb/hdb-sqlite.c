@@ -40,6 +40,9 @@ typedef struct hdb_sqlite_db {
     double version;
     sqlite3 *db;
     char *db_file;
+    dev_t dev;		/* of the file db was opened on */
+    ino_t ino;
+    int rollback;	/* the outermost unlock rolls back */
 
     sqlite3_stmt *get_version;
     sqlite3_stmt *fetch;
@@ -59,6 +62,9 @@ typedef struct hdb_sqlite_db {
  * compatibility is not broken. */
 #define HDBSQLITE_VERSION 0.1
 
+/* How long sqlite waits on a lock itself before returning SQLITE_BUSY */
+#define HDBSQLITE_BUSY_TIMEOUT 1000
+
 #define _HDBSQLITE_STRINGIFY(x) #x
 #define HDBSQLITE_STRINGIFY(x) _HDBSQLITE_STRINGIFY(x)
 
@@ -82,6 +88,9 @@ typedef struct hdb_sqlite_db {
                  "  DELETE FROM Principal" \
                  "  WHERE entry = OLD.id;" \
                  " END"
+#define HDBSQLITE_CREATE_INDEXES \
+                 " CREATE INDEX IF NOT EXISTS Principal_entry" \
+                 "  ON Principal (entry)"
 #define HDBSQLITE_GET_VERSION \
                  " SELECT number FROM Version"
 #define HDBSQLITE_FETCH \
@@ -111,6 +120,16 @@ typedef struct hdb_sqlite_db {
                  "   WHERE principal = ?)"
 #define HDBSQLITE_GET_ALL_ENTRIES \
                  " SELECT data FROM Entry"
+#define HDBSQLITE_GET_ID_RANGE \
+                 " SELECT min(id), max(id) FROM Entry"
+#define HDBSQLITE_GET_ID_SHARD \
+                 " SELECT data FROM Entry WHERE id BETWEEN ? AND ?"
+#define HDBSQLITE_GET_NAMES_FROM \
+                 " SELECT principal FROM Principal" \
+                 " WHERE principal >= ? AND canonical = 1"
+#define HDBSQLITE_GET_NAMES_RANGE \
+                 " SELECT principal FROM Principal" \
+                 " WHERE principal >= ? AND principal < ? AND canonical = 1"
 
 /**
  * Wrapper around sqlite3_prepare_v2.
@@ -221,6 +240,7 @@ hdb_sqlite_open_database(krb5_context context, HDB *db, int flags)
 {
     int ret;
     hdb_sqlite_db *hsdb = (hdb_sqlite_db*) db->hdb_db;
+    struct stat sb;
 
     ret = sqlite3_open_v2(hsdb->db_file, &hsdb->db,
                           SQLITE_OPEN_READWRITE | flags, NULL);
@@ -238,9 +258,57 @@ hdb_sqlite_open_database(krb5_context context, HDB *db, int flags)
         return ret;
     }
 
+    sqlite3_busy_timeout(hsdb->db, HDBSQLITE_BUSY_TIMEOUT);
+
+    if (stat(hsdb->db_file, &sb) == 0) {
+        hsdb->dev = sb.st_dev;
+        hsdb->ino = sb.st_ino;
+    }
+
     return 0;
 }
 
+/**
+ * Sets the journal mode from [kdc]hdb-sqlite-journal-mode.  The
+ * default is WAL, which lets readers such as the KDC go on while
+ * kadmind or ipropd-slave is writing.
+ *
+ * @param context The current krb5 context
+ * @param db      Heimdal database handle
+ *
+ * @return        0 if OK, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_set_journal_mode(krb5_context context, HDB *db)
+{
+    static const char *modes[] = {
+	"delete", "truncate", "persist", "memory", "wal", "off"
+    };
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    const char *mode;
+    char *stmt;
+    size_t i;
+    int ret;
+
+    mode = krb5_config_get_string_default(context, NULL, "wal", "kdc",
+					  "hdb-sqlite-journal-mode", NULL);
+    for (i = 0; i < sizeof(modes)/sizeof(modes[0]); i++)
+	if (strcasecmp(mode, modes[i]) == 0)
+	    break;
+    if (i == sizeof(modes)/sizeof(modes[0])) {
+	krb5_set_error_message(context, EINVAL,
+			       "Unknown sqlite journal mode: %s", mode);
+	return EINVAL;
+    }
+
+    if (asprintf(&stmt, "PRAGMA journal_mode = %s", modes[i]) == -1 ||
+	stmt == NULL)
+	return krb5_enomem(context);
+    ret = hdb_sqlite_exec_stmt(context, hsdb->db, stmt, EINVAL);
+    free(stmt);
+    return ret;
+}
+
 static int
 hdb_sqlite_step(krb5_context context, sqlite3 *db, sqlite3_stmt *stmt)
 {
@@ -304,6 +372,10 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
     hsdb->db_file = strdup(filename);
     if(hsdb->db_file == NULL)
         return ENOMEM;
+    free(db->hdb_name);
+    db->hdb_name = strdup(filename);
+    if(db->hdb_name == NULL)
+        return ENOMEM;
 
     ret = hdb_sqlite_open_database(context, db, 0);
     if (ret) {
@@ -516,19 +588,36 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
     int i;
     sqlite_int64 entry_id;
     const HDB_Ext_Aliases *aliases;
+    const char *begin, *commit, *rollback;
 
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
     krb5_data value;
     sqlite3_stmt *get_ids = hsdb->get_ids;
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb->db,
-                               "BEGIN IMMEDIATE TRANSACTION", EINVAL);
+    krb5_data_zero(&value);
+
+    /*
+     * Under hdb_lock() we are already inside a transaction that
+     * hdb_unlock() commits, so only use a savepoint to be able to
+     * undo this one entry.
+     */
+    if (db->lock_count > 0) {
+        begin = "SAVEPOINT hdb_sqlite_store";
+        commit = "RELEASE hdb_sqlite_store";
+        rollback = "ROLLBACK TO hdb_sqlite_store; RELEASE hdb_sqlite_store";
+    } else {
+        begin = "BEGIN IMMEDIATE TRANSACTION";
+        commit = "COMMIT";
+        rollback = "ROLLBACK";
+    }
+
+    ret = hdb_sqlite_exec_stmt(context, hsdb->db, begin, EINVAL);
     if(ret != SQLITE_OK) {
 	ret = EINVAL;
         krb5_set_error_message(context, ret,
 			       "SQLite BEGIN TRANSACTION failed: %s",
 			       sqlite3_errmsg(hsdb->db));
-        goto rollback;
+        return ret;
     }
 
     ret = hdb_seal_keys(context, db, &entry->entry);
@@ -543,7 +632,7 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
 
     ret = bind_principal(context, entry->entry.principal, get_ids, 1);
     if (ret)
-	return ret;
+	goto rollback;
 
     ret = hdb_sqlite_step(context, hsdb->db, get_ids);
 
@@ -555,7 +644,7 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
         sqlite3_clear_bindings(hsdb->add_entry);
         sqlite3_reset(hsdb->add_entry);
         if(ret != SQLITE_DONE)
-            goto rollback;
+            goto sqlite_error;
 
 	ret = bind_principal(context, entry->entry.principal, hsdb->add_principal, 1);
 	if (ret)
@@ -565,32 +654,34 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
         sqlite3_clear_bindings(hsdb->add_principal);
         sqlite3_reset(hsdb->add_principal);
         if(ret != SQLITE_DONE)
-            goto rollback;
+            goto sqlite_error;
 
         entry_id = sqlite3_column_int64(get_ids, 1);
 
     } else if(ret == SQLITE_ROW) { /* Found a principal */
 
-        if(! (flags & HDB_F_REPLACE)) /* Not allowed to replace it */
+        if(! (flags & HDB_F_REPLACE)) { /* Not allowed to replace it */
+            ret = HDB_ERR_EXISTS;
             goto rollback;
+        }
 
         entry_id = sqlite3_column_int64(get_ids, 1);
 
         sqlite3_bind_int64(hsdb->delete_aliases, 1, entry_id);
         ret = hdb_sqlite_step_once(context, db, hsdb->delete_aliases);
         if(ret != SQLITE_DONE)
-            goto rollback;
+            goto sqlite_error;
 
         sqlite3_bind_blob(hsdb->update_entry, 1,
                           value.data, value.length, SQLITE_STATIC);
         sqlite3_bind_int64(hsdb->update_entry, 2, entry_id);
         ret = hdb_sqlite_step_once(context, db, hsdb->update_entry);
         if(ret != SQLITE_DONE)
-            goto rollback;
+            goto sqlite_error;
 
     } else {
 	/* Error! */
-        goto rollback;
+        goto sqlite_error;
     }
 
     ret = hdb_entry_get_aliases(&entry->entry, &aliases);
@@ -607,7 +698,7 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
         ret = hdb_sqlite_step_once(context, db, hsdb->add_alias);
 
         if(ret != SQLITE_DONE)
-            goto rollback;
+            goto sqlite_error;
     }
 
     ret = 0;
@@ -619,20 +710,29 @@ commit:
     sqlite3_clear_bindings(get_ids);
     sqlite3_reset(get_ids);
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb->db, "COMMIT", EINVAL);
+    ret = hdb_sqlite_exec_stmt(context, hsdb->db, commit, EINVAL);
     if(ret != SQLITE_OK)
 	krb5_warnx(context, "hdb-sqlite: COMMIT problem: %d: %s",
 		   ret, sqlite3_errmsg(hsdb->db));
 
     return ret;
 
-rollback:
+sqlite_error:
 
     krb5_warnx(context, "hdb-sqlite: store rollback problem: %d: %s",
 	       ret, sqlite3_errmsg(hsdb->db));
+    ret = EINVAL;
+    krb5_set_error_message(context, ret, "SQLite store failed: %s",
+			   sqlite3_errmsg(hsdb->db));
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb->db,
-                               "ROLLBACK", EINVAL);
+rollback:
+
+    krb5_data_free(&value);
+
+    sqlite3_clear_bindings(get_ids);
+    sqlite3_reset(get_ids);
+
+    (void) hdb_sqlite_exec_stmt(context, hsdb->db, rollback, 0);
     return ret;
 }
 
@@ -657,18 +757,60 @@ hdb_sqlite_close(krb5_context context, HDB *db)
 /**
  * The opposite of hdb_sqlite_close. Since SQLite accepts
  * many open handles to the database file the handle does not
- * need to be closed, or reopened.
+ * need to be closed, or reopened, unless the file has been
+ * replaced meanwhile.  O_TRUNC empties the database.
  *
  * @param context The current krb5 context
  * @param db      Heimdal database handle
  * @param flags
  * @param mode_t
  *
- * @return        Always returns 0
+ * @return        0 on success, an error code if not
  */
 static krb5_error_code
 hdb_sqlite_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    struct stat sb;
+    char *fn;
+    int ret;
+
+    if (stat(hsdb->db_file, &sb) == 0 &&
+        (sb.st_dev != hsdb->dev || sb.st_ino != hsdb->ino)) {
+        fn = hsdb->db_file;
+        hdb_sqlite_close_database(context, db);
+        ret = hdb_sqlite_make_database(context, db, fn);
+        free(fn);
+        if (ret)
+            return ret;
+    }
+
+    if ((flags & O_ACCMODE) == O_RDONLY)
+        return 0;
+
+    /*
+     * The journal mode is kept in the database file, so only writers
+     * set it; a reader like the KDC may not be allowed to create the
+     * -wal and -shm files next to it.
+     */
+    ret = hdb_sqlite_set_journal_mode(context, db);
+    if (ret)
+        krb5_warn(context, ret, "hdb-sqlite: setting journal mode of %s",
+                  hsdb->db_file);
+
+    /*
+     * Alias deletion and the remove_principals trigger look up
+     * principals by entry, which only writers do.  Databases made
+     * before the index existed get it here; if that fails they just
+     * stay slower.
+     */
+    (void) hdb_sqlite_exec_stmt(context, hsdb->db,
+                                HDBSQLITE_CREATE_INDEXES, 0);
+
+    /* The remove_principals trigger takes the Principal rows along */
+    if (flags & O_TRUNC)
+        return hdb_sqlite_exec_stmt(context, hsdb->db,
+                                    "DELETE FROM Entry", EINVAL);
     return 0;
 }
 
@@ -693,6 +835,7 @@ hdb_sqlite_destroy(krb5_context context, HDB *db)
     hsdb = (hdb_sqlite_db*)(db->hdb_db);
 
     free(hsdb->db_file);
+    free(db->hdb_name);
     free(db->hdb_db);
     free(db);
 
@@ -700,25 +843,72 @@ hdb_sqlite_destroy(krb5_context context, HDB *db)
 }
 
 /*
- * Not sure if this is needed.
+ * A lock holds a transaction open until the matching unlock, so that
+ * everything stored in between, e.g. by kadmin load, is committed at
+ * once instead of one fsync per entry.  A write lock takes the sqlite
+ * write lock up front, a read lock just gets a consistent snapshot.
  */
 static krb5_error_code
 hdb_sqlite_lock(krb5_context context, HDB *db, int operation)
 {
-    krb5_set_error_message(context, HDB_ERR_CANT_LOCK_DB,
-			   "lock not implemented");
-    return HDB_ERR_CANT_LOCK_DB;
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+    krb5_error_code ret;
+
+    if (db->lock_count > 0) {
+	if (operation == HDB_WLOCK && db->lock_type != HDB_WLOCK) {
+	    krb5_set_error_message(context, HDB_ERR_CANT_LOCK_DB,
+				   "Can't upgrade read lock on %s",
+				   db->hdb_name);
+	    return HDB_ERR_CANT_LOCK_DB;
+	}
+	db->lock_count++;
+	return 0;
+    }
+
+    ret = hdb_sqlite_exec_stmt(context, hsdb->db,
+			       operation == HDB_WLOCK ?
+			       "BEGIN IMMEDIATE TRANSACTION" :
+			       "BEGIN TRANSACTION",
+			       HDB_ERR_CANT_LOCK_DB);
+    if (ret)
+	return ret;
+    hsdb->rollback = 0;
+    db->lock_type = operation;
+    db->lock_count++;
+    return 0;
 }
 
 /*
- * Not sure if this is needed.
+ * Commits the transaction started by the outermost lock, unless some
+ * unlock along the way was a rollback.
  */
 static krb5_error_code
 hdb_sqlite_unlock(krb5_context context, HDB *db)
 {
-    krb5_set_error_message(context, HDB_ERR_CANT_LOCK_DB,
-			  "unlock not implemented");
-    return HDB_ERR_CANT_LOCK_DB;
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+    krb5_error_code ret;
+
+    heim_assert(db->lock_count > 0, "HDB lock/unlock sequence does not match");
+    if (--db->lock_count > 0)
+	return 0;
+
+    if (hsdb->rollback) {
+	hsdb->rollback = 0;
+	return hdb_sqlite_exec_stmt(context, hsdb->db, "ROLLBACK", EINVAL);
+    }
+    ret = hdb_sqlite_exec_stmt(context, hsdb->db, "COMMIT", EINVAL);
+    if (ret)
+	(void) hdb_sqlite_exec_stmt(context, hsdb->db, "ROLLBACK", 0);
+    return ret;
+}
+
+static krb5_error_code
+hdb_sqlite_rollback(krb5_context context, HDB *db)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+
+    hsdb->rollback = 1;
+    return hdb_sqlite_unlock(context, db);
 }
 
 /*
@@ -775,6 +965,173 @@ hdb_sqlite_firstkey(krb5_context context, HDB *db, unsigned flags,
     return 0;
 }
 
+/*
+ * Iterates over one shard of the entries.  The shards are ranges of
+ * Entry ids rather than hash buckets, so each handle only reads its
+ * part of the table.
+ */
+static krb5_error_code
+hdb_sqlite_foreach_shard(krb5_context context, HDB *db, unsigned shard,
+                         unsigned nshards, hdb_foreach_raw_func_t func,
+                         void *arg)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 lo, hi, step;
+    krb5_data key, value;
+    krb5_error_code ret;
+    int sqlite_error;
+
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db, &stmt,
+                                  HDBSQLITE_GET_ID_RANGE);
+    if (ret)
+        return ret;
+    sqlite_error = hdb_sqlite_step(context, hsdb->db, stmt);
+    if (sqlite_error != SQLITE_ROW ||
+        sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+        /* no entries */
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    lo = sqlite3_column_int64(stmt, 0);
+    hi = sqlite3_column_int64(stmt, 1);
+    sqlite3_finalize(stmt);
+
+    step = (hi - lo) / nshards + 1;
+    lo += step * shard;
+    if (shard + 1 < nshards && lo + step - 1 < hi)
+        hi = lo + step - 1;
+    if (lo > hi)
+        return 0;
+
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db, &stmt,
+                                  HDBSQLITE_GET_ID_SHARD);
+    if (ret)
+        return ret;
+    sqlite3_bind_int64(stmt, 1, lo);
+    sqlite3_bind_int64(stmt, 2, hi);
+
+    krb5_data_zero(&key);
+    while ((sqlite_error = hdb_sqlite_step(context, hsdb->db, stmt)) ==
+           SQLITE_ROW) {
+        value.length = sqlite3_column_bytes(stmt, 0);
+        value.data = (void *) sqlite3_column_blob(stmt, 0);
+        ret = (*func)(context, db, &key, &value, arg);
+        if (ret)
+            break;
+    }
+    if (ret == 0 && sqlite_error != SQLITE_DONE) {
+        ret = EINVAL;
+        krb5_set_error_message(context, ret,
+                               "sqlite iteration failed: %s",
+                               sqlite3_errmsg(hsdb->db));
+    }
+    sqlite3_finalize(stmt);
+
+    return ret;
+}
+
+/*
+ * Lists the canonical names starting with prefix from the index on
+ * Principal.principal, which compares names bytewise, so the names
+ * with the prefix are those from the prefix up to (not including)
+ * the prefix with its last byte (that is not 0xff) incremented.
+ */
+static krb5_error_code
+hdb_sqlite_foreach_name(krb5_context context, HDB *db, const char *prefix,
+                        hdb_foreach_name_func_t func, void *arg)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    sqlite3_stmt *stmt;
+    krb5_error_code ret;
+    char *end;
+    size_t len;
+    int sqlite_error;
+
+    end = strdup(prefix);
+    if (end == NULL)
+        return krb5_enomem(context);
+    for (len = strlen(end); len > 0; len--) {
+        if ((unsigned char)end[len - 1] != 0xff) {
+            end[len - 1]++;
+            break;
+        }
+    }
+    end[len] = '\0';
+
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db, &stmt,
+                                  len ? HDBSQLITE_GET_NAMES_RANGE :
+                                  HDBSQLITE_GET_NAMES_FROM);
+    if (ret) {
+        free(end);
+        return ret;
+    }
+    sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC);
+    if (len)
+        sqlite3_bind_text(stmt, 2, end, -1, SQLITE_STATIC);
+
+    while ((sqlite_error = hdb_sqlite_step(context, hsdb->db, stmt)) ==
+           SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+
+        if (name == NULL)
+            continue;
+        ret = (*func)(context, db, name, arg);
+        if (ret)
+            break;
+    }
+    if (ret == 0 && sqlite_error != SQLITE_DONE) {
+        ret = EINVAL;
+        krb5_set_error_message(context, ret,
+                               "sqlite iteration failed: %s",
+                               sqlite3_errmsg(hsdb->db));
+    }
+    sqlite3_finalize(stmt);
+    free(end);
+
+    return ret;
+}
+
+/*
+ * PRAGMA data_version changes whenever another connection commits.
+ * Older sqlite versions don't have it, then the -wal file is stamped
+ * along with the database, since that is where the writes go first.
+ */
+static krb5_error_code
+hdb_sqlite_get_stamp(krb5_context context, HDB *db, struct hdb_stamp *stamp)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    struct hdb_stamp wal;
+    sqlite3_stmt *stmt;
+    krb5_error_code ret;
+    char *fn;
+
+    ret = _hdb_file_stamp(context, hsdb->db_file, stamp);
+    if (ret)
+        return ret;
+
+    if (hsdb->db && sqlite3_prepare_v2(hsdb->db, "PRAGMA data_version", -1,
+                                       &stmt, NULL) == SQLITE_OK) {
+        ret = hdb_sqlite_step(context, hsdb->db, stmt);
+        if (ret == SQLITE_ROW)
+            stamp->version = (uint64_t)sqlite3_column_int64(stmt, 0) + 1;
+        sqlite3_finalize(stmt);
+        if (ret == SQLITE_ROW)
+            return 0;
+    }
+
+    if (asprintf(&fn, "%s-wal", hsdb->db_file) == -1 || fn == NULL)
+        return krb5_enomem(context);
+    if (_hdb_file_stamp(context, fn, &wal) == 0) {
+        if (wal.version == 0)
+            stamp->version = 0;
+        else if (stamp->version)
+            stamp->version = stamp->version * 31 + wal.version;
+    }
+    free(fn);
+    return 0;
+}
+
 /*
  * Renames the database file.
  */
@@ -859,6 +1216,7 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *argument)
     /* XXX make_database should make sure everything else is freed on error */
     ret = hdb_sqlite_make_database(context, *db, argument);
     if (ret) {
+        free((*db)->hdb_name);
         free((*db)->hdb_db);
         free(*db);
 
@@ -867,15 +1225,21 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *argument)
 
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_KEEP_OPEN |
+        HDB_CAP_F_FOREACH_SHARD | HDB_CAP_F_FOREACH_NAME |
+        HDB_CAP_F_PARALLEL_WALK | HDB_CAP_F_STAMP | HDB_CAP_F_ROLLBACK;
 
     (*db)->hdb_open = hdb_sqlite_open;
     (*db)->hdb_close = hdb_sqlite_close;
 
     (*db)->hdb_lock = hdb_sqlite_lock;
     (*db)->hdb_unlock = hdb_sqlite_unlock;
+    (*db)->hdb_rollback = hdb_sqlite_rollback;
     (*db)->hdb_firstkey = hdb_sqlite_firstkey;
     (*db)->hdb_nextkey = hdb_sqlite_nextkey;
+    (*db)->hdb_foreach_shard = hdb_sqlite_foreach_shard;
+    (*db)->hdb_foreach_name = hdb_sqlite_foreach_name;
+    (*db)->hdb_get_stamp = hdb_sqlite_get_stamp;
     (*db)->hdb_fetch_kvno = hdb_sqlite_fetch_kvno;
     (*db)->hdb_store = hdb_sqlite_store;
     (*db)->hdb_remove = hdb_sqlite_remove;
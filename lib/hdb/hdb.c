@@ -83,6 +83,9 @@ static struct hdb_method methods[] = {
 #endif
 #ifdef HAVE_SQLITE3
     { HDB_INTERFACE_VERSION, NULL, NULL, "sqlite:", hdb_sqlite_create},
+#endif
+#ifdef HAVE_MMAP
+    { HDB_INTERFACE_VERSION, NULL, NULL, "snapshot:", hdb_snapshot_create},
 #endif
     { 0, NULL, NULL, NULL, NULL}
 };
@@ -232,6 +235,199 @@ hdb_foreach(krb5_context context,
     return ret;
 }
 
+/*
+ * The shard of an entry for backends that hash their keys into
+ * shards (FNV-1a of the encoded principal).
+ */
+
+unsigned
+_hdb_key2shard(const krb5_data *key, unsigned nshards)
+{
+    const unsigned char *p = key->data;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < key->length; i++) {
+	h ^= p[i];
+	h *= 16777619U;
+    }
+    return h % nshards;
+}
+
+/*
+ * Stored values are either an hdb_entry (a SEQUENCE) or, for the
+ * classical DB backends, an hdb_entry_alias ([APPLICATION 0]) that
+ * iterations skip.
+ */
+
+int
+_hdb_value_is_entry(const krb5_data *value)
+{
+    return value->length > 0 && ((unsigned char *)value->data)[0] == 0x30;
+}
+
+/*
+ * For backends keyed by the encoded principal: call func with the name
+ * of the entry stored under key if it starts with prefix, skipping
+ * aliases.
+ */
+
+krb5_error_code
+_hdb_foreach_name_key(krb5_context context, HDB *db,
+		      const krb5_data *key, const krb5_data *value,
+		      const char *prefix, size_t prefix_len,
+		      hdb_foreach_name_func_t func, void *data)
+{
+    krb5_error_code ret;
+    Principal p;
+    char *name;
+
+    if (!_hdb_value_is_entry(value))
+	return 0;
+    ret = decode_Principal(key->data, key->length, &p, NULL);
+    if (ret)
+	return ret;
+    ret = krb5_unparse_name(context, &p, &name);
+    free_Principal(&p);
+    if (ret)
+	return ret;
+    if (strncmp(name, prefix, prefix_len) == 0)
+	ret = (*func)(context, db, name, data);
+    free(name);
+    return ret;
+}
+
+/**
+ * Call `func' with the name of every entry in the database that
+ * starts with `prefix' ("" for all of them).  Backends with a
+ * HDB::hdb_foreach_name do not decode the entries, and the ordered
+ * ones only look at the matching names, the others are walked entry
+ * by entry.
+ */
+
+krb5_error_code
+hdb_foreach_name(krb5_context context,
+		 HDB *db,
+		 const char *prefix,
+		 hdb_foreach_name_func_t func,
+		 void *data)
+{
+    krb5_error_code ret;
+    hdb_entry_ex entry;
+    size_t prefix_len = strlen(prefix);
+    char *name;
+
+    if (db->hdb_capability_flags & HDB_CAP_F_FOREACH_NAME)
+	return (*db->hdb_foreach_name)(context, db, prefix, func, data);
+
+    ret = db->hdb_firstkey(context, db, HDB_F_ADMIN_DATA, &entry);
+    while (ret == 0) {
+	ret = krb5_unparse_name(context, entry.entry.principal, &name);
+	if (ret == 0) {
+	    if (strncmp(name, prefix, prefix_len) == 0)
+		ret = (*func)(context, db, name, data);
+	    free(name);
+	}
+	hdb_free_entry(context, &entry);
+	if (ret == 0)
+	    ret = db->hdb_nextkey(context, db, HDB_F_ADMIN_DATA, &entry);
+    }
+    if (ret == HDB_ERR_NOENTRY)
+	ret = 0;
+    return ret;
+}
+
+/**
+ * Release the HDB_WLOCK on `db' without keeping what was stored while
+ * it was held, if the backend can.  The others keep the changes and
+ * are just unlocked.
+ */
+
+krb5_error_code
+hdb_rollback(krb5_context context, HDB *db)
+{
+    if (db->hdb_capability_flags & HDB_CAP_F_ROLLBACK)
+	return (*db->hdb_rollback)(context, db);
+    return db->hdb_unlock(context, db);
+}
+
+/**
+ * Iterate over the encoded entries in shard number `shard' of
+ * `nshards' of the database.  Each shard can be walked by its own
+ * handle (and thread), all of them together visit every entry once.
+ * The handles only see the same database if the backend has
+ * HDB_CAP_F_PARALLEL_WALK and one handle holds HDB_WLOCK meanwhile.
+ * Backends without a HDB::hdb_foreach_shard are walked entry by entry
+ * and the entries re-encoded.
+ */
+
+krb5_error_code
+hdb_foreach_shard(krb5_context context,
+		  HDB *db,
+		  unsigned shard,
+		  unsigned nshards,
+		  hdb_foreach_raw_func_t func,
+		  void *data)
+{
+    krb5_error_code ret;
+    hdb_entry_ex entry;
+    krb5_data key, value;
+
+    if (nshards == 0 || shard >= nshards)
+	return EINVAL;
+    if (db->hdb_capability_flags & HDB_CAP_F_FOREACH_SHARD)
+	return (*db->hdb_foreach_shard)(context, db, shard, nshards,
+					func, data);
+
+    ret = db->hdb_firstkey(context, db, HDB_F_ADMIN_DATA, &entry);
+    while (ret == 0) {
+	krb5_data_zero(&key);
+	ret = hdb_principal2key(context, entry.entry.principal, &key);
+	if (ret == 0 && _hdb_key2shard(&key, nshards) == shard) {
+	    ret = hdb_entry2value(context, &entry.entry, &value);
+	    if (ret == 0) {
+		ret = (*func)(context, db, &key, &value, data);
+		krb5_data_free(&value);
+	    }
+	}
+	krb5_data_free(&key);
+	hdb_free_entry(context, &entry);
+	if (ret == 0)
+	    ret = db->hdb_nextkey(context, db, HDB_F_ADMIN_DATA, &entry);
+    }
+    if (ret == HDB_ERR_NOENTRY)
+	ret = 0;
+    return ret;
+}
+
+/*
+ * Stamp a database by its file `fn'.  Writes within the same second
+ * don't change the modification time, so the version is left at 0
+ * until the file has not been modified for a while.
+ */
+
+krb5_error_code
+_hdb_file_stamp(krb5_context context, const char *fn, struct hdb_stamp *stamp)
+{
+    struct stat sb;
+    krb5_error_code ret;
+
+    if (stat(fn, &sb) < 0) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "stat %s: %s", fn, strerror(ret));
+	return ret;
+    }
+    stamp->dev = sb.st_dev;
+    stamp->ino = sb.st_ino;
+    stamp->version = 0;
+    if (sb.st_mtime + 1 < time(NULL)) {
+	stamp->version = ((uint64_t)sb.st_mtime << 32) ^ (uint64_t)sb.st_size;
+	if (stamp->version == 0)
+	    stamp->version = 1;
+    }
+    return 0;
+}
+
 krb5_error_code
 hdb_check_db_format(krb5_context context, HDB *db)
 {
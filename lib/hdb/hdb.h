@@ -70,6 +70,12 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL 1
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
+#define HDB_CAP_F_KEEP_OPEN		8 /* readers may stay open while written */
+#define HDB_CAP_F_FOREACH_SHARD		16 /* has hdb_foreach_shard */
+#define HDB_CAP_F_FOREACH_NAME		32 /* has hdb_foreach_name */
+#define HDB_CAP_F_PARALLEL_WALK		64 /* HDB_WLOCK holds other handles still */
+#define HDB_CAP_F_STAMP			128 /* has hdb_get_stamp */
+#define HDB_CAP_F_ROLLBACK		256 /* has hdb_rollback */
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -102,6 +108,35 @@ typedef struct hdb_entry_ex {
  * query the backend database when talking about principals.
  */
 
+struct HDB;
+
+/*
+ * Called by HDB::hdb_foreach_shard() with the key and the encoded
+ * hdb_entry of every entry in the shard.
+ */
+typedef krb5_error_code (*hdb_foreach_raw_func_t)(krb5_context, struct HDB*,
+						  krb5_data*, krb5_data*,
+						  void*);
+
+/*
+ * Called by HDB::hdb_foreach_name() with the unparsed principal name
+ * of every matching entry.
+ */
+typedef krb5_error_code (*hdb_foreach_name_func_t)(krb5_context, struct HDB*,
+						   const char*, void*);
+
+/*
+ * Filled in by HDB::hdb_get_stamp().  The device and inode change when
+ * the database file is replaced, the version whenever the database is
+ * written to.  A version of 0 means that the backend can't tell yet,
+ * it goes by the modification time of the file and that is too recent.
+ */
+struct hdb_stamp {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t version;
+};
+
 typedef struct HDB {
     void *hdb_db;
     void *hdb_dbc; /** don't use, only for DB3 */
@@ -261,6 +296,65 @@ typedef struct HDB {
      * Check if s4u2self is allowed from this client to this server
      */
     krb5_error_code (*hdb_check_s4u2self)(krb5_context, struct HDB *, hdb_entry_ex *, krb5_const_principal);
+
+    /**
+     * Iterate over one shard of the database without decoding entries.
+     *
+     * Calls the function with the key and the encoded hdb_entry of
+     * every entry in shard number shard of nshards.  The shards are
+     * disjoint and together cover the whole database, so that several
+     * handles can walk it in parallel.  The key is empty for backends
+     * that do not key entries by the encoded principal.
+     * This call is optional to support, use hdb_foreach_shard().
+     * Only set if HDB_CAP_F_FOREACH_SHARD is, backends built for
+     * older versions of this structure do not have the field.
+     *
+     * With HDB_CAP_F_PARALLEL_WALK a handle that holds HDB_WLOCK keeps
+     * the database from changing under the other handles of the
+     * process, so that they can walk the shards in parallel and still
+     * see the same database.
+     */
+    krb5_error_code (*hdb_foreach_shard)(krb5_context, struct HDB *,
+					 unsigned, unsigned,
+					 hdb_foreach_raw_func_t, void *);
+
+    /**
+     * Iterate over the principal names of the entries.
+     *
+     * Calls the function with the unparsed principal name of every
+     * entry, not its aliases, whose name starts with the prefix,
+     * without decoding the entries.  Backends that keep the names
+     * ordered only look at the range of matching names.
+     * This call is optional to support, use hdb_foreach_name().
+     * Only set if HDB_CAP_F_FOREACH_NAME is.
+     */
+    krb5_error_code (*hdb_foreach_name)(krb5_context, struct HDB *,
+					const char *,
+					hdb_foreach_name_func_t, void *);
+
+    /**
+     * Tell whether the database has been replaced or written to.
+     *
+     * Fills in a stamp that is compared with an earlier one to find
+     * out, see struct hdb_stamp.  Backends with a write counter of
+     * their own need the handle to be open to use it, the others
+     * stat() their files.
+     * This call is optional to support.
+     * Only set if HDB_CAP_F_STAMP is.
+     */
+    krb5_error_code (*hdb_get_stamp)(krb5_context, struct HDB *,
+				     struct hdb_stamp *);
+
+    /**
+     * Release a HDB_WLOCK and throw away what was stored under it.
+     *
+     * Like HDB::hdb_unlock, but backends that write in a transaction
+     * abort it instead of committing it.  When the lock is held more
+     * than once the outermost unlock aborts.
+     * This call is optional to support, use hdb_rollback().
+     * Only set if HDB_CAP_F_ROLLBACK is.
+     */
+    krb5_error_code (*hdb_rollback)(krb5_context, struct HDB *);
 }HDB;
 
 #define HDB_INTERFACE_VERSION	8
@@ -59,17 +59,41 @@ NDBM_destroy(krb5_context context, HDB *db)
     return 0;
 }
 
+/*
+ * Locks nest, so that the lock each store takes does not let go of
+ * an outer one, such as the write lock kadmin load holds throughout.
+ */
+
 static krb5_error_code
 NDBM_lock(krb5_context context, HDB *db, int operation)
 {
     struct ndbm_db *d = db->hdb_db;
-    return hdb_lock(d->lock_fd, operation);
+    krb5_error_code ret;
+
+    if (db->lock_count > 0 &&
+	(db->lock_type == HDB_WLOCK || operation == HDB_RLOCK)) {
+	db->lock_count++;
+	return 0;
+    }
+    ret = hdb_lock(d->lock_fd, operation);
+    if (ret)
+	return ret;
+    db->lock_count++;
+    db->lock_type = operation;
+    return 0;
 }
 
 static krb5_error_code
 NDBM_unlock(krb5_context context, HDB *db)
 {
     struct ndbm_db *d = db->hdb_db;
+
+    if (db->lock_count > 1) {
+	db->lock_count--;
+	return 0;
+    }
+    heim_assert(db->lock_count == 1, "HDB lock/unlock sequence does not match");
+    db->lock_count--;
     return hdb_unlock(d->lock_fd);
 }
 
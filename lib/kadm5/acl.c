@@ -32,6 +32,7 @@
  */
 
 #include "kadm5_locl.h"
+#include "heim_threads.h"
 
 RCSID("$Id$");
 
@@ -69,6 +70,147 @@ _kadm5_privs_to_string(uint32_t privs, char *string, size_t len)
     return 0;
 }
 
+/*
+ * The acl file, parsed once per process and kept until the file
+ * changes, so that the connections a kadmind worker serves one after
+ * the other do not read it again.  Every line remembers how far it
+ * parsed so that fetch_acl() fails on exactly the lines the file would
+ * have failed on when read through.
+ */
+
+struct acl_line {
+    krb5_error_code princ_ret;
+    krb5_principal princ;
+    int has_privs;
+    krb5_error_code privs_ret;
+    unsigned privs;
+    int has_pattern;
+    krb5_error_code pattern_ret;
+    krb5_principal pattern;
+};
+
+struct kadm5_acl {
+    char *file;
+    struct stat st;
+    size_t num;
+    struct acl_line *lines;
+};
+
+static HEIMDAL_MUTEX acl_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct kadm5_acl *acl_cache;
+
+static void
+acl_free(krb5_context context, struct kadm5_acl *acl)
+{
+    size_t i;
+
+    if (acl == NULL)
+	return;
+    for (i = 0; i < acl->num; i++) {
+	if (acl->lines[i].princ)
+	    krb5_free_principal(context, acl->lines[i].princ);
+	if (acl->lines[i].pattern)
+	    krb5_free_principal(context, acl->lines[i].pattern);
+    }
+    free(acl->lines);
+    free(acl->file);
+    free(acl);
+}
+
+static kadm5_ret_t
+read_acl(kadm5_server_context *context, FILE *f, struct kadm5_acl *acl)
+{
+    char buf[256];
+    struct acl_line *l, *tmp;
+
+    while(fgets(buf, sizeof(buf), f) != NULL) {
+	char *foo = NULL, *p;
+
+	p = strtok_r(buf, " \t\n", &foo);
+	if(p == NULL)
+	    continue;
+	if (*p == '#')		/* comment */
+	    continue;
+
+	tmp = realloc(acl->lines, (acl->num + 1) * sizeof(*acl->lines));
+	if (tmp == NULL)
+	    return ENOMEM;
+	acl->lines = tmp;
+	l = &acl->lines[acl->num++];
+	memset(l, 0, sizeof(*l));
+
+	l->princ_ret = krb5_parse_name(context->context, p, &l->princ);
+	if (l->princ_ret)
+	    continue;
+	p = strtok_r(NULL, " \t\n", &foo);
+	if(p == NULL)
+	    continue;
+	l->has_privs = 1;
+	l->privs_ret = _kadm5_string_to_privs(p, &l->privs);
+	if (l->privs_ret)
+	    continue;
+	p = strtok_r(NULL, " \t\n", &foo);
+	if (p == NULL)
+	    continue;
+	l->has_pattern = 1;
+	l->pattern_ret = krb5_parse_name(context->context, p, &l->pattern);
+    }
+    return 0;
+}
+
+/*
+ * Make sure acl_cache is the current contents of the acl file of
+ * `context', or NULL if there is none.  The file is only read when its
+ * device, inode, size or modification time differ from the cached
+ * copy.  A file changed within the last second is read again every
+ * time, as its modification time cannot tell a second change from the
+ * first.  Called with acl_mutex held.
+ */
+
+static kadm5_ret_t
+load_acl(kadm5_server_context *context)
+{
+    const char *file = context->config.acl_file;
+    struct kadm5_acl *acl = acl_cache;
+    kadm5_ret_t ret;
+    struct stat st;
+    FILE *f;
+
+    if (stat(file, &st) < 0) {
+	acl_free(context->context, acl_cache);
+	acl_cache = NULL;
+	return 0;
+    }
+    if (acl != NULL && strcmp(acl->file, file) == 0 &&
+	st.st_dev == acl->st.st_dev && st.st_ino == acl->st.st_ino &&
+	st.st_size == acl->st.st_size && st.st_mtime == acl->st.st_mtime &&
+	st.st_mtime < time(NULL) - 1)
+	return 0;
+
+    acl_free(context->context, acl_cache);
+    acl_cache = NULL;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+	return 0;
+    acl = calloc(1, sizeof(*acl));
+    if (acl == NULL || (acl->file = strdup(file)) == NULL) {
+	free(acl);
+	fclose(f);
+	return ENOMEM;
+    }
+    if (fstat(fileno(f), &acl->st) < 0)
+	acl->st = st;
+    ret = read_acl(context, f, acl);
+    fclose(f);
+    if (ret) {
+	acl_free(context->context, acl);
+	return ret;
+    }
+    acl_cache = acl;
+    return 0;
+}
+
 /*
  * retrieve the right for the current caller on `princ' (NULL means all)
  * and store them in `ret_flags'
@@ -80,64 +222,46 @@ fetch_acl (kadm5_server_context *context,
 	   krb5_const_principal princ,
 	   unsigned *ret_flags)
 {
-    FILE *f;
     krb5_error_code ret = 0;
-    char buf[256];
+    struct acl_line *l;
+    size_t i;
 
     *ret_flags = 0;
 
-    /* no acl file -> no rights */
-    f = fopen(context->config.acl_file, "r");
-    if (f == NULL)
-	return 0;
+    HEIMDAL_MUTEX_lock(&acl_mutex);
+    ret = load_acl(context);
 
-    while(fgets(buf, sizeof(buf), f) != NULL) {
-	char *foo = NULL, *p;
-	krb5_principal this_princ;
-	unsigned flags = 0;
+    /* no acl file -> no rights */
+    for (i = 0; ret == 0 && acl_cache != NULL && i < acl_cache->num; i++) {
+	l = &acl_cache->lines[i];
 
-	p = strtok_r(buf, " \t\n", &foo);
-	if(p == NULL)
-	    continue;
-	if (*p == '#')		/* comment */
-	    continue;
-	ret = krb5_parse_name(context->context, p, &this_princ);
+	ret = l->princ_ret;
 	if(ret)
 	    break;
 	if(!krb5_principal_compare(context->context,
-				   context->caller, this_princ)) {
-	    krb5_free_principal(context->context, this_princ);
+				   context->caller, l->princ))
 	    continue;
-	}
-	krb5_free_principal(context->context, this_princ);
-	p = strtok_r(NULL, " \t\n", &foo);
-	if(p == NULL)
+	if(!l->has_privs)
 	    continue;
-	ret = _kadm5_string_to_privs(p, &flags);
+	ret = l->privs_ret;
 	if (ret)
 	    break;
-	p = strtok_r(NULL, " \t\n", &foo);
-	if (p == NULL) {
-	    *ret_flags = flags;
+	if (!l->has_pattern) {
+	    *ret_flags = l->privs;
 	    break;
 	}
 	if (princ != NULL) {
-	    krb5_principal pattern_princ;
-	    krb5_boolean match;
-
-	    ret = krb5_parse_name (context->context, p, &pattern_princ);
+	    ret = l->pattern_ret;
 	    if (ret)
 		break;
-	    match = krb5_principal_match (context->context,
-					  princ, pattern_princ);
-	    krb5_free_principal (context->context, pattern_princ);
-	    if (match) {
-		*ret_flags = flags;
+	    if (krb5_principal_match (context->context,
+				      princ, l->pattern)) {
+		*ret_flags = l->privs;
 		break;
 	    }
 	}
     }
-    fclose(f);
+    HEIMDAL_MUTEX_unlock(&acl_mutex);
     return ret;
 }
 
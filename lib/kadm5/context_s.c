@@ -57,8 +57,21 @@ kadm5_s_lock(void *server_handle)
 	return ret;
 
     ret = context->db->hdb_lock(context->context, context->db, HDB_WLOCK);
-    if (ret)
+    if (ret) {
+	(void) context->db->hdb_close(context->context, context->db);
 	return ret;
+    }
+
+    /*
+     * Log records for changes made while locked are written out with
+     * one fsync() when unlocking, the log stays locked until then.
+     */
+    ret = kadm5_log_begin(context);
+    if (ret) {
+	(void) context->db->hdb_unlock(context->context, context->db);
+	(void) context->db->hdb_close(context->context, context->db);
+	return ret;
+    }
 
     context->keep_open = 1;
     return 0;
@@ -73,8 +86,20 @@ kadm5_s_unlock(void *server_handle)
     if (!context->keep_open)
 	return KADM5_NOT_LOCKED;
 
+    /*
+     * The log goes to disk before the changes are committed to the
+     * database, and if it can't they are thrown away, so that the
+     * slaves never miss a change.  The log is released last, so that
+     * ipropd-master sees the database match the log while it holds
+     * the log lock.
+     */
     context->keep_open = 0;
-    ret = context->db->hdb_unlock(context->context, context->db);
+    ret = kadm5_log_commit(context);
+    if (ret)
+	(void) hdb_rollback(context->context, context->db);
+    else
+	ret = context->db->hdb_unlock(context->context, context->db);
+    (void) kadm5_log_end(context);
     (void) context->db->hdb_close(context->context, context->db);
     return ret;
 }
@@ -57,6 +57,8 @@ destroy_kadm5_log_context (kadm5_log_context *c)
 {
     free (c->log_file);
     rk_closesocket (c->socket_fd);
+    if (c->batch)
+	krb5_storage_free (c->batch);
 #ifdef NO_UNIX_SOCKETS
     if (c->socket_info) {
 	freeaddrinfo(c->socket_info);
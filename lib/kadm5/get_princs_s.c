@@ -55,27 +55,37 @@ add_princ(struct foreach_data *d, char *princ)
 }
 
 static krb5_error_code
-foreach(krb5_context context, HDB *db, hdb_entry_ex *ent, void *data)
+foreach(krb5_context context, HDB *db, const char *name, void *data)
 {
     struct foreach_data *d = data;
     char *princ;
     krb5_error_code ret;
-    ret = krb5_unparse_name(context, ent->entry.principal, &princ);
-    if(ret)
-	return ret;
-    if(d->exp){
-	if(fnmatch(d->exp, princ, 0) == 0 || fnmatch(d->exp2, princ, 0) == 0)
-	    ret = add_princ(d, princ);
-	else
-	    free(princ);
-    }else{
-	ret = add_princ(d, princ);
-    }
+
+    if(d->exp &&
+       fnmatch(d->exp, name, 0) != 0 && fnmatch(d->exp2, name, 0) != 0)
+	return 0;
+    princ = strdup(name);
+    if(princ == NULL)
+	return ENOMEM;
+    ret = add_princ(d, princ);
     if(ret)
 	free(princ);
     return ret;
 }
 
+/*
+ * The part of `exp' before the first wildcard, which every name it
+ * matches starts with, with or without the default realm.
+ */
+
+static char *
+fixed_prefix(const char *exp)
+{
+    if(exp == NULL)
+	return strdup("");
+    return strndup(exp, strcspn(exp, "*?[\\"));
+}
+
 kadm5_ret_t
 kadm5_s_get_principals(void *server_handle,
 		       const char *expression,
@@ -85,11 +95,16 @@ kadm5_s_get_principals(void *server_handle,
     struct foreach_data d;
     kadm5_server_context *context = server_handle;
     kadm5_ret_t ret;
+    char *prefix;
 
+    prefix = fixed_prefix(expression);
+    if (prefix == NULL)
+	return ENOMEM;
     if (!context->keep_open) {
 	ret = context->db->hdb_open(context->context, context->db, O_RDONLY, 0);
 	if(ret) {
 	    krb5_warn(context->context, ret, "opening database");
+	    free(prefix);
 	    return ret;
 	}
     }
@@ -102,12 +117,14 @@ kadm5_s_get_principals(void *server_handle,
 	aret = asprintf(&d.exp2, "%s@%s", expression, r);
 	free(r);
 	if (aret == -1 || d.exp2 == NULL) {
+	    free(prefix);
 	    return ENOMEM;
 	}
     }
     d.princs = NULL;
     d.count = 0;
-    ret = hdb_foreach(context->context, context->db, HDB_F_ADMIN_DATA, foreach, &d);
+    ret = hdb_foreach_name(context->context, context->db, prefix, foreach, &d);
+    free(prefix);
     if (!context->keep_open)
 	context->db->hdb_close(context->context, context->db);
     if(ret == 0)
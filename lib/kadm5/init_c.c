@@ -466,6 +466,14 @@ kadm_connect(kadm5_client_context *ctx)
 	krb5_warnx (context, "failed to contact %s", hostname);
 	return KADM5_FAILURE;
     }
+#if defined(TCP_NODELAY) && defined(HAVE_SETSOCKOPT)
+    {
+	/* the params and first request go out back to back */
+	int one = 1;
+
+	setsockopt (s, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+    }
+#endif
     ret = _kadm5_c_get_cred_cache(context,
 				  ctx->client_name,
 				  ctx->service_name,
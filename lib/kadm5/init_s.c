@@ -105,6 +105,28 @@ kadm5_s_init_with_context(krb5_context context,
     return 0;
 }
 
+/*
+ * Hand a server handle over to another client: the caller and its
+ * acl flags are replaced, the open database and parsed acl file are
+ * kept.
+ */
+
+kadm5_ret_t
+kadm5_s_set_caller(void *server_handle, const char *client_name)
+{
+    kadm5_server_context *ctx = server_handle;
+    krb5_principal caller;
+    kadm5_ret_t ret;
+
+    ret = krb5_parse_name(ctx->context, client_name, &caller);
+    if (ret)
+	return ret;
+    krb5_free_principal(ctx->context, ctx->caller);
+    ctx->caller = caller;
+    ctx->acl_flags = 0;
+    return _kadm5_acl_init(ctx);
+}
+
 kadm5_ret_t
 kadm5_s_init_with_password_ctx(krb5_context context,
 			       const char *client_name,
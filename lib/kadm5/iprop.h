@@ -62,9 +62,18 @@ enum iprop_cmd { I_HAVE = 1,
 		 NOW_YOU_HAVE = 5,
 		 ARE_YOU_THERE = 6,
 		 I_AM_HERE = 7,
-		 YOU_HAVE_LAST_VERSION = 8
+		 YOU_HAVE_LAST_VERSION = 8,
+		 MANY_PRINCS = 9
 };
 
+/*
+ * Capabilities a slave may append to I_HAVE; masters that predate
+ * them ignore the extra bytes.
+ */
+#define IPROP_CAP_MANY_PRINCS	0x1	/* entries sent in MANY_PRINCS chunks */
+
+#define IPROP_CHUNK_SIZE	(64 * 1024)
+
 extern sig_atomic_t exit_flag;
 void setup_signal(void);
 
@@ -43,6 +43,8 @@ const char *slave_time_gone = "5 min";
 static int time_before_missing;
 static int time_before_gone;
 
+static const char *log_file;
+
 const char *master_hostname;
 
 static krb5_socket_t
@@ -129,9 +131,35 @@ struct slave {
     unsigned long flags;
 #define SLAVE_F_DEAD	0x1
 #define SLAVE_F_AYT	0x2
+#define SLAVE_F_ITER	0x4	/* iteration of `iter' has begun */
+    uint32_t caps;		/* IPROP_CAP_* announced in I_HAVE */
+    krb5_data out;		/* framed KRB-PRIVs not yet written */
+    size_t outoff;
+    unsigned char inhdr[4];	/* partially read message from slave */
+    size_t inhdrlen;
+    krb5_data in;
+    size_t inoff;
+    krb5_storage *dump;		/* complete database being streamed */
+    HDB *iter;			/* ... or the database it is read from */
+    uint32_t dump_version;
     struct slave *next;
 };
 
+/*
+ * Slaves are written to without blocking: messages are encrypted once
+ * into the slave's output queue and written out as the socket drains.
+ * A complete dump is read into the queue a bit at a time, and diffs
+ * are held back from a slave that has more than SLAVE_QUEUE_HIGH
+ * bytes outstanding until it has caught up.
+ *
+ * Slaves that understand MANY_PRINCS are not sent the dump file but
+ * get the database from an iteration of their own over a snapshot of
+ * it, in IPROP_CHUNK_SIZE pieces.
+ */
+
+#define SLAVE_QUEUE_LOW		(64 * 1024)
+#define SLAVE_QUEUE_HIGH	(1024 * 1024)
+
 typedef struct slave slave;
 
 static int
@@ -192,6 +220,26 @@ slave_gone_p (slave *s)
     return 0;
 }
 
+static void
+slave_free_buffers(krb5_context context, slave *s)
+{
+    krb5_data_free(&s->out);
+    s->outoff = 0;
+    krb5_data_free(&s->in);
+    s->inoff = 0;
+    s->inhdrlen = 0;
+    if (s->dump) {
+	krb5_storage_free(s->dump);
+	s->dump = NULL;
+    }
+    if (s->iter) {
+	(*s->iter->hdb_close)(context, s->iter);
+	(*s->iter->hdb_destroy)(context, s->iter);
+	s->iter = NULL;
+    }
+    s->flags &= ~SLAVE_F_ITER;
+}
+
 static void
 slave_dead(krb5_context context, slave *s)
 {
@@ -201,10 +249,267 @@ slave_dead(krb5_context context, slave *s)
 	rk_closesocket (s->fd);
 	s->fd = rk_INVALID_SOCKET;
     }
+    slave_free_buffers(context, s);
     s->flags |= SLAVE_F_DEAD;
     slave_seen(s);
 }
 
+static size_t
+slave_queued(slave *s)
+{
+    return s->out.length - s->outoff;
+}
+
+static int
+slave_streaming(slave *s)
+{
+    return s->dump != NULL || s->iter != NULL;
+}
+
+/*
+ * Encrypt `data' for the slave and append it to its output queue.
+ */
+
+static krb5_error_code
+slave_queue(krb5_context context, slave *s, krb5_data *data)
+{
+    krb5_error_code ret;
+    krb5_data packet;
+    unsigned char *p;
+    size_t len;
+
+    ret = krb5_mk_priv(context, s->ac, data, &packet, NULL);
+    if (ret)
+	return ret;
+
+    len = s->out.length;
+    ret = krb5_data_realloc(&s->out, len + 4 + packet.length);
+    if (ret) {
+	krb5_data_free(&packet);
+	return ret;
+    }
+    p = (unsigned char *)s->out.data + len;
+    p[0] = (packet.length >> 24) & 0xff;
+    p[1] = (packet.length >> 16) & 0xff;
+    p[2] = (packet.length >> 8) & 0xff;
+    p[3] = packet.length & 0xff;
+    memcpy(p + 4, packet.data, packet.length);
+    krb5_data_free(&packet);
+    return 0;
+}
+
+/*
+ * Queue the next MANY_PRINCS chunk of the database being iterated
+ * for the slave, and NOW_YOU_HAVE once all of it has been read.
+ */
+
+static krb5_error_code
+slave_fill(krb5_context context, slave *s)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data data;
+    hdb_entry_ex entry;
+    int count = 0;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return ENOMEM;
+    ret = krb5_store_int32(sp, MANY_PRINCS);
+
+    while (ret == 0 && krb5_storage_seek(sp, 0, SEEK_CUR) < IPROP_CHUNK_SIZE) {
+	memset(&entry, 0, sizeof(entry));
+	if (s->flags & SLAVE_F_ITER) {
+	    ret = (*s->iter->hdb_nextkey)(context, s->iter,
+					  HDB_F_ADMIN_DATA, &entry);
+	} else {
+	    ret = (*s->iter->hdb_firstkey)(context, s->iter,
+					   HDB_F_ADMIN_DATA, &entry);
+	    s->flags |= SLAVE_F_ITER;
+	}
+	if (ret)
+	    break;
+	ret = hdb_entry2value(context, &entry.entry, &data);
+	hdb_free_entry(context, &entry);
+	if (ret)
+	    break;
+	ret = krb5_store_data(sp, data);
+	krb5_data_free(&data);
+	count++;
+    }
+    if (ret != 0 && ret != HDB_ERR_NOENTRY)
+	goto out;
+
+    if (count > 0) {
+	krb5_error_code ret2;
+
+	ret2 = krb5_storage_to_data(sp, &data);
+	if (ret2 == 0) {
+	    ret2 = slave_queue(context, s, &data);
+	    krb5_data_free(&data);
+	}
+	if (ret2) {
+	    ret = ret2;
+	    goto out;
+	}
+    }
+
+    if (ret == HDB_ERR_NOENTRY) {
+	char buf[8];
+
+	krb5_storage_free(sp);
+	sp = krb5_storage_from_mem(buf, 8);
+	if (sp == NULL) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	krb5_store_int32(sp, NOW_YOU_HAVE);
+	krb5_store_int32(sp, s->dump_version);
+	data.data = buf;
+	data.length = 8;
+	ret = slave_queue(context, s, &data);
+	if (ret)
+	    goto out;
+
+	(*s->iter->hdb_close)(context, s->iter);
+	(*s->iter->hdb_destroy)(context, s->iter);
+	s->iter = NULL;
+	s->flags &= ~SLAVE_F_ITER;
+	s->version = s->dump_version;
+	slave_seen(s);
+    }
+
+out:
+    if (sp)
+	krb5_storage_free(sp);
+    return ret;
+}
+
+/*
+ * Write as much of the output queue as the socket takes without
+ * blocking, topping the queue up from the dump being streamed.
+ */
+
+static krb5_error_code
+slave_flush(krb5_context context, slave *s)
+{
+    krb5_error_code ret;
+    krb5_data data;
+    ssize_t n;
+
+    for (;;) {
+	while (s->iter && slave_queued(s) < SLAVE_QUEUE_LOW) {
+	    ret = slave_fill(context, s);
+	    if (ret)
+		return ret;
+	}
+	while (s->dump && slave_queued(s) < SLAVE_QUEUE_LOW) {
+	    ret = krb5_ret_data(s->dump, &data);
+	    if (ret == HEIM_ERR_EOF) {
+		krb5_storage_free(s->dump);
+		s->dump = NULL;
+		s->version = s->dump_version;
+		slave_seen(s);
+		break;
+	    }
+	    if (ret)
+		return ret;
+	    ret = slave_queue(context, s, &data);
+	    krb5_data_free(&data);
+	    if (ret)
+		return ret;
+	}
+
+	if (slave_queued(s) == 0)
+	    break;
+	n = send(s->fd, (char *)s->out.data + s->outoff, slave_queued(s), 0);
+	if (n < 0) {
+	    if (rk_SOCK_ERRNO == EINTR)
+		continue;
+	    if (rk_SOCK_ERRNO == EAGAIN || rk_SOCK_ERRNO == EWOULDBLOCK)
+		break;
+	    return rk_SOCK_ERRNO;
+	}
+	s->outoff += n;
+    }
+
+    if (s->outoff == s->out.length) {
+	krb5_data_free(&s->out);
+	s->outoff = 0;
+    } else if (s->outoff > s->out.length / 2) {
+	memmove(s->out.data, (char *)s->out.data + s->outoff,
+		s->out.length - s->outoff);
+	s->out.length -= s->outoff;
+	s->outoff = 0;
+    }
+    return 0;
+}
+
+static krb5_error_code
+slave_send(krb5_context context, slave *s, krb5_data *data)
+{
+    krb5_error_code ret;
+
+    ret = slave_queue(context, s, data);
+    if (ret)
+	return ret;
+    return slave_flush(context, s);
+}
+
+/*
+ * Read what the slave has sent so far.  Returns 0 with the message in
+ * `packet' once a whole one has arrived, and EAGAIN before that.
+ */
+
+static krb5_error_code
+slave_recv(krb5_context context, slave *s, krb5_data *packet)
+{
+    krb5_error_code ret;
+    ssize_t n;
+
+    if (s->inhdrlen < sizeof(s->inhdr)) {
+	n = recv(s->fd, (void *)(s->inhdr + s->inhdrlen),
+		 sizeof(s->inhdr) - s->inhdrlen, 0);
+	if (n == 0)
+	    return HEIM_ERR_EOF;
+	if (n < 0) {
+	    if (rk_SOCK_ERRNO == EINTR || rk_SOCK_ERRNO == EAGAIN ||
+		rk_SOCK_ERRNO == EWOULDBLOCK)
+		return EAGAIN;
+	    return rk_SOCK_ERRNO;
+	}
+	s->inhdrlen += n;
+	if (s->inhdrlen < sizeof(s->inhdr))
+	    return EAGAIN;
+	ret = krb5_data_alloc(&s->in, (s->inhdr[0] << 24) |
+			      (s->inhdr[1] << 16) | (s->inhdr[2] << 8) |
+			      s->inhdr[3]);
+	if (ret)
+	    return ret;
+	s->inoff = 0;
+    }
+
+    while (s->inoff < s->in.length) {
+	n = recv(s->fd, (char *)s->in.data + s->inoff,
+		 s->in.length - s->inoff, 0);
+	if (n == 0)
+	    return HEIM_ERR_EOF;
+	if (n < 0) {
+	    if (rk_SOCK_ERRNO == EINTR || rk_SOCK_ERRNO == EAGAIN ||
+		rk_SOCK_ERRNO == EWOULDBLOCK)
+		return EAGAIN;
+	    return rk_SOCK_ERRNO;
+	}
+	s->inoff += n;
+    }
+
+    *packet = s->in;
+    krb5_data_zero(&s->in);
+    s->inoff = 0;
+    s->inhdrlen = 0;
+    return 0;
+}
+
 static void
 remove_slave (krb5_context context, slave *s, slave **root)
 {
@@ -216,6 +521,7 @@ remove_slave (krb5_context context, slave *s, slave **root)
 	free (s->name);
     if (s->ac)
 	krb5_auth_con_free (context, s->ac);
+    slave_free_buffers(context, s);
 
     for (p = root; *p; p = &(*p)->next)
 	if (*p == s) {
@@ -236,13 +542,11 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     krb5_ticket *ticket = NULL;
     char hostname[128];
 
-    s = malloc(sizeof(*s));
+    s = calloc(1, sizeof(*s));
     if (s == NULL) {
 	krb5_warnx (context, "add_slave: no memory");
 	return;
     }
-    s->name = NULL;
-    s->ac = NULL;
 
     addr_len = sizeof(s->addr);
     s->fd = accept (fd, (struct sockaddr *)&s->addr, &addr_len);
@@ -300,6 +604,8 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
 
     krb5_warnx (context, "connection from %s", s->name);
 
+    socket_set_nonblocking(s->fd, 1);
+
     s->version = 0;
     s->flags = 0;
     slave_seen(s);
@@ -350,8 +656,6 @@ write_dump (krb5_context context, krb5_storage *dump,
     krb5_data data;
     char buf[8];
 
-    /* we assume that the caller has obtained an exclusive lock */
-
     ret = krb5_storage_truncate(dump, 0);
     if (ret)
 	return ret;
@@ -452,156 +756,230 @@ write_dump (krb5_context context, krb5_storage *dump,
     return 0;
 }
 
+#ifdef HAVE_MMAP
+
+static uint32_t snapshot_version;	/* of ipropd.snapshot, 0 if none */
+
+/*
+ * Write the database to the snapshot that MANY_PRINCS slaves are
+ * streamed from.  The version is read and the database walked under
+ * the log lock and a read lock on the database, which is one read
+ * transaction on sqlite.  kadmin holds the log lock until its batch
+ * is committed to the database, so the snapshot has every change up
+ * to the version.  Single changes are stored before they are logged,
+ * so it may also have some later ones, which replay harmlessly when
+ * the slave gets them as diffs.
+ */
+
+static krb5_error_code
+write_snapshot (krb5_context context, int log_fd, const char *database,
+		const char *fn)
+{
+    krb5_error_code ret;
+    uint32_t version = 0;
+    HDB *db;
+
+    ret = hdb_create (context, &db, database);
+    if (ret) {
+	krb5_warn (context, ret, "hdb_create: %s", database);
+	return ret;
+    }
+    flock(log_fd, LOCK_SH);
+    ret = kadm5_log_get_version_fd (log_fd, &version);
+    if (ret == 0)
+	ret = db->hdb_open (context, db, O_RDONLY, 0);
+    if (ret == 0) {
+	ret = db->hdb_lock (context, db, HDB_RLOCK);
+	if (ret == 0) {
+	    ret = hdb_write_snapshot (context, db, fn, 0600);
+	    (void) db->hdb_unlock (context, db);
+	}
+	(*db->hdb_close)(context, db);
+    }
+    flock(log_fd, LOCK_UN);
+    (*db->hdb_destroy)(context, db);
+    if (ret) {
+	krb5_warn (context, ret, "write_snapshot: %s", fn);
+	return ret;
+    }
+
+    snapshot_version = version;
+    krb5_warnx(context, "wrote new snapshot (version %u)", version);
+    return 0;
+}
+
+/*
+ * Start streaming a complete database to a slave that takes
+ * MANY_PRINCS.  Like the dump file, the snapshot is shared between
+ * slaves and only rewritten when it is older than the log.  Each slave
+ * iterates its own mapping of it in slave_fill() as it drains its
+ * queue, so a snapshot renamed over it meanwhile does not disturb it,
+ * and nothing is held open in the database itself.
+ */
+
 static int
-send_complete (krb5_context context, slave *s, const char *database,
-	       uint32_t current_version, uint32_t oldest_version)
+stream_complete (krb5_context context, slave *s, int log_fd,
+		 const char *database, uint32_t oldest_version)
 {
     krb5_error_code ret;
-    krb5_storage *dump = NULL;
-    uint32_t vno = 0;
+    krb5_storage *sp;
     krb5_data data;
-    int fd = -1;
-    char *dfn;
+    char *fn = NULL, *name = NULL;
+    char buf[4];
 
-    ret = asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context));
-    if (ret == -1 || !dfn) {
+    if (asprintf(&fn, "%s/ipropd.snapshot", hdb_db_dir(context)) == -1 ||
+	fn == NULL) {
+	krb5_warn(context, ENOMEM, "Cannot allocate memory");
+	return ENOMEM;
+    }
+    if (snapshot_version == 0 || snapshot_version < oldest_version) {
+	ret = write_snapshot(context, log_fd, database, fn);
+	if (ret) {
+	    free(fn);
+	    return ret;
+	}
+    }
+    if (asprintf(&name, "snapshot:%s", fn) == -1 || name == NULL) {
+	free(fn);
 	krb5_warn(context, ENOMEM, "Cannot allocate memory");
 	return ENOMEM;
     }
+    free(fn);
 
-    fd = open(dfn, O_CREAT|O_RDWR, 0600);
-    if (fd == -1) {
-	ret = errno;
-	krb5_warn(context, ret, "Cannot open/create iprop dumpfile %s", dfn);
-	free(dfn);
-        return ret;
+    ret = hdb_create (context, &s->iter, name);
+    if (ret) {
+	krb5_warn (context, ret, "hdb_create: %s", name);
+	free(name);
+	s->iter = NULL;
+	return ret;
     }
-    free(dfn);
+    free(name);
+    ret = (*s->iter->hdb_open)(context, s->iter, O_RDONLY, 0);
+    if (ret) {
+	krb5_warn (context, ret, "db->open");
+	(*s->iter->hdb_destroy)(context, s->iter);
+	s->iter = NULL;
+	return ret;
+    }
+    s->flags &= ~SLAVE_F_ITER;
+    s->dump_version = snapshot_version;
 
-    dump = krb5_storage_from_fd(fd);
-    if (!dump) {
-	ret = errno;
-	krb5_warn(context, ret, "krb5_storage_from_fd");
-	goto done;
+    sp = krb5_storage_from_mem (buf, 4);
+    if (sp == NULL)
+	krb5_errx (context, 1, "krb5_storage_from_mem");
+    krb5_store_int32 (sp, TELL_YOU_EVERYTHING);
+    krb5_storage_free (sp);
+
+    data.data   = buf;
+    data.length = 4;
+
+    ret = slave_send(context, s, &data);
+    if (ret) {
+	krb5_warn (context, ret, "stream_complete: %s", s->name);
+	slave_dead(context, s);
     }
+    return ret;
+}
 
-    for (;;) {
-	ret = flock(fd, LOCK_SH);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_SH)");
-	    goto done;
-	}
+#endif /* HAVE_MMAP */
 
-	krb5_storage_seek(dump, 0, SEEK_SET);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
-	    goto done;
-	}
+/*
+ * Start streaming a complete database to the slave.  The dump file is
+ * shared between slaves and only rewritten when it is older than the
+ * log.  A new one is written to a temporary file and renamed into
+ * place, so slaves still reading the previous dump are not disturbed.
+ */
 
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
-	    goto done;
-	}
+static int
+send_complete (krb5_context context, slave *s, int log_fd,
+	       const char *database, uint32_t current_version,
+	       uint32_t oldest_version)
+{
+    krb5_error_code ret;
+    krb5_storage *dump = NULL;
+    uint32_t vno = 0;
+    char *dfn, *tmp = NULL;
+    int fd;
 
-	/*
-	 * If the current dump has an appropriate version, then we can
-	 * break out of the loop and send the file below.
-	 */
+#ifdef HAVE_MMAP
+    if (s->caps & IPROP_CAP_MANY_PRINCS)
+	return stream_complete(context, s, log_fd, database, oldest_version);
+#endif
 
-	if (vno >= oldest_version)
-	    break;
+    ret = asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context));
+    if (ret == -1 || !dfn) {
+	krb5_warn(context, ENOMEM, "Cannot allocate memory");
+	return ENOMEM;
+    }
+    ret = 0;
 
-	/*
-	 * Otherwise, we may need to write a new dump file.  We
-	 * obtain an exclusive lock on the fd.  Because this is
-	 * not guaranteed to be an upgrade of our existing shared
-	 * lock, someone else may have written a new dumpfile while
-	 * we were waiting and so we must first check the vno of
-	 * the dump to see if that happened.  If it did, we need
-	 * to go back to the top of the loop so that we can downgrade
-	 * our lock to a shared one.
-	 */
-
-	flock(fd, LOCK_EX);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_EX)");
-	    goto done;
+    fd = open(dfn, O_RDONLY, 0);
+    if (fd != -1) {
+	dump = krb5_storage_from_fd(fd);
+	close(fd);
+	if (dump != NULL &&
+	    (krb5_ret_uint32(dump, &vno) != 0 || vno < oldest_version)) {
+	    krb5_storage_free(dump);
+	    dump = NULL;
 	}
+    }
 
-	krb5_storage_seek(dump, 0, SEEK_SET);
-	if (ret == -1) {
+    if (dump == NULL) {
+	if (asprintf(&tmp, "%s.new", dfn) == -1 || tmp == NULL) {
+	    tmp = NULL;
+	    ret = ENOMEM;
+	    krb5_warn(context, ret, "Cannot allocate memory");
+	    goto done;
+	}
+	fd = open(tmp, O_CREAT|O_TRUNC|O_RDWR, 0600);
+	if (fd == -1) {
 	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
+	    krb5_warn(context, ret, "Cannot open/create iprop dumpfile %s", tmp);
 	    goto done;
 	}
-
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
+	dump = krb5_storage_from_fd(fd);
+	close(fd);
+	if (!dump) {
+	    ret = errno;
+	    krb5_warn(context, ret, "krb5_storage_from_fd");
 	    goto done;
 	}
 
-	/* check if someone wrote a better version for us */
-	if (vno >= oldest_version)
-	    continue;
-
-	/* Now, we know that we must write a new dump file.  */
-
 	ret = write_dump(context, dump, database, current_version);
 	if (ret)
 	    goto done;
-
-	/*
-	 * And we must continue to the top of the loop so that we can
-	 * downgrade to a shared lock.
-	 */
+	if (rk_rename(tmp, dfn) == -1) {
+	    ret = errno;
+	    krb5_warn(context, ret, "rename %s to %s", tmp, dfn);
+	    goto done;
+	}
+	vno = current_version;
     }
 
     /*
-     * Leaving the above loop, dump should have a ptr right after the initial
-     * 4 byte DB version number and we should have a shared lock on the file
-     * (which we may have just created), so we are reading to simply blast
-     * the data down the wire.
+     * `dump' now points right after the initial 4 byte DB version
+     * number; the rest is sent from slave_flush() as the slave
+     * reads it.
      */
 
-    for (;;) {
-	ret = krb5_ret_data(dump, &data);
-	if (ret == HEIM_ERR_EOF) {
-	    ret = 0;	/* EOF is not an error, it's success */
-	    goto done;
-	}
-
-	if (ret) {
-	    krb5_warn(context, ret, "krb5_ret_data(dump, &data)");
-	    slave_dead(context, s);
-	    goto done;
-	}
-
-	ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
-	krb5_data_free(&data);
+    s->dump = dump;
+    s->dump_version = vno;
+    dump = NULL;
 
-	if (ret) {
-	    krb5_warn (context, ret, "krb5_write_priv_message");
-	    slave_dead(context, s);
-	    goto done;
-	}
+    ret = slave_flush(context, s);
+    if (ret) {
+	krb5_warn (context, ret, "send_complete: %s", s->name);
+	slave_dead(context, s);
     }
 
 done:
-    if (!ret) {
-	s->version = vno;
-	slave_seen(s);
-    }
-    if (fd != -1)
-	close(fd);
-    if (dump)
+    if (dump) {
 	krb5_storage_free(dump);
+	if (tmp)
+	    unlink(tmp);
+    }
+    free(tmp);
+    free(dfn);
     return ret;
 }
 
@@ -632,10 +1010,10 @@ send_are_you_there (krb5_context context, slave *s)
     krb5_store_int32 (sp, ARE_YOU_THERE);
     krb5_storage_free (sp);
 
-    ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+    ret = slave_send(context, s, &data);
 
     if (ret) {
-	krb5_warn (context, ret, "are_you_there: krb5_write_priv_message");
+	krb5_warn (context, ret, "are_you_there: slave_send");
 	slave_dead(context, s);
 	return 1;
     }
@@ -656,6 +1034,14 @@ send_diffs (krb5_context context, slave *s, int log_fd,
     krb5_data data;
     int ret = 0;
 
+    /*
+     * While a complete database is being streamed, or when the slave
+     * is not keeping up, hold back; it is brought up to date once its
+     * output queue drains.
+     */
+    if (slave_streaming(s) || slave_queued(s) > SLAVE_QUEUE_HIGH)
+	return 0;
+
     if (s->version == current_version) {
 	char buf[4];
 
@@ -666,7 +1052,7 @@ send_diffs (krb5_context context, slave *s, int log_fd,
 	krb5_storage_free(sp);
 	data.data   = buf;
 	data.length = 4;
-	ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+	ret = slave_send(context, s, &data);
 	krb5_warnx(context, "slave %s in sync already at version %ld",
 		   s->name, (long)s->version);
 	return ret;
@@ -677,25 +1063,33 @@ send_diffs (krb5_context context, slave *s, int log_fd,
 
     flock(log_fd, LOCK_SH);
     sp = kadm5_log_goto_end (log_fd);
-    flock(log_fd, LOCK_UN);
     right = krb5_storage_seek(sp, 0, SEEK_CUR);
-    for (;;) {
-	ret = kadm5_log_previous (context, sp, &ver, &timestamp, &op, &len);
-	if (ret)
-	    krb5_err(context, 1, ret,
-		     "send_diffs: failed to find previous entry");
-	left = krb5_storage_seek(sp, -16, SEEK_CUR);
-	if (ver == s->version)
-	    return 0;
-	if (ver == s->version + 1)
-	    break;
-	if (left == 0) {
-	    krb5_storage_free(sp);
-	    krb5_warnx(context,
-		       "slave %s (version %lu) out of sync with master "
-		       "(first version in log %lu), sending complete database",
-		       s->name, (unsigned long)s->version, (unsigned long)ver);
-	    return send_complete (context, s, database, current_version, ver);
+    ret = kadm5_log_find_version (context, log_file, log_fd,
+				  s->version + 1, &left);
+    flock(log_fd, LOCK_UN);
+    if (ret == 0) {
+	krb5_storage_seek(sp, left, SEEK_SET);
+    } else {
+	krb5_storage_seek(sp, right, SEEK_SET);
+	for (;;) {
+	    ret = kadm5_log_previous (context, sp, &ver, &timestamp, &op, &len);
+	    if (ret)
+		krb5_err(context, 1, ret,
+			 "send_diffs: failed to find previous entry");
+	    left = krb5_storage_seek(sp, -16, SEEK_CUR);
+	    if (ver == s->version)
+		return 0;
+	    if (ver == s->version + 1)
+		break;
+	    if (left == 0) {
+		krb5_storage_free(sp);
+		krb5_warnx(context,
+			   "slave %s (version %lu) out of sync with master "
+			   "(first version in log %lu), sending complete database",
+			   s->name, (unsigned long)s->version, (unsigned long)ver);
+		return send_complete (context, s, log_fd, database,
+				      current_version, ver);
+	    }
 	}
     }
 
@@ -723,11 +1117,11 @@ send_diffs (krb5_context context, slave *s, int log_fd,
     krb5_store_int32 (sp, FOR_YOU);
     krb5_storage_free(sp);
 
-    ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+    ret = slave_send(context, s, &data);
     krb5_data_free(&data);
 
     if (ret) {
-	krb5_warn (context, ret, "send_diffs: krb5_write_priv_message");
+	krb5_warn (context, ret, "send_diffs: slave_send");
 	slave_dead(context, s);
 	return 1;
     }
@@ -743,11 +1137,18 @@ process_msg (krb5_context context, slave *s, int log_fd,
 	     const char *database, uint32_t current_version)
 {
     int ret = 0;
-    krb5_data out;
+    krb5_data packet, out;
     krb5_storage *sp;
     int32_t tmp;
+    uint32_t caps;
 
-    ret = krb5_read_priv_message(context, s->ac, &s->fd, &out);
+    ret = slave_recv(context, s, &packet);
+    if (ret == EAGAIN)
+	return 0;
+    if (ret == 0) {
+	ret = krb5_rd_priv(context, s->ac, &packet, &out, NULL);
+	krb5_data_free(&packet);
+    }
     if(ret) {
 	krb5_warn (context, ret, "error reading message from %s", s->name);
 	return 1;
@@ -771,6 +1172,8 @@ process_msg (krb5_context context, slave *s, int log_fd,
 	    krb5_warnx (context, "process_msg: client send too I_HAVE data");
 	    break;
 	}
+	if (krb5_ret_uint32 (sp, &caps) == 0)
+	    s->caps = caps;
 	/* new started slave that have old log */
 	if (s->version == 0 && tmp != 0) {
 	    if (current_version < (uint32_t)tmp) {
@@ -1044,7 +1447,8 @@ main(int argc, char **argv)
 
     server_context = (kadm5_server_context *)kadm_handle;
 
-    log_fd = open (server_context->log_context.log_file, O_RDONLY, 0);
+    log_file = server_context->log_context.log_file;
+    log_fd = open (log_file, O_RDONLY, 0);
     if (log_fd < 0)
 	krb5_err (context, 1, errno, "open %s",
 		  server_context->log_context.log_file);
@@ -1061,7 +1465,7 @@ main(int argc, char **argv)
 
     while(exit_flag == 0){
 	slave *p;
-	fd_set readset;
+	fd_set readset, writeset;
 	int max_fd = 0;
 	struct timeval to = {30, 0};
 	uint32_t vers;
@@ -1072,6 +1476,7 @@ main(int argc, char **argv)
 #endif
 
 	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
 	FD_SET(signal_fd, &readset);
 	max_fd = max(max_fd, signal_fd);
 	FD_SET(listen_fd, &readset);
@@ -1081,11 +1486,13 @@ main(int argc, char **argv)
 	    if (p->flags & SLAVE_F_DEAD)
 		continue;
 	    FD_SET(p->fd, &readset);
+	    if (slave_queued(p) > 0 || slave_streaming(p))
+		FD_SET(p->fd, &writeset);
 	    max_fd = max(max_fd, p->fd);
 	}
 
 	ret = select (max_fd + 1,
-		      &readset, NULL, NULL, &to);
+		      &readset, &writeset, NULL, &to);
 	if (ret < 0) {
 	    if (errno == EINTR)
 		continue;
@@ -1151,6 +1558,20 @@ main(int argc, char **argv)
 	for(p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 	        continue;
+	    if (ret && FD_ISSET(p->fd, &writeset)) {
+		--ret;
+		assert(ret >= 0);
+		if (slave_flush(context, p)) {
+		    slave_dead(context, p);
+		    continue;
+		}
+		/* catch up a slave that was held back by send_diffs() */
+		if (!slave_streaming(p) && slave_queued(p) < SLAVE_QUEUE_LOW &&
+		    p->version < current_version)
+		    send_diffs (context, p, log_fd, database, current_version);
+		if (p->flags & SLAVE_F_DEAD)
+		    continue;
+	    }
 	    if (ret && FD_ISSET(p->fd, &readset)) {
 		--ret;
 		assert(ret >= 0);
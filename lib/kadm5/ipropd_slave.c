@@ -159,15 +159,16 @@ ihave (krb5_context context, krb5_auth_context auth_context,
        int fd, uint32_t version)
 {
     int ret;
-    u_char buf[8];
+    u_char buf[12];
     krb5_storage *sp;
     krb5_data data;
 
-    sp = krb5_storage_from_mem (buf, 8);
+    sp = krb5_storage_from_mem (buf, 12);
     krb5_store_int32 (sp, I_HAVE);
     krb5_store_int32 (sp, version);
+    krb5_store_uint32 (sp, IPROP_CAP_MANY_PRINCS);
     krb5_storage_free (sp);
-    data.length = 8;
+    data.length = 12;
     data.data   = buf;
 
     ret = krb5_write_priv_message(context, auth_context, &fd, &data);
@@ -186,6 +187,7 @@ receive_loop (krb5_context context,
     void *buf;
     int32_t vers, vers2;
     ssize_t sret;
+    int locked;
 
     /*
      * Seek to the current version of the local database.
@@ -202,33 +204,17 @@ receive_loop (krb5_context context,
 	    krb5_storage_seek(sp, len + 8, SEEK_CUR);
     } while((uint32_t)vers <= server_context->log_context.version);
 
-    /*
-     * Read up rest of the entires into the memory...
-     */
     left  = krb5_storage_seek (sp, -16, SEEK_CUR);
-    right = krb5_storage_seek (sp, 0, SEEK_END);
-    buf = malloc (right - left);
-    if (buf == NULL && (right - left) != 0)
-	krb5_errx (context, 1, "malloc: no memory");
 
     /*
-     * ...and then write them out to the on-disk log.
+     * Commit the entries to the database, all of them in one
+     * transaction where the backend has them.  They are only added
+     * to the on-disk log, and so to the version we tell the master,
+     * after that: if we die in between, the master sends them again
+     * rather than us claiming changes the database does not have.
      */
-    krb5_storage_seek (sp, left, SEEK_SET);
-    krb5_storage_read (sp, buf, right - left);
-    sret = write (server_context->log_context.log_fd, buf, right-left);
-    if (sret != right - left)
-	krb5_err(context, 1, errno, "Failed to write log to disk");
-    ret = fsync (server_context->log_context.log_fd);
-    if (ret)
-	krb5_err(context, 1, errno, "Failed to sync log to disk");
-    free (buf);
-
-    /*
-     * Go back to the startpoint and start to commit the entires to
-     * the database.
-     */
-    krb5_storage_seek (sp, left, SEEK_SET);
+    locked = (server_context->db->hdb_lock(context, server_context->db,
+					   HDB_WLOCK) == 0);
 
     for(;;) {
 	int32_t len, len2, timestamp, tmp;
@@ -286,6 +272,33 @@ receive_loop (krb5_context context,
 	    krb5_errx(context, 1, "entry %ld: vers != vers2", (long)vers);
     }
 
+    if (locked) {
+	ret = server_context->db->hdb_unlock(context, server_context->db);
+	if (ret)
+	    krb5_err(context, 1, ret, "Failed to commit entries to database");
+    }
+
+    /*
+     * Read up the entries into the memory...
+     */
+    right = krb5_storage_seek (sp, 0, SEEK_END);
+    buf = malloc (right - left);
+    if (buf == NULL && (right - left) != 0)
+	krb5_errx (context, 1, "malloc: no memory");
+
+    /*
+     * ...and then write them out to the on-disk log.
+     */
+    krb5_storage_seek (sp, left, SEEK_SET);
+    krb5_storage_read (sp, buf, right - left);
+    sret = write (server_context->log_context.log_fd, buf, right-left);
+    if (sret != right - left)
+	krb5_err(context, 1, errno, "Failed to write log to disk");
+    ret = fsync (server_context->log_context.log_fd);
+    if (ret)
+	krb5_err(context, 1, errno, "Failed to sync log to disk");
+    free (buf);
+
     /*
      * Update version
      */
@@ -372,10 +385,12 @@ receive_everything (krb5_context context, int fd,
 
     char *dbname;
     HDB *mydb;
+    int locked;
 
     krb5_warnx(context, "receive complete database");
 
-    ret = asprintf(&dbname, "%s-NEW", server_context->db->hdb_name);
+    /* keep the method prefix, hdb_name has it stripped */
+    ret = asprintf(&dbname, "%s-NEW", server_context->config.dbname);
     if (ret == -1)
 	krb5_err(context, 1, ENOMEM, "asprintf");
     ret = hdb_create(context, &mydb, dbname);
@@ -394,6 +409,12 @@ receive_everything (krb5_context context, int fd,
     if (ret)
 	krb5_err (context, 1, ret, "db->open");
 
+    /*
+     * Load everything in one transaction; backends that have none
+     * just take the lock.
+     */
+    locked = (mydb->hdb_lock(context, mydb, HDB_WLOCK) == 0);
+
     sp = NULL;
     krb5_data_zero(&data);
     do {
@@ -430,11 +451,35 @@ receive_everything (krb5_context context, int fd,
 
 	    hdb_free_entry (context, &entry);
 	    krb5_data_free (&data);
+	} else if (opcode == MANY_PRINCS) {
+	    krb5_data value;
+	    hdb_entry_ex entry;
+
+	    while ((ret = krb5_ret_data (sp, &value)) == 0) {
+		memset(&entry, 0, sizeof(entry));
+
+		ret = hdb_value2entry (context, &value, &entry.entry);
+		krb5_data_free (&value);
+		if (ret)
+		    krb5_err (context, 1, ret, "hdb_value2entry");
+		ret = mydb->hdb_store(server_context->context,
+				      mydb,
+				      0, &entry);
+		if (ret)
+		    krb5_err (context, 1, ret, "hdb_store");
+
+		hdb_free_entry (context, &entry);
+	    }
+	    if (ret != HEIM_ERR_EOF)
+		krb5_err (context, 1, ret, "receive_everything: MANY_PRINCS");
+
+	    krb5_storage_free(sp);
+	    krb5_data_free (&data);
 	} else if (opcode == NOW_YOU_HAVE)
 	    ;
 	else
 	    krb5_errx (context, 1, "strange opcode %d", opcode);
-    } while (opcode == ONE_PRINC);
+    } while (opcode == ONE_PRINC || opcode == MANY_PRINCS);
 
     if (opcode != NOW_YOU_HAVE)
 	krb5_errx (context, 1, "receive_everything: strange %d", opcode);
@@ -442,14 +487,37 @@ receive_everything (krb5_context context, int fd,
     krb5_ret_int32 (sp, &vno);
     krb5_storage_free(sp);
 
+    if (locked) {
+	ret = mydb->hdb_unlock(context, mydb);
+	if (ret)
+	    krb5_err (context, 1, ret, "db->unlock");
+	locked = 0;
+    }
+
     reinit_log(context, server_context, vno);
 
     ret = mydb->hdb_rename (context, mydb, server_context->db->hdb_name);
     if (ret)
 	krb5_err (context, 1, ret, "db->rename");
 
+    /*
+     * The old handle may still have the replaced database open, so
+     * get a new one.
+     */
+    (*server_context->db->hdb_destroy)(context, server_context->db);
+    ret = hdb_create(context, &server_context->db,
+		     server_context->config.dbname);
+    if (ret)
+	krb5_err (context, 1, ret, "hdb_create");
+    ret = hdb_set_master_keyfile (context, server_context->db,
+				  server_context->config.stash_file);
+    if (ret)
+	krb5_err (context, 1, ret, "hdb_set_master_keyfile");
+
  cleanup:
     krb5_data_free (&data);
+    if (locked)
+	mydb->hdb_unlock(context, mydb);
 
     ret = mydb->hdb_close (context, mydb);
     if (ret)
@@ -508,6 +576,8 @@ is_up_to_date(krb5_context context, const char *file,
 }
 
 static char *status_file;
+static char *snapshot_file;
+static char *snapshot_interval_str;
 static char *config_file;
 static char *realm;
 static int version_flag;
@@ -527,6 +597,10 @@ static struct getargs args[] = {
       "time before server is considered lost", "time" },
     { "status-file", 0, arg_string, &status_file,
       "file to write out status into", "file" },
+    { "snapshot", 0, arg_string, &snapshot_file,
+      "read-only snapshot of the database to keep up to date", "file" },
+    { "snapshot-interval", 0, arg_string, &snapshot_interval_str,
+      "shortest time between two snapshots (default 1 min)", "time" },
     { "port", 0, arg_string, &port_str,
       "port ipropd-slave will connect to", "port"},
 #ifdef SUPPORT_DETACH
@@ -541,6 +615,47 @@ static struct getargs args[] = {
 
 static int num_args = sizeof(args) / sizeof(args[0]);
 
+static int snapshot_interval = 60;
+static time_t snapshot_time;
+static int snapshot_pending;
+
+/*
+ * Rewrite the snapshot after the database has been updated.  Writing
+ * it copies the whole database, so unless `force' is set it is done at
+ * most once every snapshot_interval seconds; a skipped write is left
+ * pending for the main loop to do later.
+ */
+
+static void
+write_snapshot(krb5_context context, kadm5_server_context *server_context,
+	       int force)
+{
+    HDB *db = server_context->db;
+    krb5_error_code ret;
+    time_t now;
+
+    if (snapshot_file == NULL)
+	return;
+
+    now = time(NULL);
+    if (!force && now - snapshot_time < snapshot_interval) {
+	snapshot_pending = 1;
+	return;
+    }
+    snapshot_pending = 0;
+    snapshot_time = now;
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret) {
+	krb5_warn(context, ret, "db->open");
+	return;
+    }
+    ret = hdb_write_snapshot(context, db, snapshot_file, 0600);
+    if (ret)
+	krb5_warn(context, ret, "hdb_write_snapshot: %s", snapshot_file);
+    db->hdb_close(context, db);
+}
+
 static void
 usage(int status)
 {
@@ -639,6 +754,13 @@ main(int argc, char **argv)
     if (time_before_lost < 0)
 	krb5_errx (context, 1, "couldn't parse time: %s", server_time_lost);
 
+    if (snapshot_interval_str) {
+	snapshot_interval = parse_time (snapshot_interval_str, "s");
+	if (snapshot_interval < 0)
+	    krb5_errx (context, 1, "couldn't parse time: %s",
+		       snapshot_interval_str);
+    }
+
     slave_status(context, status_file, "getting credentials from keytab/database");
 
     memset(&conf, 0, sizeof(conf));
@@ -739,6 +861,7 @@ main(int argc, char **argv)
 	    int32_t tmp;
 	    fd_set readset;
 	    struct timeval to;
+	    int snapshot_wait = FALSE;
 
 #ifndef NO_LIMIT_FD_SETSIZE
 	    if (master_fd >= FD_SETSIZE)
@@ -751,6 +874,17 @@ main(int argc, char **argv)
 	    to.tv_sec = time_before_lost;
 	    to.tv_usec = 0;
 
+	    if (snapshot_pending) {
+		time_t left = snapshot_time + snapshot_interval - time(NULL);
+
+		if (left <= 0) {
+		    write_snapshot(context, server_context, TRUE);
+		} else if (left < to.tv_sec) {
+		    to.tv_sec = left;
+		    snapshot_wait = TRUE;
+		}
+	    }
+
 	    ret = select (master_fd + 1,
 			  &readset, NULL, NULL, &to);
 	    if (ret < 0) {
@@ -759,6 +893,10 @@ main(int argc, char **argv)
 		else
 		    krb5_err (context, 1, errno, "select");
 	    }
+	    if (ret == 0 && snapshot_wait) {
+		write_snapshot(context, server_context, TRUE);
+		continue;
+	    }
 	    if (ret == 0) {
 		krb5_warn (context, 1, "server didn't send a message "
 			   "in %d seconds", time_before_lost);
@@ -778,6 +916,7 @@ main(int argc, char **argv)
 	    switch (tmp) {
 	    case FOR_YOU :
 		receive (context, sp, server_context);
+		write_snapshot(context, server_context, FALSE);
 		ret = ihave (context, auth_context, master_fd,
 			     server_context->log_context.version);
 		if (ret) {
@@ -792,8 +931,10 @@ main(int argc, char **argv)
 					  auth_context);
 		if (ret)
 		    connected = FALSE;
-		else
+		else {
+		    write_snapshot(context, server_context, TRUE);
 		    is_up_to_date(context, status_file, server_context);
+		}
 		break;
 	    case ARE_YOU_THERE :
 		is_up_to_date(context, status_file, server_context);
@@ -817,6 +958,9 @@ main(int argc, char **argv)
 
 	slave_status(context, status_file, "disconnected from master");
     retry:
+	if (snapshot_pending)
+	    write_snapshot(context, server_context, TRUE);
+
 	if (connected == FALSE)
 	    krb5_warnx (context, "disconnected for server");
 
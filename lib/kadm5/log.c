@@ -33,6 +33,9 @@
 
 #include "kadm5_locl.h"
 #include "heim_threads.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 RCSID("$Id$");
 
@@ -47,8 +50,19 @@ RCSID("$Id$");
  * length of record		4 bytes
  * version number		4 bytes
  *
+ * Next to the log, in `<log_file>.idx', an index of the log is kept.
+ * It is a sequence of fixed size records, one per log record:
+ *
+ * version number		4 bytes
+ * reserved (zero)		4 bytes
+ * offset of record in log	8 bytes
+ *
+ * The index is only a hint: it is not fsync()ed, and every offset
+ * read from it is checked against the log before it is used.
  */
 
+#define LOG_INDEX_RECSIZE	16
+
 kadm5_ret_t
 kadm5_log_get_version_fd (int fd,
 			  uint32_t *ver)
@@ -88,6 +102,183 @@ kadm5_log_set_version (kadm5_server_context *context, uint32_t vno)
     return 0;
 }
 
+static char *
+log_index_name(const char *log_file)
+{
+    char *fn;
+
+    if (asprintf(&fn, "%s.idx", log_file) < 0)
+	return NULL;
+    return fn;
+}
+
+static void
+log_index_remove(kadm5_log_context *log_context)
+{
+    char *fn = log_index_name(log_context->log_file);
+
+    if (fn) {
+	unlink(fn);
+	free(fn);
+    }
+}
+
+static void
+log_index_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static uint32_t
+log_index_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+log_index_encode(unsigned char *p, uint32_t ver, off_t off)
+{
+    uint64_t o = off;
+
+    log_index_put32(p, ver);
+    log_index_put32(p + 4, 0);
+    log_index_put32(p + 8, o >> 32);
+    log_index_put32(p + 12, o & 0xffffffff);
+}
+
+static void
+log_index_decode(const unsigned char *p, uint32_t *ver, off_t *off)
+{
+    *ver = log_index_get32(p);
+    *off = (off_t)(((uint64_t)log_index_get32(p + 8) << 32) |
+		   log_index_get32(p + 12));
+}
+
+/*
+ * Write index records for the log records in [0, end) of `log_fd' to
+ * `idx_fd', replacing whatever was there.
+ */
+
+static int
+log_index_rebuild(int log_fd, int idx_fd, off_t end)
+{
+    unsigned char hdr[16], rec[LOG_INDEX_RECSIZE];
+    krb5_storage *sp;
+    krb5_data data;
+    uint32_t ver, len;
+    off_t pos = 0;
+    int ret = 0;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return ENOMEM;
+    while (pos < end) {
+	if (pread(log_fd, hdr, sizeof(hdr), pos) != sizeof(hdr)) {
+	    ret = KADM5_BAD_DB;
+	    break;
+	}
+	ver = log_index_get32(hdr);
+	len = log_index_get32(hdr + 12);
+	log_index_encode(rec, ver, pos);
+	if (krb5_storage_write(sp, rec, sizeof(rec)) != sizeof(rec)) {
+	    ret = ENOMEM;
+	    break;
+	}
+	pos += 24 + len;
+    }
+    if (ret == 0 && pos != end)
+	ret = KADM5_BAD_DB;
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, &data);
+    krb5_storage_free(sp);
+    if (ret)
+	return ret;
+
+    if (ftruncate(idx_fd, 0) < 0 ||
+	pwrite(idx_fd, data.data, data.length, 0) != (ssize_t)data.length)
+	ret = errno;
+    krb5_data_free(&data);
+    return ret;
+}
+
+/*
+ * Add the records in `records', just written at `off', to the index.
+ * An index that does not end with the version before the first of
+ * them (missing, written before a log was copied in, ...) is rebuilt
+ * from the log first.  Failures are not fatal, the index is removed
+ * and the readers fall back to walking the log.
+ */
+
+static void
+log_index_append(kadm5_log_context *log_context,
+		 const krb5_data *records, off_t off)
+{
+    const unsigned char *p = records->data;
+    unsigned char rec[LOG_INDEX_RECSIZE], *buf;
+    uint32_t ver, len, last_ver;
+    off_t size, last_off;
+    size_t pos, n;
+    int fd, ret = 0;
+    char *fn;
+
+    if (records->length < 24)
+	return;
+    buf = malloc((records->length / 24) * LOG_INDEX_RECSIZE);
+    if (buf == NULL)
+	return;
+    for (pos = 0, n = 0; pos + 24 <= records->length; pos += 24 + len) {
+	ver = log_index_get32(p + pos);
+	len = log_index_get32(p + pos + 12);
+	log_index_encode(buf + n * LOG_INDEX_RECSIZE, ver, off + pos);
+	n++;
+    }
+    ver = log_index_get32(p);
+
+    fn = log_index_name(log_context->log_file);
+    if (fn == NULL) {
+	free(buf);
+	return;
+    }
+    fd = open(fn, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+	free(buf);
+	free(fn);
+	return;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+	ret = errno;
+    } else if (size == 0) {
+	if (off != 0)
+	    ret = log_index_rebuild(log_context->log_fd, fd, off);
+    } else if (size % LOG_INDEX_RECSIZE != 0 ||
+	       pread(fd, rec, sizeof(rec), size - sizeof(rec)) != sizeof(rec)) {
+	ret = log_index_rebuild(log_context->log_fd, fd, off);
+    } else {
+	log_index_decode(rec, &last_ver, &last_off);
+	if (last_ver + 1 != ver || last_off >= off)
+	    ret = log_index_rebuild(log_context->log_fd, fd, off);
+    }
+
+    if (ret == 0) {
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0 ||
+	    pwrite(fd, buf, n * LOG_INDEX_RECSIZE, size) !=
+	    (ssize_t)(n * LOG_INDEX_RECSIZE))
+	    ret = errno;
+    }
+    close(fd);
+    if (ret)
+	unlink(fn);
+    free(fn);
+    free(buf);
+}
+
 kadm5_ret_t
 kadm5_log_init (kadm5_server_context *context)
 {
@@ -145,6 +336,7 @@ kadm5_log_reinit (kadm5_server_context *context)
 	close(fd);
 	return ret;
     }
+    log_index_remove(log_context);
 
     log_context->version = 0;
     log_context->log_fd  = fd;
@@ -152,15 +344,28 @@ kadm5_log_reinit (kadm5_server_context *context)
 }
 
 
-kadm5_ret_t
-kadm5_log_end (kadm5_server_context *context)
+static void
+log_close (kadm5_log_context *log_context)
 {
-    kadm5_log_context *log_context = &context->log_context;
     int fd = log_context->log_fd;
 
     flock (fd, LOCK_UN);
     close(fd);
     log_context->log_fd = -1;
+}
+
+/*
+ * Release the log.  Between kadm5_log_begin() and kadm5_log_commit()
+ * or kadm5_log_abort() it stays locked, this is a no-op.
+ */
+
+kadm5_ret_t
+kadm5_log_end (kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+
+    if (log_context->batch == NULL)
+	log_close(log_context);
     return 0;
 }
 
@@ -191,29 +396,33 @@ kadm5_log_postamble (kadm5_log_context *context,
 }
 
 /*
- * flush the log record in `sp'.
+ * Write `data', one or more complete log records, to the end of the
+ * log, make it durable, index it and tell any running ipropd-master.
+ * If that fails the log is cut back to where it was.
  */
 
 static kadm5_ret_t
-kadm5_log_flush (kadm5_log_context *log_context,
-		 krb5_storage *sp)
+kadm5_log_write (kadm5_log_context *log_context,
+		 const krb5_data *data)
 {
-    krb5_data data;
-    size_t len;
     ssize_t ret;
+    off_t off;
+    int save_errno;
 
-    krb5_storage_to_data(sp, &data);
-    len = data.length;
-    ret = write (log_context->log_fd, data.data, len);
-    if (ret < 0 || (size_t)ret != len) {
-	krb5_data_free(&data);
-	return errno;
-    }
-    if (fsync (log_context->log_fd) < 0) {
-	krb5_data_free(&data);
+    off = lseek (log_context->log_fd, 0, SEEK_END);
+    if (off < 0)
 	return errno;
+
+    ret = write (log_context->log_fd, data->data, data->length);
+    if (ret < 0 || (size_t)ret != data->length ||
+	fsync (log_context->log_fd) < 0) {
+	save_errno = ret >= 0 && (size_t)ret != data->length ? ENOSPC : errno;
+	(void) ftruncate (log_context->log_fd, off);
+	return save_errno;
     }
 
+    log_index_append(log_context, data, off);
+
     /*
      * Try to send a signal to any running `ipropd-master'
      */
@@ -233,10 +442,114 @@ kadm5_log_flush (kadm5_log_context *log_context,
 	    log_context->socket_info->ai_addrlen);
 #endif
 
+    return 0;
+}
+
+/*
+ * flush the log record in `sp'.  Between kadm5_log_begin() and
+ * kadm5_log_commit() the record is only queued.
+ */
+
+static kadm5_ret_t
+kadm5_log_flush (kadm5_log_context *log_context,
+		 krb5_storage *sp)
+{
+    krb5_data data;
+    kadm5_ret_t ret;
+
+    ret = krb5_storage_to_data(sp, &data);
+    if (ret)
+	return ret;
+    if (log_context->batch != NULL) {
+	if (krb5_storage_write(log_context->batch, data.data, data.length)
+	    != (krb5_ssize_t)data.length)
+	    ret = ENOMEM;
+    } else
+	ret = kadm5_log_write(log_context, &data);
     krb5_data_free(&data);
+    return ret;
+}
+
+/*
+ * Start a log transaction: until kadm5_log_commit() the records of
+ * all operations are collected in memory, and then written with a
+ * single write(), fsync() and signal to ipropd-master.  The log stays
+ * locked all the while, so no one else adds to it in between and the
+ * records keep the version numbers they are given.
+ */
+
+kadm5_ret_t
+kadm5_log_begin (kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    kadm5_ret_t ret;
+
+    if (log_context->batch != NULL)
+	return 0;
+
+    ret = kadm5_log_init (context);
+    if (ret)
+	return ret;
+
+    log_context->batch = krb5_storage_emem();
+    if (log_context->batch == NULL) {
+	log_close(log_context);
+	return krb5_enomem(context->context);
+    }
     return 0;
 }
 
+/*
+ * Write out the records collected since kadm5_log_begin().  On failure
+ * nothing is left in the log and the caller should throw away the
+ * changes to the database.  Either way the log stays locked until
+ * kadm5_log_end(), which should come after the database is unlocked,
+ * so that whoever holds the log lock sees a database that agrees with
+ * it.
+ */
+
+kadm5_ret_t
+kadm5_log_commit (kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    krb5_storage *batch = log_context->batch;
+    krb5_data data;
+    kadm5_ret_t ret;
+
+    if (batch == NULL)
+	return 0;
+    log_context->batch = NULL;
+
+    ret = krb5_storage_to_data(batch, &data);
+    krb5_storage_free(batch);
+    if (ret == 0 && data.length != 0)
+	ret = kadm5_log_write (log_context, &data);
+    krb5_data_free(&data);
+    if (ret)
+	(void) kadm5_log_get_version_fd (log_context->log_fd,
+					 &log_context->version);
+    return ret;
+}
+
+/*
+ * Throw away the records collected since kadm5_log_begin(), for when
+ * the changes they describe did not make it to the database.  Release
+ * the log with kadm5_log_end().
+ */
+
+kadm5_ret_t
+kadm5_log_abort (kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+
+    if (log_context->batch == NULL)
+	return 0;
+    krb5_storage_free(log_context->batch);
+    log_context->batch = NULL;
+    return kadm5_log_get_version_fd (log_context->log_fd,
+				     &log_context->version);
+}
+
 /*
  * Add a `create' operation to the log.
  */
@@ -281,7 +594,10 @@ kadm5_log_create (kadm5_server_context *context,
 
 /*
  * Read the data of a create log record from `sp' and change the
- * database.
+ * database.  The entry may be there already when the slave got it in
+ * a complete database that was newer than its version, so it is
+ * replaced, as are the targets of renames, and deleting a missing
+ * entry is not an error.
  */
 
 static kadm5_ret_t
@@ -309,7 +625,8 @@ kadm5_log_replay_create (kadm5_server_context *context,
 			       "Unmarshaling hdb entry failed");
 	return ret;
     }
-    ret = context->db->hdb_store(context->context, context->db, 0, &ent);
+    ret = context->db->hdb_store(context->context, context->db,
+				 HDB_F_REPLACE, &ent);
     hdb_free_entry (context->context, &ent);
     return ret;
 }
@@ -384,6 +701,8 @@ kadm5_log_replay_delete (kadm5_server_context *context,
 
     ret = context->db->hdb_remove(context->context, context->db, principal);
     krb5_free_principal (context->context, principal);
+    if (ret == HDB_ERR_NOENTRY)
+	ret = 0;
     return ret;
 }
 
@@ -494,7 +813,7 @@ kadm5_log_replay_rename (kadm5_server_context *context,
 	return ret;
     }
     ret = context->db->hdb_store (context->context, context->db,
-				  0, &target_ent);
+				  HDB_F_REPLACE, &target_ent);
     hdb_free_entry (context->context, &target_ent);
     if (ret) {
 	krb5_free_principal (context->context, source);
@@ -502,6 +821,8 @@ kadm5_log_replay_rename (kadm5_server_context *context,
     }
     ret = context->db->hdb_remove (context->context, context->db, source);
     krb5_free_principal (context->context, source);
+    if (ret == HDB_ERR_NOENTRY)
+	ret = 0;
     return ret;
 }
 
@@ -931,6 +1252,94 @@ kadm5_log_previous (krb5_context context,
     return ret;
 }
 
+/*
+ * Find the offset of the record for version `ver' in the log open on
+ * `fd' using the index kept next to `log_file'.  Returns ENOENT when
+ * the index does not know about `ver' or does not agree with the log,
+ * in which case the caller has to walk the log itself.
+ */
+
+kadm5_ret_t
+kadm5_log_find_version (krb5_context context,
+			const char *log_file,
+			int fd,
+			uint32_t ver,
+			off_t *off)
+{
+#ifdef HAVE_MMAP
+    const unsigned char *base;
+    unsigned char hdr[4];
+    uint32_t first, v;
+    off_t log_size;
+    size_t n, lo, hi, mid;
+    struct stat st;
+    char *fn;
+    int idx_fd;
+    kadm5_ret_t ret = ENOENT;
+
+    *off = 0;
+
+    fn = log_index_name(log_file);
+    if (fn == NULL)
+	return ENOMEM;
+    idx_fd = open(fn, O_RDONLY, 0);
+    free(fn);
+    if (idx_fd < 0)
+	return ENOENT;
+    if (fstat(idx_fd, &st) < 0 || st.st_size < LOG_INDEX_RECSIZE) {
+	close(idx_fd);
+	return ENOENT;
+    }
+    n = st.st_size / LOG_INDEX_RECSIZE;
+    base = mmap(NULL, n * LOG_INDEX_RECSIZE, PROT_READ, MAP_SHARED, idx_fd, 0);
+    close(idx_fd);
+    if (base == MAP_FAILED)
+	return ENOENT;
+
+    /*
+     * Versions in the log are consecutive, so the record for `ver' is
+     * normally at a fixed distance from the first; if not, the index
+     * is still sorted and can be searched.
+     */
+    log_index_decode(base, &first, off);
+    if (ver >= first && ver - first < n) {
+	lo = ver - first;
+	log_index_decode(base + lo * LOG_INDEX_RECSIZE, &v, off);
+	if (v == ver)
+	    ret = 0;
+    }
+    if (ret) {
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+	    mid = lo + (hi - lo) / 2;
+	    log_index_decode(base + mid * LOG_INDEX_RECSIZE, &v, off);
+	    if (v == ver) {
+		ret = 0;
+		break;
+	    } else if (v < ver)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+    }
+    munmap((void *)base, n * LOG_INDEX_RECSIZE);
+    if (ret)
+	return ret;
+
+    /* Trust, but verify */
+    log_size = lseek(fd, 0, SEEK_END);
+    if (log_size < 0 || *off + 24 > log_size ||
+	pread(fd, hdr, sizeof(hdr), *off) != sizeof(hdr))
+	return ENOENT;
+    if (log_index_get32(hdr) != ver)
+	return ENOENT;
+    return 0;
+#else
+    return ENOENT;
+#endif
+}
+
 /*
  * Replay a record from the log
  */
@@ -33,6 +33,7 @@
 
 #include "kadm5_locl.h"
 #include "kadm5-pwcheck.h"
+#include "heim_threads.h"
 
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
@@ -40,6 +41,10 @@
 #ifdef HAVE_DLFCN_H
 #include <dlfcn.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <ctype.h>
 
 static int
 min_length_passwd_quality (krb5_context context,
@@ -226,6 +231,303 @@ external_passwd_quality (krb5_context context,
 }
 
 
+/*
+ * A password dictionary is a Bloom filter of the lower-cased words of
+ * a word list, built by kadm5_create_passwd_dictionary().  The file is
+ * the magic, the number of hash functions (four bytes) and the number
+ * of bits (eight bytes, both big endian) followed by the bits.  It is
+ * mapped once and checking a password is a few memory reads, instead
+ * of running an external program for every password change.
+ */
+
+#define PWDICT_MAGIC "kadm5dic"
+#define PWDICT_HEADER_SIZE 20
+
+struct pwdict {
+    char *path;
+    struct stat st;
+    unsigned char *map;
+    size_t len;
+    uint32_t k;
+    uint64_t nbits;
+};
+
+/* the mapped dictionary, remapped when the file changes */
+static HEIMDAL_MUTEX pwdict_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct pwdict pwdict;
+
+static void
+pwdict_hash(const char *s, size_t len, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t a = 14695981039346656037ULL, b = 0x9ae16a3b2f90404fULL;
+    size_t i;
+    int c;
+
+    for (i = 0; i < len; i++) {
+	c = tolower((unsigned char)s[i]);
+	a = (a ^ c) * 1099511628211ULL;
+	b = (b ^ c) * 0x100000001b3ULL;
+	b ^= b >> 29;
+    }
+    *h1 = a;
+    *h2 = b | 1;
+}
+
+static void
+pwdict_unmap(struct pwdict *d)
+{
+    if (d->map) {
+#ifdef HAVE_MMAP
+	munmap(d->map, d->len);
+#else
+	free(d->map);
+#endif
+    }
+    free(d->path);
+    memset(d, 0, sizeof(*d));
+}
+
+static uint64_t
+get_be(const unsigned char *p, size_t n)
+{
+    uint64_t v = 0;
+
+    while (n--)
+	v = (v << 8) | *p++;
+    return v;
+}
+
+/*
+ * Map the dictionary in `path', unless it is the one already mapped.
+ * Called with pwdict_mutex held.
+ */
+
+static int
+pwdict_load(struct pwdict *d, const char *path, char *message, size_t length)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (stat(path, &st) < 0) {
+	snprintf(message, length, "password dictionary %s: %s",
+		 path, strerror(errno));
+	return 1;
+    }
+    if (d->map && strcmp(d->path, path) == 0 &&
+	d->st.st_dev == st.st_dev && d->st.st_ino == st.st_ino &&
+	d->st.st_size == st.st_size && d->st.st_mtime == st.st_mtime)
+	return 0;
+    pwdict_unmap(d);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	snprintf(message, length, "password dictionary %s: %s",
+		 path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return 1;
+    }
+    if (st.st_size < PWDICT_HEADER_SIZE || (uintmax_t)st.st_size > SIZE_MAX) {
+	close(fd);
+	goto bad;
+    }
+#ifdef HAVE_MMAP
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	snprintf(message, length, "password dictionary %s: %s",
+		 path, strerror(errno));
+	return 1;
+    }
+#else
+    {
+	size_t size;
+
+	close(fd);
+	if (rk_undumpdata(path, &map, &size) != 0 ||
+	    size != (size_t)st.st_size) {
+	    snprintf(message, length, "password dictionary %s: "
+		     "failed to read", path);
+	    return 1;
+	}
+    }
+#endif
+    d->map = map;
+    d->len = st.st_size;
+    d->st = st;
+    d->k = get_be(d->map + 8, 4);
+    d->nbits = get_be(d->map + 12, 8);
+    d->path = strdup(path);
+    if (d->path == NULL) {
+	pwdict_unmap(d);
+	strlcpy(message, "out of memory", length);
+	return 1;
+    }
+    if (memcmp(d->map, PWDICT_MAGIC, 8) != 0 || d->k == 0 || d->k > 64 ||
+	d->nbits == 0 || d->nbits > (uint64_t)(d->len - PWDICT_HEADER_SIZE) * 8) {
+	pwdict_unmap(d);
+	goto bad;
+    }
+    return 0;
+
+ bad:
+    snprintf(message, length, "%s is not a password dictionary", path);
+    return 1;
+}
+
+static int
+dictionary_passwd_quality (krb5_context context,
+			   krb5_principal principal,
+			   krb5_data *pwd,
+			   const char *opaque,
+			   char *message,
+			   size_t length)
+{
+    const unsigned char *bits;
+    const char *path;
+    uint64_t h1, h2, bit;
+    uint32_t i;
+    int ret = 1;
+
+    path = krb5_config_get_string(context, NULL,
+				  "password_quality",
+				  "dictionary",
+				  NULL);
+    if (path == NULL) {
+	snprintf(message, length, "password dictionary not configured");
+	return 1;
+    }
+    HEIMDAL_MUTEX_lock(&pwdict_mutex);
+    if (pwdict_load(&pwdict, path, message, length))
+	goto out;
+
+    bits = pwdict.map + PWDICT_HEADER_SIZE;
+    pwdict_hash(pwd->data, pwd->length, &h1, &h2);
+    for (i = 0; i < pwdict.k; i++) {
+	bit = (h1 + i * h2) % pwdict.nbits;
+	if ((bits[bit / 8] & (1 << (bit % 8))) == 0) {
+	    ret = 0;
+	    goto out;
+	}
+    }
+    strlcpy(message, "Password is in the dictionary of common passwords",
+	    length);
+ out:
+    HEIMDAL_MUTEX_unlock(&pwdict_mutex);
+    return ret;
+}
+
+/**
+ * Build the password dictionary used by the dictionary policy from a
+ * word list with one word per line, using about `bits_per_word' bits
+ * of the filter per word (16 makes the false positives about 1 in
+ * 2000).  The new dictionary replaces `dictionary' atomically.
+ *
+ * @param context Kerberos 5 context
+ * @param wordlist file with the words
+ * @param dictionary file to write the dictionary to
+ * @param bits_per_word size of the dictionary
+ *
+ * @return 0 or an error code
+ */
+
+krb5_error_code
+kadm5_create_passwd_dictionary(krb5_context context,
+			       const char *wordlist,
+			       const char *dictionary,
+			       unsigned bits_per_word)
+{
+    unsigned char header[PWDICT_HEADER_SIZE], *bits;
+    uint64_t nwords = 0, nbits, h1, h2, bit;
+    char *data, *p, *end, *nl, *tmp;
+    size_t size, len, i;
+    uint32_t k;
+    int ret, fd;
+
+    if (bits_per_word == 0 || bits_per_word > 64) {
+	krb5_set_error_message(context, EINVAL, "invalid bits per word %u",
+			       bits_per_word);
+	return EINVAL;
+    }
+    ret = rk_undumpdata(wordlist, (void **)&data, &size);
+    if (ret) {
+	krb5_set_error_message(context, ret, "%s: %s", wordlist,
+			       strerror(ret));
+	return ret;
+    }
+    end = data + size;
+    for (p = data; p < end; p = nl + 1) {
+	nl = memchr(p, '\n', end - p);
+	if (nl == NULL)
+	    nl = end;
+	if (nl > p)
+	    nwords++;
+    }
+
+    nbits = nwords * bits_per_word;
+    if (nbits < 64)
+	nbits = 64;
+    nbits = (nbits + 7) & ~(uint64_t)7;
+    k = (bits_per_word * 693 + 500) / 1000; /* bits_per_word * ln 2 */
+    if (k == 0)
+	k = 1;
+
+    bits = calloc(1, nbits / 8);
+    if (bits == NULL) {
+	free(data);
+	return krb5_enomem(context);
+    }
+    for (p = data; p < end; p = nl + 1) {
+	nl = memchr(p, '\n', end - p);
+	if (nl == NULL)
+	    nl = end;
+	len = nl - p;
+	if (len > 0 && p[len - 1] == '\r')
+	    len--;
+	if (len == 0)
+	    continue;
+	pwdict_hash(p, len, &h1, &h2);
+	for (i = 0; i < k; i++) {
+	    bit = (h1 + i * h2) % nbits;
+	    bits[bit / 8] |= 1 << (bit % 8);
+	}
+    }
+    free(data);
+
+    memcpy(header, PWDICT_MAGIC, 8);
+    for (i = 0; i < 4; i++)
+	header[8 + i] = (k >> (24 - 8 * i)) & 0xff;
+    for (i = 0; i < 8; i++)
+	header[12 + i] = (nbits >> (56 - 8 * i)) & 0xff;
+
+    if (asprintf(&tmp, "%s.new", dictionary) < 0 || tmp == NULL) {
+	free(bits);
+	return krb5_enomem(context);
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	ret = errno;
+    } else {
+	if (net_write(fd, header, sizeof(header)) != sizeof(header) ||
+	    net_write(fd, bits, nbits / 8) != (ssize_t)(nbits / 8) ||
+	    fsync(fd) < 0)
+	    ret = errno ? errno : EIO;
+	if (close(fd) < 0 && ret == 0)
+	    ret = errno;
+	if (ret == 0 && rename(tmp, dictionary) < 0)
+	    ret = errno;
+	if (ret)
+	    unlink(tmp);
+    }
+    if (ret)
+	krb5_set_error_message(context, ret, "%s: %s", dictionary,
+			       strerror(ret));
+    free(tmp);
+    free(bits);
+    return ret;
+}
+
 static kadm5_passwd_quality_check_func_v0 passwd_quality_check =
 	min_length_passwd_quality_v0;
 
@@ -233,6 +535,7 @@ struct kadm5_pw_policy_check_func builtin_funcs[] = {
     { "minimum-length", min_length_passwd_quality },
     { "character-class", char_class_passwd_quality },
     { "external-check", external_passwd_quality },
+    { "dictionary", dictionary_passwd_quality },
     { NULL, NULL }
 };
 struct kadm5_pw_policy_verifier builtin_verifier = {
@@ -89,6 +89,7 @@ typedef struct kadm5_log_context {
     struct addrinfo *socket_info;
 #endif
     krb5_socket_t socket_fd;
+    krb5_storage *batch;	/* records queued by kadm5_log_begin() */
 } kadm5_log_context;
 
 typedef struct kadm5_server_context {
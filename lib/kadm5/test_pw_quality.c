@@ -49,6 +49,94 @@ static struct getargs args[] = {
 };
 int num_args = sizeof(args) / sizeof(args[0]);
 
+static void
+write_file(krb5_context context, const char *fn, const char *s)
+{
+    FILE *f;
+
+    f = fopen(fn, "w");
+    if (f == NULL)
+	krb5_err(context, 1, errno, "%s", fn);
+    if (fputs(s, f) == EOF || fclose(f) == EOF)
+	krb5_err(context, 1, errno, "%s", fn);
+}
+
+static int
+check_password(krb5_context context, krb5_principal p, const char *pw,
+	       int rejected)
+{
+    krb5_data pw_data;
+    const char *s;
+
+    pw_data.data = rk_UNCONST(pw);
+    pw_data.length = strlen(pw);
+    s = kadm5_check_password_quality(context, p, &pw_data);
+    if ((s != NULL) != rejected) {
+	krb5_warnx(context, "\"%s\" was %s", pw,
+		   s ? "rejected" : "accepted");
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Build a password dictionary, check passwords against it, then
+ * rebuild it with other words and check that the new one is used.
+ */
+
+static int
+test_dictionary(krb5_context context)
+{
+    const char *words = "test_pw_quality.words";
+    const char *dict = "test_pw_quality.dict";
+    char *files[2];
+    krb5_principal p;
+    krb5_error_code ret;
+    int failed = 0;
+
+    files[0] = "test_pw_quality.conf";
+    files[1] = NULL;
+    write_file(context, files[0],
+	       "[password_quality]\n"
+	       "\tpolicies = builtin:dictionary\n"
+	       "\tdictionary = test_pw_quality.dict\n");
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+    ret = krb5_parse_name(context, "test@EXAMPLE.ORG", &p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+
+    /* a configured dictionary that is missing rejects everything */
+    unlink(dict);
+    failed += check_password(context, p, "correct horse battery staple", 1);
+
+    write_file(context, words, "password\nLetMeIn\r\n\nqwerty\n123456\n");
+    ret = kadm5_create_passwd_dictionary(context, words, dict, 16);
+    if (ret)
+	krb5_err(context, 1, ret, "kadm5_create_passwd_dictionary");
+    failed += check_password(context, p, "password", 1);
+    failed += check_password(context, p, "PASSWORD", 1);
+    failed += check_password(context, p, "letmein", 1);
+    failed += check_password(context, p, "123456", 1);
+    failed += check_password(context, p, "qwert", 0);
+    failed += check_password(context, p, "correct horse battery staple", 0);
+
+    write_file(context, words, "hunter2\n");
+    ret = kadm5_create_passwd_dictionary(context, words, dict, 16);
+    if (ret)
+	krb5_err(context, 1, ret, "kadm5_create_passwd_dictionary");
+    failed += check_password(context, p, "hunter2", 1);
+    failed += check_password(context, p, "password", 0);
+    failed += check_password(context, p, "letmein", 0);
+
+    krb5_free_principal(context, p);
+    unlink(words);
+    unlink(dict);
+    unlink(files[0]);
+    return failed;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -67,6 +155,13 @@ main(int argc, char **argv)
 	exit(0);
     }
 
+    /* without a password to check, test the dictionary policy */
+    if (principal == NULL && password == NULL) {
+	ret = test_dictionary(context);
+	krb5_free_context(context);
+	return ret != 0;
+    }
+
     if (principal == NULL)
 	krb5_errx(context, 1, "no principal given");
     if (password == NULL)
@@ -86,6 +86,7 @@ _krb5_HMAC_MD5_checksum(krb5_context context,
 	return ret;
     }
     ksign.key = &kb;
+    ksign.hmac = NULL;
     kb.keyvalue = ksign_c.checksum;
     EVP_DigestInit_ex(m, EVP_md5(), NULL);
     t[0] = (usage >>  0) & 0xFF;
@@ -155,6 +156,7 @@ ARCFOUR_subencrypt(krb5_context context,
     k2_c.checksum.data   = k2_c_data;
 
     ke.key = &kb;
+    ke.hmac = NULL;
     kb.keyvalue = k2_c.checksum;
 
     cksum.checksum.length = 16;
@@ -165,6 +167,7 @@ ARCFOUR_subencrypt(krb5_context context,
 	krb5_abortx(context, "hmac failed");
 
     ke.key = &kb;
+    ke.hmac = NULL;
     kb.keyvalue = k1_c.checksum;
 
     k3_c.checksum.length = sizeof(k3_c_data);
@@ -223,6 +226,7 @@ ARCFOUR_subdecrypt(krb5_context context,
     k2_c.checksum.data   = k2_c_data;
 
     ke.key = &kb;
+    ke.hmac = NULL;
     kb.keyvalue = k1_c.checksum;
 
     k3_c.checksum.length = sizeof(k3_c_data);
@@ -238,6 +242,7 @@ ARCFOUR_subdecrypt(krb5_context context,
     EVP_CIPHER_CTX_cleanup(&ctx);
 
     ke.key = &kb;
+    ke.hmac = NULL;
     kb.keyvalue = k2_c.checksum;
 
     cksum.checksum.length = 16;
@@ -50,6 +50,7 @@ static struct _krb5_key_data *_new_derived_key(krb5_crypto crypto, unsigned usag
 static void free_key_schedule(krb5_context,
 			      struct _krb5_key_data *,
 			      struct _krb5_encryption_type *);
+static void free_hmac_state(struct _krb5_key_data *);
 
 /* 
  * Converts etype to a user readable string and sets as a side effect
@@ -142,6 +143,10 @@ _key_schedule(krb5_context context,
 
     kt = et->keytype;
 
+    /* keys that get a schedule also keep their HMAC pads */
+    if (key->hmac == NULL)
+	key->hmac = calloc(1, sizeof(*key->hmac));
+
     if(kt->schedule == NULL)
 	return 0;
     if (key->schedule != NULL)
@@ -176,6 +181,181 @@ SHA1_checksum(krb5_context context,
     return 0;
 }
 
+static const EVP_MD *
+hmac_md(struct _krb5_checksum_type *cm)
+{
+    switch (cm->type) {
+    case CKSUMTYPE_SHA1:
+	return EVP_sha1();
+    case CKSUMTYPE_RSA_MD5:
+	return EVP_md5();
+    default:
+	return NULL;
+    }
+}
+
+static void
+free_hmac_state(struct _krb5_key_data *key)
+{
+    struct _krb5_hmac_state *h = key->hmac;
+
+    if (h == NULL)
+	return;
+    if (h->ipad)
+	EVP_MD_CTX_destroy(h->ipad);
+    if (h->opad)
+	EVP_MD_CTX_destroy(h->opad);
+    if (h->ctx)
+	EVP_MD_CTX_destroy(h->ctx);
+    free(h);
+    key->hmac = NULL;
+}
+
+static krb5_error_code
+hmac_init_pads(krb5_context context,
+	       struct _krb5_checksum_type *cm,
+	       const EVP_MD *md,
+	       struct _krb5_key_data *keyblock,
+	       EVP_MD_CTX *ipad,
+	       EVP_MD_CTX *opad)
+{
+    unsigned char pad[128], digest[EVP_MAX_MD_SIZE];
+    const unsigned char *key;
+    size_t key_len, i;
+
+    if (keyblock->key->keyvalue.length > cm->blocksize) {
+	if (EVP_Digest(keyblock->key->keyvalue.data,
+		       keyblock->key->keyvalue.length,
+		       digest, NULL, md, NULL) != 1)
+	    return krb5_enomem(context);
+	key = digest;
+	key_len = EVP_MD_size(md);
+    } else {
+	key = keyblock->key->keyvalue.data;
+	key_len = keyblock->key->keyvalue.length;
+    }
+
+    memset(pad, 0x36, cm->blocksize);
+    for (i = 0; i < key_len; i++)
+	pad[i] ^= key[i];
+    if (EVP_DigestInit_ex(ipad, md, NULL) != 1 ||
+	EVP_DigestUpdate(ipad, pad, cm->blocksize) != 1)
+	goto fail;
+    memset(pad, 0x5c, cm->blocksize);
+    for (i = 0; i < key_len; i++)
+	pad[i] ^= key[i];
+    if (EVP_DigestInit_ex(opad, md, NULL) != 1 ||
+	EVP_DigestUpdate(opad, pad, cm->blocksize) != 1)
+	goto fail;
+
+    memset(pad, 0, sizeof(pad));
+    memset(digest, 0, sizeof(digest));
+    return 0;
+
+ fail:
+    memset(pad, 0, sizeof(pad));
+    memset(digest, 0, sizeof(digest));
+    return krb5_enomem(context);
+}
+
+/*
+ * Set up the HMAC state of a key for `md', if the key keeps one.
+ */
+
+static krb5_error_code
+hmac_state(krb5_context context,
+	   struct _krb5_checksum_type *cm,
+	   const EVP_MD *md,
+	   struct _krb5_key_data *keyblock)
+{
+    struct _krb5_hmac_state *h = keyblock->hmac;
+    krb5_error_code ret;
+
+    if (h->md == md)
+	return 0;
+    h->md = NULL;
+    if (h->ipad == NULL)
+	h->ipad = EVP_MD_CTX_create();
+    if (h->opad == NULL)
+	h->opad = EVP_MD_CTX_create();
+    if (h->ctx == NULL)
+	h->ctx = EVP_MD_CTX_create();
+    if (h->ipad == NULL || h->opad == NULL || h->ctx == NULL)
+	return krb5_enomem(context);
+    ret = hmac_init_pads(context, cm, md, keyblock, h->ipad, h->opad);
+    if (ret)
+	return ret;
+    h->md = md;
+    return 0;
+}
+
+static krb5_error_code
+hmac_evp(krb5_context context,
+	 struct _krb5_checksum_type *cm,
+	 const EVP_MD *md,
+	 const void *data,
+	 size_t len,
+	 struct _krb5_key_data *keyblock,
+	 Checksum *result)
+{
+    unsigned char inner[EVP_MAX_MD_SIZE];
+    EVP_MD_CTX *ipad, *opad, *ctx;
+    krb5_error_code ret = 0;
+    unsigned int inner_len;
+
+    if (keyblock->hmac) {
+	ret = hmac_state(context, cm, md, keyblock);
+	if (ret)
+	    return ret;
+	ipad = keyblock->hmac->ipad;
+	opad = keyblock->hmac->opad;
+	ctx = keyblock->hmac->ctx;
+    } else {
+	/* a key without a schedule, most likely used only once */
+	ipad = EVP_MD_CTX_create();
+	opad = EVP_MD_CTX_create();
+	ctx = NULL;
+	if (ipad == NULL || opad == NULL)
+	    ret = krb5_enomem(context);
+	else
+	    ret = hmac_init_pads(context, cm, md, keyblock, ipad, opad);
+	if (ret)
+	    goto out;
+    }
+
+    if (ctx) {
+	if (EVP_MD_CTX_copy_ex(ctx, ipad) != 1)
+	    goto fail;
+    } else {
+	ctx = ipad;
+    }
+    if (EVP_DigestUpdate(ctx, data, len) != 1 ||
+	EVP_DigestFinal_ex(ctx, inner, &inner_len) != 1)
+	goto fail;
+    if (keyblock->hmac) {
+	if (EVP_MD_CTX_copy_ex(ctx, opad) != 1)
+	    goto fail;
+    } else {
+	ctx = opad;
+    }
+    if (EVP_DigestUpdate(ctx, inner, inner_len) != 1 ||
+	EVP_DigestFinal_ex(ctx, result->checksum.data, NULL) != 1)
+	goto fail;
+    goto out;
+
+ fail:
+    ret = krb5_enomem(context);
+ out:
+    memset(inner, 0, sizeof(inner));
+    if (keyblock->hmac == NULL) {
+	if (ipad)
+	    EVP_MD_CTX_destroy(ipad);
+	if (opad)
+	    EVP_MD_CTX_destroy(opad);
+    }
+    return ret;
+}
+
 /* HMAC according to RFC2104 */
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 _krb5_internal_hmac(krb5_context context,
@@ -190,6 +370,10 @@ _krb5_internal_hmac(krb5_context context,
     unsigned char *key;
     size_t key_len;
     size_t i;
+    const EVP_MD *md = hmac_md(cm);
+
+    if (md != NULL && cm->blocksize <= 128)
+	return hmac_evp(context, cm, md, data, len, keyblock, result);
 
     ipad = malloc(cm->blocksize + len);
     if (ipad == NULL)
@@ -256,11 +440,13 @@ krb5_hmac(krb5_context context,
 
     kd.key = key;
     kd.schedule = NULL;
+    kd.hmac = NULL;
 
     ret = _krb5_internal_hmac(context, c, data, len, usage, &kd, result);
 
     if (kd.schedule)
 	krb5_free_data(context, kd.schedule);
+    free_hmac_state(&kd);
 
     return ret;
 }
@@ -1907,6 +2093,7 @@ _krb5_derive_key(krb5_context context,
 	free_key_schedule(context, key, et);
 	key->schedule = NULL;
     }
+    free_hmac_state(key);
     if (k) {
 	memset(k, 0, nblocks * et->blocksize);
 	free(k);
@@ -1918,10 +2105,16 @@ static struct _krb5_key_data *
 _new_derived_key(krb5_crypto crypto, unsigned usage)
 {
     struct _krb5_key_usage *d = crypto->key_usage;
-    d = realloc(d, (crypto->num_key_usage + 1) * sizeof(*d));
-    if(d == NULL)
-	return NULL;
-    crypto->key_usage = d;
+
+    if (crypto->num_key_usage == crypto->alloc_key_usage) {
+	int n = crypto->alloc_key_usage ? crypto->alloc_key_usage * 2 : 4;
+
+	d = realloc(d, n * sizeof(*d));
+	if(d == NULL)
+	    return NULL;
+	crypto->key_usage = d;
+	crypto->alloc_key_usage = n;
+    }
     d += crypto->num_key_usage++;
     memset(d, 0, sizeof(*d));
     d->usage = usage;
@@ -1952,6 +2145,7 @@ krb5_derive_key(krb5_context context,
 	return ret;
 
     d.schedule = NULL;
+    d.hmac = NULL;
     ret = _krb5_derive_key(context, et, &d, constant, constant_len);
     if (ret == 0)
 	ret = krb5_copy_keyblock(context, d.key, derived_key);
@@ -1959,27 +2153,152 @@ krb5_derive_key(krb5_context context,
     return ret;
 }
 
+/*
+ * Derived keys are looked up in a small direct mapped table in front
+ * of the array of derived keys, since a context typically uses a few
+ * usages over and over.
+ */
+
+static unsigned
+key_usage_slot(unsigned usage)
+{
+    return ((usage >> 8) ^ usage ^ (usage >> 3)) % KEY_USAGE_MAP_SIZE;
+}
+
+/*
+ * Process wide cache of derived keys.  Crypto contexts that are set up
+ * again and again with the same key, like the krbtgt key in the KDC,
+ * then skip deriving the same keys each time.  Entries are found by a
+ * digest of the enctype and the key together with the usage; the
+ * cache is direct mapped and of fixed size, and only used when
+ * [libdefaults] derived_key_cache is set.
+ */
+
+#define DERIVED_KEY_CACHE_SIZE 256
+
+struct derived_key_cache_entry {
+    unsigned char digest[32];
+    unsigned usage;
+    krb5_keyblock key;
+};
+
+static HEIMDAL_MUTEX derived_key_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct derived_key_cache_entry derived_key_cache[DERIVED_KEY_CACHE_SIZE];
+
+static struct derived_key_cache_entry *
+derived_key_cache_slot(krb5_crypto crypto, unsigned usage)
+{
+    uint32_t h;
+
+    memcpy(&h, crypto->key_digest, sizeof(h));
+    h ^= usage * 2654435761U;
+    return &derived_key_cache[h % DERIVED_KEY_CACHE_SIZE];
+}
+
+static int
+derived_key_cache_digest(krb5_crypto crypto)
+{
+    unsigned char t[8];
+    EVP_MD_CTX *m;
+    int ok;
+
+    if (crypto->key_digest_set)
+	return 1;
+    _krb5_put_int(t, crypto->et->type, 4);
+    _krb5_put_int(t + 4, crypto->key.key->keytype, 4);
+    m = EVP_MD_CTX_create();
+    if (m == NULL)
+	return 0;
+    ok = EVP_DigestInit_ex(m, EVP_sha256(), NULL) == 1 &&
+	EVP_DigestUpdate(m, t, sizeof(t)) == 1 &&
+	EVP_DigestUpdate(m, crypto->key.key->keyvalue.data,
+			 crypto->key.key->keyvalue.length) == 1 &&
+	EVP_DigestFinal_ex(m, crypto->key_digest, NULL) == 1;
+    EVP_MD_CTX_destroy(m);
+    crypto->key_digest_set = ok;
+    return ok;
+}
+
+static krb5_error_code
+derived_key_cache_get(krb5_context context,
+		      krb5_crypto crypto,
+		      unsigned usage,
+		      krb5_keyblock **key)
+{
+    struct derived_key_cache_entry *e;
+    krb5_error_code ret = ENOENT;
+
+    if ((context->flags & KRB5_CTX_F_DERIVED_KEY_CACHE) == 0 ||
+	!derived_key_cache_digest(crypto))
+	return ENOENT;
+
+    e = derived_key_cache_slot(crypto, usage);
+    HEIMDAL_MUTEX_lock(&derived_key_cache_mutex);
+    if (e->key.keyvalue.length != 0 && e->usage == usage &&
+	memcmp(e->digest, crypto->key_digest, sizeof(e->digest)) == 0)
+	ret = krb5_copy_keyblock(context, &e->key, key);
+    HEIMDAL_MUTEX_unlock(&derived_key_cache_mutex);
+    return ret;
+}
+
+static void
+derived_key_cache_put(krb5_context context,
+		      krb5_crypto crypto,
+		      unsigned usage,
+		      const krb5_keyblock *key)
+{
+    struct derived_key_cache_entry *e;
+
+    if ((context->flags & KRB5_CTX_F_DERIVED_KEY_CACHE) == 0 ||
+	!derived_key_cache_digest(crypto))
+	return;
+
+    e = derived_key_cache_slot(crypto, usage);
+    HEIMDAL_MUTEX_lock(&derived_key_cache_mutex);
+    krb5_free_keyblock_contents(context, &e->key);
+    if (krb5_copy_keyblock_contents(context, key, &e->key) == 0) {
+	memcpy(e->digest, crypto->key_digest, sizeof(e->digest));
+	e->usage = usage;
+    } else {
+	memset(&e->key, 0, sizeof(e->key));
+    }
+    HEIMDAL_MUTEX_unlock(&derived_key_cache_mutex);
+}
+
 static krb5_error_code
 _get_derived_key(krb5_context context,
 		 krb5_crypto crypto,
 		 unsigned usage,
 		 struct _krb5_key_data **key)
 {
-    int i;
+    int i, *slot;
     struct _krb5_key_data *d;
     unsigned char constant[5];
+    krb5_error_code ret;
 
+    slot = &crypto->key_usage_map[key_usage_slot(usage)];
+    if (*slot > 0 && crypto->key_usage[*slot - 1].usage == usage) {
+	*key = &crypto->key_usage[*slot - 1].key;
+	return 0;
+    }
     for(i = 0; i < crypto->num_key_usage; i++)
 	if(crypto->key_usage[i].usage == usage) {
+	    *slot = i + 1;
 	    *key = &crypto->key_usage[i].key;
 	    return 0;
 	}
     d = _new_derived_key(crypto, usage);
     if (d == NULL)
 	return krb5_enomem(context);
-    krb5_copy_keyblock(context, crypto->key.key, &d->key);
-    _krb5_put_int(constant, usage, 5);
-    _krb5_derive_key(context, crypto->et, d, constant, sizeof(constant));
+    *slot = crypto->num_key_usage;
+    if (derived_key_cache_get(context, crypto, usage, &d->key) != 0) {
+	krb5_copy_keyblock(context, crypto->key.key, &d->key);
+	_krb5_put_int(constant, usage, 5);
+	ret = _krb5_derive_key(context, crypto->et, d, constant,
+			       sizeof(constant));
+	if (ret == 0)
+	    derived_key_cache_put(context, crypto, usage, d->key);
+    }
     *key = d;
     return 0;
 }
@@ -2034,8 +2353,12 @@ krb5_crypto_init(krb5_context context,
 	return ret;
     }
     (*crypto)->key.schedule = NULL;
+    (*crypto)->key.hmac = NULL;
     (*crypto)->num_key_usage = 0;
+    (*crypto)->alloc_key_usage = 0;
     (*crypto)->key_usage = NULL;
+    memset((*crypto)->key_usage_map, 0, sizeof((*crypto)->key_usage_map));
+    (*crypto)->key_digest_set = 0;
     return 0;
 }
 
@@ -2059,6 +2382,7 @@ _krb5_free_key_data(krb5_context context, struct _krb5_key_data *key,
 	free_key_schedule(context, key, et);
 	key->schedule = NULL;
     }
+    free_hmac_state(key);
 }
 
 static void
@@ -35,18 +35,38 @@
 #define DES3_OLD_ENCTYPE 1
 #endif
 
+/*
+ * HMAC state of a key: the digest contexts after the inner and outer
+ * key pads, so that a checksum only hashes the data and the inner
+ * digest, and a context to run them in.
+ */
+
+struct _krb5_hmac_state {
+    const EVP_MD *md;
+    EVP_MD_CTX *ipad;
+    EVP_MD_CTX *opad;
+    EVP_MD_CTX *ctx;
+};
+
 struct _krb5_key_data {
     krb5_keyblock *key;
     krb5_data *schedule;
+    struct _krb5_hmac_state *hmac;
 };
 
 struct _krb5_key_usage;
 
+#define KEY_USAGE_MAP_SIZE 16
+
 struct krb5_crypto_data {
     struct _krb5_encryption_type *et;
     struct _krb5_key_data key;
     int num_key_usage;
+    int alloc_key_usage;
     struct _krb5_key_usage *key_usage;
+    int key_usage_map[KEY_USAGE_MAP_SIZE]; /* index + 1 of recent usages */
+    int key_digest_set;
+    unsigned char key_digest[32];
 };
 
 #define CRYPTO_ETYPE(C) ((C)->et->type)
@@ -101,6 +101,7 @@ krb5_recvauth_match_version(krb5_context context,
     uint32_t len;
     u_char repl;
     krb5_data data;
+    unsigned char *buf;
     krb5_flags ap_options;
     ssize_t n;
 
@@ -230,20 +231,10 @@ krb5_recvauth_match_version(krb5_context context,
     }
 
     /*
-     * Send OK.
-     */
-    len = 0;
-    if (krb5_net_write (context, p_fd, &len, 4) != 4) {
-	ret = errno;
-	krb5_set_error_message(context, ret, "write: %s", strerror(ret));
-	krb5_free_ticket(context, *ticket);
-	*ticket = NULL;
-	return ret;
-    }
-
-    /*
-     * If client requires mutual authentication, send AP_REP.
+     * Send OK, and the AP_REP if the client requires mutual
+     * authentication, in one write (see krb5_write_message()).
      */
+    krb5_data_zero (&data);
     if (ap_options & AP_OPTS_MUTUAL_REQUIRED) {
 	ret = krb5_mk_rep (context, *auth_context, &data);
 	if (ret) {
@@ -251,14 +242,31 @@ krb5_recvauth_match_version(krb5_context context,
 	    *ticket = NULL;
 	    return ret;
 	}
+    }
 
-	ret = krb5_write_message (context, p_fd, &data);
-	if (ret) {
-	    krb5_free_ticket(context, *ticket);
-	    *ticket = NULL;
-	    return ret;
-	}
+    len = 4 + (data.length ? 4 + data.length : 0);
+    buf = malloc(len);
+    if (buf == NULL) {
 	krb5_data_free (&data);
+	krb5_free_ticket(context, *ticket);
+	*ticket = NULL;
+	return krb5_enomem(context);
+    }
+    _krb5_put_int(buf, 0, 4);
+    if (data.length) {
+	_krb5_put_int(buf + 4, data.length, 4);
+	memcpy(buf + 8, data.data, data.length);
+    }
+    krb5_data_free (&data);
+
+    if (krb5_net_write (context, p_fd, buf, len) != (ssize_t)len) {
+	ret = errno;
+	free(buf);
+	krb5_set_error_message(context, ret, "write: %s", strerror(ret));
+	krb5_free_ticket(context, *ticket);
+	*ticket = NULL;
+	return ret;
     }
+    free(buf);
     return 0;
 }
@@ -34,10 +34,1014 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+/*
+ * A replay cache type.  The name is kept in the handle, `resolve' and
+ * `close' may be NULL for types that keep no other state.
+ */
+
+typedef struct krb5_rc_ops {
+    const char *type;
+    const char *default_name;
+    krb5_error_code (*resolve)(krb5_context, krb5_rcache);
+    krb5_error_code (*initialize)(krb5_context, krb5_rcache, krb5_deltat);
+    krb5_error_code (*destroy)(krb5_context, krb5_rcache);
+    void (*close)(krb5_context, krb5_rcache);
+    krb5_error_code (*store)(krb5_context, krb5_rcache, time_t,
+			     const unsigned char *);
+    krb5_error_code (*expunge)(krb5_context, krb5_rcache);
+    krb5_error_code (*get_lifespan)(krb5_context, krb5_rcache, krb5_deltat *);
+} krb5_rc_ops;
+
 struct krb5_rcache_data {
+    const krb5_rc_ops *ops;
+    char *name;
+    void *data;
+};
+
+struct rc_entry{
+    time_t stamp;
+    unsigned char data[16];
+};
+
+static krb5_error_code
+file_initialize(krb5_context context,
+		krb5_rcache id,
+		krb5_deltat auth_lifespan)
+{
+    FILE *f = fopen(id->name, "w");
+    struct rc_entry tmp;
+    int ret;
+
+    if(f == NULL) {
+	char buf[128];
+	ret = errno;
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "open(%s): %s", id->name, buf);
+	return ret;
+    }
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.stamp = auth_lifespan;
+    fwrite(&tmp, 1, sizeof(tmp), f);
+    fclose(f);
+    return 0;
+}
+
+static krb5_error_code
+rc_remove(krb5_context context, krb5_rcache id)
+{
+    int ret;
+
+    if(remove(id->name) < 0) {
+	char buf[128];
+	ret = errno;
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "remove(%s): %s", id->name, buf);
+	return ret;
+    }
+    return 0;
+}
+
+static krb5_error_code
+file_store(krb5_context context,
+	   krb5_rcache id,
+	   time_t now,
+	   const unsigned char *data)
+{
+    struct rc_entry ent, tmp;
+    time_t t;
+    FILE *f;
+    int ret;
+    size_t count;
+
+    ent.stamp = now;
+    memcpy(ent.data, data, sizeof(ent.data));
+    f = fopen(id->name, "r");
+    if(f == NULL) {
+	char buf[128];
+	ret = errno;
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "open(%s): %s", id->name, buf);
+	return ret;
+    }
+    rk_cloexec_file(f);
+    count = fread(&tmp, sizeof(ent), 1, f);
+    if(count != 1) {
+	fclose(f);
+	return KRB5_RC_IO_UNKNOWN;
+    }
+    t = ent.stamp - tmp.stamp;
+    while(fread(&tmp, sizeof(ent), 1, f)){
+	if(tmp.stamp < t)
+	    continue;
+	if(memcmp(tmp.data, ent.data, sizeof(ent.data)) == 0){
+	    fclose(f);
+	    krb5_clear_error_message (context);
+	    return KRB5_RC_REPLAY;
+	}
+    }
+    if(ferror(f)){
+	char buf[128];
+	ret = errno;
+	fclose(f);
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "%s: %s",
+			       id->name, buf);
+	return ret;
+    }
+    fclose(f);
+    f = fopen(id->name, "a");
+    if(f == NULL) {
+	char buf[128];
+	rk_strerror_r(errno, buf, sizeof(buf));
+	krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
+			       "open(%s): %s", id->name, buf);
+	return KRB5_RC_IO_UNKNOWN;
+    }
+    fwrite(&ent, 1, sizeof(ent), f);
+    fclose(f);
+    return 0;
+}
+
+static krb5_error_code
+file_expunge(krb5_context context,
+	     krb5_rcache id)
+{
+    return 0;
+}
+
+static krb5_error_code
+file_get_lifespan(krb5_context context,
+		  krb5_rcache id,
+		  krb5_deltat *auth_lifespan)
+{
+    FILE *f = fopen(id->name, "r");
+    int r;
+    struct rc_entry ent;
+
+    if (f == NULL) {
+	krb5_clear_error_message (context);
+	return KRB5_RC_IO_UNKNOWN;
+    }
+    r = fread(&ent, sizeof(ent), 1, f);
+    fclose(f);
+    if(r){
+	*auth_lifespan = ent.stamp;
+	return 0;
+    }
+    krb5_clear_error_message (context);
+    return KRB5_RC_IO_UNKNOWN;
+}
+
+static const krb5_rc_ops file_ops = {
+    "FILE",
+    "FILE:/var/run/default_rcache",
+    NULL,
+    file_initialize,
+    rc_remove,
+    NULL,
+    file_store,
+    file_expunge,
+    file_get_lifespan
+};
+
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+
+/*
+ * The HASH replay cache is a memory mapped open addressing hash table
+ * of authenticator checksums, so checking and storing an
+ * authenticator touches a few cache lines instead of reading the
+ * whole file.  The table is split into stripes that are locked
+ * independently, both between the threads of a process and with
+ * fcntl range locks between processes.  The range locks are open file
+ * description locks where there are any: a classic POSIX lock belongs
+ * to the process, and the close of any other descriptor of the file in
+ * the process, say by another context's replay cache, silently drops
+ * it.  A checksum is only ever kept
+ * within RC_HASH_PROBE slots of its home slot, and a slot whose stamp
+ * is older than the lifespan is free to be reused, so the file has a
+ * fixed size and never needs expunging.  If all the slots near the
+ * home slot are in use the store fails rather than let a replay
+ * through.  Like the FILE type the file is in host byte order.
+ *
+ * krb5_rc_initialize() replaces the file and bumps the generation in
+ * the header of the old one, which tells the handles that have it
+ * mapped to map the new one.  Failing that, say when the file was
+ * removed, they stat() it at most every RC_HASH_RECHECK seconds.  A
+ * mapping a handle stops using is kept until the handle is closed,
+ * as other threads may still be in it.
+ */
+
+#define RC_HASH_MAGIC "KRB5HRC1"
+#define RC_HASH_HEADER_SIZE 64
+#define RC_HASH_STRIPES 256
+#define RC_HASH_PROBE 32
+#define RC_HASH_DEFAULT_SIZE (1 << 18)
+#define RC_HASH_MUTEXES 64
+#define RC_HASH_RECHECK 1
+
+struct rc_hash_header {
+    char magic[8];
+    uint32_t lifespan;
+    uint32_t nstripes;
+    uint32_t stripe_slots;
+    uint32_t generation;
+};
+
+struct rc_hash_slot {
+    uint32_t stamp;
+    unsigned char data[16];
+};
+
+struct rc_hash_map {
+    struct rc_hash_map *next;	/* older mappings */
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    unsigned char *map;
+    size_t len;
+    struct rc_hash_header hdr;
+    struct rc_hash_slot *slots;
+};
+
+struct rc_hash {
+    HEIMDAL_MUTEX mutex;	/* protects current and checked */
+    struct rc_hash_map *current;
+    time_t checked;
+};
+
+static HEIMDAL_MUTEX rc_hash_mutex[RC_HASH_MUTEXES];
+static heim_base_once_t rc_hash_once = HEIM_BASE_ONCE_INIT;
+
+static void
+rc_hash_init_mutexes(void *arg)
+{
+    size_t i;
+
+    for (i = 0; i < RC_HASH_MUTEXES; i++)
+	HEIMDAL_MUTEX_init(&rc_hash_mutex[i]);
+}
+
+static krb5_error_code
+rc_hash_error(krb5_context context, int ret, const char *op,
+	      const char *name)
+{
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, ret, "%s(%s): %s", op, name, buf);
+    return ret;
+}
+
+static void
+rc_hash_unmap(struct rc_hash *h)
+{
+    struct rc_hash_map *m;
+
+    while ((m = h->current) != NULL) {
+	h->current = m->next;
+	munmap(m->map, m->len);
+	close(m->fd);
+	free(m);
+    }
+}
+
+/*
+ * Write a new empty table next to `name' and move it into place.
+ * Unless `replace' is set an existing cache is left alone.
+ */
+
+static krb5_error_code
+rc_hash_create(krb5_context context, const char *name,
+	       krb5_deltat lifespan, int replace)
+{
+    unsigned char header[RC_HASH_HEADER_SIZE];
+    struct rc_hash_header hdr;
+    krb5_error_code ret = 0;
+    uint32_t nslots;
+    int64_t size;
+    char *tmp;
+    int fd;
+
+    size = krb5_config_get_int_default(context, NULL, RC_HASH_DEFAULT_SIZE,
+				       "libdefaults", "rcache_hash_size",
+				       NULL);
+    for (nslots = RC_HASH_STRIPES * RC_HASH_PROBE;
+	 nslots < size && nslots < (1U << 30);
+	 nslots <<= 1)
+	;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RC_HASH_MAGIC, sizeof(hdr.magic));
+    hdr.lifespan = lifespan;
+    hdr.nstripes = RC_HASH_STRIPES;
+    hdr.stripe_slots = nslots / RC_HASH_STRIPES;
+    memset(header, 0, sizeof(header));
+    memcpy(header, &hdr, sizeof(hdr));
+
+    if (asprintf(&tmp, "%s.XXXXXX", name) < 0 || tmp == NULL)
+	return krb5_enomem(context);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	ret = rc_hash_error(context, errno, "mkstemp", tmp);
+	free(tmp);
+	return ret;
+    }
+    if (net_write(fd, header, sizeof(header)) != sizeof(header) ||
+	ftruncate(fd, sizeof(header) +
+		  (off_t)nslots * sizeof(struct rc_hash_slot)) < 0)
+	ret = rc_hash_error(context, errno ? errno : EIO, "write", tmp);
+    if (close(fd) < 0 && ret == 0)
+	ret = rc_hash_error(context, errno, "close", tmp);
+    if (ret == 0) {
+	if (replace) {
+	    int old = open(name, O_RDWR);
+	    uint32_t generation;
+
+	    if (rename(tmp, name) < 0)
+		ret = rc_hash_error(context, errno, "rename", name);
+	    /* send the handles still on the old file to the new one */
+	    if (ret == 0 && old >= 0 &&
+		pread(old, &generation, sizeof(generation),
+		      offsetof(struct rc_hash_header, generation)) ==
+		sizeof(generation)) {
+		generation++;
+		(void) pwrite(old, &generation, sizeof(generation),
+			      offsetof(struct rc_hash_header, generation));
+	    }
+	    if (old >= 0)
+		close(old);
+	} else if (link(tmp, name) < 0 && errno != EEXIST) {
+	    ret = rc_hash_error(context, errno, "link", name);
+	}
+    }
+    unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/*
+ * Map the cache, creating it with the default lifespan if needed, and
+ * add the mapping in front of the older ones of `h'.
+ */
+
+static krb5_error_code
+rc_hash_map_file(krb5_context context, krb5_rcache id, struct rc_hash *h)
+{
+    const struct rc_hash_header *hdr;
+    struct rc_hash_map *m;
+    krb5_error_code ret;
+    struct stat st;
+    int created = 0;
+    void *map;
+    int fd;
+
+ again:
+    fd = open(id->name, O_RDWR);
+    if (fd < 0) {
+	if (errno != ENOENT || created)
+	    return rc_hash_error(context, errno, "open", id->name);
+	ret = rc_hash_create(context, id->name, context->max_skew, 0);
+	if (ret)
+	    return ret;
+	created = 1;
+	goto again;
+    }
+    rk_cloexec(fd);
+    if (fstat(fd, &st) < 0) {
+	ret = rc_hash_error(context, errno, "fstat", id->name);
+	close(fd);
+	return ret;
+    }
+    if (st.st_size < RC_HASH_HEADER_SIZE || (uintmax_t)st.st_size > SIZE_MAX)
+	goto bad;
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	ret = rc_hash_error(context, errno, "mmap", id->name);
+	close(fd);
+	return ret;
+    }
+    hdr = map;
+    if (memcmp(hdr->magic, RC_HASH_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->nstripes == 0 || hdr->stripe_slots < RC_HASH_PROBE ||
+	(hdr->stripe_slots & (hdr->stripe_slots - 1)) != 0 ||
+	(uint64_t)st.st_size != RC_HASH_HEADER_SIZE +
+	(uint64_t)hdr->nstripes * hdr->stripe_slots *
+	sizeof(struct rc_hash_slot)) {
+	munmap(map, st.st_size);
+	goto bad;
+    }
+    m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+	munmap(map, st.st_size);
+	close(fd);
+	return krb5_enomem(context);
+    }
+    m->fd = fd;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->map = map;
+    m->len = st.st_size;
+    m->hdr = *hdr;
+    m->slots = (struct rc_hash_slot *)(m->map + RC_HASH_HEADER_SIZE);
+    m->next = h->current;
+    h->current = m;
+    return 0;
+
+ bad:
+    close(fd);
+    krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
+			   N_("%s is not a HASH replay cache", ""), id->name);
+    return KRB5_RC_IO_UNKNOWN;
+}
+
+/*
+ * Return the current mapping of the cache in `mp', mapping it again if
+ * the file was replaced.
+ */
+
+static krb5_error_code
+rc_hash_open(krb5_context context, krb5_rcache id, struct rc_hash_map **mp)
+{
+    struct rc_hash *h = id->data;
+    struct rc_hash_map *m;
+    krb5_error_code ret = 0;
+    struct stat st;
+    time_t now;
+
+    HEIMDAL_MUTEX_lock(&h->mutex);
+    m = h->current;
+    if (m != NULL) {
+	const volatile struct rc_hash_header *hdr = (void *)m->map;
+
+	if (hdr->generation != m->hdr.generation) {
+	    m = NULL;
+	} else if ((now = time(NULL)) - h->checked >= RC_HASH_RECHECK) {
+	    if (stat(id->name, &st) < 0 ||
+		st.st_dev != m->dev || st.st_ino != m->ino)
+		m = NULL;
+	    else
+		h->checked = now;
+	}
+    }
+    if (m == NULL) {
+	ret = rc_hash_map_file(context, id, h);
+	if (ret == 0)
+	    h->checked = time(NULL);
+    }
+    *mp = h->current;
+    HEIMDAL_MUTEX_unlock(&h->mutex);
+    return ret;
+}
+
+static int
+rc_hash_fcntl(int fd, int cmd, struct flock *l)
+{
+    int ret;
+
+    do {
+	ret = fcntl(fd, cmd, l);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? errno : 0;
+}
+
+static krb5_error_code
+rc_hash_lock(krb5_context context, krb5_rcache id, struct rc_hash_map *h,
+	     uint32_t stripe, int type)
+{
+    size_t stripe_len = h->hdr.stripe_slots * sizeof(struct rc_hash_slot);
+    struct flock l;
+    int ret;
+
+    if (type != F_UNLCK)
+	HEIMDAL_MUTEX_lock(&rc_hash_mutex[stripe % RC_HASH_MUTEXES]);
+
+    memset(&l, 0, sizeof(l));
+    l.l_start = RC_HASH_HEADER_SIZE + (off_t)stripe * stripe_len;
+    l.l_len = stripe_len;
+    l.l_type = type;
+    l.l_whence = SEEK_SET;
+#ifdef F_OFD_SETLKW
+    ret = rc_hash_fcntl(h->fd, F_OFD_SETLKW, &l);
+    if (ret == EINVAL)		/* a kernel without OFD locks */
+	ret = rc_hash_fcntl(h->fd, F_SETLKW, &l);
+#else
+    ret = rc_hash_fcntl(h->fd, F_SETLKW, &l);
+#endif
+
+    if (type == F_UNLCK || ret)
+	HEIMDAL_MUTEX_unlock(&rc_hash_mutex[stripe % RC_HASH_MUTEXES]);
+    if (ret)
+	return rc_hash_error(context, ret, "lock", id->name);
+    return 0;
+}
+
+static krb5_error_code
+hash_resolve(krb5_context context, krb5_rcache id)
+{
+    struct rc_hash *h;
+
+    heim_base_once_f(&rc_hash_once, NULL, rc_hash_init_mutexes);
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL)
+	return krb5_enomem(context);
+    HEIMDAL_MUTEX_init(&h->mutex);
+    id->data = h;
+    return 0;
+}
+
+static void
+hash_close(krb5_context context, krb5_rcache id)
+{
+    struct rc_hash *h = id->data;
+
+    if (h) {
+	rc_hash_unmap(h);
+	HEIMDAL_MUTEX_destroy(&h->mutex);
+	free(h);
+    }
+}
+
+static krb5_error_code
+hash_initialize(krb5_context context,
+		krb5_rcache id,
+		krb5_deltat auth_lifespan)
+{
+    return rc_hash_create(context, id->name, auth_lifespan, 1);
+}
+
+static krb5_error_code
+hash_destroy(krb5_context context,
+	     krb5_rcache id)
+{
+    struct rc_hash *h = id->data;
+
+    HEIMDAL_MUTEX_lock(&h->mutex);
+    rc_hash_unmap(h);
+    HEIMDAL_MUTEX_unlock(&h->mutex);
+    return rc_remove(context, id);
+}
+
+static krb5_error_code
+hash_store(krb5_context context,
+	   krb5_rcache id,
+	   time_t now,
+	   const unsigned char *data)
+{
+    struct rc_hash_map *h;
+    struct rc_hash_slot *base, *s, *slot = NULL;
+    uint32_t h1, h2, stripe, mask, limit, i;
+    krb5_error_code ret;
+
+    ret = rc_hash_open(context, id, &h);
+    if (ret)
+	return ret;
+
+    memcpy(&h1, data, sizeof(h1));
+    memcpy(&h2, data + 4, sizeof(h2));
+    stripe = h1 % h->hdr.nstripes;
+    mask = h->hdr.stripe_slots - 1;
+    base = h->slots + (size_t)stripe * h->hdr.stripe_slots;
+    limit = (uint32_t)now - h->hdr.lifespan;
+
+    ret = rc_hash_lock(context, id, h, stripe, F_WRLCK);
+    if (ret)
+	return ret;
+    for (i = 0; i < RC_HASH_PROBE; i++) {
+	s = &base[(h2 + i) & mask];
+	if (s->stamp == 0 || s->stamp < limit) {
+	    if (slot == NULL)
+		slot = s;
+	    continue;
+	}
+	if (memcmp(s->data, data, sizeof(s->data)) == 0) {
+	    ret = KRB5_RC_REPLAY;
+	    krb5_clear_error_message(context);
+	    break;
+	}
+    }
+    if (ret == 0 && slot == NULL) {
+	ret = KRB5_RC_IO_SPACE;
+	krb5_set_error_message(context, ret,
+			       N_("replay cache %s is full", ""), id->name);
+    }
+    if (ret == 0) {
+	memcpy(slot->data, data, sizeof(slot->data));
+	slot->stamp = now;
+    }
+    rc_hash_lock(context, id, h, stripe, F_UNLCK);
+    return ret;
+}
+
+static krb5_error_code
+hash_expunge(krb5_context context,
+	     krb5_rcache id)
+{
+    struct rc_hash_map *h;
+    struct rc_hash_slot *s;
+    uint32_t stripe, limit, i;
+    krb5_error_code ret;
+
+    ret = rc_hash_open(context, id, &h);
+    if (ret)
+	return ret;
+
+    limit = (uint32_t)time(NULL) - h->hdr.lifespan;
+    for (stripe = 0; stripe < h->hdr.nstripes; stripe++) {
+	ret = rc_hash_lock(context, id, h, stripe, F_WRLCK);
+	if (ret)
+	    return ret;
+	s = h->slots + (size_t)stripe * h->hdr.stripe_slots;
+	for (i = 0; i < h->hdr.stripe_slots; i++, s++)
+	    if (s->stamp != 0 && s->stamp < limit)
+		memset(s, 0, sizeof(*s));
+	rc_hash_lock(context, id, h, stripe, F_UNLCK);
+    }
+    return 0;
+}
+
+static krb5_error_code
+hash_get_lifespan(krb5_context context,
+		  krb5_rcache id,
+		  krb5_deltat *auth_lifespan)
+{
+    struct rc_hash_map *h;
+    krb5_error_code ret;
+
+    ret = rc_hash_open(context, id, &h);
+    if (ret)
+	return ret;
+    *auth_lifespan = h->hdr.lifespan;
+    return 0;
+}
+
+static const krb5_rc_ops hash_ops = {
+    "HASH",
+    "HASH:/var/run/default_rcache.hash",
+    hash_resolve,
+    hash_initialize,
+    hash_destroy,
+    hash_close,
+    hash_store,
+    hash_expunge,
+    hash_get_lifespan
+};
+
+#endif /* HAVE_MMAP && HAVE_FCNTL */
+
+/*
+ * A MEMORY replay cache lives in the process and is shared by every
+ * context that resolves the same name, so threaded acceptors can
+ * check for replays without touching the file system.  Entries are
+ * spread by checksum over RC_MEM_SHARDS shards, each with its own
+ * lock and hash table, and expire on a clock wheel.  An entry is
+ * filed in the wheel slot of the tick it was stored in.  When the
+ * wheel comes round to that slot again, the entries there are older
+ * than the lifespan and are freed.  Like a MEMORY credential cache,
+ * a replay cache lives until it is destroyed.
+ */
+
+#define RC_MEM_SHARDS 64
+#define RC_MEM_WHEEL 64
+#define RC_MEM_MIN_BUCKETS 64
+
+struct rc_mem_entry {
+    struct rc_mem_entry *next, **prev;
+    struct rc_mem_entry *wnext;
+    time_t stamp;
+    unsigned char data[16];
+};
+
+struct rc_mem_shard {
+    HEIMDAL_MUTEX mutex;
+    krb5_deltat lifespan;
+    time_t tick_len;
+    time_t tick;
+    size_t count;
+    size_t nbuckets;
+    struct rc_mem_entry **table;
+    struct rc_mem_entry *wheel[RC_MEM_WHEEL];
+};
+
+struct rc_mem {
     char *name;
+    unsigned int refcnt;
+    int dead;
+    struct rc_mem *next;
+    struct rc_mem_shard shard[RC_MEM_SHARDS];
 };
 
+static HEIMDAL_MUTEX rc_mem_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct rc_mem *rc_mem_head;
+
+static void
+rc_mem_set_lifespan(struct rc_mem_shard *sh, krb5_deltat lifespan)
+{
+    if (lifespan < 0)
+	lifespan = 0;
+    sh->lifespan = lifespan;
+    sh->tick_len = lifespan / (RC_MEM_WHEEL - 1) + 1;
+    sh->tick = 0;
+}
+
+static void
+rc_mem_unlink(struct rc_mem_shard *sh, struct rc_mem_entry *e)
+{
+    *e->prev = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    sh->count--;
+}
+
+static void
+rc_mem_clear(struct rc_mem_shard *sh)
+{
+    struct rc_mem_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < RC_MEM_WHEEL; i++) {
+	for (e = sh->wheel[i]; e; e = next) {
+	    next = e->wnext;
+	    free(e);
+	}
+	sh->wheel[i] = NULL;
+    }
+    free(sh->table);
+    sh->table = NULL;
+    sh->nbuckets = 0;
+    sh->count = 0;
+}
+
+/*
+ * Move the wheel up to `now', freeing the slots it passes.
+ */
+
+static void
+rc_mem_expire(struct rc_mem_shard *sh, time_t now)
+{
+    struct rc_mem_entry *e, *next;
+    time_t tick = now / sh->tick_len;
+    size_t slot;
+
+    if (tick <= sh->tick)
+	return;
+    if (tick - sh->tick > RC_MEM_WHEEL)
+	sh->tick = tick - RC_MEM_WHEEL;
+    while (sh->tick < tick) {
+	sh->tick++;
+	slot = sh->tick % RC_MEM_WHEEL;
+	for (e = sh->wheel[slot]; e; e = next) {
+	    next = e->wnext;
+	    rc_mem_unlink(sh, e);
+	    free(e);
+	}
+	sh->wheel[slot] = NULL;
+    }
+}
+
+static uint64_t
+rc_mem_hash(const unsigned char *data)
+{
+    uint64_t h;
+
+    memcpy(&h, data + 4, sizeof(h));
+    return h;
+}
+
+static void
+rc_mem_link(struct rc_mem_shard *sh, struct rc_mem_entry *e)
+{
+    struct rc_mem_entry **head;
+
+    head = &sh->table[rc_mem_hash(e->data) & (sh->nbuckets - 1)];
+    e->next = *head;
+    if (e->next)
+	e->next->prev = &e->next;
+    e->prev = head;
+    *head = e;
+    sh->count++;
+}
+
+static int
+rc_mem_grow(struct rc_mem_shard *sh)
+{
+    struct rc_mem_entry **old = sh->table, *e, *next;
+    size_t i, n = sh->nbuckets;
+
+    sh->table = calloc(n ? n * 2 : RC_MEM_MIN_BUCKETS, sizeof(sh->table[0]));
+    if (sh->table == NULL) {
+	sh->table = old;
+	return ENOMEM;
+    }
+    sh->nbuckets = n ? n * 2 : RC_MEM_MIN_BUCKETS;
+    sh->count = 0;
+    for (i = 0; i < n; i++) {
+	for (e = old[i]; e; e = next) {
+	    next = e->next;
+	    rc_mem_link(sh, e);
+	}
+    }
+    free(old);
+    return 0;
+}
+
+static krb5_error_code
+mem_resolve(krb5_context context, krb5_rcache id)
+{
+    struct rc_mem *m;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    for (m = rc_mem_head; m != NULL; m = m->next)
+	if (strcmp(m->name, id->name) == 0)
+	    break;
+    if (m == NULL) {
+	m = calloc(1, sizeof(*m));
+	if (m == NULL || (m->name = strdup(id->name)) == NULL) {
+	    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	    free(m);
+	    return krb5_enomem(context);
+	}
+	for (i = 0; i < RC_MEM_SHARDS; i++) {
+	    HEIMDAL_MUTEX_init(&m->shard[i].mutex);
+	    rc_mem_set_lifespan(&m->shard[i], context->max_skew);
+	}
+	m->next = rc_mem_head;
+	rc_mem_head = m;
+    }
+    m->refcnt++;
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+    id->data = m;
+    return 0;
+}
+
+static void
+mem_close(krb5_context context, krb5_rcache id)
+{
+    struct rc_mem *m = id->data;
+    size_t i;
+
+    if (m == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    if (--m->refcnt != 0 || !m->dead) {
+	HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	return;
+    }
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+
+    for (i = 0; i < RC_MEM_SHARDS; i++) {
+	rc_mem_clear(&m->shard[i]);
+	HEIMDAL_MUTEX_destroy(&m->shard[i].mutex);
+    }
+    free(m->name);
+    free(m);
+}
+
+static krb5_error_code
+mem_initialize(krb5_context context,
+	       krb5_rcache id,
+	       krb5_deltat auth_lifespan)
+{
+    struct rc_mem *m = id->data;
+    size_t i;
+
+    for (i = 0; i < RC_MEM_SHARDS; i++) {
+	HEIMDAL_MUTEX_lock(&m->shard[i].mutex);
+	rc_mem_clear(&m->shard[i]);
+	rc_mem_set_lifespan(&m->shard[i], auth_lifespan);
+	HEIMDAL_MUTEX_unlock(&m->shard[i].mutex);
+    }
+    return 0;
+}
+
+static krb5_error_code
+mem_destroy(krb5_context context,
+	    krb5_rcache id)
+{
+    struct rc_mem *m = id->data, **mp;
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    if (!m->dead) {
+	for (mp = &rc_mem_head; *mp != NULL; mp = &(*mp)->next) {
+	    if (*mp == m) {
+		*mp = m->next;
+		break;
+	    }
+	}
+	m->dead = 1;
+    }
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+    return 0;
+}
+
+static krb5_error_code
+mem_store(krb5_context context,
+	  krb5_rcache id,
+	  time_t now,
+	  const unsigned char *data)
+{
+    struct rc_mem *m = id->data;
+    struct rc_mem_shard *sh;
+    struct rc_mem_entry *e;
+    uint32_t h;
+
+    memcpy(&h, data, sizeof(h));
+    sh = &m->shard[h % RC_MEM_SHARDS];
+
+    HEIMDAL_MUTEX_lock(&sh->mutex);
+    rc_mem_expire(sh, now);
+    if (sh->nbuckets) {
+	e = sh->table[rc_mem_hash(data) & (sh->nbuckets - 1)];
+	for (; e; e = e->next) {
+	    if (e->stamp >= now - sh->lifespan &&
+		memcmp(e->data, data, sizeof(e->data)) == 0) {
+		HEIMDAL_MUTEX_unlock(&sh->mutex);
+		krb5_clear_error_message(context);
+		return KRB5_RC_REPLAY;
+	    }
+	}
+    }
+    if (sh->count >= sh->nbuckets * 2 && rc_mem_grow(sh)) {
+	HEIMDAL_MUTEX_unlock(&sh->mutex);
+	return krb5_enomem(context);
+    }
+    e = malloc(sizeof(*e));
+    if (e == NULL) {
+	HEIMDAL_MUTEX_unlock(&sh->mutex);
+	return krb5_enomem(context);
+    }
+    e->stamp = now;
+    memcpy(e->data, data, sizeof(e->data));
+    rc_mem_link(sh, e);
+    e->wnext = sh->wheel[(now / sh->tick_len) % RC_MEM_WHEEL];
+    sh->wheel[(now / sh->tick_len) % RC_MEM_WHEEL] = e;
+    HEIMDAL_MUTEX_unlock(&sh->mutex);
+    return 0;
+}
+
+static krb5_error_code
+mem_expunge(krb5_context context,
+	    krb5_rcache id)
+{
+    struct rc_mem *m = id->data;
+    time_t now = time(NULL);
+    size_t i;
+
+    for (i = 0; i < RC_MEM_SHARDS; i++) {
+	HEIMDAL_MUTEX_lock(&m->shard[i].mutex);
+	rc_mem_expire(&m->shard[i], now);
+	HEIMDAL_MUTEX_unlock(&m->shard[i].mutex);
+    }
+    return 0;
+}
+
+static krb5_error_code
+mem_get_lifespan(krb5_context context,
+		 krb5_rcache id,
+		 krb5_deltat *auth_lifespan)
+{
+    struct rc_mem *m = id->data;
+
+    HEIMDAL_MUTEX_lock(&m->shard[0].mutex);
+    *auth_lifespan = m->shard[0].lifespan;
+    HEIMDAL_MUTEX_unlock(&m->shard[0].mutex);
+    return 0;
+}
+
+static const krb5_rc_ops mem_ops = {
+    "MEMORY",
+    "MEMORY:default_rcache",
+    mem_resolve,
+    mem_initialize,
+    mem_destroy,
+    mem_close,
+    mem_store,
+    mem_expunge,
+    mem_get_lifespan
+};
+
+static const krb5_rc_ops *rc_ops[] = {
+    &file_ops,
+    &mem_ops,
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+    &hash_ops,
+#endif
+    NULL
+};
+
+static const krb5_rc_ops *
+rc_get_ops(const char *type, size_t len)
+{
+    size_t i;
+
+    for (i = 0; rc_ops[i] != NULL; i++)
+	if (strlen(rc_ops[i]->type) == len &&
+	    strncmp(rc_ops[i]->type, type, len) == 0)
+	    return rc_ops[i];
+    return NULL;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_resolve(krb5_context context,
 		krb5_rcache id,
@@ -49,6 +1053,8 @@ krb5_rc_resolve(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    if (id->ops->resolve)
+	return (*id->ops->resolve)(context, id);
     return 0;
 }
 
@@ -57,8 +1063,11 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    const krb5_rc_ops *ops;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    ops = rc_get_ops(type, strlen(type));
+    if(ops == NULL) {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +1079,7 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->ops = ops;
     return 0;
 }
 
@@ -78,20 +1088,25 @@ krb5_rc_resolve_full(krb5_context context,
 		     krb5_rcache *id,
 		     const char *string_name)
 {
+    const krb5_rc_ops *ops = NULL;
     krb5_error_code ret;
+    const char *p;
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    p = strchr(string_name, ':');
+    if (p)
+	ops = rc_get_ops(string_name, p - string_name);
+    if(ops == NULL) {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    ret = krb5_rc_resolve_type(context, id, ops->type);
     if(ret)
 	return ret;
-    ret = krb5_rc_resolve(context, *id, string_name + 5);
+    ret = krb5_rc_resolve(context, *id, p + 1);
     if (ret) {
 	krb5_rc_close(context, *id);
 	*id = NULL;
@@ -99,16 +1114,31 @@ krb5_rc_resolve_full(krb5_context context,
     return ret;
 }
 
+static const krb5_rc_ops *
+rc_default_ops(krb5_context context)
+{
+    const krb5_rc_ops *ops = NULL;
+    const char *type;
+
+    type = krb5_config_get_string(context, NULL, "libdefaults",
+				  "default_rcache_type", NULL);
+    if (type)
+	ops = rc_get_ops(type, strlen(type));
+    if (ops == NULL)
+	ops = rc_ops[0];
+    return ops;
+}
+
 KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_default_name(krb5_context context)
 {
-    return "FILE:/var/run/default_rcache";
+    return rc_default_ops(context)->default_name;
 }
 
 KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_default_type(krb5_context context)
 {
-    return "FILE";
+    return rc_default_ops(context)->type;
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -118,32 +1148,12 @@ krb5_rc_default(krb5_context context,
     return krb5_rc_resolve_full(context, id, krb5_rc_default_name(context));
 }
 
-struct rc_entry{
-    time_t stamp;
-    unsigned char data[16];
-};
-
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
-    struct rc_entry tmp;
-    int ret;
-
-    if(f == NULL) {
-	char buf[128];
-	ret = errno;
-	rk_strerror_r(ret, buf, sizeof(buf));
-	krb5_set_error_message(context, ret, "open(%s): %s", id->name, buf);
-	return ret;
-    }
-    memset(&tmp, 0, sizeof(tmp));
-    tmp.stamp = auth_lifespan;
-    fwrite(&tmp, 1, sizeof(tmp), f);
-    fclose(f);
-    return 0;
+    return (*id->ops->initialize)(context, id, auth_lifespan);
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -157,15 +1167,11 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_destroy(krb5_context context,
 		krb5_rcache id)
 {
-    int ret;
+    krb5_error_code ret;
 
-    if(remove(id->name) < 0) {
-	char buf[128];
-	ret = errno;
-	rk_strerror_r(ret, buf, sizeof(buf));
-	krb5_set_error_message(context, ret, "remove(%s): %s", id->name, buf);
+    ret = (*id->ops->destroy)(context, id);
+    if (ret)
 	return ret;
-    }
     return krb5_rc_close(context, id);
 }
 
@@ -173,6 +1179,8 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+    if (id->ops->close)
+	(*id->ops->close)(context, id);
     free(id->name);
     free(id);
     return 0;
@@ -202,64 +1210,34 @@ krb5_rc_store(krb5_context context,
 	      krb5_rcache id,
 	      krb5_donot_replay *rep)
 {
-    struct rc_entry ent, tmp;
-    time_t t;
-    FILE *f;
-    int ret;
-    size_t count;
+    unsigned char data[16];
 
-    ent.stamp = time(NULL);
-    checksum_authenticator(rep, ent.data);
-    f = fopen(id->name, "r");
-    if(f == NULL) {
-	char buf[128];
-	ret = errno;
-	rk_strerror_r(ret, buf, sizeof(buf));
-	krb5_set_error_message(context, ret, "open(%s): %s", id->name, buf);
-	return ret;
-    }
-    rk_cloexec_file(f);
-    count = fread(&tmp, sizeof(ent), 1, f);
-    if(count != 1)
-	return KRB5_RC_IO_UNKNOWN;
-    t = ent.stamp - tmp.stamp;
-    while(fread(&tmp, sizeof(ent), 1, f)){
-	if(tmp.stamp < t)
-	    continue;
-	if(memcmp(tmp.data, ent.data, sizeof(ent.data)) == 0){
-	    fclose(f);
-	    krb5_clear_error_message (context);
-	    return KRB5_RC_REPLAY;
-	}
-    }
-    if(ferror(f)){
-	char buf[128];
-	ret = errno;
-	fclose(f);
-	rk_strerror_r(ret, buf, sizeof(buf));
-	krb5_set_error_message(context, ret, "%s: %s",
-			       id->name, buf);
-	return ret;
-    }
-    fclose(f);
-    f = fopen(id->name, "a");
-    if(f == NULL) {
-	char buf[128];
-	rk_strerror_r(errno, buf, sizeof(buf));
-	krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
-			       "open(%s): %s", id->name, buf);
-	return KRB5_RC_IO_UNKNOWN;
-    }
-    fwrite(&ent, 1, sizeof(ent), f);
-    fclose(f);
-    return 0;
+    checksum_authenticator(rep, data);
+    return (*id->ops->store)(context, id, time(NULL), data);
+}
+
+/*
+ * Like krb5_rc_store() as if it was called at `now', for testing
+ * expiry.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_rc_store_at(krb5_context context,
+		  krb5_rcache id,
+		  krb5_donot_replay *rep,
+		  time_t now)
+{
+    unsigned char data[16];
+
+    checksum_authenticator(rep, data);
+    return (*id->ops->store)(context, id, now, data);
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_expunge(krb5_context context,
 		krb5_rcache id)
 {
-    return 0;
+    return (*id->ops->expunge)(context, id);
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -267,17 +1245,7 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
-    int r;
-    struct rc_entry ent;
-    r = fread(&ent, sizeof(ent), 1, f);
-    fclose(f);
-    if(r){
-	*auth_lifespan = ent.stamp;
-	return 0;
-    }
-    krb5_clear_error_message (context);
-    return KRB5_RC_IO_UNKNOWN;
+    return (*id->ops->get_lifespan)(context, id, auth_lifespan);
 }
 
 KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
@@ -291,7 +1259,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return id->ops->type;
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -309,9 +1277,10 @@ krb5_get_server_rcache(krb5_context context,
 	return krb5_enomem(context);
     strvisx(tmp, piece->data, piece->length, VIS_WHITE | VIS_OCTAL);
 #ifdef HAVE_GETEUID
-    ret = asprintf(&name, "FILE:rc_%s_%u", tmp, (unsigned)geteuid());
+    ret = asprintf(&name, "%s:rc_%s_%u", krb5_rc_default_type(context),
+		   tmp, (unsigned)geteuid());
 #else
-    ret = asprintf(&name, "FILE:rc_%s", tmp);
+    ret = asprintf(&name, "%s:rc_%s", krb5_rc_default_type(context), tmp);
 #endif
     free(tmp);
     if (ret < 0 || name == NULL)
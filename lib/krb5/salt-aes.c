@@ -62,6 +62,7 @@ AES_string_to_key(krb5_context context,
 	return KRB5_PROG_KEYTYPE_NOSUPP;
 
     kd.schedule = NULL;
+    kd.hmac = NULL;
     ALLOC(kd.key, 1);
     if (kd.key == NULL)
 	return krb5_enomem(context);
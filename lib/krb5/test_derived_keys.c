@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+/*
+ * Check that the derived keys come out the same however they are
+ * found: derived again, from the usage table of a long lived crypto
+ * context, or from the process wide derived key cache.  Everything
+ * encrypted with one context is decrypted with a fresh one from a
+ * context that has no cache.
+ */
+
+#define NUM_USAGES 300
+
+static krb5_crypto
+crypto_init(krb5_context context, krb5_keyblock *key)
+{
+    krb5_crypto crypto;
+    krb5_error_code ret;
+
+    ret = krb5_crypto_init(context, key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    return crypto;
+}
+
+/* encrypt with `crypto', decrypt with a fresh context in `plain' */
+static int
+check_usage(krb5_context context, krb5_context plain, krb5_crypto crypto,
+	    krb5_keyblock *key, unsigned usage)
+{
+    unsigned char data[8];	/* a block, so that des3 doesn't pad */
+    krb5_data enc, dec;
+    krb5_crypto c;
+    krb5_error_code ret;
+    int failed = 0;
+
+    memset(data, 0, sizeof(data));
+    _krb5_put_int(data, usage, 4);
+    ret = krb5_encrypt(context, crypto, usage, data, sizeof(data), &enc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt");
+    c = crypto_init(plain, key);
+    ret = krb5_decrypt(plain, c, usage, enc.data, enc.length, &dec);
+    if (ret) {
+	printf("usage %u does not decrypt\n", usage);
+	failed = 1;
+    } else {
+	if (dec.length != sizeof(data) ||
+	    memcmp(dec.data, data, sizeof(data)) != 0) {
+	    printf("usage %u decrypts to the wrong data\n", usage);
+	    failed = 1;
+	}
+	krb5_data_free(&dec);
+    }
+    krb5_crypto_destroy(plain, c);
+    krb5_data_free(&enc);
+    return failed;
+}
+
+static int
+test_enctype(krb5_context context, krb5_context plain, krb5_enctype etype)
+{
+    krb5_keyblock key, other;
+    krb5_crypto crypto;
+    krb5_error_code ret;
+    krb5_data enc, dec;
+    unsigned usage;
+    int pass, failed = 0;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_generate_random_keyblock(context, etype, &other);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    /* one context, many usages, the second pass from its table */
+    crypto = crypto_init(context, &key);
+    for (pass = 0; pass < 2; pass++)
+	for (usage = 1; usage <= NUM_USAGES; usage++)
+	    failed |= check_usage(context, plain, crypto, &key, usage);
+    krb5_crypto_destroy(context, crypto);
+
+    /* a new context per usage, with the keys from the cache */
+    for (usage = 1; usage <= NUM_USAGES; usage++) {
+	crypto = crypto_init(context, &key);
+	failed |= check_usage(context, plain, crypto, &key, usage);
+	krb5_crypto_destroy(context, crypto);
+    }
+
+    /* another key must not get the keys of the first one */
+    crypto = crypto_init(context, &other);
+    failed |= check_usage(context, plain, crypto, &other, 1);
+    ret = krb5_encrypt(context, crypto, 1, "x", 1, &enc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt");
+    krb5_crypto_destroy(context, crypto);
+    crypto = crypto_init(plain, &key);
+    if (krb5_decrypt(plain, crypto, 1, enc.data, enc.length, &dec) == 0) {
+	printf("enctype %d: key decrypts data of another key\n", (int)etype);
+	krb5_data_free(&dec);
+	failed = 1;
+    }
+    krb5_crypto_destroy(plain, crypto);
+    krb5_data_free(&enc);
+
+    krb5_free_keyblock_contents(context, &key);
+    krb5_free_keyblock_contents(context, &other);
+    return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context, plain;
+    krb5_error_code ret;
+    int val = 0;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+    ret = krb5_init_context(&plain);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    /* [libdefaults] derived_key_cache = true */
+    context->flags |= KRB5_CTX_F_DERIVED_KEY_CACHE;
+    plain->flags &= ~KRB5_CTX_F_DERIVED_KEY_CACHE;
+
+    val |= test_enctype(context, plain, ETYPE_AES128_CTS_HMAC_SHA1_96);
+    val |= test_enctype(context, plain, ETYPE_AES256_CTS_HMAC_SHA1_96);
+    val |= test_enctype(context, plain, ETYPE_DES3_CBC_SHA1);
+
+    krb5_free_context(plain);
+    krb5_free_context(context);
+
+    return val;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+#include <hex.h>
+
+/*
+ * Check the HMACs, both the one-shot krb5_hmac() against RFC 2202 and
+ * the keyed checksums of a crypto context, that keep their key pads
+ * between calls, against a key derived and HMACed by hand.
+ */
+
+static struct hmac_test {
+    krb5_cksumtype type;
+    int keybyte;
+    size_t keylen;
+    const char *key;
+    const char *data;
+    const char *result;
+} hmac_tests[] = {
+    { CKSUMTYPE_SHA1, 0x0b, 20, NULL, "Hi There",
+      "b617318655057264e28bc0b6fb378c8ef146be00" },
+    { CKSUMTYPE_SHA1, 0, 4, "Jefe", "what do ya want for nothing?",
+      "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79" },
+    { CKSUMTYPE_SHA1, 0xaa, 80, NULL,
+      "Test Using Larger Than Block-Size Key - Hash Key First",
+      "aa4ae5e15272d00e95705637ce8a3b55ed402112" },
+    { CKSUMTYPE_RSA_MD5, 0x0b, 16, NULL, "Hi There",
+      "9294727a3638bb1c13f48ef8158bfc9d" },
+    { CKSUMTYPE_RSA_MD5, 0, 4, "Jefe", "what do ya want for nothing?",
+      "750c783e6ab0b503eaa86e310a5db738" },
+    { CKSUMTYPE_RSA_MD5, 0xaa, 80, NULL,
+      "Test Using Larger Than Block-Size Key - Hash Key First",
+      "6b1ab7fe4bd7bf8f0b62e6ce61b9d0cd" }
+};
+
+static int
+test_hmac(krb5_context context, struct hmac_test *t)
+{
+    unsigned char keyvalue[80], sum[20], result[20];
+    krb5_keyblock key;
+    krb5_error_code ret;
+    Checksum cksum;
+    ssize_t len;
+
+    if (t->key)
+	memcpy(keyvalue, t->key, t->keylen);
+    else
+	memset(keyvalue, t->keybyte, t->keylen);
+    key.keytype = 0;
+    key.keyvalue.data = keyvalue;
+    key.keyvalue.length = t->keylen;
+
+    len = hex_decode(t->result, result, sizeof(result));
+    if (len < 0)
+	krb5_errx(context, 1, "bad hex %s", t->result);
+
+    cksum.checksum.data = sum;
+    cksum.checksum.length = len;
+    ret = krb5_hmac(context, t->type, t->data, strlen(t->data), 0,
+		    &key, &cksum);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_hmac");
+    if (memcmp(sum, result, len) != 0) {
+	printf("hmac %d of \"%s\" failed\n", (int)t->type, t->data);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * The keyed checksum for `usage' computed the long way: derive Kc
+ * and HMAC-SHA1 the data with it.
+ */
+
+static void
+kd_checksum(krb5_context context, krb5_keyblock *key, unsigned usage,
+	    const void *data, size_t len, unsigned char *sum)
+{
+    unsigned char constant[5];
+    krb5_keyblock *kc;
+    krb5_error_code ret;
+    Checksum cksum;
+
+    _krb5_put_int(constant, usage, 4);
+    constant[4] = 0x99;
+    ret = krb5_derive_key(context, key, key->keytype, constant,
+			  sizeof(constant), &kc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_derive_key");
+
+    cksum.checksum.data = sum;
+    cksum.checksum.length = 20;
+    ret = krb5_hmac(context, CKSUMTYPE_SHA1, data, len, 0, kc, &cksum);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_hmac");
+    krb5_free_keyblock(context, kc);
+}
+
+static int
+test_keyed(krb5_context context, krb5_enctype etype)
+{
+    unsigned char buf[1024], sum[20];
+    krb5_keyblock key;
+    krb5_crypto crypto;
+    krb5_error_code ret;
+    Checksum cksum;
+    size_t len;
+    unsigned usage;
+    int failed = 0;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_crypto_init(context, &key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    krb5_generate_random_block(buf, sizeof(buf));
+
+    /* the same keys over and over, with the usages interleaved */
+    for (len = 0; len < sizeof(buf); len += 61) {
+	for (usage = 1; usage < 4; usage++) {
+	    ret = krb5_create_checksum(context, crypto, usage, 0,
+				       buf, len, &cksum);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_create_checksum");
+	    kd_checksum(context, &key, usage, buf, len, sum);
+	    if (cksum.checksum.length > sizeof(sum) ||
+		memcmp(cksum.checksum.data, sum,
+		       cksum.checksum.length) != 0) {
+		printf("keyed checksum of enctype %d, usage %u, "
+		       "length %lu failed\n", (int)etype, usage,
+		       (unsigned long)len);
+		failed = 1;
+	    }
+	    free_Checksum(&cksum);
+	}
+    }
+
+    krb5_crypto_destroy(context, crypto);
+    krb5_free_keyblock_contents(context, &key);
+    return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    size_t i;
+    int val = 0;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    for (i = 0; i < sizeof(hmac_tests)/sizeof(hmac_tests[0]); i++)
+	val |= test_hmac(context, &hmac_tests[i]);
+
+    val |= test_keyed(context, ETYPE_AES128_CTS_HMAC_SHA1_96);
+    val |= test_keyed(context, ETYPE_AES256_CTS_HMAC_SHA1_96);
+    val |= test_keyed(context, ETYPE_DES3_CBC_SHA1);
+
+    krb5_free_context(context);
+
+    return val;
+}
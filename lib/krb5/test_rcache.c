@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+static void
+set_authenticator(Authenticator *auth, heim_general_string *name,
+		  time_t ctime, int cusec)
+{
+    memset(auth, 0, sizeof(*auth));
+    auth->crealm = "TEST.H5L.SE";
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = name;
+    auth->ctime = ctime;
+    auth->cusec = cusec;
+}
+
+static void
+check_rcache(krb5_context context, const char *type, const char *file)
+{
+    heim_general_string name = "lha";
+    krb5_rcache id, id2;
+    krb5_error_code ret;
+    krb5_deltat lifespan;
+    Authenticator auth;
+    char *rcname;
+    time_t now = time(NULL);
+    int i;
+
+    if (asprintf(&rcname, "%s:%s", type, file) < 0 || rcname == NULL)
+	errx(1, "out of memory");
+
+    ret = krb5_rc_resolve_full(context, &id, rcname);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    if (strcmp(krb5_rc_get_type(context, id), type) != 0)
+	krb5_errx(context, 1, "%s: wrong type %s", rcname,
+		  krb5_rc_get_type(context, id));
+    if (strcmp(krb5_rc_get_name(context, id), file) != 0)
+	krb5_errx(context, 1, "%s: wrong name %s", rcname,
+		  krb5_rc_get_name(context, id));
+
+    ret = krb5_rc_initialize(context, id, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan: %s", rcname);
+    if (lifespan != 600)
+	krb5_errx(context, 1, "%s: lifespan %d", rcname, (int)lifespan);
+
+    for (i = 0; i < 1000; i++) {
+	set_authenticator(&auth, &name, now, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store: %s %d", rcname, i);
+    }
+
+    /* replays are caught, also by another handle to the same cache */
+    ret = krb5_rc_resolve_full(context, &id2, rcname);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    for (i = 0; i < 1000; i += 7) {
+	set_authenticator(&auth, &name, now, i);
+	ret = krb5_rc_store(context, (i & 1) ? id : id2, &auth);
+	if (ret != KRB5_RC_REPLAY)
+	    krb5_errx(context, 1, "%s: replay %d not detected: %d",
+		      rcname, i, ret);
+    }
+    set_authenticator(&auth, &name, now + 1, 0);
+    ret = krb5_rc_store(context, id2, &auth);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store: %s", rcname);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay not detected: %d", rcname, ret);
+
+    ret = krb5_rc_expunge(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_expunge: %s", rcname);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay lost by expunge: %d", rcname, ret);
+
+    /* initialize empties the cache */
+    ret = krb5_rc_initialize(context, id2, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store after initialize: %s",
+		 rcname);
+
+    krb5_rc_close(context, id2);
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", rcname);
+    free(rcname);
+}
+
+/*
+ * An entry older than the lifespan no longer counts as a replay.
+ */
+
+static void
+check_expiry(krb5_context context, const char *type, const char *file)
+{
+    heim_general_string name = "lha";
+    krb5_rcache id;
+    krb5_error_code ret;
+    Authenticator auth;
+    char *rcname;
+    time_t now = time(NULL);
+
+    if (asprintf(&rcname, "%s:%s", type, file) < 0 || rcname == NULL)
+	errx(1, "out of memory");
+
+    ret = krb5_rc_resolve_full(context, &id, rcname);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    ret = krb5_rc_initialize(context, id, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+
+    set_authenticator(&auth, &name, now, 17);
+    ret = _krb5_rc_store_at(context, id, &auth, now - 700);
+    if (ret)
+	krb5_err(context, 1, ret, "%s: store in the past", rcname);
+    ret = _krb5_rc_store_at(context, id, &auth, now);
+    if (ret)
+	krb5_err(context, 1, ret, "%s: expired entry taken for a replay",
+		 rcname);
+    ret = _krb5_rc_store_at(context, id, &auth, now);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay after expiry not detected: %d",
+		  rcname, ret);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", rcname);
+    free(rcname);
+}
+
+/*
+ * A MEMORY replay cache is shared by all contexts in the process and
+ * outlives its handles until it is destroyed.
+ */
+
+static void
+check_memory(krb5_context context)
+{
+    heim_general_string name = "lha";
+    krb5_context context2;
+    krb5_rcache id, id2;
+    krb5_error_code ret;
+    Authenticator auth;
+
+    ret = krb5_init_context(&context2);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    ret = krb5_rc_resolve_full(context, &id, "MEMORY:shared");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full");
+    set_authenticator(&auth, &name, time(NULL), 4711);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store");
+    krb5_rc_close(context, id);
+
+    ret = krb5_rc_resolve_full(context2, &id2, "MEMORY:shared");
+    if (ret)
+	krb5_err(context2, 1, ret, "krb5_rc_resolve_full");
+    ret = krb5_rc_store(context2, id2, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context2, 1, "replay in other context not detected: %d",
+		  ret);
+    ret = krb5_rc_destroy(context2, id2);
+    if (ret)
+	krb5_err(context2, 1, ret, "krb5_rc_destroy");
+
+    ret = krb5_rc_resolve_full(context, &id, "MEMORY:shared");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full");
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store after destroy");
+    krb5_rc_destroy(context, id);
+
+    krb5_free_context(context2);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    krb5_rcache id;
+
+    setprogname(argv[0]);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    check_rcache(context, "FILE", "test_rcache.file");
+    check_rcache(context, "MEMORY", "test_rcache");
+    check_memory(context);
+    check_expiry(context, "MEMORY", "test_rcache");
+#if defined(HAVE_MMAP) && defined(HAVE_FCNTL)
+    check_rcache(context, "HASH", "test_rcache.hash");
+    check_expiry(context, "HASH", "test_rcache.hash");
+#endif
+
+    ret = krb5_rc_resolve_full(context, &id, "FOO:bar");
+    if (ret != KRB5_RC_TYPE_NOTFOUND)
+	krb5_errx(context, 1, "unknown replay cache type resolved: %d", ret);
+
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -382,6 +382,8 @@ struct entry libdefaults_entries[] = {
     { "default_keytab_modify_name", krb5_config_string, NULL, 0 },
     { "default_keytab_name", krb5_config_string, NULL, 0 },
     { "default_realm", krb5_config_string, NULL, 0 },
+    { "derived_key_cache", krb5_config_string, check_boolean, 0 },
+    { "default_rcache_type", krb5_config_string, NULL, 0 },
     { "dns_canonize_hostname", krb5_config_string, check_boolean, 0 },
     { "dns_proxy", krb5_config_string, NULL, 0 },
     { "dns_lookup_kdc", krb5_config_string, check_boolean, 0 },
@@ -414,6 +416,7 @@ struct entry libdefaults_entries[] = {
     { "max_retries", krb5_config_string, check_time, 0 },
     { "renew_lifetime", krb5_config_string, check_time, 0 },
     { "proxiable", krb5_config_string, check_boolean, 0 },
+    { "rcache_hash_size", krb5_config_string, check_numeric, 0 },
     { "warn_pwexpire", krb5_config_string, check_time, 0 },
     /* MIT stuff */
     { "permitted_enctypes", krb5_config_string, mit_entry, 0 },
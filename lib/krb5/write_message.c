@@ -39,17 +39,26 @@ krb5_write_message (krb5_context context,
 		    krb5_data *data)
 {
     uint32_t len;
-    uint8_t buf[4];
+    uint8_t *buf;
     int ret;
 
+    /*
+     * The length goes out in the same write as the data, or Nagle
+     * holds the data back until the peer has ACKed the length.
+     */
     len = data->length;
+    buf = malloc(4 + len);
+    if (buf == NULL)
+	return krb5_enomem(context);
     _krb5_put_int(buf, len, 4);
-    if (krb5_net_write (context, p_fd, buf, 4) != 4
-	|| krb5_net_write (context, p_fd, data->data, len) != len) {
+    memcpy(buf + 4, data->data, len);
+    if (krb5_net_write (context, p_fd, buf, 4 + len) != 4 + len) {
 	ret = errno;
+	free(buf);
 	krb5_set_error_message (context, ret, "write: %s", strerror(ret));
 	return ret;
     }
+    free(buf);
     return 0;
 }
 